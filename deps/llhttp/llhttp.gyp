@@ -7,7 +7,7 @@
       'direct_dependent_settings': {
         'include_dirs': [ 'include' ],
       },
-      'sources': [ 'src/llhttp.c', 'src/api.c', 'src/http.c' ],
+      'sources': [ 'src/llhttp.c', 'src/api.c', 'src/http.c', 'src/scan.c' ],
     },
   ]
 }
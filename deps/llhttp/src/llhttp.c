@@ -4,14 +4,6 @@
 #include <stdint.h>
 #include <string.h>
 
-#ifdef __SSE4_2__
- #ifdef _MSC_VER
-  #include <nmmintrin.h>
- #else  /* !_MSC_VER */
-  #include <x86intrin.h>
- #endif  /* _MSC_VER */
-#endif  /* __SSE4_2__ */
-
 #ifdef _MSC_VER
  #define ALIGN(n) _declspec(align(n))
 #else  /* !_MSC_VER */
@@ -19,6 +11,7 @@
 #endif  /* _MSC_VER */
 
 #include "llhttp.h"
+#include "scan.h"
 
 typedef int (*llhttp__internal__span_cb)(
              llhttp__internal_t*, const char*, const char*);
@@ -44,24 +37,18 @@ static const unsigned char llparse_blob5[] = {
 static const unsigned char llparse_blob6[] = {
   'c', 'h', 'u', 'n', 'k', 'e', 'd'
 };
-#ifdef __SSE4_2__
 static const unsigned char ALIGN(16) llparse_blob7[] = {
   0x9, 0x9, ' ', '~', 0x80, 0xff, 0x0, 0x0, 0x0, 0x0, 0x0,
   0x0, 0x0, 0x0, 0x0, 0x0
 };
-#endif  /* __SSE4_2__ */
-#ifdef __SSE4_2__
 static const unsigned char ALIGN(16) llparse_blob8[] = {
   '!', '!', '#', '\'', '*', '+', '-', '.', '0', '9', 'A',
   'Z', '^', 'z', '|', '|'
 };
-#endif  /* __SSE4_2__ */
-#ifdef __SSE4_2__
 static const unsigned char ALIGN(16) llparse_blob9[] = {
-  '~', '~', 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
+  '!', '"', '$', '>', '@', '~', 0x0, 0x0, 0x0, 0x0, 0x0,
   0x0, 0x0, 0x0, 0x0, 0x0
 };
-#endif  /* __SSE4_2__ */
 static const unsigned char llparse_blob10[] = {
   'e', 'n', 't', '-', 'l', 'e', 'n', 'g', 't', 'h'
 };
@@ -2011,30 +1998,12 @@ static llparse_state_t llhttp__internal__run(
       if (p == endp) {
         return s_n_llhttp__internal__n_header_value;
       }
-      #ifdef __SSE4_2__
       if (endp - p >= 16) {
-        __m128i ranges;
-        __m128i input;
-        int avail;
-        int match_len;
-      
-        /* Load input */
-        input = _mm_loadu_si128((__m128i const*) p);
-        ranges = _mm_loadu_si128((__m128i const*) llparse_blob7);
-      
-        /* Find first character that does not match `ranges` */
-        match_len = _mm_cmpestri(ranges, 6,
-            input, 16,
-            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
-              _SIDD_NEGATIVE_POLARITY);
-      
-        if (match_len != 0) {
-          p += match_len;
-          goto s_n_llhttp__internal__n_header_value;
+        p += llhttp__scan(llparse_blob7, 6, lookup_table, 1, p, endp);
+        if (p == endp) {
+          return s_n_llhttp__internal__n_header_value;
         }
-        goto s_n_llhttp__internal__n_header_value_otherwise;
       }
-      #endif  /* __SSE4_2__ */
       switch (lookup_table[(uint8_t) *p]) {
         case 1: {
           p++;
@@ -2198,42 +2167,12 @@ static llparse_state_t llhttp__internal__run(
       if (p == endp) {
         return s_n_llhttp__internal__n_header_field_general;
       }
-      #ifdef __SSE4_2__
       if (endp - p >= 16) {
-        __m128i ranges;
-        __m128i input;
-        int avail;
-        int match_len;
-      
-        /* Load input */
-        input = _mm_loadu_si128((__m128i const*) p);
-        ranges = _mm_loadu_si128((__m128i const*) llparse_blob8);
-      
-        /* Find first character that does not match `ranges` */
-        match_len = _mm_cmpestri(ranges, 16,
-            input, 16,
-            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
-              _SIDD_NEGATIVE_POLARITY);
-      
-        if (match_len != 0) {
-          p += match_len;
-          goto s_n_llhttp__internal__n_header_field_general;
+        p += llhttp__scan(llparse_blob8, 16, lookup_table, 1, p, endp);
+        if (p == endp) {
+          return s_n_llhttp__internal__n_header_field_general;
         }
-        ranges = _mm_loadu_si128((__m128i const*) llparse_blob9);
-      
-        /* Find first character that does not match `ranges` */
-        match_len = _mm_cmpestri(ranges, 2,
-            input, 16,
-            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
-              _SIDD_NEGATIVE_POLARITY);
-      
-        if (match_len != 0) {
-          p += match_len;
-          goto s_n_llhttp__internal__n_header_field_general;
-        }
-        goto s_n_llhttp__internal__n_header_field_general_otherwise;
       }
-      #endif  /* __SSE4_2__ */
       switch (lookup_table[(uint8_t) *p]) {
         case 1: {
           p++;
@@ -3100,6 +3039,12 @@ static llparse_state_t llhttp__internal__run(
       if (p == endp) {
         return s_n_llhttp__internal__n_url_path;
       }
+      if (endp - p >= 16) {
+        p += llhttp__scan(llparse_blob9, 6, lookup_table, 2, p, endp);
+        if (p == endp) {
+          return s_n_llhttp__internal__n_url_path;
+        }
+      }
       switch (lookup_table[(uint8_t) *p]) {
         case 1: {
           p++;
@@ -7575,14 +7520,6 @@ int llhttp__internal_execute(llhttp__internal_t* state, const char* p, const cha
 #include <stdint.h>
 #include <string.h>
 
-#ifdef __SSE4_2__
- #ifdef _MSC_VER
-  #include <nmmintrin.h>
- #else  /* !_MSC_VER */
-  #include <x86intrin.h>
- #endif  /* _MSC_VER */
-#endif  /* __SSE4_2__ */
-
 #ifdef _MSC_VER
  #define ALIGN(n) _declspec(align(n))
 #else  /* !_MSC_VER */
@@ -7590,16 +7527,15 @@ int llhttp__internal_execute(llhttp__internal_t* state, const char* p, const cha
 #endif  /* _MSC_VER */
 
 #include "llhttp.h"
+#include "scan.h"
 
 typedef int (*llhttp__internal__span_cb)(
              llhttp__internal_t*, const char*, const char*);
 
-#ifdef __SSE4_2__
 static const unsigned char ALIGN(16) llparse_blob0[] = {
   0x9, 0x9, 0xc, 0xc, '!', '"', '$', '>', '@', '~', 0x80,
   0xff, 0x0, 0x0, 0x0, 0x0
 };
-#endif  /* __SSE4_2__ */
 static const unsigned char llparse_blob1[] = {
   'o', 'n'
 };
@@ -7618,24 +7554,14 @@ static const unsigned char llparse_blob5[] = {
 static const unsigned char llparse_blob6[] = {
   'c', 'h', 'u', 'n', 'k', 'e', 'd'
 };
-#ifdef __SSE4_2__
 static const unsigned char ALIGN(16) llparse_blob7[] = {
   0x9, 0x9, ' ', '~', 0x80, 0xff, 0x0, 0x0, 0x0, 0x0, 0x0,
   0x0, 0x0, 0x0, 0x0, 0x0
 };
-#endif  /* __SSE4_2__ */
-#ifdef __SSE4_2__
 static const unsigned char ALIGN(16) llparse_blob8[] = {
   ' ', '!', '#', '\'', '*', '+', '-', '.', '0', '9', 'A',
   'Z', '^', 'z', '|', '|'
 };
-#endif  /* __SSE4_2__ */
-#ifdef __SSE4_2__
-static const unsigned char ALIGN(16) llparse_blob9[] = {
-  '~', '~', 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0, 0x0,
-  0x0, 0x0, 0x0, 0x0, 0x0
-};
-#endif  /* __SSE4_2__ */
 static const unsigned char llparse_blob10[] = {
   'e', 'n', 't', '-', 'l', 'e', 'n', 'g', 't', 'h'
 };
@@ -9534,30 +9460,12 @@ static llparse_state_t llhttp__internal__run(
       if (p == endp) {
         return s_n_llhttp__internal__n_header_value;
       }
-      #ifdef __SSE4_2__
       if (endp - p >= 16) {
-        __m128i ranges;
-        __m128i input;
-        int avail;
-        int match_len;
-      
-        /* Load input */
-        input = _mm_loadu_si128((__m128i const*) p);
-        ranges = _mm_loadu_si128((__m128i const*) llparse_blob7);
-      
-        /* Find first character that does not match `ranges` */
-        match_len = _mm_cmpestri(ranges, 6,
-            input, 16,
-            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
-              _SIDD_NEGATIVE_POLARITY);
-      
-        if (match_len != 0) {
-          p += match_len;
-          goto s_n_llhttp__internal__n_header_value;
+        p += llhttp__scan(llparse_blob7, 6, lookup_table, 1, p, endp);
+        if (p == endp) {
+          return s_n_llhttp__internal__n_header_value;
         }
-        goto s_n_llhttp__internal__n_header_value_otherwise;
       }
-      #endif  /* __SSE4_2__ */
       switch (lookup_table[(uint8_t) *p]) {
         case 1: {
           p++;
@@ -9721,42 +9629,12 @@ static llparse_state_t llhttp__internal__run(
       if (p == endp) {
         return s_n_llhttp__internal__n_header_field_general;
       }
-      #ifdef __SSE4_2__
       if (endp - p >= 16) {
-        __m128i ranges;
-        __m128i input;
-        int avail;
-        int match_len;
-      
-        /* Load input */
-        input = _mm_loadu_si128((__m128i const*) p);
-        ranges = _mm_loadu_si128((__m128i const*) llparse_blob8);
-      
-        /* Find first character that does not match `ranges` */
-        match_len = _mm_cmpestri(ranges, 16,
-            input, 16,
-            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
-              _SIDD_NEGATIVE_POLARITY);
-      
-        if (match_len != 0) {
-          p += match_len;
-          goto s_n_llhttp__internal__n_header_field_general;
-        }
-        ranges = _mm_loadu_si128((__m128i const*) llparse_blob9);
-      
-        /* Find first character that does not match `ranges` */
-        match_len = _mm_cmpestri(ranges, 2,
-            input, 16,
-            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
-              _SIDD_NEGATIVE_POLARITY);
-      
-        if (match_len != 0) {
-          p += match_len;
-          goto s_n_llhttp__internal__n_header_field_general;
+        p += llhttp__scan(llparse_blob8, 16, lookup_table, 1, p, endp);
+        if (p == endp) {
+          return s_n_llhttp__internal__n_header_field_general;
         }
-        goto s_n_llhttp__internal__n_header_field_general_otherwise;
       }
-      #endif  /* __SSE4_2__ */
       switch (lookup_table[(uint8_t) *p]) {
         case 1: {
           p++;
@@ -10523,30 +10401,12 @@ static llparse_state_t llhttp__internal__run(
       if (p == endp) {
         return s_n_llhttp__internal__n_url_path;
       }
-      #ifdef __SSE4_2__
       if (endp - p >= 16) {
-        __m128i ranges;
-        __m128i input;
-        int avail;
-        int match_len;
-      
-        /* Load input */
-        input = _mm_loadu_si128((__m128i const*) p);
-        ranges = _mm_loadu_si128((__m128i const*) llparse_blob0);
-      
-        /* Find first character that does not match `ranges` */
-        match_len = _mm_cmpestri(ranges, 12,
-            input, 16,
-            _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES |
-              _SIDD_NEGATIVE_POLARITY);
-      
-        if (match_len != 0) {
-          p += match_len;
-          goto s_n_llhttp__internal__n_url_path;
+        p += llhttp__scan(llparse_blob0, 12, lookup_table, 1, p, endp);
+        if (p == endp) {
+          return s_n_llhttp__internal__n_url_path;
         }
-        goto s_n_llhttp__internal__n_url_query_or_fragment;
       }
-      #endif  /* __SSE4_2__ */
       switch (lookup_table[(uint8_t) *p]) {
         case 1: {
           p++;
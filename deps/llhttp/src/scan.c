@@ -0,0 +1,176 @@
+#include "scan.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define LLHTTP__SCAN_X86 1
+# include <immintrin.h>
+#endif  /* x86 && __GNUC__ */
+
+typedef size_t (*llhttp__scan_fn)(const unsigned char*, int, const uint8_t*,
+                                  uint8_t, const unsigned char*,
+                                  const unsigned char*);
+
+static size_t llhttp__scan_scalar(const unsigned char* ranges,
+                                  int ranges_len,
+                                  const uint8_t* table,
+                                  uint8_t match,
+                                  const unsigned char* p,
+                                  const unsigned char* endp) {
+  const unsigned char* start = p;
+
+  (void) ranges;
+  (void) ranges_len;
+
+  while (p != endp && table[*p] == match) {
+    p++;
+  }
+
+  return p - start;
+}
+
+#ifdef LLHTTP__SCAN_X86
+
+__attribute__((target("sse4.2")))
+static size_t llhttp__scan_sse42(const unsigned char* ranges,
+                                 int ranges_len,
+                                 const uint8_t* table,
+                                 uint8_t match,
+                                 const unsigned char* p,
+                                 const unsigned char* endp) {
+  const unsigned char* start = p;
+  __m128i r;
+
+  r = _mm_loadu_si128((__m128i const*) ranges);
+
+  while (endp - p >= 16) {
+    __m128i input;
+    int match_len;
+
+    input = _mm_loadu_si128((__m128i const*) p);
+
+    /* Find first character that does not match `ranges` */
+    match_len = _mm_cmpestri(r, ranges_len, input, 16,
+        _SIDD_UBYTE_OPS | _SIDD_CMP_RANGES | _SIDD_NEGATIVE_POLARITY);
+
+    p += match_len;
+    if (match_len == 16) {
+      continue;
+    }
+
+    /* Might still be in the class, just not in the ranges */
+    if (table[*p] != match) {
+      return p - start;
+    }
+    p++;
+  }
+
+  return (p - start) + llhttp__scan_scalar(ranges, ranges_len, table, match,
+                                           p, endp);
+}
+
+__attribute__((target("avx2")))
+static size_t llhttp__scan_avx2(const unsigned char* ranges,
+                                int ranges_len,
+                                const uint8_t* table,
+                                uint8_t match,
+                                const unsigned char* p,
+                                const unsigned char* endp) {
+  const unsigned char* start = p;
+  __m256i lo[8];
+  __m256i width[8];
+  int count;
+  size_t head;
+
+  /* Most spans are short, don't pay for the setup below unless needed */
+  if (endp - p < 64) {
+    return llhttp__scan_sse42(ranges, ranges_len, table, match, p, endp);
+  }
+
+  head = llhttp__scan_sse42(ranges, ranges_len, table, match, p, p + 32);
+  if (head != 32) {
+    return head;
+  }
+  p += head;
+
+  /* `c` is in `[lo, lo + width]` iff `min(c - lo, width) == c - lo` */
+  count = ranges_len / 2;
+  for (int i = 0; i < count; i++) {
+    lo[i] = _mm256_set1_epi8((char) ranges[i * 2]);
+    width[i] = _mm256_set1_epi8((char) (ranges[i * 2 + 1] - ranges[i * 2]));
+  }
+
+  while (endp - p >= 32) {
+    __m256i input;
+    __m256i in_ranges;
+    uint32_t mask;
+
+    input = _mm256_loadu_si256((__m256i const*) p);
+    in_ranges = _mm256_setzero_si256();
+
+    for (int i = 0; i < count; i++) {
+      __m256i off = _mm256_sub_epi8(input, lo[i]);
+      in_ranges = _mm256_or_si256(in_ranges,
+          _mm256_cmpeq_epi8(_mm256_min_epu8(off, width[i]), off));
+    }
+
+    mask = ~(uint32_t) _mm256_movemask_epi8(in_ranges);
+    if (mask == 0) {
+      p += 32;
+      continue;
+    }
+
+    p += __builtin_ctz(mask);
+    if (table[*p] != match) {
+      _mm256_zeroupper();
+      return p - start;
+    }
+    p++;
+  }
+
+  /* Avoid SSE transition penalty in the code that runs after us */
+  _mm256_zeroupper();
+
+  return (p - start) + llhttp__scan_scalar(ranges, ranges_len, table, match,
+                                           p, endp);
+}
+
+#endif  /* LLHTTP__SCAN_X86 */
+
+static size_t llhttp__scan_resolve(const unsigned char* ranges,
+                                   int ranges_len,
+                                   const uint8_t* table,
+                                   uint8_t match,
+                                   const unsigned char* p,
+                                   const unsigned char* endp);
+
+static llhttp__scan_fn llhttp__scan_impl = llhttp__scan_resolve;
+
+static size_t llhttp__scan_resolve(const unsigned char* ranges,
+                                   int ranges_len,
+                                   const uint8_t* table,
+                                   uint8_t match,
+                                   const unsigned char* p,
+                                   const unsigned char* endp) {
+  llhttp__scan_fn impl = llhttp__scan_scalar;
+
+#ifdef LLHTTP__SCAN_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    impl = llhttp__scan_avx2;
+  } else if (__builtin_cpu_supports("sse4.2")) {
+    impl = llhttp__scan_sse42;
+  }
+#endif  /* LLHTTP__SCAN_X86 */
+
+  /* NOTE: Racing threads would store the same value */
+  llhttp__scan_impl = impl;
+  return impl(ranges, ranges_len, table, match, p, endp);
+}
+
+size_t llhttp__scan(const unsigned char* ranges,
+                    int ranges_len,
+                    const uint8_t* table,
+                    uint8_t match,
+                    const unsigned char* p,
+                    const unsigned char* endp) {
+  return llhttp__scan_impl(ranges, ranges_len, table, match, p, endp);
+}
@@ -0,0 +1,24 @@
+#ifndef INCLUDE_LLHTTP_SCAN_H_
+#define INCLUDE_LLHTTP_SCAN_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Returns the length of the longest prefix of `[p, endp)` whose bytes map to
+ * `match` in `table`. `ranges` holds up to 8 inclusive byte ranges, given
+ * as `ranges_len` bytes of lower and upper bounds, that all map to `match`.
+ * Vectorized implementations skip over bytes within the ranges, and consult
+ * `table` only for the rest.
+ *
+ * The implementation is chosen on the first call, depending on the features
+ * of the CPU that runs the code rather than the one it was compiled for.
+ */
+size_t llhttp__scan(const unsigned char* ranges,
+                    int ranges_len,
+                    const uint8_t* table,
+                    uint8_t match,
+                    const unsigned char* p,
+                    const unsigned char* endp);
+
+#endif  /* INCLUDE_LLHTTP_SCAN_H_ */
@@ -0,0 +1,70 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "dukhttp_plugin.h"
+
+/*
+ * Example plugin, run with:
+ *
+ *   ./dukhttp --plugin ./dukhttp_example_plugin.so examples/routes.js
+ */
+
+static const dukhttp_api_t* api;
+static unsigned long long hits;
+
+static int on_health(const dukhttp_req_t* req, dukhttp_res_t* res,
+                     void* data) {
+  (void) req;
+  (void) data;
+
+  api->set_header(res, "Content-Type", "text/plain");
+  api->write(res, "OK", 2);
+  return 0;
+}
+
+static int on_user(const dukhttp_req_t* req, dukhttp_res_t* res, void* data) {
+  char body[256];
+  int len;
+
+  (void) data;
+
+  /* Numeric ids only, the JS handler serves the rest */
+  const dukhttp_str_t* id = &req->params[0].value;
+  for (size_t i = 0; i < id->len; i++) {
+    if (id->base[i] < '0' || id->base[i] > '9') {
+      return 1;
+    }
+  }
+
+  dukhttp_str_t agent = api->get_header(req, "User-Agent");
+  len = snprintf(body, sizeof(body), "Native user %.*s, hit %llu, %.*s\n",
+      (int) id->len, id->base,
+      ++hits,
+      (int) agent.len, agent.base != NULL ? agent.base : "");
+  if (len < 0) {
+    return 1;
+  }
+  if ((size_t) len >= sizeof(body)) {
+    len = sizeof(body) - 1;
+  }
+
+  api->set_header(res, "Content-Type", "text/plain");
+  api->write(res, body, len);
+  return 0;
+}
+
+DUKHTTP_PLUGIN_EXPORT int dukhttp_plugin_init(const dukhttp_api_t* a) {
+  if (a->abi_version != DUKHTTP_PLUGIN_ABI_VERSION) {
+    return -1;
+  }
+  api = a;
+
+  if (api->add_route("GET", "/health", on_health, NULL) != 0) {
+    return -1;
+  }
+  if (api->add_route("GET", "/users/:id", on_user, NULL) != 0) {
+    return -1;
+  }
+
+  return 0;
+}
@@ -0,0 +1,25 @@
+({
+  'GET /': function(headers, url, method) {
+    return { code: 200, body: 'Main page' };
+  },
+
+  'GET /about': function(headers, url, method) {
+    return { code: 200, body: 'About this project' };
+  },
+
+  'GET /users/:id': function(headers, url, method, respond, params) {
+    return { code: 200, body: 'User ' + params.id };
+  },
+
+  'POST /users/:id': function(headers, url, method, respond, params) {
+    return { code: 201, body: 'Updated user ' + params.id };
+  },
+
+  'GET /files/*path': function(headers, url, method, respond, params) {
+    return { code: 200, body: 'File ' + params.path };
+  },
+
+  '/echo': function(headers, url, method) {
+    return { code: 200, body: method + ' ' + url };
+  },
+})
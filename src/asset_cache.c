@@ -0,0 +1,375 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#ifndef _WIN32
+#include <sys/mman.h>
+#endif  /* !_WIN32 */
+
+#include "asset_cache.h"
+#include "common.h"
+#include "http_cond.h"
+#include "mime.h"
+
+/* Some static vars */
+
+static const unsigned int ASSET_CACHE_INITIAL_SIZE = 256;
+static const uint64_t ASSET_MAX_SIZE = 256 * 1024 * 1024;
+
+static uv_loop_t* asset_cache_loop;
+static map_t asset_cache_map;
+
+/* Helpers */
+
+/* FNV-1a, 64 bit version */
+static uint64_t asset_cache_hash64(const char* data, size_t len) {
+  uint64_t hash = 14695981039346656037ull;
+
+  for (size_t i = 0; i < len; i++) {
+    hash ^= (uint8_t) data[i];
+    hash *= 1099511628211ull;
+  }
+
+  return hash;
+}
+
+static int asset_cache_is_url_safe(char c) {
+  if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+      (c >= '0' && c <= '9')) {
+    return 1;
+  }
+  return strchr("-._~/!$&'()*+,;=:@", c) != NULL && c != '\0';
+}
+
+/* Appends percent-encoded `name` to `url`, returns new length or `-1` */
+static int asset_cache_append_url(char* url, size_t url_len, size_t url_size,
+                                  const char* name) {
+  static const char hex[] = "0123456789ABCDEF";
+
+  for (; *name != '\0'; name++) {
+    if (asset_cache_is_url_safe(*name)) {
+      if (url_len + 1 >= url_size) {
+        return -1;
+      }
+      url[url_len++] = *name;
+      continue;
+    }
+
+    if (url_len + 3 >= url_size) {
+      return -1;
+    }
+    url[url_len++] = '%';
+    url[url_len++] = hex[((uint8_t) *name) >> 4];
+    url[url_len++] = hex[((uint8_t) *name) & 0xf];
+  }
+
+  url[url_len] = '\0';
+  return (int) url_len;
+}
+
+static void asset_cache_insert(asset_t* asset, const char* url,
+                               size_t url_len) {
+  uint32_t hash = map_hash(url, url_len);
+
+  /*
+   * Overlapping directories, the first one wins. Files are checked before
+   * loading, so only aliases that share the bytes of another entry get here.
+   */
+  if (map_get(&asset_cache_map, url, url_len, hash) != NULL) {
+    free(asset);
+    return;
+  }
+
+  asset->url = malloc(url_len + 1);
+  CHECK(asset->url != NULL);
+  memcpy(asset->url, url, url_len);
+  asset->url[url_len] = '\0';
+
+  asset->map_entry.key = asset->url;
+  asset->map_entry.key_len = url_len;
+  asset->map_entry.hash = hash;
+  map_insert(&asset_cache_map, &asset->map_entry);
+}
+
+static int asset_cache_read(uv_file fd, char* out, size_t len) {
+  size_t off = 0;
+
+  while (off < len) {
+    uv_fs_t req;
+    uv_buf_t buf = uv_buf_init(out + off, len - off);
+
+    int nread = uv_fs_read(asset_cache_loop, &req, fd, &buf, 1, off, NULL);
+    uv_fs_req_cleanup(&req);
+
+    if (nread < 0) {
+      return nread;
+    }
+
+    /* File was truncated while reading */
+    if (nread == 0) {
+      return UV_EIO;
+    }
+    off += nread;
+  }
+
+  return 0;
+}
+
+/* Loading */
+
+static int asset_cache_load_file(const char* path,
+                                 const char* url,
+                                 size_t url_len,
+                                 int use_mmap) {
+  uv_fs_t req;
+  uv_file fd;
+  int err;
+
+  /* Overlapping directories, the first one wins */
+  if (map_get(&asset_cache_map, url, url_len, map_hash(url, url_len)) != NULL) {
+    return 0;
+  }
+
+  fd = uv_fs_open(asset_cache_loop, &req, path, UV_FS_O_RDONLY, 0, NULL);
+  uv_fs_req_cleanup(&req);
+  if (fd < 0) {
+    return fd;
+  }
+
+  err = uv_fs_fstat(asset_cache_loop, &req, fd, NULL);
+  uint64_t size = req.statbuf.st_size;
+  time_t mtime = (time_t) req.statbuf.st_mtim.tv_sec;
+  uint64_t mode = req.statbuf.st_mode;
+  uv_fs_req_cleanup(&req);
+
+  if (err != 0) {
+    goto done;
+  }
+
+  /* Skip sockets, pipes and such */
+  if ((mode & S_IFMT) != S_IFREG) {
+    goto done;
+  }
+
+  if (size > ASSET_MAX_SIZE) {
+    err = UV_EFBIG;
+    goto done;
+  }
+
+  asset_t* asset = malloc(sizeof(*asset));
+  CHECK(asset != NULL);
+  memset(asset, 0, sizeof(*asset));
+
+  asset->mtime = mtime;
+
+  char last_modified[64];
+  http_date(last_modified, sizeof(last_modified), mtime);
+
+  char* body = NULL;
+  int mapped = 0;
+
+#ifndef _WIN32
+  if (use_mmap && size != 0) {
+    body = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (body == MAP_FAILED) {
+      body = NULL;
+    } else {
+      mapped = 1;
+    }
+  }
+#else
+  (void) use_mmap;
+#endif  /* !_WIN32 */
+
+  if (!mapped) {
+    body = malloc(size + 1);
+    CHECK(body != NULL);
+
+    err = asset_cache_read(fd, body, size);
+    if (err != 0) {
+      free(body);
+      free(asset);
+      goto done;
+    }
+  }
+
+  snprintf(asset->etag, sizeof(asset->etag), "\"%llx-%llx\"",
+      (unsigned long long) size,
+      (unsigned long long) asset_cache_hash64(body, size));
+
+  const char* fmt =
+      "HTTP/1.1 200 HTTP/1.1 WHATEVER\r\n"
+      "Content-Length: %llu\r\n"
+      "Accept-Ranges: bytes\r\n"
+      "Content-Type: %s\r\n"
+      "ETag: %s\r\n"
+      "Last-Modified: %s\r\n"
+      "\r\n";
+  const char* content_type = mime_from_path(path, strlen(path));
+
+  int head_len = snprintf(NULL, 0, fmt, (unsigned long long) size,
+      content_type, asset->etag, last_modified);
+
+  /* Keep head and body in a single allocation when copying */
+  char* head = malloc(head_len + 1 + (mapped ? 0 : size));
+  CHECK(head != NULL);
+
+  CHECK_EQ(head_len, snprintf(head, head_len + 1, fmt,
+        (unsigned long long) size, content_type, asset->etag, last_modified));
+
+  if (!mapped) {
+    if (size != 0) {
+      memcpy(head + head_len, body, size);
+    }
+    free(body);
+    body = head + head_len;
+  }
+
+  asset->head = uv_buf_init(head, head_len);
+  asset->body = uv_buf_init(body, size);
+
+  asset_cache_insert(asset, url, url_len);
+
+done:
+  /* NOTE: Mapping stays valid after closing the descriptor */
+  uv_fs_close(asset_cache_loop, &req, fd, NULL);
+  uv_fs_req_cleanup(&req);
+  return err;
+}
+
+/* `path` and `url` are buffers of `size` bytes holding current directory */
+static int asset_cache_load_dir(char* path, size_t path_len,
+                                char* url, size_t url_len,
+                                size_t size,
+                                int use_mmap) {
+  uv_fs_t req;
+  uv_dirent_t ent;
+  int err;
+
+  err = uv_fs_scandir(asset_cache_loop, &req, path, 0, NULL);
+  if (err < 0) {
+    uv_fs_req_cleanup(&req);
+    return err;
+  }
+  err = 0;
+
+  while (err == 0 && uv_fs_scandir_next(&req, &ent) != UV_EOF) {
+    size_t name_len = strlen(ent.name);
+
+    if (path_len + 1 + name_len >= size) {
+      err = UV_ENAMETOOLONG;
+      break;
+    }
+    path[path_len] = '/';
+    memcpy(path + path_len + 1, ent.name, name_len + 1);
+
+    url[url_len] = '/';
+    int child_url_len = asset_cache_append_url(url, url_len + 1, size,
+        ent.name);
+    if (child_url_len == -1) {
+      err = UV_ENAMETOOLONG;
+      break;
+    }
+
+    uv_dirent_type_t type = ent.type;
+
+    /* Follow symlinks */
+    if (type != UV_DIRENT_FILE && type != UV_DIRENT_DIR) {
+      uv_fs_t stat_req;
+
+      type = UV_DIRENT_UNKNOWN;
+      if (uv_fs_stat(asset_cache_loop, &stat_req, path, NULL) == 0) {
+        if ((stat_req.statbuf.st_mode & S_IFMT) == S_IFDIR) {
+          type = UV_DIRENT_DIR;
+        } else if ((stat_req.statbuf.st_mode & S_IFMT) == S_IFREG) {
+          type = UV_DIRENT_FILE;
+        }
+      }
+      uv_fs_req_cleanup(&stat_req);
+    }
+
+    if (type == UV_DIRENT_DIR) {
+      err = asset_cache_load_dir(path, path_len + 1 + name_len,
+          url, child_url_len, size, use_mmap);
+    } else if (type == UV_DIRENT_FILE) {
+      err = asset_cache_load_file(path, url, child_url_len, use_mmap);
+    }
+  }
+  uv_fs_req_cleanup(&req);
+
+  /* Directory index, shares the bytes with `index.html` */
+  if (err == 0) {
+    static const char index[] = "/index.html";
+    uint32_t hash;
+    map_entry_t* entry;
+
+    if (url_len + sizeof(index) > size) {
+      return UV_ENAMETOOLONG;
+    }
+    memcpy(url + url_len, index, sizeof(index));
+
+    hash = map_hash(url, url_len + sizeof(index) - 1);
+    entry = map_get(&asset_cache_map, url, url_len + sizeof(index) - 1, hash);
+    if (entry != NULL) {
+      asset_t* index_asset = CONTAINER_OF(entry, asset_t, map_entry);
+      asset_t* alias = malloc(sizeof(*alias));
+      CHECK(alias != NULL);
+
+      *alias = *index_asset;
+      asset_cache_insert(alias, url, url_len + 1);
+    }
+  }
+
+  return err;
+}
+
+int asset_cache_add_dir(const char* prefix, size_t prefix_len,
+                        const char* dir, int use_mmap) {
+  char path[4096];
+  char url[4096];
+  size_t dir_len = strlen(dir);
+
+  /* Strip trailing slashes, they are added back when recursing */
+  while (dir_len > 1 && dir[dir_len - 1] == '/') {
+    dir_len--;
+  }
+  while (prefix_len > 0 && prefix[prefix_len - 1] == '/') {
+    prefix_len--;
+  }
+
+  if (dir_len >= sizeof(path) || prefix_len >= sizeof(url)) {
+    return UV_ENAMETOOLONG;
+  }
+
+  memcpy(path, dir, dir_len);
+  path[dir_len] = '\0';
+  memcpy(url, prefix, prefix_len);
+  url[prefix_len] = '\0';
+
+  return asset_cache_load_dir(path, dir_len, url, prefix_len, sizeof(path),
+      use_mmap);
+}
+
+void asset_cache_init(uv_loop_t* loop) {
+  asset_cache_loop = loop;
+
+  map_init(&asset_cache_map, ASSET_CACHE_INITIAL_SIZE);
+}
+
+const asset_t* asset_cache_get(const char* url, size_t url_len) {
+  size_t path_len = 0;
+  map_entry_t* entry;
+
+  while (path_len < url_len && url[path_len] != '?' && url[path_len] != '#') {
+    path_len++;
+  }
+
+  entry = map_get(&asset_cache_map, url, path_len,
+      map_hash(url, path_len));
+  if (entry == NULL) {
+    return NULL;
+  }
+
+  return CONTAINER_OF(entry, asset_t, map_entry);
+}
@@ -0,0 +1,42 @@
+#ifndef SRC_ASSET_CACHE_H_
+#define SRC_ASSET_CACHE_H_
+
+#include <time.h>
+
+#include "uv.h"
+
+#include "map.h"
+
+/*
+ * Directories loaded into memory at startup. Every file is stored as a fully
+ * serialized HTTP response, so serving it takes a single write of bytes that
+ * are never modified after loading and thus safe to share between threads.
+ */
+
+typedef struct asset_s asset_t;
+struct asset_s {
+  map_entry_t map_entry;
+  char* url;
+
+  /* Response head and the file contents */
+  uv_buf_t head;
+  uv_buf_t body;
+
+  char etag[48];
+  time_t mtime;
+};
+
+void asset_cache_init(uv_loop_t* loop);
+
+/*
+ * Loads all files from `dir` and serves them under `prefix`. With `use_mmap`
+ * the bodies are mapped instead of copied, and the files must not be modified
+ * afterwards. Returns libuv error code.
+ */
+int asset_cache_add_dir(const char* prefix, size_t prefix_len,
+                        const char* dir, int use_mmap);
+
+/* NOTE: `url` may contain query string, it is ignored */
+const asset_t* asset_cache_get(const char* url, size_t url_len);
+
+#endif  /* SRC_ASSET_CACHE_H_ */
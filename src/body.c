@@ -0,0 +1,96 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "body.h"
+#include "common.h"
+
+/* Some static vars */
+
+static const size_t BODY_CHUNK_SIZE = 16384;
+
+static body_chunk_t* body_free_list;
+static unsigned int body_free_count;
+static unsigned int body_max_free;
+
+/* Helpers */
+
+static size_t body_chunk_capacity(void) {
+  return BODY_CHUNK_SIZE - sizeof(body_chunk_t);
+}
+
+static body_chunk_t* body_chunk_new(void) {
+  body_chunk_t* chunk = body_free_list;
+
+  if (chunk != NULL) {
+    body_free_list = chunk->next;
+    body_free_count--;
+  } else {
+    chunk = malloc(BODY_CHUNK_SIZE);
+    CHECK(chunk != NULL);
+  }
+
+  chunk->next = NULL;
+  chunk->len = 0;
+  return chunk;
+}
+
+/* Body */
+
+void body_pool_init(unsigned int max_free) {
+  body_max_free = max_free;
+}
+
+void body_append(body_t* body, const char* data, size_t len) {
+  body->len += len;
+
+  while (len != 0) {
+    body_chunk_t* chunk = body->tail;
+
+    if (chunk == NULL || chunk->len == body_chunk_capacity()) {
+      chunk = body_chunk_new();
+      if (body->tail == NULL) {
+        body->head = chunk;
+      } else {
+        body->tail->next = chunk;
+      }
+      body->tail = chunk;
+    }
+
+    size_t avail = body_chunk_capacity() - chunk->len;
+    size_t to_copy = len < avail ? len : avail;
+
+    memcpy(chunk->data + chunk->len, data, to_copy);
+    chunk->len += to_copy;
+    data += to_copy;
+    len -= to_copy;
+  }
+}
+
+void body_reset(body_t* body) {
+  body_chunk_t* chunk = body->head;
+
+  while (chunk != NULL) {
+    body_chunk_t* next = chunk->next;
+
+    if (body_free_count < body_max_free) {
+      chunk->next = body_free_list;
+      body_free_list = chunk;
+      body_free_count++;
+    } else {
+      free(chunk);
+    }
+
+    chunk = next;
+  }
+
+  body->head = NULL;
+  body->tail = NULL;
+  body->len = 0;
+}
+
+void body_copy(const body_t* body, char* out) {
+  for (body_chunk_t* chunk = body->head; chunk != NULL; chunk = chunk->next) {
+    memcpy(out, chunk->data, chunk->len);
+    out += chunk->len;
+  }
+}
@@ -0,0 +1,41 @@
+#ifndef SRC_BODY_H_
+#define SRC_BODY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Request bodies. The data is accumulated in a list of fixed-size chunks
+ * instead of a single growing buffer, so that large uploads are never
+ * reallocated and copied. Released chunks go to a shared free list and are
+ * reused by the next requests.
+ */
+
+typedef struct body_s body_t;
+typedef struct body_chunk_s body_chunk_t;
+
+struct body_chunk_s {
+  body_chunk_t* next;
+  size_t len;
+  char data[];
+};
+
+/* NOTE: Zero-initialized body is empty */
+struct body_s {
+  body_chunk_t* head;
+  body_chunk_t* tail;
+  uint64_t len;
+};
+
+/* Keeps up to `max_free` released chunks around */
+void body_pool_init(unsigned int max_free);
+
+void body_append(body_t* body, const char* data, size_t len);
+
+/* Returns the chunks to the pool, the body becomes empty */
+void body_reset(body_t* body);
+
+/* Copies the data into `out`, which has to fit `body->len` bytes */
+void body_copy(const body_t* body, char* out);
+
+#endif  /* SRC_BODY_H_ */
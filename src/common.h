@@ -0,0 +1,31 @@
+#ifndef SRC_COMMON_H_
+#define SRC_COMMON_H_
+
+#include <stddef.h>
+#include <stdlib.h>
+#include <stdio.h>
+
+#define CHECK(result) \
+  do { \
+    if (!(result)) { \
+      fprintf(stderr, "Check failed at %s:%d\n", __FILE__, __LINE__); \
+      abort(); \
+    } \
+  } while (0)
+
+#define CHECK_EQ(expected, actual) \
+  do { \
+    int res = (actual); \
+    if (res != (expected)) { \
+      fprintf(stderr, "Expected: %d, but got %d at %s:%d\n", \
+          (expected), res, __FILE__, __LINE__); \
+      abort(); \
+    } \
+  } while (0)
+
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+
+#define CONTAINER_OF(ptr, type, field) \
+  ((type*) ((char*) (ptr) - offsetof(type, field)))
+
+#endif  /* SRC_COMMON_H_ */
@@ -0,0 +1,101 @@
+#ifndef SRC_DUKHTTP_PLUGIN_H_
+#define SRC_DUKHTTP_PLUGIN_H_
+
+#include <stddef.h>
+
+/*
+ * Native handler plugins. A plugin is a shared object loaded at startup with
+ * `--plugin path`, which exports:
+ *
+ *   DUKHTTP_PLUGIN_EXPORT int dukhttp_plugin_init(const dukhttp_api_t* api);
+ *
+ * and registers its routes through `api->add_route()`. It should fail if
+ * `api->abi_version` isn't the version it was built against. Plugin routes are
+ * matched before the JS handler. Handlers run on the event loop thread and
+ * must not block. All strings passed to the handlers are valid only during
+ * the call.
+ *
+ * Plugins talk to the server only through the `api` table, so they don't
+ * need to link against anything.
+ */
+
+#define DUKHTTP_PLUGIN_ABI_VERSION 1
+
+#ifdef _WIN32
+# define DUKHTTP_PLUGIN_EXPORT __declspec(dllexport)
+#else
+# define DUKHTTP_PLUGIN_EXPORT __attribute__((visibility("default")))
+#endif  /* _WIN32 */
+
+typedef struct dukhttp_api_s dukhttp_api_t;
+typedef struct dukhttp_req_s dukhttp_req_t;
+typedef struct dukhttp_res_s dukhttp_res_t;
+typedef struct dukhttp_str_s dukhttp_str_t;
+typedef struct dukhttp_param_s dukhttp_param_t;
+
+/* NOTE: Not NUL-terminated */
+struct dukhttp_str_s {
+  const char* base;
+  size_t len;
+};
+
+struct dukhttp_param_s {
+  dukhttp_str_t name;
+
+  /* Not percent-decoded */
+  dukhttp_str_t value;
+};
+
+struct dukhttp_req_s {
+  const char* method;
+  dukhttp_str_t url;
+
+  /* `url` without query string */
+  dukhttp_str_t path;
+
+  const dukhttp_param_t* params;
+  unsigned int param_count;
+
+  /* Opaque, for `api->get_header()` */
+  void* internal;
+};
+
+/*
+ * Returns `0` if the request was handled and the response is written to
+ * `res`, or non-zero to let the JS handler respond instead.
+ */
+typedef int (*dukhttp_handler_t)(const dukhttp_req_t* req,
+                                 dukhttp_res_t* res,
+                                 void* data);
+
+struct dukhttp_api_s {
+  int abi_version;
+
+  /*
+   * Registers `handler` for `method` (`NULL` for any method) and `pattern`,
+   * which has the same syntax as the JS route tables: static segments,
+   * `:name` parameters and a trailing `*name` wildcard. Returns `0` on
+   * success.
+   */
+  int (*add_route)(const char* method,
+                   const char* pattern,
+                   dukhttp_handler_t handler,
+                   void* data);
+
+  /* Returns value of header `name` (case-insensitive), `NULL` base if none */
+  dukhttp_str_t (*get_header)(const dukhttp_req_t* req, const char* name);
+
+  /* Response status code, `200` by default */
+  void (*set_status)(dukhttp_res_t* res, int code);
+
+  /* Adds a response header. `Content-Length` is set by the server */
+  void (*set_header)(dukhttp_res_t* res, const char* name, const char* value);
+
+  /* Appends to the response body */
+  void (*write)(dukhttp_res_t* res, const void* data, size_t len);
+};
+
+/* Entry point, returns `0` on success */
+typedef int (*dukhttp_plugin_init_t)(const dukhttp_api_t* api);
+
+#endif  /* SRC_DUKHTTP_PLUGIN_H_ */
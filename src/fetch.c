@@ -0,0 +1,770 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fetch.h"
+#include "common.h"
+#include "fs.h"
+#include "llhttp.h"
+#include "refs.h"
+#include "upstream.h"
+
+/* Typedefs */
+
+typedef struct fetch_req_s fetch_req_t;
+struct fetch_req_s {
+  upstream_wait_t wait;
+  upstream_conn_t* conn;
+  uv_timer_t timer;
+  llhttp_t parser;
+
+  int callback_ref;
+
+  /* Serialized request, a buffer on the heap */
+  int out_ref;
+  const char* out;
+  size_t out_len;
+
+  int idempotent;
+  int head;
+  int retried;
+
+  /* Incremented for every connection the request is written to */
+  unsigned int attempt;
+  int writing;
+
+  /* Timer and writes that haven't called back yet */
+  unsigned int pending;
+  int done;
+
+  /* Response */
+  int received;
+  int complete;
+  int err;
+  size_t max_size;
+  int status;
+
+  /* `name\0value\0` pairs, names are lowercase */
+  char* headers;
+  size_t headers_len;
+  size_t headers_size;
+
+  char* body;
+  size_t body_len;
+  size_t body_size;
+};
+
+typedef struct fetch_write_s fetch_write_t;
+struct fetch_write_s {
+  uv_write_t req;
+  fetch_req_t* fetch;
+  unsigned int attempt;
+};
+
+/* Some static vars */
+
+static const uint64_t FETCH_DEFAULT_TIMEOUT = 30000;
+static const size_t FETCH_DEFAULT_MAX_SIZE = 8 * 1024 * 1024;
+static const size_t FETCH_MAX_HEADERS_SIZE = 64 * 1024;
+
+/* Upper bounds of the options, the timeout is the same as in `setTimeout()` */
+static const double FETCH_MAX_TIMEOUT = 2147483647.0;
+static const double FETCH_MAX_MAX_SIZE = 1024.0 * 1024 * 1024;
+
+static uv_loop_t* fetch_loop;
+static duk_context* fetch_ctx;
+static llhttp_settings_t fetch_settings;
+
+/* Prototype of the response objects */
+static int fetch_response_proto_ref;
+
+static char fetch_read_buf[65536];
+
+/* Helpers */
+
+static void fetch_append(char** buf, size_t* len, size_t* size,
+                         const char* data, size_t data_len) {
+  if (*len + data_len > *size) {
+    size_t new_size = *size == 0 ? 1024 : *size;
+    char* new_buf;
+
+    while (new_size < *len + data_len) {
+      new_size *= 2;
+    }
+    new_buf = realloc(*buf, new_size);
+    CHECK(new_buf != NULL);
+
+    *buf = new_buf;
+    *size = new_size;
+  }
+
+  memcpy(*buf + *len, data, data_len);
+  *len += data_len;
+}
+
+/* Appends to the dynamic buffer at `idx` of the stack */
+static void fetch_out_append(duk_context* ctx, duk_idx_t idx, size_t* len,
+                             const char* data, size_t data_len) {
+  duk_size_t size;
+  char* out = duk_get_buffer_data(ctx, idx, &size);
+
+  if (*len + data_len > size) {
+    size = size * 2 < 1024 ? 1024 : size * 2;
+    if (size < *len + data_len) {
+      size = *len + data_len;
+    }
+    out = duk_resize_buffer(ctx, idx, size);
+  }
+
+  memcpy(out + *len, data, data_len);
+  *len += data_len;
+}
+
+/*
+ * Returns `options[name]`, or `def` if it is undefined. Throws a `TypeError`
+ * unless the value is a number between `0` and `max`.
+ */
+static double fetch_get_limit(duk_context* ctx,
+                              duk_idx_t options,
+                              const char* name,
+                              double def,
+                              double max) {
+  double value;
+
+  duk_get_prop_string(ctx, options, name);
+  if (duk_is_undefined(ctx, -1)) {
+    duk_pop(ctx);
+    return def;
+  }
+
+  value = duk_get_number(ctx, -1);
+  if (!duk_is_number(ctx, -1) || !(value >= 0 && value <= max)) {
+    (void) duk_type_error(ctx, "Invalid %s", name);
+  }
+  duk_pop(ctx);
+
+  return value;
+}
+
+static int fetch_is_token(const char* str, size_t len) {
+  if (len == 0) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    char c = str[i];
+
+    if ((c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+        (c >= '0' && c <= '9')) {
+      continue;
+    }
+    if (c == '\0' || strchr("!#$%&'*+-.^_`|~", c) == NULL) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static int fetch_is_idempotent(const char* method, size_t len) {
+  static const char* const methods[] = {
+    "GET", "HEAD", "PUT", "DELETE", "OPTIONS", "TRACE"
+  };
+
+  for (size_t i = 0; i < ARRAY_SIZE(methods); i++) {
+    if (strlen(methods[i]) == len && memcmp(methods[i], method, len) == 0) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/* Requests */
+
+static void fetch_maybe_free(fetch_req_t* req) {
+  if (req->pending != 0) {
+    return;
+  }
+
+  /* NOTE: Kept until the writes are cancelled */
+  refs_del(fetch_ctx, req->out_ref);
+  free(req);
+}
+
+static void fetch_on_timer_close(uv_handle_t* handle) {
+  fetch_req_t* req = handle->data;
+
+  req->pending--;
+  fetch_maybe_free(req);
+}
+
+/*
+ * Calls back with the error or with the response on the top of the stack,
+ * and closes the request.
+ */
+static void fetch_complete(fetch_req_t* req, int err, const char* syscall) {
+  duk_context* ctx = fetch_ctx;
+
+  refs_push(ctx, req->callback_ref);
+  if (err < 0) {
+    fs_push_error(ctx, err, syscall);
+    duk_push_undefined(ctx);
+  } else {
+    duk_push_null(ctx);
+    duk_pull(ctx, -3);
+  }
+
+  refs_del(ctx, req->callback_ref);
+  free(req->headers);
+  free(req->body);
+  req->headers = NULL;
+  req->body = NULL;
+
+  req->done = 1;
+  uv_close((uv_handle_t*) &req->timer, fetch_on_timer_close);
+
+  if (duk_pcall(ctx, 2) != DUK_EXEC_SUCCESS) {
+    fprintf(stderr, "fetch callback error: %s\n",
+        duk_safe_to_string(ctx, -1));
+  }
+  duk_pop(ctx);
+}
+
+static void fetch_fail(fetch_req_t* req, int err, const char* syscall) {
+  if (req->conn != NULL) {
+    uv_read_stop((uv_stream_t*) &req->conn->tcp);
+    upstream_release(req->conn, 0);
+    req->conn = NULL;
+  } else {
+    upstream_cancel(&req->wait);
+  }
+
+  fetch_complete(req, err, syscall);
+}
+
+static void fetch_push_response(fetch_req_t* req) {
+  duk_context* ctx = fetch_ctx;
+  const char* p = req->headers;
+  const char* end = req->headers + req->headers_len;
+
+  duk_push_object(ctx);
+  refs_push(ctx, fetch_response_proto_ref);
+  duk_set_prototype(ctx, -2);
+
+  duk_push_int(ctx, req->status);
+  duk_put_prop_string(ctx, -2, "status");
+
+  duk_push_boolean(ctx, req->status >= 200 && req->status <= 299);
+  duk_put_prop_string(ctx, -2, "ok");
+
+  /* NOTE: Repeated headers are joined */
+  duk_push_object(ctx);
+  while (p != end) {
+    size_t name_len = strlen(p);
+    const char* value = p + name_len + 1;
+    size_t value_len = strlen(value);
+
+    duk_push_lstring(ctx, p, name_len);
+    if (duk_get_prop_lstring(ctx, -2, p, name_len)) {
+      duk_push_string(ctx, ", ");
+      duk_push_lstring(ctx, value, value_len);
+      duk_concat(ctx, 3);
+    } else {
+      duk_pop(ctx);
+      duk_push_lstring(ctx, value, value_len);
+    }
+    duk_put_prop(ctx, -3);
+
+    p = value + value_len + 1;
+  }
+  duk_put_prop_string(ctx, -2, "headers");
+
+  if (req->body_len != 0) {
+    memcpy(duk_push_fixed_buffer(ctx, req->body_len), req->body,
+        req->body_len);
+  } else {
+    duk_push_fixed_buffer(ctx, 0);
+  }
+  duk_put_prop_string(ctx, -2, "body");
+}
+
+static void fetch_finish(fetch_req_t* req, int reuse) {
+  uv_read_stop((uv_stream_t*) &req->conn->tcp);
+  upstream_release(req->conn, reuse);
+  req->conn = NULL;
+
+  fetch_push_response(req);
+  fetch_complete(req, 0, NULL);
+}
+
+static void fetch_on_acquire(upstream_wait_t* wait,
+                             upstream_conn_t* conn,
+                             int status);
+
+/*
+ * Servers close keep-alive connections whenever they like, and a request
+ * written to one at that moment is lost. Idempotent ones are sent again on a
+ * new connection if nothing was received.
+ */
+static void fetch_conn_error(fetch_req_t* req, int err, const char* syscall) {
+  upstream_t* upstream = req->wait.upstream;
+
+  if (req->received || req->conn->uses == 0 || !req->idempotent ||
+      req->retried) {
+    fetch_fail(req, err, syscall);
+    return;
+  }
+
+  uv_read_stop((uv_stream_t*) &req->conn->tcp);
+  upstream_release(req->conn, 0);
+  req->conn = NULL;
+  req->writing = 0;
+  req->retried = 1;
+
+  err = upstream_acquire(upstream, &req->wait, fetch_on_acquire, 1);
+  if (err != 0) {
+    fetch_complete(req, err, "connect");
+  }
+}
+
+static void fetch_on_write(uv_write_t* write_req, int status) {
+  fetch_write_t* write = CONTAINER_OF(write_req, fetch_write_t, req);
+  fetch_req_t* req = write->fetch;
+  unsigned int attempt = write->attempt;
+
+  free(write);
+  req->pending--;
+
+  if (req->done) {
+    fetch_maybe_free(req);
+    return;
+  }
+
+  /* Connection was dropped for a retry */
+  if (attempt != req->attempt) {
+    return;
+  }
+
+  req->writing = 0;
+  if (status != 0) {
+    fetch_conn_error(req, status, "write");
+  }
+}
+
+static void fetch_alloc_cb(uv_handle_t* handle,
+                           size_t suggested_size,
+                           uv_buf_t* buf) {
+  (void) handle;
+  (void) suggested_size;
+
+  *buf = uv_buf_init(fetch_read_buf, sizeof(fetch_read_buf));
+}
+
+static void fetch_read_cb(uv_stream_t* stream,
+                          ssize_t nread,
+                          const uv_buf_t* buf) {
+  upstream_conn_t* conn = CONTAINER_OF(stream, upstream_conn_t, tcp);
+  fetch_req_t* req = conn->data;
+  llhttp_errno_t err;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread < 0) {
+    /* Responses without `Content-Length` end with the connection */
+    if (nread == UV_EOF && req->received) {
+      llhttp_finish(&req->parser);
+      if (req->complete) {
+        fetch_finish(req, 0);
+        return;
+      }
+    }
+
+    fetch_conn_error(req, nread == UV_EOF ? UV_ECONNRESET : (int) nread,
+        "read");
+    return;
+  }
+
+  req->received = 1;
+  err = llhttp_execute(&req->parser, buf->base, nread);
+
+  if (err == HPE_PAUSED && req->complete) {
+    const char* pos = llhttp_get_error_pos(&req->parser);
+
+    /*
+     * NOTE: Anything past the response means the connection is out of sync,
+     * and the server might not have read the whole request before answering.
+     */
+    fetch_finish(req, pos == buf->base + nread && !req->writing &&
+        llhttp_should_keep_alive(&req->parser));
+    return;
+  }
+
+  if (err != HPE_OK) {
+    fetch_fail(req, req->err != 0 ? req->err : UV_EPROTO, "read");
+  }
+}
+
+static void fetch_on_acquire(upstream_wait_t* wait,
+                             upstream_conn_t* conn,
+                             int status) {
+  fetch_req_t* req = CONTAINER_OF(wait, fetch_req_t, wait);
+  fetch_write_t* write;
+  uv_buf_t buf;
+  int err;
+
+  if (status != 0) {
+    fetch_complete(req, status, "connect");
+    return;
+  }
+
+  req->conn = conn;
+  req->attempt++;
+  conn->data = req;
+
+  llhttp_init(&req->parser, HTTP_RESPONSE, &fetch_settings);
+  req->parser.data = req;
+
+  CHECK_EQ(0, uv_read_start((uv_stream_t*) &conn->tcp, fetch_alloc_cb,
+        fetch_read_cb));
+
+  write = malloc(sizeof(*write));
+  CHECK(write != NULL);
+
+  write->fetch = req;
+  write->attempt = req->attempt;
+
+  buf = uv_buf_init((char*) req->out, req->out_len);
+  err = uv_write(&write->req, (uv_stream_t*) &conn->tcp, &buf, 1,
+      fetch_on_write);
+  if (err != 0) {
+    free(write);
+    fetch_conn_error(req, err, "write");
+    return;
+  }
+
+  req->pending++;
+  req->writing = 1;
+}
+
+static void fetch_timer_cb(uv_timer_t* timer) {
+  fetch_req_t* req = timer->data;
+
+  fetch_fail(req, UV_ETIMEDOUT, req->conn == NULL ? "connect" : "read");
+}
+
+/* Parser */
+
+static int fetch_on_message_begin(llhttp_t* p) {
+  fetch_req_t* req = p->data;
+
+  /* NOTE: Informational responses are skipped */
+  req->status = 0;
+  req->headers_len = 0;
+  req->body_len = 0;
+  return 0;
+}
+
+static int fetch_on_header_data(fetch_req_t* req, const char* at,
+                                size_t length) {
+  if (req->headers_len + length + 1 > FETCH_MAX_HEADERS_SIZE) {
+    req->err = UV_E2BIG;
+    return -1;
+  }
+
+  fetch_append(&req->headers, &req->headers_len, &req->headers_size, at,
+      length);
+  return 0;
+}
+
+static int fetch_on_header_field(llhttp_t* p, const char* at, size_t length) {
+  fetch_req_t* req = p->data;
+  char* name;
+
+  if (fetch_on_header_data(req, at, length) != 0) {
+    return -1;
+  }
+
+  name = req->headers + req->headers_len - length;
+  for (size_t i = 0; i < length; i++) {
+    if (name[i] >= 'A' && name[i] <= 'Z') {
+      name[i] |= 0x20;
+    }
+  }
+  return 0;
+}
+
+static int fetch_on_header_value(llhttp_t* p, const char* at, size_t length) {
+  return fetch_on_header_data(p->data, at, length);
+}
+
+static int fetch_on_header_complete(llhttp_t* p) {
+  return fetch_on_header_data(p->data, "", 1);
+}
+
+static int fetch_on_headers_complete(llhttp_t* p) {
+  fetch_req_t* req = p->data;
+
+  req->status = p->status_code;
+  if (p->content_length > req->max_size) {
+    req->err = UV_E2BIG;
+    return -1;
+  }
+
+  if (p->content_length != 0 && !req->head) {
+    req->body = realloc(req->body, p->content_length);
+    CHECK(req->body != NULL);
+    req->body_size = p->content_length;
+  }
+
+  /* No body */
+  return req->head ? 1 : 0;
+}
+
+static int fetch_on_body(llhttp_t* p, const char* at, size_t length) {
+  fetch_req_t* req = p->data;
+
+  if (req->body_len + length > req->max_size) {
+    req->err = UV_E2BIG;
+    return -1;
+  }
+
+  fetch_append(&req->body, &req->body_len, &req->body_size, at, length);
+  return 0;
+}
+
+static int fetch_on_message_complete(llhttp_t* p) {
+  fetch_req_t* req = p->data;
+
+  if (req->status < 200) {
+    return 0;
+  }
+
+  req->complete = 1;
+  return HPE_PAUSED;
+}
+
+/* Response */
+
+static duk_ret_t fetch_response_text_cb(duk_context* ctx) {
+  duk_push_this(ctx);
+  duk_get_prop_string(ctx, -1, "body");
+  duk_buffer_to_string(ctx, -1);
+  return 1;
+}
+
+static duk_ret_t fetch_response_json_cb(duk_context* ctx) {
+  duk_push_this(ctx);
+  duk_get_prop_string(ctx, -1, "body");
+  duk_buffer_to_string(ctx, -1);
+  duk_json_decode(ctx, -1);
+  return 1;
+}
+
+/*
+ * `fetch(url, [options], callback)` where `options` may contain `method`,
+ * `headers`, `body`, `timeout` and `maxResponseSize`.
+ */
+static duk_ret_t fetch_cb(duk_context* ctx) {
+  duk_idx_t callback = duk_get_top_index(ctx);
+  const char* url;
+  size_t url_len;
+  const char* host;
+  size_t host_len;
+  unsigned short port;
+  const char* path;
+  size_t path_len;
+  const char* method = "GET";
+  duk_size_t method_len = 3;
+  const char* body = NULL;
+  duk_size_t body_len = 0;
+  uint64_t timeout = FETCH_DEFAULT_TIMEOUT;
+  size_t max_size = FETCH_DEFAULT_MAX_SIZE;
+  upstream_t* upstream;
+  const char* host_header;
+  size_t host_header_len;
+  int has_host = 0;
+  size_t out_len = 0;
+  duk_idx_t out;
+  fetch_req_t* req;
+  int err;
+
+  url = duk_require_lstring(ctx, 0, &url_len);
+  duk_require_callable(ctx, callback);
+
+  if (upstream_parse_url(url, url_len, &host, &host_len, &port, &path,
+        &path_len) != 0) {
+    return duk_type_error(ctx, "Invalid url, only http: is supported");
+  }
+
+  if (callback != 2 || duk_is_null_or_undefined(ctx, 1)) {
+    duk_push_object(ctx);
+  } else {
+    duk_require_object(ctx, 1);
+    duk_dup(ctx, 1);
+  }
+
+  /* [ ..., options ] */
+  duk_get_prop_string(ctx, -1, "method");
+  if (!duk_is_undefined(ctx, -1)) {
+    method = duk_require_lstring(ctx, -1, &method_len);
+    if (!fetch_is_token(method, method_len)) {
+      return duk_type_error(ctx, "Invalid method");
+    }
+  }
+
+  duk_get_prop_string(ctx, -2, "body");
+  if (duk_is_string(ctx, -1)) {
+    body = duk_get_lstring(ctx, -1, &body_len);
+  } else if (duk_is_buffer_data(ctx, -1)) {
+    body = duk_get_buffer_data(ctx, -1, &body_len);
+  } else if (!duk_is_null_or_undefined(ctx, -1)) {
+    return duk_type_error(ctx, "Body must be a string or a buffer");
+  }
+
+  timeout = (uint64_t) fetch_get_limit(ctx, -3, "timeout", (double) timeout,
+      FETCH_MAX_TIMEOUT);
+  max_size = (size_t) fetch_get_limit(ctx, -3, "maxResponseSize",
+      (double) max_size, FETCH_MAX_MAX_SIZE);
+
+  upstream = upstream_get(host, host_len, port);
+  if (upstream == NULL) {
+    return duk_type_error(ctx, "Invalid url, host is too long");
+  }
+
+  /* [ ..., options, method, body, out ] */
+  duk_push_dynamic_buffer(ctx, 0);
+  out = duk_get_top_index(ctx);
+
+  fetch_out_append(ctx, out, &out_len, method, method_len);
+  fetch_out_append(ctx, out, &out_len, " ", 1);
+  if (path_len == 0 || path[0] != '/') {
+    fetch_out_append(ctx, out, &out_len, "/", 1);
+  }
+  fetch_out_append(ctx, out, &out_len, path, path_len);
+  fetch_out_append(ctx, out, &out_len, " HTTP/1.1\r\n", 11);
+
+  duk_get_prop_string(ctx, -4, "headers");
+  if (duk_is_object(ctx, -1)) {
+    duk_enum(ctx, -1, DUK_ENUM_OWN_PROPERTIES_ONLY);
+    while (duk_next(ctx, -1, 1)) {
+      duk_size_t name_len;
+      duk_size_t value_len;
+      const char* name = duk_get_lstring(ctx, -2, &name_len);
+      const char* value = duk_to_lstring(ctx, -1, &value_len);
+
+      if (!fetch_is_token(name, name_len)) {
+        return duk_type_error(ctx, "Invalid header name");
+      }
+      for (duk_size_t i = 0; i < value_len; i++) {
+        if (value[i] == '\r' || value[i] == '\n' || value[i] == '\0') {
+          return duk_type_error(ctx, "Invalid header value");
+        }
+      }
+
+      /* NOTE: Framing and the connection are managed here */
+      if ((name_len == 14 &&
+           upstream_equals_nocase(name, "content-length", 14)) ||
+          (name_len == 17 &&
+           upstream_equals_nocase(name, "transfer-encoding", 17)) ||
+          (name_len == 10 && upstream_equals_nocase(name, "connection", 10))) {
+        duk_pop_2(ctx);
+        continue;
+      }
+      has_host |= name_len == 4 && upstream_equals_nocase(name, "host", 4);
+
+      fetch_out_append(ctx, out, &out_len, name, name_len);
+      fetch_out_append(ctx, out, &out_len, ": ", 2);
+      fetch_out_append(ctx, out, &out_len, value, value_len);
+      fetch_out_append(ctx, out, &out_len, "\r\n", 2);
+      duk_pop_2(ctx);
+    }
+    duk_pop(ctx);
+  }
+  duk_pop(ctx);
+
+  if (!has_host) {
+    host_header = upstream_host(upstream, &host_header_len);
+    fetch_out_append(ctx, out, &out_len, "Host: ", 6);
+    fetch_out_append(ctx, out, &out_len, host_header, host_header_len);
+    fetch_out_append(ctx, out, &out_len, "\r\n", 2);
+  }
+
+  if (body != NULL || !fetch_is_idempotent(method, method_len)) {
+    char content_length[64];
+    int len = snprintf(content_length, sizeof(content_length),
+        "Content-Length: %llu\r\n", (unsigned long long) body_len);
+
+    fetch_out_append(ctx, out, &out_len, content_length, len);
+  }
+  fetch_out_append(ctx, out, &out_len, "\r\n", 2);
+  if (body_len != 0) {
+    fetch_out_append(ctx, out, &out_len, body, body_len);
+  }
+
+  /* Create request */
+  req = malloc(sizeof(*req));
+  CHECK(req != NULL);
+
+  memset(req, 0, sizeof(*req));
+
+  req->out = duk_get_buffer_data(ctx, out, NULL);
+  req->out_len = out_len;
+  req->out_ref = refs_put(ctx);
+
+  duk_dup(ctx, callback);
+  req->callback_ref = refs_put(ctx);
+
+  req->idempotent = fetch_is_idempotent(method, method_len);
+  req->head = method_len == 4 && memcmp(method, "HEAD", 4) == 0;
+  req->max_size = max_size;
+
+  CHECK_EQ(0, uv_timer_init(fetch_loop, &req->timer));
+  req->timer.data = req;
+  req->pending = 1;
+  if (timeout != 0) {
+    CHECK_EQ(0, uv_timer_start(&req->timer, fetch_timer_cb, timeout, 0));
+  }
+
+  err = upstream_acquire(upstream, &req->wait, fetch_on_acquire, 0);
+  if (err != 0) {
+    refs_del(ctx, req->callback_ref);
+    req->done = 1;
+    uv_close((uv_handle_t*) &req->timer, fetch_on_timer_close);
+
+    fs_push_error(ctx, err, "connect");
+    return duk_throw(ctx);
+  }
+
+  return 0;
+}
+
+void fetch_init(uv_loop_t* loop, duk_context* ctx) {
+  static const duk_function_list_entry fetch_response_funcs[] = {
+    { "text", fetch_response_text_cb, 0 },
+    { "json", fetch_response_json_cb, 0 },
+    { NULL, NULL, 0 }
+  };
+
+  fetch_loop = loop;
+  fetch_ctx = ctx;
+
+  llhttp_settings_init(&fetch_settings);
+  fetch_settings.on_message_begin = fetch_on_message_begin;
+  fetch_settings.on_header_field = fetch_on_header_field;
+  fetch_settings.on_header_field_complete = fetch_on_header_complete;
+  fetch_settings.on_header_value = fetch_on_header_value;
+  fetch_settings.on_header_value_complete = fetch_on_header_complete;
+  fetch_settings.on_headers_complete = fetch_on_headers_complete;
+  fetch_settings.on_body = fetch_on_body;
+  fetch_settings.on_message_complete = fetch_on_message_complete;
+
+  duk_push_object(ctx);
+  duk_put_function_list(ctx, -1, fetch_response_funcs);
+  fetch_response_proto_ref = refs_put(ctx);
+
+  duk_push_global_object(ctx);
+  duk_push_c_function(ctx, fetch_cb, DUK_VARARGS);
+  duk_put_prop_string(ctx, -2, "fetch");
+  duk_pop(ctx);
+}
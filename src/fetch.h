@@ -0,0 +1,17 @@
+#ifndef SRC_FETCH_H_
+#define SRC_FETCH_H_
+
+#include "uv.h"
+#include "duktape.h"
+
+/*
+ * Global `fetch(url, [options], callback)` for requests to upstream HTTP/1.1
+ * servers. Requests are written to keep-alive connections borrowed from the
+ * upstream pools, responses are parsed with llhttp and buffered up to a
+ * limit, and `callback(err, res)` is invoked on the worker heap like the
+ * ones of `fs`.
+ */
+
+void fetch_init(uv_loop_t* loop, duk_context* ctx);
+
+#endif  /* SRC_FETCH_H_ */
@@ -0,0 +1,284 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "file_cache.h"
+#include "common.h"
+
+/* Typedefs */
+
+struct file_waiter_s {
+  file_cache_cb cb;
+  void* arg;
+  file_waiter_t* next;
+};
+
+/* Some static vars */
+
+static uv_loop_t* file_cache_loop;
+static unsigned int file_cache_max;
+
+static map_t file_cache_map;
+static unsigned int file_cache_count;
+
+/* Most recently used entry is at the head */
+static file_entry_t* file_cache_lru_head;
+static file_entry_t* file_cache_lru_tail;
+
+/* LRU */
+
+static void file_cache_lru_unlink(file_entry_t* entry) {
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    file_cache_lru_head = entry->lru_next;
+  }
+
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    file_cache_lru_tail = entry->lru_prev;
+  }
+
+  entry->lru_prev = NULL;
+  entry->lru_next = NULL;
+}
+
+static void file_cache_lru_push(file_entry_t* entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = file_cache_lru_head;
+
+  if (file_cache_lru_head != NULL) {
+    file_cache_lru_head->lru_prev = entry;
+  } else {
+    file_cache_lru_tail = entry;
+  }
+  file_cache_lru_head = entry;
+}
+
+/* Entries */
+
+static void file_cache_on_watcher_close(uv_handle_t* handle) {
+  file_entry_t* entry = handle->data;
+
+  free(entry->path);
+  free(entry);
+}
+
+static void file_cache_free(file_entry_t* entry) {
+  uv_fs_t req;
+
+  CHECK(!entry->cached);
+
+  if (entry->fd != -1) {
+    /* NOTE: Closing a regular file doesn't block */
+    uv_fs_close(file_cache_loop, &req, entry->fd, NULL);
+    uv_fs_req_cleanup(&req);
+    entry->fd = -1;
+  }
+
+  if (entry->watching) {
+    uv_close((uv_handle_t*) &entry->watcher, file_cache_on_watcher_close);
+    return;
+  }
+
+  free(entry->path);
+  free(entry);
+}
+
+void file_cache_release(file_entry_t* entry) {
+  CHECK(entry->refs > 0);
+  entry->refs--;
+  if (entry->refs == 0) {
+    file_cache_free(entry);
+  }
+}
+
+/* Removes the entry from the cache, it will be freed once unused */
+static void file_cache_invalidate(file_entry_t* entry) {
+  if (!entry->cached) {
+    return;
+  }
+
+  map_remove(&file_cache_map, &entry->map_entry);
+  file_cache_lru_unlink(entry);
+  file_cache_count--;
+  entry->cached = 0;
+
+  file_cache_release(entry);
+}
+
+static void file_cache_on_change(uv_fs_event_t* handle,
+                                 const char* filename,
+                                 int events,
+                                 int status) {
+  (void) filename;
+  (void) events;
+  (void) status;
+
+  file_cache_invalidate(handle->data);
+}
+
+static void file_cache_complete(file_entry_t* entry, int status) {
+  file_waiter_t* waiter = entry->waiters;
+
+  entry->waiters = NULL;
+  entry->opening = 0;
+
+  /* Keep entry alive while calling back */
+  entry->refs++;
+
+  if (status != 0) {
+    /* Waiters see the error, the entry goes away right after */
+    file_cache_invalidate(entry);
+  } else {
+    /* Hold a reference for each waiter */
+    for (file_waiter_t* w = waiter; w != NULL; w = w->next) {
+      entry->refs++;
+    }
+  }
+
+  while (waiter != NULL) {
+    file_waiter_t* next = waiter->next;
+
+    waiter->cb(status == 0 ? entry : NULL, status, waiter->arg);
+    free(waiter);
+    waiter = next;
+  }
+
+  file_cache_release(entry);
+}
+
+static void file_cache_on_stat(uv_fs_t* req) {
+  file_entry_t* entry = req->data;
+  int status = (int) req->result;
+
+  if (status == 0) {
+    if ((req->statbuf.st_mode & S_IFMT) == S_IFDIR) {
+      status = UV_EISDIR;
+    } else if ((req->statbuf.st_mode & S_IFMT) != S_IFREG) {
+      status = UV_EINVAL;
+    } else {
+      entry->size = req->statbuf.st_size;
+      entry->mtime = req->statbuf.st_mtim;
+    }
+  }
+  uv_fs_req_cleanup(req);
+
+  if (status == 0) {
+    int err = uv_fs_event_init(file_cache_loop, &entry->watcher);
+    if (err == 0) {
+      entry->watcher.data = entry;
+      entry->watching = 1;
+
+      err = uv_fs_event_start(&entry->watcher, file_cache_on_change,
+          entry->path, 0);
+    }
+
+    /* NOTE: Without a watcher we'd serve stale data, so don't cache */
+    if (err != 0) {
+      file_cache_complete(entry, 0);
+      file_cache_invalidate(entry);
+      return;
+    }
+  }
+
+  file_cache_complete(entry, status);
+}
+
+static void file_cache_on_open(uv_fs_t* req) {
+  file_entry_t* entry = req->data;
+  int status = (int) req->result;
+
+  uv_fs_req_cleanup(req);
+
+  if (status < 0) {
+    file_cache_complete(entry, status);
+    return;
+  }
+
+  entry->fd = status;
+  CHECK_EQ(0, uv_fs_fstat(file_cache_loop, &entry->req, entry->fd,
+        file_cache_on_stat));
+}
+
+static void file_cache_evict(void) {
+  file_entry_t* entry = file_cache_lru_tail;
+
+  while (file_cache_count > file_cache_max && entry != NULL) {
+    file_entry_t* prev = entry->lru_prev;
+
+    /* Can't evict entries that are still being opened */
+    if (!entry->opening) {
+      file_cache_invalidate(entry);
+    }
+    entry = prev;
+  }
+}
+
+void file_cache_get(const char* path, size_t path_len,
+                    file_cache_cb cb, void* arg) {
+  uint32_t hash = map_hash(path, path_len);
+  map_entry_t* map_entry;
+  file_entry_t* entry;
+  file_waiter_t* waiter;
+
+  map_entry = map_get(&file_cache_map, path, path_len, hash);
+  if (map_entry != NULL) {
+    entry = CONTAINER_OF(map_entry, file_entry_t, map_entry);
+
+    file_cache_lru_unlink(entry);
+    file_cache_lru_push(entry);
+
+    if (!entry->opening) {
+      entry->refs++;
+      cb(entry, 0, arg);
+      return;
+    }
+  } else {
+    entry = malloc(sizeof(*entry));
+    CHECK(entry != NULL);
+
+    memset(entry, 0, sizeof(*entry));
+
+    entry->path = malloc(path_len + 1);
+    CHECK(entry->path != NULL);
+    memcpy(entry->path, path, path_len);
+    entry->path[path_len] = '\0';
+    entry->path_len = path_len;
+
+    entry->fd = -1;
+    entry->refs = 1;
+    entry->cached = 1;
+    entry->opening = 1;
+    entry->req.data = entry;
+
+    entry->map_entry.key = entry->path;
+    entry->map_entry.key_len = path_len;
+    entry->map_entry.hash = hash;
+    map_insert(&file_cache_map, &entry->map_entry);
+
+    file_cache_lru_push(entry);
+    file_cache_count++;
+
+    CHECK_EQ(0, uv_fs_open(file_cache_loop, &entry->req, entry->path,
+          UV_FS_O_RDONLY, 0, file_cache_on_open));
+
+    file_cache_evict();
+  }
+
+  waiter = malloc(sizeof(*waiter));
+  CHECK(waiter != NULL);
+
+  waiter->cb = cb;
+  waiter->arg = arg;
+  waiter->next = entry->waiters;
+  entry->waiters = waiter;
+}
+
+void file_cache_init(uv_loop_t* loop, unsigned int max_entries) {
+  file_cache_loop = loop;
+  file_cache_max = max_entries;
+
+  map_init(&file_cache_map, max_entries);
+}
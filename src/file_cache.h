@@ -0,0 +1,53 @@
+#ifndef SRC_FILE_CACHE_H_
+#define SRC_FILE_CACHE_H_
+
+#include "uv.h"
+
+#include "map.h"
+
+/*
+ * LRU cache of open file descriptors and their stat results. Entries are
+ * invalidated by `uv_fs_event` watchers when the files change, and the
+ * descriptors are closed once the last user releases them.
+ */
+
+typedef struct file_entry_s file_entry_t;
+typedef struct file_waiter_s file_waiter_t;
+
+/* NOTE: `entry` is `NULL` when `status` is an error */
+typedef void (*file_cache_cb)(file_entry_t* entry, int status, void* arg);
+
+struct file_entry_s {
+  map_entry_t map_entry;
+  char* path;
+  size_t path_len;
+
+  uv_file fd;
+  uint64_t size;
+  uv_timespec_t mtime;
+
+  /* One for the cache itself and one per user */
+  int refs;
+  int cached;
+  int opening;
+
+  file_entry_t* lru_prev;
+  file_entry_t* lru_next;
+
+  uv_fs_t req;
+  uv_fs_event_t watcher;
+  int watching;
+
+  /* Callbacks waiting for the file to open */
+  file_waiter_t* waiters;
+};
+
+void file_cache_init(uv_loop_t* loop, unsigned int max_entries);
+
+/* Invokes `cb`, synchronously when the file is in the cache */
+void file_cache_get(const char* path, size_t path_len,
+                    file_cache_cb cb, void* arg);
+
+void file_cache_release(file_entry_t* entry);
+
+#endif  /* SRC_FILE_CACHE_H_ */
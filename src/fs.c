@@ -0,0 +1,689 @@
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+
+#include "fs.h"
+#include "common.h"
+#include "refs.h"
+
+/* Typedefs */
+
+typedef struct fs_op_s fs_op_t;
+struct fs_op_s {
+  uv_fs_t req;
+  const char* syscall;
+
+  int callback_ref;
+
+  /* readFile */
+  uv_file fd;
+  int err;
+  int utf8;
+  int buffer_ref;
+  char* data;
+  size_t size;
+  size_t len;
+  int size_known;
+};
+
+typedef struct fs_stream_s fs_stream_t;
+struct fs_stream_s {
+  uv_fs_t req;
+
+  /* JS stream object, holds the callbacks */
+  int obj_ref;
+
+  /* Chunk being read */
+  int buffer_ref;
+  char* data;
+
+  uv_file fd;
+  int64_t offset;
+
+  /* Inclusive, `-1` for end of file */
+  int64_t end;
+  size_t high_water_mark;
+
+  int paused;
+  int reading;
+  int ended;
+  int destroyed;
+
+  /*
+   * `pause()`, `resume()` and `destroy()` only set flags while a callback
+   * runs, the caller of the callback reads or closes afterwards
+   */
+  int in_callback;
+  int closing;
+};
+
+/* Some static vars */
+
+static const size_t FS_CHUNK_LEN = 65536;
+
+static uv_loop_t* fs_loop;
+static duk_context* fs_ctx;
+
+/* Prototype of the objects returned by `createReadStream` */
+static int fs_stream_proto_ref;
+
+/* Helpers */
+
+void fs_push_error(duk_context* ctx, int err, const char* syscall) {
+  duk_push_error_object(ctx, DUK_ERR_ERROR, "%s: %s, %s",
+      uv_err_name(err), uv_strerror(err), syscall);
+
+  duk_push_string(ctx, uv_err_name(err));
+  duk_put_prop_string(ctx, -2, "code");
+
+  duk_push_int(ctx, err);
+  duk_put_prop_string(ctx, -2, "errno");
+
+  duk_push_string(ctx, syscall);
+  duk_put_prop_string(ctx, -2, "syscall");
+}
+
+static fs_op_t* fs_op_new(duk_context* ctx, duk_idx_t callback) {
+  fs_op_t* op;
+
+  duk_require_callable(ctx, callback);
+
+  op = malloc(sizeof(*op));
+  CHECK(op != NULL);
+
+  memset(op, 0, sizeof(*op));
+
+  op->req.data = op;
+  op->fd = -1;
+
+  duk_dup(ctx, callback);
+  op->callback_ref = refs_put(ctx);
+
+  return op;
+}
+
+static void fs_check_sync_error(duk_context* ctx, fs_op_t* op, int err) {
+  if (err == 0) {
+    return;
+  }
+
+  refs_del(ctx, op->callback_ref);
+  free(op);
+
+  fs_push_error(ctx, err, "fs");
+  (void) duk_throw(ctx);
+}
+
+/*
+ * Returns integer `options[name]`, or `def` when it is undefined. Throws a
+ * `TypeError` for values that are not integers between `min` and 2^53 - 1.
+ */
+static int64_t fs_get_position(duk_context* ctx, duk_idx_t options,
+                               const char* name, int64_t min, int64_t def) {
+  double value;
+
+  duk_get_prop_string(ctx, options, name);
+  if (duk_is_undefined(ctx, -1)) {
+    duk_pop(ctx);
+    return def;
+  }
+
+  value = duk_get_number(ctx, -1);
+  if (!duk_is_number(ctx, -1) ||
+      !(value >= (double) min && value <= 9007199254740991.0) ||
+      value != (double) (int64_t) value) {
+    (void) duk_type_error(ctx, "Invalid %s", name);
+  }
+  duk_pop(ctx);
+
+  return (int64_t) value;
+}
+
+/*
+ * Calls back with the error or with the value on the top of the stack and
+ * frees the operation.
+ */
+static void fs_op_complete(fs_op_t* op, int err) {
+  duk_context* ctx = fs_ctx;
+
+  refs_push(ctx, op->callback_ref);
+  if (err < 0) {
+    fs_push_error(ctx, err, op->syscall);
+    duk_push_undefined(ctx);
+  } else {
+    duk_push_null(ctx);
+    duk_pull(ctx, -3);
+  }
+
+  refs_del(ctx, op->callback_ref);
+  if (op->buffer_ref != REFS_NONE) {
+    refs_del(ctx, op->buffer_ref);
+  }
+  free(op);
+
+  if (duk_pcall(ctx, 2) != DUK_EXEC_SUCCESS) {
+    fprintf(stderr, "fs callback error: %s\n", duk_safe_to_string(ctx, -1));
+  }
+  duk_pop(ctx);
+}
+
+static void fs_push_stat(duk_context* ctx, const uv_stat_t* st) {
+  duk_push_object(ctx);
+
+  duk_push_number(ctx, (double) st->st_size);
+  duk_put_prop_string(ctx, -2, "size");
+
+  duk_push_uint(ctx, (duk_uint_t) st->st_mode);
+  duk_put_prop_string(ctx, -2, "mode");
+
+  duk_push_number(ctx,
+      st->st_mtim.tv_sec * 1e3 + st->st_mtim.tv_nsec / 1e6);
+  duk_put_prop_string(ctx, -2, "mtimeMs");
+
+  duk_push_boolean(ctx, (st->st_mode & S_IFMT) == S_IFREG);
+  duk_put_prop_string(ctx, -2, "isFile");
+
+  duk_push_boolean(ctx, (st->st_mode & S_IFMT) == S_IFDIR);
+  duk_put_prop_string(ctx, -2, "isDirectory");
+}
+
+/* readFile */
+
+static void fs_read_file_read(fs_op_t* op);
+
+static void fs_read_file_on_close(uv_fs_t* req) {
+  fs_op_t* op = req->data;
+  duk_context* ctx = fs_ctx;
+
+  uv_fs_req_cleanup(req);
+
+  if (op->err < 0) {
+    fs_op_complete(op, op->err);
+    return;
+  }
+
+  refs_push(ctx, op->buffer_ref);
+  duk_resize_buffer(ctx, -1, op->len);
+  if (op->utf8) {
+    duk_buffer_to_string(ctx, -1);
+  }
+
+  fs_op_complete(op, 0);
+}
+
+static void fs_read_file_close(fs_op_t* op, int err) {
+  op->err = err;
+  op->syscall = err < 0 ? op->syscall : "close";
+
+  CHECK_EQ(0, uv_fs_close(fs_loop, &op->req, op->fd,
+        fs_read_file_on_close));
+}
+
+static void fs_read_file_on_read(uv_fs_t* req) {
+  fs_op_t* op = req->data;
+  ssize_t nread = req->result;
+
+  uv_fs_req_cleanup(req);
+
+  if (nread < 0) {
+    fs_read_file_close(op, (int) nread);
+    return;
+  }
+
+  op->len += nread;
+  if (nread == 0 || (op->size_known && op->len == op->size)) {
+    fs_read_file_close(op, 0);
+    return;
+  }
+
+  fs_read_file_read(op);
+}
+
+static void fs_read_file_read(fs_op_t* op) {
+  duk_context* ctx = fs_ctx;
+
+  /* Size is not known upfront (e.g. procfs), grow as we go */
+  if (op->len == op->size) {
+    op->size += FS_CHUNK_LEN;
+
+    refs_push(ctx, op->buffer_ref);
+    op->data = duk_resize_buffer(ctx, -1, op->size);
+    duk_pop(ctx);
+  }
+
+  /* NOTE: Read straight into the Duktape buffer */
+  uv_buf_t buf = uv_buf_init(op->data + op->len, op->size - op->len);
+
+  op->syscall = "read";
+  CHECK_EQ(0, uv_fs_read(fs_loop, &op->req, op->fd, &buf, 1, op->len,
+        fs_read_file_on_read));
+}
+
+static void fs_read_file_on_stat(uv_fs_t* req) {
+  fs_op_t* op = req->data;
+  duk_context* ctx = fs_ctx;
+
+  if (req->result < 0) {
+    int err = (int) req->result;
+    uv_fs_req_cleanup(req);
+    fs_read_file_close(op, err);
+    return;
+  }
+
+  op->size = (size_t) req->statbuf.st_size;
+  op->size_known = op->size != 0;
+  uv_fs_req_cleanup(req);
+
+  op->data = duk_push_dynamic_buffer(ctx, op->size);
+  op->buffer_ref = refs_put(ctx);
+
+  fs_read_file_read(op);
+}
+
+static void fs_read_file_on_open(uv_fs_t* req) {
+  fs_op_t* op = req->data;
+
+  if (req->result < 0) {
+    int err = (int) req->result;
+    uv_fs_req_cleanup(req);
+    fs_op_complete(op, err);
+    return;
+  }
+
+  op->fd = (uv_file) req->result;
+  uv_fs_req_cleanup(req);
+
+  op->syscall = "fstat";
+  CHECK_EQ(0, uv_fs_fstat(fs_loop, &op->req, op->fd, fs_read_file_on_stat));
+}
+
+/* `fs.readFile(path, [options], callback)` */
+static duk_ret_t fs_read_file_cb(duk_context* ctx) {
+  const char* path = duk_require_string(ctx, 0);
+  duk_idx_t callback = duk_get_top_index(ctx);
+  fs_op_t* op = fs_op_new(ctx, callback);
+
+  if (callback == 2) {
+    const char* encoding = NULL;
+    if (duk_is_string(ctx, 1)) {
+      encoding = duk_get_string(ctx, 1);
+    } else if (duk_is_object(ctx, 1)) {
+      duk_get_prop_string(ctx, 1, "encoding");
+      encoding = duk_get_string(ctx, -1);
+      duk_pop(ctx);
+    }
+    op->utf8 = encoding != NULL &&
+        (strcmp(encoding, "utf8") == 0 || strcmp(encoding, "utf-8") == 0);
+  }
+
+  op->syscall = "open";
+  fs_check_sync_error(ctx, op, uv_fs_open(fs_loop, &op->req, path,
+        UV_FS_O_RDONLY, 0, fs_read_file_on_open));
+
+  return 0;
+}
+
+/* stat */
+
+static void fs_stat_on_stat(uv_fs_t* req) {
+  fs_op_t* op = req->data;
+  int err = (int) req->result;
+
+  if (err >= 0) {
+    fs_push_stat(fs_ctx, &req->statbuf);
+  }
+  uv_fs_req_cleanup(req);
+
+  fs_op_complete(op, err);
+}
+
+/* `fs.stat(path, callback)` */
+static duk_ret_t fs_stat_cb(duk_context* ctx) {
+  const char* path = duk_require_string(ctx, 0);
+  fs_op_t* op = fs_op_new(ctx, 1);
+
+  op->syscall = "stat";
+  fs_check_sync_error(ctx, op,
+      uv_fs_stat(fs_loop, &op->req, path, fs_stat_on_stat));
+
+  return 0;
+}
+
+/* readdir */
+
+static void fs_readdir_on_scandir(uv_fs_t* req) {
+  fs_op_t* op = req->data;
+  duk_context* ctx = fs_ctx;
+  int err = (int) req->result;
+
+  if (err >= 0) {
+    uv_dirent_t ent;
+    duk_uarridx_t i = 0;
+
+    duk_push_array(ctx);
+    while (uv_fs_scandir_next(req, &ent) != UV_EOF) {
+      duk_push_string(ctx, ent.name);
+      duk_put_prop_index(ctx, -2, i++);
+    }
+  }
+  uv_fs_req_cleanup(req);
+
+  fs_op_complete(op, err);
+}
+
+/* `fs.readdir(path, callback)` */
+static duk_ret_t fs_readdir_cb(duk_context* ctx) {
+  const char* path = duk_require_string(ctx, 0);
+  fs_op_t* op = fs_op_new(ctx, 1);
+
+  op->syscall = "scandir";
+  fs_check_sync_error(ctx, op,
+      uv_fs_scandir(fs_loop, &op->req, path, 0, fs_readdir_on_scandir));
+
+  return 0;
+}
+
+/* Streams */
+
+static void fs_stream_read(fs_stream_t* stream);
+
+/* Calls `stream[name](...)` with arguments from the top of the stack */
+static void fs_stream_emit(fs_stream_t* stream,
+                           const char* name,
+                           duk_idx_t nargs) {
+  duk_context* ctx = fs_ctx;
+
+  refs_push(ctx, stream->obj_ref);
+  duk_get_prop_string(ctx, -1, name);
+  if (!duk_is_callable(ctx, -1)) {
+    duk_pop_n(ctx, nargs + 2);
+    return;
+  }
+
+  /* [ ...args, stream, fn ] => [ fn, stream, ...args ] */
+  duk_insert(ctx, -(nargs + 2));
+  duk_insert(ctx, -(nargs + 1));
+
+  stream->in_callback = 1;
+  if (duk_pcall_method(ctx, nargs) != DUK_EXEC_SUCCESS) {
+    fprintf(stderr, "fs stream callback error: %s\n",
+        duk_safe_to_string(ctx, -1));
+  }
+  stream->in_callback = 0;
+  duk_pop(ctx);
+}
+
+static void fs_stream_free(fs_stream_t* stream) {
+  duk_context* ctx = fs_ctx;
+
+  /* Detach JS object */
+  refs_push(ctx, stream->obj_ref);
+  duk_del_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("stream"));
+  duk_pop(ctx);
+
+  refs_del(ctx, stream->obj_ref);
+  free(stream);
+}
+
+static void fs_stream_on_close(uv_fs_t* req) {
+  fs_stream_t* stream = req->data;
+
+  uv_fs_req_cleanup(req);
+
+  if (stream->ended && !stream->destroyed) {
+    fs_stream_emit(stream, "onEnd", 0);
+  }
+  fs_stream_free(stream);
+}
+
+static void fs_stream_close(fs_stream_t* stream) {
+  /* NOTE: `fs_stream_on_close()` frees it */
+  if (stream->closing) {
+    return;
+  }
+  stream->closing = 1;
+
+  if (stream->fd == -1) {
+    fs_stream_free(stream);
+    return;
+  }
+
+  CHECK_EQ(0, uv_fs_close(fs_loop, &stream->req, stream->fd,
+        fs_stream_on_close));
+  stream->fd = -1;
+}
+
+static void fs_stream_error(fs_stream_t* stream, int err, const char* syscall) {
+  if (!stream->destroyed) {
+    fs_push_error(fs_ctx, err, syscall);
+    fs_stream_emit(stream, "onError", 1);
+  }
+  stream->destroyed = 1;
+  fs_stream_close(stream);
+}
+
+static void fs_stream_on_read(uv_fs_t* req) {
+  fs_stream_t* stream = req->data;
+  duk_context* ctx = fs_ctx;
+  ssize_t nread = req->result;
+
+  uv_fs_req_cleanup(req);
+  stream->reading = 0;
+
+  refs_push(ctx, stream->buffer_ref);
+  refs_del(ctx, stream->buffer_ref);
+  stream->buffer_ref = REFS_NONE;
+  stream->data = NULL;
+
+  if (nread < 0 || nread == 0 || stream->destroyed) {
+    duk_pop(ctx);
+
+    if (nread < 0) {
+      fs_stream_error(stream, (int) nread, "read");
+    } else {
+      stream->ended = 1;
+      fs_stream_close(stream);
+    }
+    return;
+  }
+
+  stream->offset += nread;
+  if (stream->end != -1 && stream->offset > stream->end) {
+    stream->ended = 1;
+  }
+
+  duk_resize_buffer(ctx, -1, nread);
+  fs_stream_emit(stream, "onData", 1);
+
+  if (stream->destroyed || stream->ended) {
+    fs_stream_close(stream);
+  } else if (!stream->paused) {
+    fs_stream_read(stream);
+  }
+}
+
+static void fs_stream_read(fs_stream_t* stream) {
+  duk_context* ctx = fs_ctx;
+  size_t len = stream->high_water_mark;
+
+  if (stream->end != -1 && (int64_t) len > stream->end - stream->offset + 1) {
+    len = (size_t) (stream->end - stream->offset + 1);
+  }
+
+  /* NOTE: Each chunk is a fresh buffer handed over to JS */
+  stream->data = duk_push_dynamic_buffer(ctx, len);
+  stream->buffer_ref = refs_put(ctx);
+  stream->reading = 1;
+
+  uv_buf_t buf = uv_buf_init(stream->data, len);
+  CHECK_EQ(0, uv_fs_read(fs_loop, &stream->req, stream->fd, &buf, 1,
+        stream->offset, fs_stream_on_read));
+}
+
+static void fs_stream_on_open(uv_fs_t* req) {
+  fs_stream_t* stream = req->data;
+  int err = (int) req->result;
+
+  uv_fs_req_cleanup(req);
+
+  if (err < 0) {
+    fs_stream_error(stream, err, "open");
+    return;
+  }
+
+  stream->fd = err;
+  if (stream->destroyed) {
+    fs_stream_close(stream);
+  } else if (!stream->paused) {
+    fs_stream_read(stream);
+  }
+}
+
+static fs_stream_t* fs_stream_get(duk_context* ctx) {
+  duk_push_this(ctx);
+  duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("stream"));
+  fs_stream_t* stream = duk_get_pointer(ctx, -1);
+  duk_pop_2(ctx);
+
+  return stream;
+}
+
+static duk_ret_t fs_stream_pause_cb(duk_context* ctx) {
+  fs_stream_t* stream = fs_stream_get(ctx);
+
+  if (stream != NULL) {
+    stream->paused = 1;
+  }
+  return 0;
+}
+
+static duk_ret_t fs_stream_resume_cb(duk_context* ctx) {
+  fs_stream_t* stream = fs_stream_get(ctx);
+
+  if (stream == NULL || !stream->paused) {
+    return 0;
+  }
+
+  stream->paused = 0;
+  if (!stream->reading && !stream->in_callback && !stream->ended &&
+      !stream->destroyed && !stream->closing && stream->fd != -1) {
+    fs_stream_read(stream);
+  }
+  return 0;
+}
+
+static duk_ret_t fs_stream_destroy_cb(duk_context* ctx) {
+  fs_stream_t* stream = fs_stream_get(ctx);
+
+  if (stream == NULL || stream->destroyed) {
+    return 0;
+  }
+
+  stream->destroyed = 1;
+
+  /* Otherwise closed once the pending open, read or callback completes */
+  if (!stream->reading && !stream->in_callback && stream->fd != -1) {
+    fs_stream_close(stream);
+  }
+  return 0;
+}
+
+/*
+ * `fs.createReadStream(path, options)` where `options` may contain `onData`,
+ * `onEnd`, `onError`, `start`, `end` and `highWaterMark`.
+ */
+static duk_ret_t fs_create_read_stream_cb(duk_context* ctx) {
+  const char* path = duk_require_string(ctx, 0);
+  fs_stream_t* stream;
+  int64_t start;
+  int64_t end;
+
+  if (duk_is_null_or_undefined(ctx, 1)) {
+    duk_push_object(ctx);
+    duk_replace(ctx, 1);
+  }
+  duk_require_object(ctx, 1);
+
+  /* `end` is inclusive, `start - 1` selects an empty range */
+  start = fs_get_position(ctx, 1, "start", 0, 0);
+  end = fs_get_position(ctx, 1, "end", -1, -1);
+  if (end != -1 && end < start - 1) {
+    return duk_type_error(ctx, "Invalid end");
+  }
+
+  stream = malloc(sizeof(*stream));
+  CHECK(stream != NULL);
+
+  memset(stream, 0, sizeof(*stream));
+
+  stream->req.data = stream;
+  stream->fd = -1;
+  stream->buffer_ref = REFS_NONE;
+
+  stream->offset = start;
+  stream->end = end;
+
+  duk_get_prop_string(ctx, 1, "highWaterMark");
+  stream->high_water_mark = duk_get_uint_default(ctx, -1, FS_CHUNK_LEN);
+  if (stream->high_water_mark == 0) {
+    stream->high_water_mark = FS_CHUNK_LEN;
+  }
+  duk_pop(ctx);
+
+  /* Create stream object */
+  duk_push_object(ctx);
+  refs_push(ctx, fs_stream_proto_ref);
+  duk_set_prototype(ctx, -2);
+
+  duk_get_prop_string(ctx, 1, "onData");
+  duk_put_prop_string(ctx, -2, "onData");
+  duk_get_prop_string(ctx, 1, "onEnd");
+  duk_put_prop_string(ctx, -2, "onEnd");
+  duk_get_prop_string(ctx, 1, "onError");
+  duk_put_prop_string(ctx, -2, "onError");
+
+  duk_push_pointer(ctx, stream);
+  duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("stream"));
+
+  duk_dup_top(ctx);
+  stream->obj_ref = refs_put(ctx);
+
+  int err = uv_fs_open(fs_loop, &stream->req, path, UV_FS_O_RDONLY, 0,
+      fs_stream_on_open);
+  if (err != 0) {
+    fs_stream_free(stream);
+    fs_push_error(ctx, err, "open");
+    return duk_throw(ctx);
+  }
+
+  return 1;
+}
+
+void fs_init(uv_loop_t* loop, duk_context* ctx) {
+  static const duk_function_list_entry fs_funcs[] = {
+    { "readFile", fs_read_file_cb, DUK_VARARGS },
+    { "stat", fs_stat_cb, 2 },
+    { "readdir", fs_readdir_cb, 2 },
+    { "createReadStream", fs_create_read_stream_cb, 2 },
+    { NULL, NULL, 0 }
+  };
+  static const duk_function_list_entry fs_stream_funcs[] = {
+    { "pause", fs_stream_pause_cb, 0 },
+    { "resume", fs_stream_resume_cb, 0 },
+    { "destroy", fs_stream_destroy_cb, 0 },
+    { NULL, NULL, 0 }
+  };
+
+  fs_loop = loop;
+  fs_ctx = ctx;
+
+  duk_push_object(ctx);
+  duk_put_function_list(ctx, -1, fs_stream_funcs);
+  fs_stream_proto_ref = refs_put(ctx);
+
+  duk_push_global_object(ctx);
+  duk_push_object(ctx);
+  duk_put_function_list(ctx, -1, fs_funcs);
+  duk_put_prop_string(ctx, -2, "fs");
+  duk_pop(ctx);
+}
@@ -0,0 +1,18 @@
+#ifndef SRC_FS_H_
+#define SRC_FS_H_
+
+#include "uv.h"
+#include "duktape.h"
+
+/*
+ * Global `fs` object with non-blocking `readFile`, `stat`, `readdir` and
+ * `createReadStream`. All of them run `uv_fs_*` requests on the threadpool
+ * and invoke Node.js-style `callback(err, result)` on the worker heap.
+ */
+
+void fs_init(uv_loop_t* loop, duk_context* ctx);
+
+/* Pushes an `Error` with `code` and `errno` properties set from `err` */
+void fs_push_error(duk_context* ctx, int err, const char* syscall);
+
+#endif  /* SRC_FS_H_ */
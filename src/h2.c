@@ -0,0 +1,1459 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "h2.h"
+#include "common.h"
+#include "hpack.h"
+
+/* Typedefs */
+
+enum h2_frame_type_e {
+  kH2FrameData = 0x0,
+  kH2FrameHeaders = 0x1,
+  kH2FramePriority = 0x2,
+  kH2FrameRstStream = 0x3,
+  kH2FrameSettings = 0x4,
+  kH2FramePushPromise = 0x5,
+  kH2FramePing = 0x6,
+  kH2FrameGoaway = 0x7,
+  kH2FrameWindowUpdate = 0x8,
+  kH2FrameContinuation = 0x9
+};
+
+enum h2_flag_e {
+  kH2FlagEndStream = 0x1,
+  kH2FlagAck = 0x1,
+  kH2FlagEndHeaders = 0x4,
+  kH2FlagPadded = 0x8,
+  kH2FlagPriority = 0x20
+};
+
+enum h2_error_e {
+  kH2NoError = 0x0,
+  kH2ProtocolError = 0x1,
+  kH2InternalError = 0x2,
+  kH2FlowControlError = 0x3,
+  kH2StreamClosed = 0x5,
+  kH2FrameSizeError = 0x6,
+  kH2RefusedStream = 0x7,
+  kH2CompressionError = 0x9,
+  kH2EnhanceYourCalm = 0xb
+};
+
+enum h2_setting_e {
+  kH2SettingHeaderTableSize = 0x1,
+  kH2SettingEnablePush = 0x2,
+  kH2SettingMaxConcurrentStreams = 0x3,
+  kH2SettingInitialWindowSize = 0x4,
+  kH2SettingMaxFrameSize = 0x5,
+  kH2SettingMaxHeaderListSize = 0x6
+};
+
+/* Callbacks that are due, run outside of the parser and the API calls */
+enum h2_notify_e {
+  kH2NotifyDrain = 0x1,
+  kH2NotifyClose = 0x2
+};
+
+/* Byte queue that is consumed from the front */
+typedef struct h2_buf_s h2_buf_t;
+struct h2_buf_s {
+  char* base;
+  size_t off;
+  size_t len;
+  size_t size;
+};
+
+struct h2_stream_s {
+  h2_t* h2;
+  uint32_t id;
+  void* data;
+
+  /* All streams of the connection */
+  h2_stream_t* prev;
+  h2_stream_t* next;
+
+  /* Streams with data that can be sent, served round-robin */
+  h2_stream_t* send_prev;
+  h2_stream_t* send_next;
+  int sending;
+
+  h2_stream_t* notify_next;
+  int notify;
+
+  /* Request */
+  size_t header_list_size;
+  int regular_seen;
+  int malformed;
+  int remote_closed;
+  int ended;
+  int paused;
+  int discard;
+  int in_callback;
+  int64_t recv_window;
+  uint32_t recv_consumed;
+
+  /* Body received while paused */
+  h2_buf_t in;
+
+  /* Response */
+  int headers_sent;
+  int end_queued;
+  int local_closed;
+  int drain;
+  int64_t send_window;
+  h2_buf_t out;
+
+  int closed;
+  int error;
+};
+
+struct h2_s {
+  uv_stream_t* stream;
+  const h2_callbacks_t* callbacks;
+  void* arg;
+
+  hpack_decoder_t decoder;
+  hpack_encoder_t encoder;
+
+  int settings_received;
+
+  /* Frame being received, buffered only if it spans several reads */
+  unsigned char head[9];
+  unsigned int head_len;
+  uint32_t frame_len;
+  uint8_t frame_type;
+  uint8_t frame_flags;
+  uint32_t frame_stream;
+  char* frame;
+  size_t frame_off;
+
+  /* Header block that continues in `CONTINUATION` frames */
+  uint32_t block_stream;
+  int block_end_stream;
+  h2_buf_t block;
+
+  h2_stream_t* streams;
+  unsigned int stream_count;
+  uint32_t last_stream_id;
+
+  h2_stream_t* send_head;
+  h2_stream_t* send_tail;
+  unsigned int send_count;
+
+  h2_stream_t* notify_head;
+  h2_stream_t* notify_tail;
+
+  /* Flow control, windows may go negative after `SETTINGS` */
+  int64_t send_window;
+  uint32_t peer_window;
+  uint32_t peer_max_frame_size;
+  int64_t recv_window;
+  uint32_t recv_consumed;
+
+  /* Response data of all streams that is not written yet */
+  uint64_t queued;
+
+  /* Frames other than `DATA`, they go out first */
+  h2_buf_t control;
+  unsigned int pending_writes;
+
+  int in_execute;
+  int in_run;
+  int failed;
+  int ended;
+};
+
+/* Some static vars */
+
+static const size_t H2_FRAME_HEADER_LEN = 9;
+
+/* Frames we receive and send, the default `SETTINGS_MAX_FRAME_SIZE` */
+static const uint32_t H2_MAX_FRAME_SIZE = 16384;
+
+static const uint32_t H2_DEFAULT_WINDOW = 65535;
+static const int64_t H2_MAX_WINDOW = 0x7fffffff;
+static const uint32_t H2_MAX_CONCURRENT_STREAMS = 128;
+
+/* Connection window, large enough for many uploads at once */
+static const uint32_t H2_CONNECTION_WINDOW = 1024 * 1024;
+
+/* Header blocks over this are answered with `ENHANCE_YOUR_CALM` */
+static const size_t H2_MAX_BLOCK_SIZE = 65536;
+
+/*
+ * Decoded headers of a stream, counted as in `SETTINGS_MAX_HEADER_LIST_SIZE`.
+ * HPACK references make them much larger than the block, streams over this
+ * are reset as malformed.
+ */
+static const size_t H2_MAX_HEADER_LIST_SIZE = 65536;
+
+/* Data frames are written while the socket has less than this queued */
+static const size_t H2_WRITE_SIZE = 65536;
+
+/* `h2_send()` returns zero once a stream has this much queued */
+static const size_t H2_STREAM_HIGH_WATERMARK = 65536;
+
+/* Forward declarations */
+
+static void h2_run(h2_t* h2);
+
+/* Helpers */
+
+static uint32_t h2_read_u32(const unsigned char* p) {
+  return ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16) |
+         ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+}
+
+static void h2_write_u32(unsigned char* p, uint32_t value) {
+  p[0] = (unsigned char) (value >> 24);
+  p[1] = (unsigned char) (value >> 16);
+  p[2] = (unsigned char) (value >> 8);
+  p[3] = (unsigned char) value;
+}
+
+static void h2_frame_head(unsigned char* out,
+                          size_t len,
+                          int type,
+                          int flags,
+                          uint32_t stream_id) {
+  out[0] = (unsigned char) (len >> 16);
+  out[1] = (unsigned char) (len >> 8);
+  out[2] = (unsigned char) len;
+  out[3] = (unsigned char) type;
+  out[4] = (unsigned char) flags;
+  h2_write_u32(out + 5, stream_id);
+}
+
+static size_t h2_buf_size(const h2_buf_t* buf) {
+  return buf->len - buf->off;
+}
+
+/* Returns pointer to `len` bytes at the end of the queue */
+static char* h2_buf_reserve(h2_buf_t* buf, size_t len) {
+  if (buf->off != 0 && buf->len + len > buf->size) {
+    memmove(buf->base, buf->base + buf->off, buf->len - buf->off);
+    buf->len -= buf->off;
+    buf->off = 0;
+  }
+
+  if (buf->len + len > buf->size) {
+    size_t size = buf->size * 2;
+    if (size < buf->len + len) {
+      size = buf->len + len;
+    }
+
+    char* base = realloc(buf->base, size);
+    CHECK(base != NULL);
+    buf->base = base;
+    buf->size = size;
+  }
+
+  char* p = buf->base + buf->len;
+  buf->len += len;
+  return p;
+}
+
+static void h2_buf_append(h2_buf_t* buf, const char* data, size_t len) {
+  if (len != 0) {
+    memcpy(h2_buf_reserve(buf, len), data, len);
+  }
+}
+
+static void h2_buf_reset(h2_buf_t* buf) {
+  free(buf->base);
+  memset(buf, 0, sizeof(*buf));
+}
+
+/* Drops `len` bytes from the front, the memory goes once it is empty */
+static void h2_buf_consume(h2_buf_t* buf, size_t len) {
+  buf->off += len;
+  if (buf->off == buf->len) {
+    h2_buf_reset(buf);
+  }
+}
+
+static void h2_queue_frame(h2_t* h2,
+                           int type,
+                           int flags,
+                           uint32_t stream_id,
+                           const void* payload,
+                           size_t len) {
+  unsigned char* p;
+
+  p = (unsigned char*) h2_buf_reserve(&h2->control, H2_FRAME_HEADER_LEN + len);
+  h2_frame_head(p, len, type, flags, stream_id);
+  if (len != 0) {
+    memcpy(p + H2_FRAME_HEADER_LEN, payload, len);
+  }
+}
+
+static void h2_queue_u32(h2_t* h2, int type, uint32_t stream_id,
+                         uint32_t value) {
+  unsigned char payload[4];
+
+  h2_write_u32(payload, value);
+  h2_queue_frame(h2, type, 0, stream_id, payload, sizeof(payload));
+}
+
+/* Connection error, nothing is read after it */
+static void h2_fail(h2_t* h2, uint32_t code) {
+  unsigned char payload[8];
+
+  if (h2->failed) {
+    return;
+  }
+  h2->failed = 1;
+
+  h2_write_u32(payload, h2->last_stream_id);
+  h2_write_u32(payload + 4, code);
+  h2_queue_frame(h2, kH2FrameGoaway, 0, 0, payload, sizeof(payload));
+}
+
+static void h2_end(h2_t* h2) {
+  if (h2->ended) {
+    return;
+  }
+
+  h2->ended = 1;
+  h2->callbacks->on_fail(h2->arg);
+}
+
+/* Streams */
+
+static h2_stream_t* h2_find(h2_t* h2, uint32_t id) {
+  for (h2_stream_t* s = h2->streams; s != NULL; s = s->next) {
+    if (s->id == id) {
+      return s;
+    }
+  }
+  return NULL;
+}
+
+static void h2_notify(h2_stream_t* stream, int flag) {
+  h2_t* h2 = stream->h2;
+
+  if (stream->notify == 0) {
+    stream->notify_next = NULL;
+    if (h2->notify_tail == NULL) {
+      h2->notify_head = stream;
+    } else {
+      h2->notify_tail->notify_next = stream;
+    }
+    h2->notify_tail = stream;
+  }
+  stream->notify |= flag;
+}
+
+static void h2_send_list_add(h2_stream_t* stream) {
+  h2_t* h2 = stream->h2;
+
+  if (stream->sending) {
+    return;
+  }
+
+  stream->sending = 1;
+  stream->send_next = NULL;
+  stream->send_prev = h2->send_tail;
+  if (h2->send_tail == NULL) {
+    h2->send_head = stream;
+  } else {
+    h2->send_tail->send_next = stream;
+  }
+  h2->send_tail = stream;
+  h2->send_count++;
+}
+
+static void h2_send_list_remove(h2_stream_t* stream) {
+  h2_t* h2 = stream->h2;
+
+  if (!stream->sending) {
+    return;
+  }
+
+  if (stream->send_prev == NULL) {
+    h2->send_head = stream->send_next;
+  } else {
+    stream->send_prev->send_next = stream->send_next;
+  }
+  if (stream->send_next == NULL) {
+    h2->send_tail = stream->send_prev;
+  } else {
+    stream->send_next->send_prev = stream->send_prev;
+  }
+
+  stream->sending = 0;
+  stream->send_prev = NULL;
+  stream->send_next = NULL;
+  h2->send_count--;
+}
+
+/* Whether there is data or the end of the stream to send */
+static int h2_stream_has_output(h2_stream_t* stream) {
+  return h2_buf_size(&stream->out) != 0 ||
+         (stream->end_queued && !stream->local_closed);
+}
+
+static h2_stream_t* h2_stream_new(h2_t* h2, uint32_t id) {
+  h2_stream_t* stream = malloc(sizeof(*stream));
+  CHECK(stream != NULL);
+
+  memset(stream, 0, sizeof(*stream));
+  stream->h2 = h2;
+  stream->id = id;
+  stream->recv_window = H2_DEFAULT_WINDOW;
+  stream->send_window = h2->peer_window;
+
+  stream->next = h2->streams;
+  if (h2->streams != NULL) {
+    h2->streams->prev = stream;
+  }
+  h2->streams = stream;
+  h2->stream_count++;
+
+  return stream;
+}
+
+/* `on_close` is called once the current callbacks return */
+static void h2_stream_close(h2_stream_t* stream, int error) {
+  h2_t* h2 = stream->h2;
+
+  if (stream->closed) {
+    return;
+  }
+
+  stream->closed = 1;
+  stream->error = error;
+
+  h2->queued -= h2_buf_size(&stream->out);
+  h2_send_list_remove(stream);
+  h2_buf_reset(&stream->out);
+  h2_buf_reset(&stream->in);
+  h2->stream_count--;
+
+  h2_notify(stream, kH2NotifyClose);
+}
+
+static void h2_stream_free(h2_stream_t* stream) {
+  h2_t* h2 = stream->h2;
+
+  if (stream->prev == NULL) {
+    h2->streams = stream->next;
+  } else {
+    stream->prev->next = stream->next;
+  }
+  if (stream->next != NULL) {
+    stream->next->prev = stream->prev;
+  }
+
+  h2_buf_reset(&stream->out);
+  h2_buf_reset(&stream->in);
+  free(stream);
+}
+
+static void h2_stream_reset(h2_stream_t* stream, uint32_t code) {
+  if (stream->closed) {
+    return;
+  }
+
+  h2_queue_u32(stream->h2, kH2FrameRstStream, stream->id, code);
+  h2_stream_close(stream, code != kH2NoError);
+}
+
+/* Both sides have ended the stream, or the response is all we need */
+static void h2_stream_maybe_close(h2_stream_t* stream) {
+  if (!stream->local_closed || stream->closed) {
+    return;
+  }
+
+  if (stream->remote_closed && h2_buf_size(&stream->in) == 0) {
+    h2_stream_close(stream, 0);
+  } else if (stream->discard) {
+    h2_stream_reset(stream, kH2NoError);
+  }
+}
+
+/* Request body was passed on, let the peer send more */
+static void h2_stream_consume(h2_stream_t* stream, size_t len) {
+  stream->recv_consumed += len;
+  if (stream->remote_closed ||
+      stream->recv_consumed < H2_DEFAULT_WINDOW / 2) {
+    return;
+  }
+
+  h2_queue_u32(stream->h2, kH2FrameWindowUpdate, stream->id,
+      stream->recv_consumed);
+  stream->recv_window += stream->recv_consumed;
+  stream->recv_consumed = 0;
+}
+
+static void h2_stream_deliver(h2_stream_t* stream, const char* p, size_t len) {
+  h2_t* h2 = stream->h2;
+
+  stream->in_callback = 1;
+  h2->callbacks->on_data(stream->data, p, len);
+  stream->in_callback = 0;
+
+  if (!stream->closed) {
+    h2_stream_consume(stream, len);
+  }
+}
+
+/* Passes the body that was received while paused, and its end */
+static void h2_stream_flush_in(h2_stream_t* stream) {
+  while (!stream->paused && !stream->closed &&
+         h2_buf_size(&stream->in) != 0) {
+    size_t len = h2_buf_size(&stream->in);
+    if (len > H2_MAX_FRAME_SIZE) {
+      len = H2_MAX_FRAME_SIZE;
+    }
+
+    /* NOTE: Nothing is appended while not paused */
+    const char* p = stream->in.base + stream->in.off;
+    h2_stream_deliver(stream, p, len);
+    if (!stream->closed) {
+      h2_buf_consume(&stream->in, len);
+    }
+  }
+
+  if (stream->paused || stream->closed || !stream->remote_closed ||
+      stream->ended || h2_buf_size(&stream->in) != 0) {
+    return;
+  }
+
+  stream->ended = 1;
+  if (!stream->discard) {
+    stream->h2->callbacks->on_end(stream->data);
+  }
+  h2_stream_maybe_close(stream);
+}
+
+/* Frames */
+
+static int h2_ignore_field(void* arg,
+                           const char* name,
+                           size_t name_len,
+                           const char* value,
+                           size_t value_len) {
+  (void) arg;
+  (void) name;
+  (void) name_len;
+  (void) value;
+  (void) value_len;
+  return 0;
+}
+
+/* NOTE: The whole block is decoded even if the stream is malformed */
+static int h2_on_field(void* arg,
+                       const char* name,
+                       size_t name_len,
+                       const char* value,
+                       size_t value_len) {
+  static const char* const connection_headers[] = {
+    "connection", "keep-alive", "proxy-connection", "transfer-encoding",
+    "upgrade"
+  };
+  h2_stream_t* stream = arg;
+
+  if (stream->malformed) {
+    return 0;
+  }
+
+  stream->header_list_size += name_len + value_len + 32;
+  if (stream->header_list_size > H2_MAX_HEADER_LIST_SIZE) {
+    stream->malformed = 1;
+    return 0;
+  }
+
+  if (name_len == 0) {
+    stream->malformed = 1;
+    return 0;
+  }
+
+  /* Pseudo-headers come first */
+  if (name[0] == ':') {
+    stream->malformed = stream->regular_seen;
+  } else {
+    stream->regular_seen = 1;
+
+    for (size_t i = 0; i < name_len; i++) {
+      if (name[i] >= 'A' && name[i] <= 'Z') {
+        stream->malformed = 1;
+        return 0;
+      }
+    }
+
+    for (unsigned int i = 0; i < ARRAY_SIZE(connection_headers); i++) {
+      if (strlen(connection_headers[i]) == name_len &&
+          memcmp(connection_headers[i], name, name_len) == 0) {
+        stream->malformed = 1;
+        return 0;
+      }
+    }
+
+    if (name_len == 2 && memcmp(name, "te", 2) == 0 &&
+        !(value_len == 8 && memcmp(value, "trailers", 8) == 0)) {
+      stream->malformed = 1;
+      return 0;
+    }
+  }
+
+  if (!stream->malformed &&
+      stream->h2->callbacks->on_header(stream->data, name, name_len, value,
+                                       value_len) != 0) {
+    stream->malformed = 1;
+  }
+  return 0;
+}
+
+static void h2_on_block(h2_t* h2,
+                        uint32_t id,
+                        int end_stream,
+                        const unsigned char* data,
+                        size_t len) {
+  h2_stream_t* stream = h2_find(h2, id);
+
+  /* Trailers, or a stream that is gone. Decoder has to stay in sync. */
+  if (stream != NULL || id <= h2->last_stream_id || h2->failed ||
+      h2->stream_count >= H2_MAX_CONCURRENT_STREAMS) {
+    if (hpack_decode(&h2->decoder, data, len, h2_ignore_field, NULL) != 0) {
+      h2_fail(h2, kH2CompressionError);
+      return;
+    }
+
+    if (stream == NULL) {
+      if (id > h2->last_stream_id) {
+        h2->last_stream_id = id;
+        h2_queue_u32(h2, kH2FrameRstStream, id, kH2RefusedStream);
+      }
+      return;
+    }
+
+    if (stream->closed) {
+      return;
+    }
+    if (stream->remote_closed) {
+      h2_stream_reset(stream, kH2StreamClosed);
+      return;
+    }
+    if (!end_stream) {
+      h2_stream_reset(stream, kH2ProtocolError);
+      return;
+    }
+
+    stream->remote_closed = 1;
+    h2_stream_flush_in(stream);
+    return;
+  }
+
+  h2->last_stream_id = id;
+  stream = h2_stream_new(h2, id);
+  stream->data = h2->callbacks->on_stream(h2->arg, stream);
+
+  if (hpack_decode(&h2->decoder, data, len, h2_on_field, stream) != 0) {
+    h2_stream_close(stream, 1);
+    h2_fail(h2, kH2CompressionError);
+    return;
+  }
+
+  if (stream->malformed) {
+    h2_stream_reset(stream, kH2ProtocolError);
+    return;
+  }
+
+  stream->remote_closed = end_stream;
+  stream->ended = end_stream;
+  if (h2->callbacks->on_headers_complete(stream->data, end_stream) != 0) {
+    h2_stream_reset(stream, kH2ProtocolError);
+  }
+}
+
+static void h2_on_headers(h2_t* h2, const unsigned char* p, size_t len) {
+  uint32_t id = h2->frame_stream;
+  uint8_t flags = h2->frame_flags;
+  size_t pad = 0;
+
+  if (id == 0 || (id & 1) == 0) {
+    h2_fail(h2, kH2ProtocolError);
+    return;
+  }
+
+  if (flags & kH2FlagPadded) {
+    if (len < 1) {
+      h2_fail(h2, kH2FrameSizeError);
+      return;
+    }
+    pad = p[0];
+    p++;
+    len--;
+  }
+  if (flags & kH2FlagPriority) {
+    if (len < 5) {
+      h2_fail(h2, kH2FrameSizeError);
+      return;
+    }
+    p += 5;
+    len -= 5;
+  }
+  if (pad > len) {
+    h2_fail(h2, kH2ProtocolError);
+    return;
+  }
+  len -= pad;
+
+  /* Most blocks fit into a single frame and are decoded in place */
+  if (flags & kH2FlagEndHeaders) {
+    h2_on_block(h2, id, flags & kH2FlagEndStream, p, len);
+    return;
+  }
+
+  h2->block_stream = id;
+  h2->block_end_stream = flags & kH2FlagEndStream;
+  h2_buf_append(&h2->block, (const char*) p, len);
+}
+
+static void h2_on_continuation(h2_t* h2, const unsigned char* p, size_t len) {
+  if (h2->block_stream == 0 || h2->frame_stream != h2->block_stream) {
+    h2_fail(h2, kH2ProtocolError);
+    return;
+  }
+
+  if (h2_buf_size(&h2->block) + len > H2_MAX_BLOCK_SIZE) {
+    h2_fail(h2, kH2EnhanceYourCalm);
+    return;
+  }
+  h2_buf_append(&h2->block, (const char*) p, len);
+
+  if ((h2->frame_flags & kH2FlagEndHeaders) == 0) {
+    return;
+  }
+
+  uint32_t id = h2->block_stream;
+  h2->block_stream = 0;
+  h2_on_block(h2, id, h2->block_end_stream,
+      (const unsigned char*) h2->block.base, h2_buf_size(&h2->block));
+  h2_buf_reset(&h2->block);
+}
+
+static void h2_on_data(h2_t* h2, const unsigned char* p, size_t len) {
+  uint32_t id = h2->frame_stream;
+  size_t frame_len = len;
+  h2_stream_t* stream;
+
+  if (id == 0) {
+    h2_fail(h2, kH2ProtocolError);
+    return;
+  }
+
+  if (h2->frame_flags & kH2FlagPadded) {
+    if (len < 1 || p[0] >= len) {
+      h2_fail(h2, kH2ProtocolError);
+      return;
+    }
+    len -= 1 + p[0];
+    p++;
+  }
+
+  /* Padding counts against the windows too */
+  if ((int64_t) frame_len > h2->recv_window) {
+    h2_fail(h2, kH2FlowControlError);
+    return;
+  }
+  h2->recv_window -= frame_len;
+  h2->recv_consumed += frame_len;
+  if (h2->recv_consumed >= H2_CONNECTION_WINDOW / 2) {
+    h2_queue_u32(h2, kH2FrameWindowUpdate, 0, h2->recv_consumed);
+    h2->recv_window += h2->recv_consumed;
+    h2->recv_consumed = 0;
+  }
+
+  stream = h2_find(h2, id);
+  if (stream == NULL) {
+    if (id > h2->last_stream_id) {
+      h2_fail(h2, kH2ProtocolError);
+    }
+    return;
+  }
+  if (stream->closed) {
+    return;
+  }
+  if (stream->remote_closed) {
+    h2_stream_reset(stream, kH2StreamClosed);
+    return;
+  }
+  if ((int64_t) frame_len > stream->recv_window) {
+    h2_stream_reset(stream, kH2FlowControlError);
+    return;
+  }
+  stream->recv_window -= frame_len;
+  stream->remote_closed = h2->frame_flags & kH2FlagEndStream;
+
+  if (len != 0 && !stream->discard) {
+    if (stream->paused || h2_buf_size(&stream->in) != 0) {
+      h2_buf_append(&stream->in, (const char*) p, len);
+    } else {
+      h2_stream_deliver(stream, (const char*) p, len);
+    }
+  } else {
+    h2_stream_consume(stream, len);
+  }
+
+  if (!stream->closed) {
+    h2_stream_consume(stream, frame_len - len);
+    h2_stream_flush_in(stream);
+  }
+}
+
+static void h2_on_settings(h2_t* h2, const unsigned char* p, size_t len) {
+  if (h2->frame_stream != 0) {
+    h2_fail(h2, kH2ProtocolError);
+    return;
+  }
+
+  if (h2->frame_flags & kH2FlagAck) {
+    if (len != 0) {
+      h2_fail(h2, kH2FrameSizeError);
+    }
+    return;
+  }
+
+  if (len % 6 != 0) {
+    h2_fail(h2, kH2FrameSizeError);
+    return;
+  }
+
+  for (; len != 0; p += 6, len -= 6) {
+    unsigned int id = ((unsigned int) p[0] << 8) | p[1];
+    uint32_t value = h2_read_u32(p + 2);
+
+    switch (id) {
+      case kH2SettingHeaderTableSize:
+        hpack_encoder_set_max_size(&h2->encoder, value);
+        break;
+      case kH2SettingEnablePush:
+        if (value > 1) {
+          h2_fail(h2, kH2ProtocolError);
+          return;
+        }
+        break;
+      case kH2SettingInitialWindowSize:
+        {
+          int64_t delta = (int64_t) value - h2->peer_window;
+
+          if (value > H2_MAX_WINDOW) {
+            h2_fail(h2, kH2FlowControlError);
+            return;
+          }
+
+          for (h2_stream_t* s = h2->streams; s != NULL; s = s->next) {
+            s->send_window += delta;
+            if (s->send_window > H2_MAX_WINDOW) {
+              h2_fail(h2, kH2FlowControlError);
+              return;
+            }
+            if (s->send_window > 0 && !s->closed &&
+                h2_stream_has_output(s)) {
+              h2_send_list_add(s);
+            }
+          }
+          h2->peer_window = value;
+        }
+        break;
+      case kH2SettingMaxFrameSize:
+        if (value < 16384 || value > 16777215) {
+          h2_fail(h2, kH2ProtocolError);
+          return;
+        }
+
+        /* Larger frames would save little, and take longer to interleave */
+        h2->peer_max_frame_size =
+            value < H2_MAX_FRAME_SIZE ? value : H2_MAX_FRAME_SIZE;
+        break;
+      default:
+        break;
+    }
+  }
+
+  h2->settings_received = 1;
+  h2_queue_frame(h2, kH2FrameSettings, kH2FlagAck, 0, NULL, 0);
+}
+
+static void h2_on_window_update(h2_t* h2, const unsigned char* p,
+                                size_t len) {
+  uint32_t id = h2->frame_stream;
+
+  if (len != 4) {
+    h2_fail(h2, kH2FrameSizeError);
+    return;
+  }
+
+  uint32_t increment = h2_read_u32(p) & 0x7fffffff;
+
+  if (id == 0) {
+    if (increment == 0) {
+      h2_fail(h2, kH2ProtocolError);
+      return;
+    }
+
+    h2->send_window += increment;
+    if (h2->send_window > H2_MAX_WINDOW) {
+      h2_fail(h2, kH2FlowControlError);
+    }
+    return;
+  }
+
+  h2_stream_t* stream = h2_find(h2, id);
+  if (stream == NULL) {
+    if (id > h2->last_stream_id) {
+      h2_fail(h2, kH2ProtocolError);
+    }
+    return;
+  }
+  if (stream->closed) {
+    return;
+  }
+
+  if (increment == 0) {
+    h2_stream_reset(stream, kH2ProtocolError);
+    return;
+  }
+
+  stream->send_window += increment;
+  if (stream->send_window > H2_MAX_WINDOW) {
+    h2_stream_reset(stream, kH2FlowControlError);
+    return;
+  }
+
+  if (stream->send_window > 0 && h2_stream_has_output(stream)) {
+    h2_send_list_add(stream);
+  }
+}
+
+static void h2_on_rst_stream(h2_t* h2, size_t len) {
+  uint32_t id = h2->frame_stream;
+
+  if (len != 4) {
+    h2_fail(h2, kH2FrameSizeError);
+    return;
+  }
+  if (id == 0) {
+    h2_fail(h2, kH2ProtocolError);
+    return;
+  }
+
+  h2_stream_t* stream = h2_find(h2, id);
+  if (stream == NULL) {
+    if (id > h2->last_stream_id) {
+      h2_fail(h2, kH2ProtocolError);
+    }
+    return;
+  }
+
+  h2_stream_close(stream, 1);
+}
+
+static void h2_on_frame(h2_t* h2, const unsigned char* p, size_t len) {
+  uint8_t type = h2->frame_type;
+
+  /* Nothing may come in between of the header block's frames */
+  if (h2->block_stream != 0 && type != kH2FrameContinuation) {
+    h2_fail(h2, kH2ProtocolError);
+    return;
+  }
+
+  /* Preface ends with `SETTINGS` */
+  if (!h2->settings_received &&
+      (type != kH2FrameSettings || (h2->frame_flags & kH2FlagAck))) {
+    h2_fail(h2, kH2ProtocolError);
+    return;
+  }
+
+  switch (type) {
+    case kH2FrameData:
+      h2_on_data(h2, p, len);
+      break;
+    case kH2FrameHeaders:
+      h2_on_headers(h2, p, len);
+      break;
+    case kH2FrameContinuation:
+      h2_on_continuation(h2, p, len);
+      break;
+    case kH2FramePriority:
+      if (h2->frame_stream == 0) {
+        h2_fail(h2, kH2ProtocolError);
+      } else if (len != 5) {
+        h2_fail(h2, kH2FrameSizeError);
+      }
+      break;
+    case kH2FrameRstStream:
+      h2_on_rst_stream(h2, len);
+      break;
+    case kH2FrameSettings:
+      h2_on_settings(h2, p, len);
+      break;
+    case kH2FramePushPromise:
+      h2_fail(h2, kH2ProtocolError);
+      break;
+    case kH2FramePing:
+      if (h2->frame_stream != 0) {
+        h2_fail(h2, kH2ProtocolError);
+      } else if (len != 8) {
+        h2_fail(h2, kH2FrameSizeError);
+      } else if ((h2->frame_flags & kH2FlagAck) == 0) {
+        h2_queue_frame(h2, kH2FramePing, kH2FlagAck, 0, p, len);
+      }
+      break;
+    case kH2FrameGoaway:
+      if (h2->frame_stream != 0) {
+        h2_fail(h2, kH2ProtocolError);
+      } else if (len < 8) {
+        h2_fail(h2, kH2FrameSizeError);
+      }
+      break;
+    case kH2FrameWindowUpdate:
+      h2_on_window_update(h2, p, len);
+      break;
+    default:
+      /* Unknown frame types are ignored */
+      break;
+  }
+}
+
+void h2_execute(h2_t* h2, const char* data, size_t len) {
+  h2->in_execute = 1;
+
+  while (len != 0 && !h2->failed) {
+    /* Frame header */
+    if (h2->head_len < H2_FRAME_HEADER_LEN) {
+      size_t n = H2_FRAME_HEADER_LEN - h2->head_len;
+      if (n > len) {
+        n = len;
+      }
+
+      memcpy(h2->head + h2->head_len, data, n);
+      h2->head_len += n;
+      data += n;
+      len -= n;
+
+      if (h2->head_len != H2_FRAME_HEADER_LEN) {
+        continue;
+      }
+
+      h2->frame_len = ((uint32_t) h2->head[0] << 16) |
+                      ((uint32_t) h2->head[1] << 8) |
+                      (uint32_t) h2->head[2];
+      h2->frame_type = h2->head[3];
+      h2->frame_flags = h2->head[4];
+      h2->frame_stream = h2_read_u32(h2->head + 5) & 0x7fffffff;
+
+      if (h2->frame_len > H2_MAX_FRAME_SIZE) {
+        h2_fail(h2, kH2FrameSizeError);
+        break;
+      }
+
+      /* Whole payload is in the read buffer */
+      if (len >= h2->frame_len) {
+        h2_on_frame(h2, (const unsigned char*) data, h2->frame_len);
+        data += h2->frame_len;
+        len -= h2->frame_len;
+        h2->head_len = 0;
+        continue;
+      }
+
+      h2->frame = malloc(h2->frame_len);
+      CHECK(h2->frame != NULL);
+      h2->frame_off = 0;
+    }
+
+    /* Rest of the payload */
+    size_t n = h2->frame_len - h2->frame_off;
+    if (n > len) {
+      n = len;
+    }
+
+    memcpy(h2->frame + h2->frame_off, data, n);
+    h2->frame_off += n;
+    data += n;
+    len -= n;
+
+    if (h2->frame_off == h2->frame_len) {
+      h2_on_frame(h2, (const unsigned char*) h2->frame, h2->frame_len);
+      free(h2->frame);
+      h2->frame = NULL;
+      h2->head_len = 0;
+    }
+  }
+
+  h2->in_execute = 0;
+  h2_run(h2);
+}
+
+/* Output */
+
+static void h2_on_write(uv_write_t* req, int status) {
+  h2_t* h2 = req->data;
+
+  free(req);
+  h2->pending_writes--;
+
+  if (status != 0) {
+    h2_end(h2);
+    return;
+  }
+
+  h2_run(h2);
+}
+
+/* Interleaves `DATA` frames of the streams, returns the length written */
+static size_t h2_write_data(h2_t* h2, unsigned char* out, size_t size) {
+  size_t n = 0;
+  int progress = 1;
+
+  while (progress && h2->send_head != NULL &&
+         size - n > H2_FRAME_HEADER_LEN) {
+    unsigned int count = h2->send_count;
+
+    progress = 0;
+    for (unsigned int i = 0;
+         i < count && h2->send_head != NULL &&
+         size - n > H2_FRAME_HEADER_LEN;
+         i++) {
+      h2_stream_t* stream = h2->send_head;
+      size_t queued = h2_buf_size(&stream->out);
+      size_t len = queued;
+      int blocked = 0;
+
+      h2_send_list_remove(stream);
+
+      if (len > h2->peer_max_frame_size) {
+        len = h2->peer_max_frame_size;
+      }
+      if ((int64_t) len > stream->send_window) {
+        len = stream->send_window > 0 ? (size_t) stream->send_window : 0;
+        blocked = 1;
+      }
+      if ((int64_t) len > h2->send_window) {
+        len = h2->send_window > 0 ? (size_t) h2->send_window : 0;
+        blocked = 0;
+      }
+      if (len > size - n - H2_FRAME_HEADER_LEN) {
+        len = size - n - H2_FRAME_HEADER_LEN;
+        blocked = 0;
+      }
+
+      int last = stream->end_queued && len == queued;
+
+      /* Stream waits for `WINDOW_UPDATE`, the connection for the next pass */
+      if (len == 0 && !last) {
+        if (!blocked) {
+          h2_send_list_add(stream);
+        }
+        continue;
+      }
+
+      h2_frame_head(out + n, len, kH2FrameData,
+          last ? kH2FlagEndStream : 0, stream->id);
+      if (len != 0) {
+        memcpy(out + n + H2_FRAME_HEADER_LEN,
+            stream->out.base + stream->out.off, len);
+      }
+      n += H2_FRAME_HEADER_LEN + len;
+
+      h2_buf_consume(&stream->out, len);
+      stream->send_window -= len;
+      h2->send_window -= len;
+      h2->queued -= len;
+      progress = 1;
+
+      if (stream->drain && queued - len < H2_STREAM_HIGH_WATERMARK) {
+        stream->drain = 0;
+        h2_notify(stream, kH2NotifyDrain);
+      }
+
+      if (last) {
+        stream->local_closed = 1;
+        h2_stream_maybe_close(stream);
+      } else if (queued != len) {
+        h2_send_list_add(stream);
+      }
+    }
+  }
+
+  return n;
+}
+
+/* Writes control frames and the data that windows allow, no callbacks */
+static int h2_write(h2_t* h2) {
+  size_t size = 0;
+
+  if (uv_is_closing((uv_handle_t*) h2->stream)) {
+    return 0;
+  }
+
+  /* NOTE: Only `GOAWAY` goes out after the failure */
+  if (!h2->failed && h2->send_head != NULL &&
+      uv_stream_get_write_queue_size(h2->stream) < H2_WRITE_SIZE) {
+    uint64_t frames = 2 * h2->send_count + h2->queued / H2_MAX_FRAME_SIZE + 1;
+
+    size = H2_WRITE_SIZE;
+    if (h2->queued + frames * H2_FRAME_HEADER_LEN < size) {
+      size = (size_t) (h2->queued + frames * H2_FRAME_HEADER_LEN);
+    }
+  }
+
+  size_t control_len = h2_buf_size(&h2->control);
+  if (control_len == 0 && size == 0) {
+    return 0;
+  }
+
+  uv_write_t* req = malloc(sizeof(*req) + control_len + size);
+  CHECK(req != NULL);
+
+  unsigned char* out = ((unsigned char*) req) + sizeof(*req);
+  if (control_len != 0) {
+    memcpy(out, h2->control.base + h2->control.off, control_len);
+    h2_buf_consume(&h2->control, control_len);
+  }
+
+  size_t len = control_len + h2_write_data(h2, out + control_len, size);
+  if (len == 0) {
+    free(req);
+    return 0;
+  }
+
+  uv_buf_t buf = uv_buf_init((char*) out, len);
+
+  req->data = h2;
+  h2->pending_writes++;
+  CHECK_EQ(0, uv_write(req, h2->stream, &buf, 1, h2_on_write));
+  return 1;
+}
+
+/* Writes what can be written, and runs the callbacks that are due */
+static void h2_run(h2_t* h2) {
+  if (h2->in_execute || h2->in_run || h2->ended) {
+    return;
+  }
+
+  h2->in_run = 1;
+  for (;;) {
+    int wrote = h2_write(h2);
+    h2_stream_t* stream = h2->notify_head;
+
+    if (stream == NULL) {
+      if (!wrote) {
+        break;
+      }
+      continue;
+    }
+
+    h2->notify_head = stream->notify_next;
+    if (h2->notify_head == NULL) {
+      h2->notify_tail = NULL;
+    }
+
+    int flags = stream->notify;
+    stream->notify = 0;
+
+    if (flags & kH2NotifyClose) {
+      h2->callbacks->on_close(stream->data, stream->error);
+      h2_stream_free(stream);
+    } else if ((flags & kH2NotifyDrain) && !stream->closed) {
+      h2->callbacks->on_drain(stream->data);
+    }
+  }
+  h2->in_run = 0;
+
+  if (h2->failed && h2->pending_writes == 0) {
+    h2_end(h2);
+  }
+}
+
+/* Writes right away unless the parser or the callbacks will do it */
+static void h2_maybe_write(h2_t* h2) {
+  if (h2->in_execute || h2->in_run || h2->ended) {
+    return;
+  }
+  while (h2_write(h2)) {
+  }
+}
+
+/* Connection */
+
+void h2_init(void) {
+  hpack_init();
+}
+
+h2_t* h2_new(uv_stream_t* stream, const h2_callbacks_t* callbacks, void* arg) {
+  unsigned char settings[12];
+  h2_t* h2;
+
+  h2 = malloc(sizeof(*h2));
+  CHECK(h2 != NULL);
+
+  memset(h2, 0, sizeof(*h2));
+  h2->stream = stream;
+  h2->callbacks = callbacks;
+  h2->arg = arg;
+
+  hpack_decoder_init(&h2->decoder, 4096);
+  hpack_encoder_init(&h2->encoder);
+
+  h2->send_window = H2_DEFAULT_WINDOW;
+  h2->peer_window = H2_DEFAULT_WINDOW;
+  h2->peer_max_frame_size = H2_MAX_FRAME_SIZE;
+  h2->recv_window = H2_CONNECTION_WINDOW;
+
+  settings[0] = 0;
+  settings[1] = kH2SettingMaxConcurrentStreams;
+  h2_write_u32(settings + 2, H2_MAX_CONCURRENT_STREAMS);
+  settings[6] = 0;
+  settings[7] = kH2SettingMaxHeaderListSize;
+  h2_write_u32(settings + 8, H2_MAX_HEADER_LIST_SIZE);
+  h2_queue_frame(h2, kH2FrameSettings, 0, 0, settings, sizeof(settings));
+  h2_queue_u32(h2, kH2FrameWindowUpdate, 0,
+      H2_CONNECTION_WINDOW - H2_DEFAULT_WINDOW);
+
+  return h2;
+}
+
+void h2_destroy(h2_t* h2) {
+  /* Callbacks of the closed streams might still be due */
+  while (h2->streams != NULL) {
+    h2_stream_t* stream = h2->streams;
+    int error = stream->closed ? stream->error : 1;
+
+    if (!stream->closed) {
+      stream->closed = 1;
+      h2->stream_count--;
+    }
+    h2->callbacks->on_close(stream->data, error);
+    h2_stream_free(stream);
+  }
+
+  hpack_decoder_destroy(&h2->decoder);
+  hpack_encoder_destroy(&h2->encoder);
+  h2_buf_reset(&h2->block);
+  h2_buf_reset(&h2->control);
+  free(h2->frame);
+  free(h2);
+}
+
+/* Responses */
+
+void h2_respond(h2_stream_t* stream,
+                int status,
+                const h2_header_t* headers,
+                unsigned int header_count,
+                const char* data,
+                size_t len,
+                int end_stream) {
+  h2_t* h2 = stream->h2;
+  char status_str[16];
+  size_t size;
+
+  if (stream->closed || stream->headers_sent) {
+    return;
+  }
+  stream->headers_sent = 1;
+
+  snprintf(status_str, sizeof(status_str), "%d", status);
+
+  size = HPACK_MAX_BEGIN_LEN + HPACK_MAX_FIELD_LEN(7, strlen(status_str));
+  for (unsigned int i = 0; i < header_count; i++) {
+    size += HPACK_MAX_FIELD_LEN(headers[i].name_len, headers[i].value_len);
+  }
+
+  unsigned char* block = malloc(size);
+  CHECK(block != NULL);
+
+  size_t n = hpack_encode_begin(&h2->encoder, block);
+  n += hpack_encode(&h2->encoder, ":status", 7, status_str,
+      strlen(status_str), block + n);
+  for (unsigned int i = 0; i < header_count; i++) {
+    n += hpack_encode(&h2->encoder, headers[i].name, headers[i].name_len,
+        headers[i].value, headers[i].value_len, block + n);
+  }
+
+  /* NOTE: Frames of the block are queued together, nothing gets between */
+  int headers_end_stream = end_stream && len == 0;
+  size_t off = 0;
+  do {
+    size_t chunk = n - off;
+    if (chunk > h2->peer_max_frame_size) {
+      chunk = h2->peer_max_frame_size;
+    }
+
+    int flags = off + chunk == n ? kH2FlagEndHeaders : 0;
+    if (off == 0 && headers_end_stream) {
+      flags |= kH2FlagEndStream;
+    }
+
+    h2_queue_frame(h2, off == 0 ? kH2FrameHeaders : kH2FrameContinuation,
+        flags, stream->id, block + off, chunk);
+    off += chunk;
+  } while (off < n);
+
+  free(block);
+
+  if (headers_end_stream) {
+    stream->end_queued = 1;
+    stream->local_closed = 1;
+    h2_stream_maybe_close(stream);
+    h2_maybe_write(h2);
+    return;
+  }
+
+  h2_send(stream, data, len, end_stream);
+}
+
+int h2_send(h2_stream_t* stream, const char* data, size_t len, int end_stream) {
+  h2_t* h2 = stream->h2;
+
+  if (stream->closed || stream->end_queued || !stream->headers_sent) {
+    return 0;
+  }
+
+  h2_buf_append(&stream->out, data, len);
+  h2->queued += len;
+  stream->end_queued = end_stream;
+
+  if (h2_stream_has_output(stream) && stream->send_window > 0) {
+    h2_send_list_add(stream);
+  }
+
+  /* NOTE: The stream is freed only after the callbacks */
+  stream->drain = h2_buf_size(&stream->out) >= H2_STREAM_HIGH_WATERMARK;
+  h2_maybe_write(h2);
+
+  return !stream->drain;
+}
+
+void h2_stream_fail(h2_stream_t* stream) {
+  h2_stream_reset(stream, kH2InternalError);
+  h2_maybe_write(stream->h2);
+}
+
+void h2_stream_discard(h2_stream_t* stream) {
+  stream->discard = 1;
+  h2_buf_reset(&stream->in);
+  h2_stream_maybe_close(stream);
+  h2_maybe_write(stream->h2);
+}
+
+void h2_stream_pause(h2_stream_t* stream) {
+  stream->paused = 1;
+}
+
+void h2_stream_resume(h2_stream_t* stream) {
+  stream->paused = 0;
+
+  /* Rest of the body follows once the current chunk's callback returns */
+  if (stream->in_callback || stream->closed) {
+    return;
+  }
+
+  h2_stream_flush_in(stream);
+  h2_maybe_write(stream->h2);
+}
@@ -0,0 +1,107 @@
+#ifndef SRC_H2_H_
+#define SRC_H2_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "uv.h"
+
+/*
+ * HTTP/2 (RFC 9113) framing for connections that start with the client
+ * preface, i.e. h2c with prior knowledge. Header blocks are decoded with
+ * HPACK, flow control windows are maintained for both directions, and the
+ * response data of all streams is interleaved into frames as the peer's
+ * windows and the socket allow. Streams carry an opaque pointer that the
+ * callbacks receive, so that every stream can be handled like a separate
+ * HTTP/1.1 request.
+ */
+
+typedef struct h2_s h2_t;
+typedef struct h2_stream_s h2_stream_t;
+typedef struct h2_header_s h2_header_t;
+typedef struct h2_callbacks_s h2_callbacks_t;
+
+struct h2_header_s {
+  const char* name;
+  size_t name_len;
+  const char* value;
+  size_t value_len;
+};
+
+struct h2_callbacks_s {
+  /* New stream, returns the pointer that the other callbacks receive */
+  void* (*on_stream)(void* arg, h2_stream_t* stream);
+
+  /*
+   * Request headers, including the pseudo-headers. Non-zero return value of
+   * either callback resets the stream as malformed.
+   */
+  int (*on_header)(void* data,
+                   const char* name,
+                   size_t name_len,
+                   const char* value,
+                   size_t value_len);
+  int (*on_headers_complete)(void* data, int end_stream);
+
+  /* Request body, and its end */
+  void (*on_data)(void* data, const char* p, size_t len);
+  void (*on_end)(void* data);
+
+  /* Data queued with `h2_send()` got below the limit */
+  void (*on_drain)(void* data);
+
+  /* Stream is done, `error` is set if it was reset or the connection failed */
+  void (*on_close)(void* data, int error);
+
+  /* Connection should be closed */
+  void (*on_fail)(void* arg);
+};
+
+/* Preface that opens the connection, followed by client's `SETTINGS` */
+#define H2_PREFACE "PRI * HTTP/2.0\r\n\r\nSM\r\n\r\n"
+#define H2_PREFACE_LEN 24
+
+/* Builds HPACK tables */
+void h2_init(void);
+
+/* Sends server's `SETTINGS` */
+h2_t* h2_new(uv_stream_t* stream, const h2_callbacks_t* callbacks, void* arg);
+
+/* NOTE: `data` starts right after the preface */
+void h2_execute(h2_t* h2, const char* data, size_t len);
+
+/*
+ * Connection is gone, calls `on_close` for the remaining streams and frees
+ * everything.
+ */
+void h2_destroy(h2_t* h2);
+
+/* Sends response headers, and the start of the body if `len` is not zero */
+void h2_respond(h2_stream_t* stream,
+                int status,
+                const h2_header_t* headers,
+                unsigned int header_count,
+                const char* data,
+                size_t len,
+                int end_stream);
+
+/*
+ * Queues response data. Returns zero once too much is waiting to be sent,
+ * `on_drain` is called when it is sent.
+ */
+int h2_send(h2_stream_t* stream, const char* data, size_t len, int end_stream);
+
+/* Resets the stream with `INTERNAL_ERROR` */
+void h2_stream_fail(h2_stream_t* stream);
+
+/*
+ * Stops passing request body, and resets the stream with `NO_ERROR` once the
+ * response is sent if the peer is still sending.
+ */
+void h2_stream_discard(h2_stream_t* stream);
+
+/* Stops acknowledging the request body, it is buffered until resumed */
+void h2_stream_pause(h2_stream_t* stream);
+void h2_stream_resume(h2_stream_t* stream);
+
+#endif  /* SRC_H2_H_ */
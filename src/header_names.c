@@ -0,0 +1,157 @@
+#include <string.h>
+
+#include "header_names.h"
+#include "common.h"
+#include "refs.h"
+
+/* Typedefs */
+
+typedef struct header_name_s header_name_t;
+struct header_name_s {
+  const char* name;
+  size_t len;
+};
+
+/* Some static vars */
+
+static const uint8_t HEADER_NAMES_EMPTY = 255;
+
+static const header_name_t header_names[] = {
+  { "host", 4 },
+  { "user-agent", 10 },
+  { "accept", 6 },
+  { "accept-encoding", 15 },
+  { "accept-language", 15 },
+  { "accept-charset", 14 },
+  { "authorization", 13 },
+  { "cache-control", 13 },
+  { "connection", 10 },
+  { "content-length", 14 },
+  { "content-type", 12 },
+  { "content-encoding", 16 },
+  { "cookie", 6 },
+  { "date", 4 },
+  { "dnt", 3 },
+  { "expect", 6 },
+  { "forwarded", 9 },
+  { "from", 4 },
+  { "if-match", 8 },
+  { "if-modified-since", 17 },
+  { "if-none-match", 13 },
+  { "if-range", 8 },
+  { "if-unmodified-since", 19 },
+  { "keep-alive", 10 },
+  { "last-event-id", 13 },
+  { "origin", 6 },
+  { "pragma", 6 },
+  { "priority", 8 },
+  { "proxy-authorization", 19 },
+  { "range", 5 },
+  { "referer", 7 },
+  { "sec-ch-ua", 9 },
+  { "sec-ch-ua-mobile", 16 },
+  { "sec-ch-ua-platform", 18 },
+  { "sec-fetch-dest", 14 },
+  { "sec-fetch-mode", 14 },
+  { "sec-fetch-site", 14 },
+  { "sec-fetch-user", 14 },
+  { "sec-websocket-extensions", 24 },
+  { "sec-websocket-key", 17 },
+  { "sec-websocket-protocol", 22 },
+  { "sec-websocket-version", 21 },
+  { "te", 2 },
+  { "trailer", 7 },
+  { "transfer-encoding", 17 },
+  { "upgrade", 7 },
+  { "upgrade-insecure-requests", 25 },
+  { "via", 3 },
+  { "x-forwarded-for", 15 },
+  { "x-forwarded-host", 16 },
+  { "x-forwarded-proto", 17 },
+  { "x-real-ip", 9 },
+  { "x-requested-with", 16 },
+};
+
+/*
+ * Slot to index in `header_names`. The multipliers in `header_names_hash()`
+ * were found by trying random ones until all of the names above got distinct
+ * slots, so adding a name requires a new search.
+ */
+static const uint8_t header_names_slots[128] = {
+  255,  11, 255,  13, 255,  24, 255,  45,  50,  44, 255, 255,
+    1,  27, 255, 255,   3, 255, 255, 255,  43,  23, 255,  12,
+  255,  33, 255, 255, 255, 255, 255, 255,  19,   4,  42, 255,
+  255, 255, 255,   6, 255, 255,  10,  14,  39,  48, 255, 255,
+   15, 255, 255, 255,  52,   7,   9, 255, 255, 255, 255,  36,
+   34, 255, 255,  32,  38,  21,   5, 255, 255, 255, 255,  22,
+    2, 255, 255,   0, 255, 255,  37, 255,  31, 255,  16, 255,
+  255, 255, 255, 255, 255,  20, 255, 255, 255, 255,  30, 255,
+  255, 255, 255, 255, 255, 255,  40, 255, 255, 255,  25,  41,
+   46, 255,   8, 255,  17, 255, 255,  28,  26, 255,  29,  47,
+   51, 255,  18,  35,  49, 255, 255, 255,
+};
+
+/* Interned names, kept reachable by an array in the stash */
+static void* header_names_ptrs[ARRAY_SIZE(header_names)];
+
+/* Helpers */
+
+static uint8_t header_names_lower(char c) {
+  if (c >= 'A' && c <= 'Z') {
+    c += 'a' - 'A';
+  }
+  return (uint8_t) c;
+}
+
+/* NOTE: `| 32` lowercases letters and leaves `-` and digits intact */
+static unsigned int header_names_hash(const char* name, size_t len) {
+  return ((unsigned int) len * 47 +
+          ((uint8_t) name[0] | 32) * 33 +
+          ((uint8_t) name[len / 2] | 32) * 61 +
+          ((uint8_t) name[len - 2] | 32) * 12 +
+          ((uint8_t) name[len - 1] | 32) * 35) &
+         (ARRAY_SIZE(header_names_slots) - 1);
+}
+
+/* Header names */
+
+void header_names_init(duk_context* ctx) {
+  duk_push_array(ctx);
+  for (unsigned int i = 0; i < ARRAY_SIZE(header_names); i++) {
+    duk_push_lstring(ctx, header_names[i].name, header_names[i].len);
+    header_names_ptrs[i] = duk_get_heapptr(ctx, -1);
+    duk_put_prop_index(ctx, -2, i);
+  }
+
+  /* NOTE: Never released */
+  refs_put(ctx);
+}
+
+int header_names_lookup(const char* name, size_t len) {
+  if (len < 2) {
+    return -1;
+  }
+
+  uint8_t id = header_names_slots[header_names_hash(name, len)];
+  if (id == HEADER_NAMES_EMPTY || header_names[id].len != len) {
+    return -1;
+  }
+
+  const char* known = header_names[id].name;
+  for (size_t i = 0; i < len; i++) {
+    if (header_names_lower(name[i]) != (uint8_t) known[i]) {
+      return -1;
+    }
+  }
+
+  return id;
+}
+
+const char* header_names_get(int id, size_t* len) {
+  *len = header_names[id].len;
+  return header_names[id].name;
+}
+
+void header_names_push(duk_context* ctx, int id) {
+  duk_push_heapptr(ctx, header_names_ptrs[id]);
+}
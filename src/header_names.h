@@ -0,0 +1,25 @@
+#ifndef SRC_HEADER_NAMES_H_
+#define SRC_HEADER_NAMES_H_
+
+#include <stddef.h>
+
+#include "duktape.h"
+
+/*
+ * Well-known request header names. They are recognized case-insensitively
+ * with a perfect hash, so the parser can store them without allocating, and
+ * their lowercase JS strings are interned once per heap.
+ */
+
+void header_names_init(duk_context* ctx);
+
+/* Returns the id of well-known header `name` in any case, or `-1` */
+int header_names_lookup(const char* name, size_t len);
+
+/* Returns lowercase, NUL-terminated name */
+const char* header_names_get(int id, size_t* len);
+
+/* Pushes the interned name */
+void header_names_push(duk_context* ctx, int id);
+
+#endif  /* SRC_HEADER_NAMES_H_ */
@@ -0,0 +1,769 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "hpack.h"
+#include "common.h"
+
+/* Typedefs */
+
+typedef struct hpack_code_s hpack_code_t;
+struct hpack_code_s {
+  uint32_t code;
+  uint8_t len;
+};
+
+typedef struct hpack_static_s hpack_static_t;
+struct hpack_static_s {
+  const char* name;
+  size_t name_len;
+  const char* value;
+  size_t value_len;
+};
+
+/* Decoder state after four bits of Huffman-encoded input */
+typedef struct hpack_step_s hpack_step_t;
+struct hpack_step_s {
+  uint8_t state;
+  uint8_t flags;
+  uint8_t sym;
+};
+
+enum hpack_step_flags_e {
+  kHPACKStepSym = 1,
+  kHPACKStepFail = 2,
+  kHPACKStepAccept = 4
+};
+
+/* Some static vars */
+
+/* Added to the length of every field in the table, RFC 7541 section 4.1 */
+static const size_t HPACK_FIELD_OVERHEAD = 32;
+
+/* We neither advertise nor use a larger table */
+static const size_t HPACK_DEFAULT_TABLE_SIZE = 4096;
+
+static const unsigned int HPACK_INITIAL_CAPACITY = 16;
+
+/* RFC 7541 appendix B, the last entry is EOS */
+static const hpack_code_t hpack_huffman[257] = {
+  { 0x1ff8, 13 }, { 0x7fffd8, 23 }, { 0xfffffe2, 28 }, { 0xfffffe3, 28 },
+  { 0xfffffe4, 28 }, { 0xfffffe5, 28 }, { 0xfffffe6, 28 }, { 0xfffffe7, 28 },
+  { 0xfffffe8, 28 }, { 0xffffea, 24 }, { 0x3ffffffc, 30 }, { 0xfffffe9, 28 },
+  { 0xfffffea, 28 }, { 0x3ffffffd, 30 }, { 0xfffffeb, 28 }, { 0xfffffec, 28 },
+  { 0xfffffed, 28 }, { 0xfffffee, 28 }, { 0xfffffef, 28 }, { 0xffffff0, 28 },
+  { 0xffffff1, 28 }, { 0xffffff2, 28 }, { 0x3ffffffe, 30 }, { 0xffffff3, 28 },
+  { 0xffffff4, 28 }, { 0xffffff5, 28 }, { 0xffffff6, 28 }, { 0xffffff7, 28 },
+  { 0xffffff8, 28 }, { 0xffffff9, 28 }, { 0xffffffa, 28 }, { 0xffffffb, 28 },
+  { 0x14, 6 }, { 0x3f8, 10 }, { 0x3f9, 10 }, { 0xffa, 12 },
+  { 0x1ff9, 13 }, { 0x15, 6 }, { 0xf8, 8 }, { 0x7fa, 11 },
+  { 0x3fa, 10 }, { 0x3fb, 10 }, { 0xf9, 8 }, { 0x7fb, 11 },
+  { 0xfa, 8 }, { 0x16, 6 }, { 0x17, 6 }, { 0x18, 6 },
+  { 0x0, 5 }, { 0x1, 5 }, { 0x2, 5 }, { 0x19, 6 },
+  { 0x1a, 6 }, { 0x1b, 6 }, { 0x1c, 6 }, { 0x1d, 6 },
+  { 0x1e, 6 }, { 0x1f, 6 }, { 0x5c, 7 }, { 0xfb, 8 },
+  { 0x7ffc, 15 }, { 0x20, 6 }, { 0xffb, 12 }, { 0x3fc, 10 },
+  { 0x1ffa, 13 }, { 0x21, 6 }, { 0x5d, 7 }, { 0x5e, 7 },
+  { 0x5f, 7 }, { 0x60, 7 }, { 0x61, 7 }, { 0x62, 7 },
+  { 0x63, 7 }, { 0x64, 7 }, { 0x65, 7 }, { 0x66, 7 },
+  { 0x67, 7 }, { 0x68, 7 }, { 0x69, 7 }, { 0x6a, 7 },
+  { 0x6b, 7 }, { 0x6c, 7 }, { 0x6d, 7 }, { 0x6e, 7 },
+  { 0x6f, 7 }, { 0x70, 7 }, { 0x71, 7 }, { 0x72, 7 },
+  { 0xfc, 8 }, { 0x73, 7 }, { 0xfd, 8 }, { 0x1ffb, 13 },
+  { 0x7fff0, 19 }, { 0x1ffc, 13 }, { 0x3ffc, 14 }, { 0x22, 6 },
+  { 0x7ffd, 15 }, { 0x3, 5 }, { 0x23, 6 }, { 0x4, 5 },
+  { 0x24, 6 }, { 0x5, 5 }, { 0x25, 6 }, { 0x26, 6 },
+  { 0x27, 6 }, { 0x6, 5 }, { 0x74, 7 }, { 0x75, 7 },
+  { 0x28, 6 }, { 0x29, 6 }, { 0x2a, 6 }, { 0x7, 5 },
+  { 0x2b, 6 }, { 0x76, 7 }, { 0x2c, 6 }, { 0x8, 5 },
+  { 0x9, 5 }, { 0x2d, 6 }, { 0x77, 7 }, { 0x78, 7 },
+  { 0x79, 7 }, { 0x7a, 7 }, { 0x7b, 7 }, { 0x7ffe, 15 },
+  { 0x7fc, 11 }, { 0x3ffd, 14 }, { 0x1ffd, 13 }, { 0xffffffc, 28 },
+  { 0xfffe6, 20 }, { 0x3fffd2, 22 }, { 0xfffe7, 20 }, { 0xfffe8, 20 },
+  { 0x3fffd3, 22 }, { 0x3fffd4, 22 }, { 0x3fffd5, 22 }, { 0x7fffd9, 23 },
+  { 0x3fffd6, 22 }, { 0x7fffda, 23 }, { 0x7fffdb, 23 }, { 0x7fffdc, 23 },
+  { 0x7fffdd, 23 }, { 0x7fffde, 23 }, { 0xffffeb, 24 }, { 0x7fffdf, 23 },
+  { 0xffffec, 24 }, { 0xffffed, 24 }, { 0x3fffd7, 22 }, { 0x7fffe0, 23 },
+  { 0xffffee, 24 }, { 0x7fffe1, 23 }, { 0x7fffe2, 23 }, { 0x7fffe3, 23 },
+  { 0x7fffe4, 23 }, { 0x1fffdc, 21 }, { 0x3fffd8, 22 }, { 0x7fffe5, 23 },
+  { 0x3fffd9, 22 }, { 0x7fffe6, 23 }, { 0x7fffe7, 23 }, { 0xffffef, 24 },
+  { 0x3fffda, 22 }, { 0x1fffdd, 21 }, { 0xfffe9, 20 }, { 0x3fffdb, 22 },
+  { 0x3fffdc, 22 }, { 0x7fffe8, 23 }, { 0x7fffe9, 23 }, { 0x1fffde, 21 },
+  { 0x7fffea, 23 }, { 0x3fffdd, 22 }, { 0x3fffde, 22 }, { 0xfffff0, 24 },
+  { 0x1fffdf, 21 }, { 0x3fffdf, 22 }, { 0x7fffeb, 23 }, { 0x7fffec, 23 },
+  { 0x1fffe0, 21 }, { 0x1fffe1, 21 }, { 0x3fffe0, 22 }, { 0x1fffe2, 21 },
+  { 0x7fffed, 23 }, { 0x3fffe1, 22 }, { 0x7fffee, 23 }, { 0x7fffef, 23 },
+  { 0xfffea, 20 }, { 0x3fffe2, 22 }, { 0x3fffe3, 22 }, { 0x3fffe4, 22 },
+  { 0x7ffff0, 23 }, { 0x3fffe5, 22 }, { 0x3fffe6, 22 }, { 0x7ffff1, 23 },
+  { 0x3ffffe0, 26 }, { 0x3ffffe1, 26 }, { 0xfffeb, 20 }, { 0x7fff1, 19 },
+  { 0x3fffe7, 22 }, { 0x7ffff2, 23 }, { 0x3fffe8, 22 }, { 0x1ffffec, 25 },
+  { 0x3ffffe2, 26 }, { 0x3ffffe3, 26 }, { 0x3ffffe4, 26 }, { 0x7ffffde, 27 },
+  { 0x7ffffdf, 27 }, { 0x3ffffe5, 26 }, { 0xfffff1, 24 }, { 0x1ffffed, 25 },
+  { 0x7fff2, 19 }, { 0x1fffe3, 21 }, { 0x3ffffe6, 26 }, { 0x7ffffe0, 27 },
+  { 0x7ffffe1, 27 }, { 0x3ffffe7, 26 }, { 0x7ffffe2, 27 }, { 0xfffff2, 24 },
+  { 0x1fffe4, 21 }, { 0x1fffe5, 21 }, { 0x3ffffe8, 26 }, { 0x3ffffe9, 26 },
+  { 0xffffffd, 28 }, { 0x7ffffe3, 27 }, { 0x7ffffe4, 27 }, { 0x7ffffe5, 27 },
+  { 0xfffec, 20 }, { 0xfffff3, 24 }, { 0xfffed, 20 }, { 0x1fffe6, 21 },
+  { 0x3fffe9, 22 }, { 0x1fffe7, 21 }, { 0x1fffe8, 21 }, { 0x7ffff3, 23 },
+  { 0x3fffea, 22 }, { 0x3fffeb, 22 }, { 0x1ffffee, 25 }, { 0x1ffffef, 25 },
+  { 0xfffff4, 24 }, { 0xfffff5, 24 }, { 0x3ffffea, 26 }, { 0x7ffff4, 23 },
+  { 0x3ffffeb, 26 }, { 0x7ffffe6, 27 }, { 0x3ffffec, 26 }, { 0x3ffffed, 26 },
+  { 0x7ffffe7, 27 }, { 0x7ffffe8, 27 }, { 0x7ffffe9, 27 }, { 0x7ffffea, 27 },
+  { 0x7ffffeb, 27 }, { 0xffffffe, 28 }, { 0x7ffffec, 27 }, { 0x7ffffed, 27 },
+  { 0x7ffffee, 27 }, { 0x7ffffef, 27 }, { 0x7fffff0, 27 }, { 0x3ffffee, 26 },
+  { 0x3fffffff, 30 },
+};
+
+static const hpack_static_t hpack_static_table[] = {
+  { ":authority", 10, "", 0 },
+  { ":method", 7, "GET", 3 },
+  { ":method", 7, "POST", 4 },
+  { ":path", 5, "/", 1 },
+  { ":path", 5, "/index.html", 11 },
+  { ":scheme", 7, "http", 4 },
+  { ":scheme", 7, "https", 5 },
+  { ":status", 7, "200", 3 },
+  { ":status", 7, "204", 3 },
+  { ":status", 7, "206", 3 },
+  { ":status", 7, "304", 3 },
+  { ":status", 7, "400", 3 },
+  { ":status", 7, "404", 3 },
+  { ":status", 7, "500", 3 },
+  { "accept-charset", 14, "", 0 },
+  { "accept-encoding", 15, "gzip, deflate", 13 },
+  { "accept-language", 15, "", 0 },
+  { "accept-ranges", 13, "", 0 },
+  { "accept", 6, "", 0 },
+  { "access-control-allow-origin", 27, "", 0 },
+  { "age", 3, "", 0 },
+  { "allow", 5, "", 0 },
+  { "authorization", 13, "", 0 },
+  { "cache-control", 13, "", 0 },
+  { "content-disposition", 19, "", 0 },
+  { "content-encoding", 16, "", 0 },
+  { "content-language", 16, "", 0 },
+  { "content-length", 14, "", 0 },
+  { "content-location", 16, "", 0 },
+  { "content-range", 13, "", 0 },
+  { "content-type", 12, "", 0 },
+  { "cookie", 6, "", 0 },
+  { "date", 4, "", 0 },
+  { "etag", 4, "", 0 },
+  { "expect", 6, "", 0 },
+  { "expires", 7, "", 0 },
+  { "from", 4, "", 0 },
+  { "host", 4, "", 0 },
+  { "if-match", 8, "", 0 },
+  { "if-modified-since", 17, "", 0 },
+  { "if-none-match", 13, "", 0 },
+  { "if-range", 8, "", 0 },
+  { "if-unmodified-since", 19, "", 0 },
+  { "last-modified", 13, "", 0 },
+  { "link", 4, "", 0 },
+  { "location", 8, "", 0 },
+  { "max-forwards", 12, "", 0 },
+  { "proxy-authenticate", 18, "", 0 },
+  { "proxy-authorization", 19, "", 0 },
+  { "range", 5, "", 0 },
+  { "referer", 7, "", 0 },
+  { "refresh", 7, "", 0 },
+  { "retry-after", 11, "", 0 },
+  { "server", 6, "", 0 },
+  { "set-cookie", 10, "", 0 },
+  { "strict-transport-security", 25, "", 0 },
+  { "transfer-encoding", 17, "", 0 },
+  { "user-agent", 10, "", 0 },
+  { "vary", 4, "", 0 },
+  { "via", 3, "", 0 },
+  { "www-authenticate", 16, "", 0 },
+};
+
+/* Huffman decoder, 256 internal nodes of the code tree times 16 nibbles */
+static hpack_step_t hpack_steps[256][16];
+
+/* Integers */
+
+static int hpack_decode_int(const unsigned char** p,
+                            const unsigned char* end,
+                            unsigned int prefix,
+                            uint64_t* out) {
+  uint64_t max = (1u << prefix) - 1;
+  uint64_t value = **p & max;
+  unsigned int shift = 0;
+
+  (*p)++;
+  if (value < max) {
+    *out = value;
+    return 0;
+  }
+
+  for (;;) {
+    unsigned char b;
+
+    /* NOTE: Nothing in a header block comes close to 2^35 */
+    if (*p == end || shift > 28) {
+      return -1;
+    }
+
+    b = *(*p)++;
+    value += (uint64_t) (b & 0x7f) << shift;
+    shift += 7;
+
+    if ((b & 0x80) == 0) {
+      break;
+    }
+  }
+
+  *out = value;
+  return 0;
+}
+
+static size_t hpack_encode_int(unsigned char* out,
+                               unsigned char first,
+                               unsigned int prefix,
+                               uint64_t value) {
+  uint64_t max = (1u << prefix) - 1;
+  size_t n = 1;
+
+  if (value < max) {
+    out[0] = (unsigned char) (first | value);
+    return 1;
+  }
+
+  out[0] = (unsigned char) (first | max);
+  value -= max;
+  while (value >= 0x80) {
+    out[n++] = (unsigned char) ((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out[n++] = (unsigned char) value;
+  return n;
+}
+
+/* Huffman code */
+
+/* Returns `-1` on invalid code or padding */
+static int hpack_huffman_decode(const unsigned char* p,
+                                size_t len,
+                                char* out,
+                                size_t* out_len) {
+  unsigned int state = 0;
+  unsigned int flags = kHPACKStepAccept;
+  size_t n = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    for (int shift = 4; shift >= 0; shift -= 4) {
+      const hpack_step_t* step = &hpack_steps[state][(p[i] >> shift) & 0xf];
+
+      if (step->flags & kHPACKStepFail) {
+        return -1;
+      }
+      if (step->flags & kHPACKStepSym) {
+        out[n++] = (char) step->sym;
+      }
+      state = step->state;
+      flags = step->flags;
+    }
+  }
+
+  /* Padding is at most 7 bits of EOS prefix */
+  if ((flags & kHPACKStepAccept) == 0) {
+    return -1;
+  }
+
+  *out_len = n;
+  return 0;
+}
+
+static size_t hpack_huffman_len(const char* p, size_t len) {
+  uint64_t bits = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    bits += hpack_huffman[(unsigned char) p[i]].len;
+  }
+  return (size_t) ((bits + 7) / 8);
+}
+
+static size_t hpack_huffman_encode(const char* p,
+                                   size_t len,
+                                   unsigned char* out) {
+  uint64_t acc = 0;
+  unsigned int bits = 0;
+  size_t n = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    const hpack_code_t* code = &hpack_huffman[(unsigned char) p[i]];
+
+    acc = (acc << code->len) | code->code;
+    bits += code->len;
+    while (bits >= 8) {
+      bits -= 8;
+      out[n++] = (unsigned char) (acc >> bits);
+    }
+  }
+
+  /* Pad with the most significant bits of EOS */
+  if (bits != 0) {
+    out[n++] = (unsigned char) ((acc << (8 - bits)) | (0xff >> bits));
+  }
+  return n;
+}
+
+/* Strings */
+
+/*
+ * Huffman-encoded strings are decoded into `scratch` at `*off`, the others
+ * are returned as is.
+ */
+static int hpack_decode_string(hpack_decoder_t* dec,
+                               const unsigned char** p,
+                               const unsigned char* end,
+                               size_t* off,
+                               const char** out,
+                               size_t* out_len) {
+  uint64_t len;
+  int huffman;
+
+  if (*p == end) {
+    return -1;
+  }
+
+  huffman = (**p & 0x80) != 0;
+  if (hpack_decode_int(p, end, 7, &len) != 0 ||
+      len > (uint64_t) (end - *p)) {
+    return -1;
+  }
+
+  if (!huffman) {
+    *out = (const char*) *p;
+    *out_len = (size_t) len;
+    *p += len;
+    return 0;
+  }
+
+  char* scratch = dec->scratch + *off;
+  if (hpack_huffman_decode(*p, (size_t) len, scratch, out_len) != 0) {
+    return -1;
+  }
+
+  *out = scratch;
+  *off += *out_len;
+  *p += len;
+  return 0;
+}
+
+static size_t hpack_encode_string(unsigned char* out,
+                                  const char* s,
+                                  size_t len) {
+  size_t huffman_len = hpack_huffman_len(s, len);
+  size_t n;
+
+  if (huffman_len < len) {
+    n = hpack_encode_int(out, 0x80, 7, huffman_len);
+    return n + hpack_huffman_encode(s, len, out + n);
+  }
+
+  n = hpack_encode_int(out, 0x00, 7, len);
+  memcpy(out + n, s, len);
+  return n + len;
+}
+
+/* Dynamic table */
+
+static void hpack_table_init(hpack_table_t* table, size_t max_size) {
+  memset(table, 0, sizeof(*table));
+  table->max_size = max_size;
+}
+
+/* `idx` is zero for the newest field */
+static hpack_field_t* hpack_table_get(hpack_table_t* table, unsigned int idx) {
+  return &table->fields[(table->first + idx) % table->capacity];
+}
+
+static void hpack_table_evict(hpack_table_t* table, size_t max_size) {
+  while (table->size > max_size) {
+    hpack_field_t* field = hpack_table_get(table, table->count - 1);
+
+    table->size -= field->name_len + field->value_len + HPACK_FIELD_OVERHEAD;
+    table->count--;
+    free(field->name);
+  }
+}
+
+static void hpack_table_destroy(hpack_table_t* table) {
+  hpack_table_evict(table, 0);
+  free(table->fields);
+  table->fields = NULL;
+}
+
+/* NOTE: `name` or `value` may point to a field that gets evicted here */
+static void hpack_table_add(hpack_table_t* table,
+                            const char* name,
+                            size_t name_len,
+                            const char* value,
+                            size_t value_len) {
+  size_t size = name_len + value_len + HPACK_FIELD_OVERHEAD;
+
+  /* Too large fields just empty the table */
+  if (size > table->max_size) {
+    hpack_table_evict(table, 0);
+    return;
+  }
+
+  char* data = malloc(name_len + value_len + 1);
+  CHECK(data != NULL);
+  memcpy(data, name, name_len);
+  memcpy(data + name_len, value, value_len);
+
+  hpack_table_evict(table, table->max_size - size);
+
+  if (table->count == table->capacity) {
+    unsigned int capacity = table->capacity == 0 ?
+        HPACK_INITIAL_CAPACITY : table->capacity * 2;
+    hpack_field_t* fields = malloc(capacity * sizeof(*fields));
+    CHECK(fields != NULL);
+
+    for (unsigned int i = 0; i < table->count; i++) {
+      fields[i] = *hpack_table_get(table, i);
+    }
+    free(table->fields);
+
+    table->fields = fields;
+    table->capacity = capacity;
+    table->first = 0;
+  }
+
+  table->first = (table->first + table->capacity - 1) % table->capacity;
+  table->count++;
+  table->size += size;
+
+  hpack_field_t* field = hpack_table_get(table, 0);
+  field->name = data;
+  field->name_len = name_len;
+  field->value = data + name_len;
+  field->value_len = value_len;
+}
+
+/* Resolves index of either table, `1` is the first static entry */
+static int hpack_lookup(hpack_table_t* table,
+                        uint64_t idx,
+                        const char** name,
+                        size_t* name_len,
+                        const char** value,
+                        size_t* value_len) {
+  if (idx == 0) {
+    return -1;
+  }
+
+  if (idx <= ARRAY_SIZE(hpack_static_table)) {
+    const hpack_static_t* entry = &hpack_static_table[idx - 1];
+
+    *name = entry->name;
+    *name_len = entry->name_len;
+    *value = entry->value;
+    *value_len = entry->value_len;
+    return 0;
+  }
+
+  idx -= ARRAY_SIZE(hpack_static_table) + 1;
+  if (idx >= table->count) {
+    return -1;
+  }
+
+  hpack_field_t* field = hpack_table_get(table, (unsigned int) idx);
+  *name = field->name;
+  *name_len = field->name_len;
+  *value = field->value;
+  *value_len = field->value_len;
+  return 0;
+}
+
+/* Decoder */
+
+void hpack_init(void) {
+  int16_t tree[256][2];
+  uint8_t accept[256];
+  unsigned int nodes = 1;
+
+  /* Internal nodes are numbered from the root, leaves are `-sym - 1` */
+  memset(tree, 0, sizeof(tree));
+  for (unsigned int sym = 0; sym < ARRAY_SIZE(hpack_huffman); sym++) {
+    const hpack_code_t* code = &hpack_huffman[sym];
+    unsigned int node = 0;
+
+    for (int i = code->len - 1; i > 0; i--) {
+      int bit = (code->code >> i) & 1;
+
+      if (tree[node][bit] == 0) {
+        CHECK(nodes < ARRAY_SIZE(tree));
+        tree[node][bit] = (int16_t) nodes++;
+      }
+      node = tree[node][bit];
+    }
+    tree[node][code->code & 1] = (int16_t) (-(int) sym - 1);
+  }
+
+  /* Input may end in the root, or up to 7 bits into EOS */
+  memset(accept, 0, sizeof(accept));
+  accept[0] = 1;
+  for (unsigned int i = 0, node = 0; i < 7; i++) {
+    node = tree[node][1];
+    accept[node] = 1;
+  }
+
+  for (unsigned int state = 0; state < nodes; state++) {
+    for (unsigned int nibble = 0; nibble < 16; nibble++) {
+      hpack_step_t* step = &hpack_steps[state][nibble];
+      int node = state;
+
+      step->flags = 0;
+      step->sym = 0;
+
+      /* NOTE: Codes are at least 5 bits long, one symbol per nibble at most */
+      for (int i = 3; i >= 0; i--) {
+        int child = tree[node][(nibble >> i) & 1];
+
+        if (child >= 0) {
+          node = child;
+          continue;
+        }
+
+        /* EOS in the input is an error */
+        if (-child - 1 == 256) {
+          step->flags |= kHPACKStepFail;
+          break;
+        }
+
+        step->flags |= kHPACKStepSym;
+        step->sym = (uint8_t) (-child - 1);
+        node = 0;
+      }
+
+      step->state = (uint8_t) node;
+      if (accept[node]) {
+        step->flags |= kHPACKStepAccept;
+      }
+    }
+  }
+}
+
+void hpack_decoder_init(hpack_decoder_t* dec, size_t max_table_size) {
+  memset(dec, 0, sizeof(*dec));
+  hpack_table_init(&dec->table, max_table_size);
+  dec->max_table_size = max_table_size;
+}
+
+void hpack_decoder_destroy(hpack_decoder_t* dec) {
+  hpack_table_destroy(&dec->table);
+  free(dec->scratch);
+  dec->scratch = NULL;
+}
+
+int hpack_decode(hpack_decoder_t* dec,
+                 const unsigned char* data,
+                 size_t len,
+                 hpack_field_cb cb,
+                 void* arg) {
+  const unsigned char* p = data;
+  const unsigned char* end = data + len;
+  unsigned int field_count = 0;
+
+  /* Huffman code is at least 5 bits per symbol, decoded strings fit */
+  size_t scratch_size = len * 8 / 5 + 1;
+  if (scratch_size > dec->scratch_size) {
+    char* scratch = realloc(dec->scratch, scratch_size);
+    CHECK(scratch != NULL);
+
+    dec->scratch = scratch;
+    dec->scratch_size = scratch_size;
+  }
+
+  while (p != end) {
+    unsigned char b = *p;
+    const char* name;
+    size_t name_len;
+    const char* value;
+    size_t value_len;
+    uint64_t idx;
+    int err;
+
+    /* Indexed field */
+    if (b & 0x80) {
+      if (hpack_decode_int(&p, end, 7, &idx) != 0 ||
+          hpack_lookup(&dec->table, idx, &name, &name_len, &value,
+                       &value_len) != 0) {
+        return -1;
+      }
+
+      err = cb(arg, name, name_len, value, value_len);
+      if (err != 0) {
+        return err;
+      }
+      field_count++;
+      continue;
+    }
+
+    /* Dynamic table size update, only at the start of the block */
+    if ((b & 0xe0) == 0x20) {
+      uint64_t size;
+
+      if (field_count != 0 ||
+          hpack_decode_int(&p, end, 5, &size) != 0 ||
+          size > dec->max_table_size) {
+        return -1;
+      }
+
+      dec->table.max_size = (size_t) size;
+      hpack_table_evict(&dec->table, dec->table.max_size);
+      continue;
+    }
+
+    /* Literal field, with incremental indexing, without or never indexed */
+    int indexing = (b & 0xc0) == 0x40;
+    size_t off = 0;
+
+    if (hpack_decode_int(&p, end, indexing ? 6 : 4, &idx) != 0) {
+      return -1;
+    }
+
+    if (idx != 0) {
+      if (hpack_lookup(&dec->table, idx, &name, &name_len, &value,
+                       &value_len) != 0) {
+        return -1;
+      }
+    } else if (hpack_decode_string(dec, &p, end, &off, &name,
+                                   &name_len) != 0) {
+      return -1;
+    }
+
+    if (hpack_decode_string(dec, &p, end, &off, &value, &value_len) != 0) {
+      return -1;
+    }
+
+    err = cb(arg, name, name_len, value, value_len);
+    if (err != 0) {
+      return err;
+    }
+
+    if (indexing) {
+      hpack_table_add(&dec->table, name, name_len, value, value_len);
+    }
+    field_count++;
+  }
+
+  return 0;
+}
+
+/* Encoder */
+
+void hpack_encoder_init(hpack_encoder_t* enc) {
+  memset(enc, 0, sizeof(*enc));
+  hpack_table_init(&enc->table, HPACK_DEFAULT_TABLE_SIZE);
+}
+
+void hpack_encoder_destroy(hpack_encoder_t* enc) {
+  hpack_table_destroy(&enc->table);
+}
+
+void hpack_encoder_set_max_size(hpack_encoder_t* enc, size_t size) {
+  if (size > HPACK_DEFAULT_TABLE_SIZE) {
+    size = HPACK_DEFAULT_TABLE_SIZE;
+  }
+  if (size == enc->table.max_size) {
+    return;
+  }
+
+  /* Peer has to see the smallest size since the last block */
+  if (!enc->size_update || size < enc->min_size) {
+    enc->min_size = size;
+  }
+  enc->size_update = 1;
+
+  enc->table.max_size = size;
+  hpack_table_evict(&enc->table, size);
+}
+
+size_t hpack_encode_begin(hpack_encoder_t* enc, unsigned char* out) {
+  size_t n = 0;
+
+  if (!enc->size_update) {
+    return 0;
+  }
+
+  enc->size_update = 0;
+  if (enc->min_size < enc->table.max_size) {
+    n += hpack_encode_int(out, 0x20, 5, enc->min_size);
+  }
+  n += hpack_encode_int(out + n, 0x20, 5, enc->table.max_size);
+  return n;
+}
+
+size_t hpack_encode(hpack_encoder_t* enc,
+                    const char* name,
+                    size_t name_len,
+                    const char* value,
+                    size_t value_len,
+                    unsigned char* out) {
+  hpack_table_t* table = &enc->table;
+  uint64_t name_idx = 0;
+  size_t n;
+
+  for (unsigned int i = 0; i < ARRAY_SIZE(hpack_static_table); i++) {
+    const hpack_static_t* entry = &hpack_static_table[i];
+
+    if (entry->name_len != name_len ||
+        memcmp(entry->name, name, name_len) != 0) {
+      continue;
+    }
+    if (name_idx == 0) {
+      name_idx = i + 1;
+    }
+    if (entry->value_len == value_len &&
+        memcmp(entry->value, value, value_len) == 0) {
+      return hpack_encode_int(out, 0x80, 7, i + 1);
+    }
+  }
+
+  for (unsigned int i = 0; i < table->count; i++) {
+    hpack_field_t* field = hpack_table_get(table, i);
+
+    if (field->name_len != name_len ||
+        memcmp(field->name, name, name_len) != 0) {
+      continue;
+    }
+
+    uint64_t idx = ARRAY_SIZE(hpack_static_table) + 1 + i;
+    if (name_idx == 0) {
+      name_idx = idx;
+    }
+    if (field->value_len == value_len &&
+        memcmp(field->value, value, value_len) == 0) {
+      return hpack_encode_int(out, 0x80, 7, idx);
+    }
+  }
+
+  /* Values that differ from response to response would only churn the table */
+  int indexing = 1;
+  unsigned char first = 0x00;
+  if ((name_len == 14 && memcmp(name, "content-length", 14) == 0) ||
+      (name_len == 13 && memcmp(name, "content-range", 13) == 0)) {
+    indexing = 0;
+  } else if (name_len == 10 && memcmp(name, "set-cookie", 10) == 0) {
+    indexing = 0;
+    first = 0x10;
+  }
+
+  if (indexing) {
+    n = hpack_encode_int(out, 0x40, 6, name_idx);
+  } else {
+    n = hpack_encode_int(out, first, 4, name_idx);
+  }
+  if (name_idx == 0) {
+    n += hpack_encode_string(out + n, name, name_len);
+  }
+  n += hpack_encode_string(out + n, value, value_len);
+
+  if (indexing) {
+    hpack_table_add(table, name, name_len, value, value_len);
+  }
+  return n;
+}
@@ -0,0 +1,109 @@
+#ifndef SRC_HPACK_H_
+#define SRC_HPACK_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * HPACK (RFC 7541) header compression for HTTP/2. Header blocks are decoded
+ * once all of their frames have arrived, and every field is passed to a
+ * callback as soon as it is decoded. The encoder adds response headers to
+ * its dynamic table, so the ones that repeat cost a byte or two on the next
+ * responses of the connection.
+ */
+
+typedef struct hpack_field_s hpack_field_t;
+typedef struct hpack_table_s hpack_table_t;
+typedef struct hpack_decoder_s hpack_decoder_t;
+typedef struct hpack_encoder_s hpack_encoder_t;
+
+/* NOTE: `name` and `value` share one allocation */
+struct hpack_field_s {
+  char* name;
+  size_t name_len;
+  char* value;
+  size_t value_len;
+};
+
+/* Dynamic table, a ring of fields with the newest one at `first` */
+struct hpack_table_s {
+  hpack_field_t* fields;
+  unsigned int capacity;
+  unsigned int first;
+  unsigned int count;
+
+  /* Sum of field sizes as defined by the RFC, and the limit for it */
+  size_t size;
+  size_t max_size;
+};
+
+struct hpack_decoder_s {
+  hpack_table_t table;
+
+  /* Limit for size updates, the value of our `SETTINGS_HEADER_TABLE_SIZE` */
+  size_t max_table_size;
+
+  /* Huffman-decoded strings of the current field */
+  char* scratch;
+  size_t scratch_size;
+};
+
+struct hpack_encoder_s {
+  hpack_table_t table;
+
+  /* Size update to send at the start of the next block, if any */
+  int size_update;
+  size_t min_size;
+};
+
+/*
+ * Called for every decoded field, the strings are valid until it returns.
+ * Non-zero return value stops decoding.
+ */
+typedef int (*hpack_field_cb)(void* arg,
+                              const char* name,
+                              size_t name_len,
+                              const char* value,
+                              size_t value_len);
+
+/* Builds Huffman decoding table */
+void hpack_init(void);
+
+void hpack_decoder_init(hpack_decoder_t* dec, size_t max_table_size);
+void hpack_decoder_destroy(hpack_decoder_t* dec);
+
+/*
+ * Decodes complete header block. Returns `0` on success, `-1` on
+ * compression error, or the non-zero value returned by `cb`.
+ */
+int hpack_decode(hpack_decoder_t* dec,
+                 const unsigned char* data,
+                 size_t len,
+                 hpack_field_cb cb,
+                 void* arg);
+
+void hpack_encoder_init(hpack_encoder_t* enc);
+void hpack_encoder_destroy(hpack_encoder_t* enc);
+
+/* Peer's `SETTINGS_HEADER_TABLE_SIZE` */
+void hpack_encoder_set_max_size(hpack_encoder_t* enc, size_t size);
+
+/* Upper bound for the length of the encoded field */
+#define HPACK_MAX_FIELD_LEN(name_len, value_len) \
+    ((name_len) + (value_len) + 24)
+
+/* Upper bound for the length of `hpack_encode_begin()` output */
+#define HPACK_MAX_BEGIN_LEN 12
+
+/* Starts a header block, returns the length of the data written to `out` */
+size_t hpack_encode_begin(hpack_encoder_t* enc, unsigned char* out);
+
+/* NOTE: `name` has to be lowercase */
+size_t hpack_encode(hpack_encoder_t* enc,
+                    const char* name,
+                    size_t name_len,
+                    const char* value,
+                    size_t value_len,
+                    unsigned char* out);
+
+#endif  /* SRC_HPACK_H_ */
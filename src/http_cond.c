@@ -0,0 +1,306 @@
+#include <stdio.h>
+#include <string.h>
+
+#include "http_cond.h"
+#include "common.h"
+
+/* Some static vars */
+
+static const char* const http_months[] = {
+  "Jan", "Feb", "Mar", "Apr", "May", "Jun",
+  "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"
+};
+
+/* Helpers */
+
+static int http_is_space(char c) {
+  return c == ' ' || c == '\t';
+}
+
+static void http_trim(const char** str, size_t* len) {
+  while (*len > 0 && http_is_space((*str)[0])) {
+    (*str)++;
+    (*len)--;
+  }
+  while (*len > 0 && http_is_space((*str)[*len - 1])) {
+    (*len)--;
+  }
+}
+
+/* Parses `len` decimal digits */
+static int http_parse_digits(const char* str, size_t len, int* out) {
+  int res = 0;
+
+  for (size_t i = 0; i < len; i++) {
+    if (str[i] < '0' || str[i] > '9') {
+      return -1;
+    }
+    res = res * 10 + (str[i] - '0');
+  }
+
+  *out = res;
+  return 0;
+}
+
+/* Days since 1970-01-01, see http://howardhinnant.github.io/date_algorithms */
+static int64_t http_days_from_civil(int64_t y, int m, int d) {
+  y -= m <= 2;
+
+  int64_t era = (y >= 0 ? y : y - 399) / 400;
+  int64_t yoe = y - era * 400;
+  int64_t doy = (153 * (m > 2 ? m - 3 : m + 9) + 2) / 5 + d - 1;
+  int64_t doe = yoe * 365 + yoe / 4 - yoe / 100 + doy;
+
+  return era * 146097 + doe - 719468;
+}
+
+/* Dates */
+
+void http_date(char* out, size_t size, time_t t) {
+  struct tm* tm = gmtime(&t);
+  CHECK(tm != NULL);
+  CHECK(strftime(out, size, "%a, %d %b %Y %H:%M:%S GMT", tm) != 0);
+}
+
+/* NOTE: Obsolete RFC 850 and asctime() formats are not supported */
+int http_date_parse(const char* str, size_t len, time_t* out) {
+  int day;
+  int month;
+  int year;
+  int hour;
+  int min;
+  int sec;
+
+  http_trim(&str, &len);
+
+  /* Sun, 06 Nov 1994 08:49:37 GMT */
+  if (len != 29 || str[3] != ',' || str[4] != ' ' || str[7] != ' ' ||
+      str[11] != ' ' || str[16] != ' ' || str[19] != ':' || str[22] != ':' ||
+      memcmp(str + 25, " GMT", 4) != 0) {
+    return -1;
+  }
+
+  if (http_parse_digits(str + 5, 2, &day) != 0 ||
+      http_parse_digits(str + 12, 4, &year) != 0 ||
+      http_parse_digits(str + 17, 2, &hour) != 0 ||
+      http_parse_digits(str + 20, 2, &min) != 0 ||
+      http_parse_digits(str + 23, 2, &sec) != 0) {
+    return -1;
+  }
+
+  for (month = 0; month < (int) ARRAY_SIZE(http_months); month++) {
+    if (memcmp(str + 8, http_months[month], 3) == 0) {
+      break;
+    }
+  }
+
+  if (month == (int) ARRAY_SIZE(http_months) || day < 1 || day > 31 ||
+      hour > 23 || min > 59 || sec > 60) {
+    return -1;
+  }
+
+  *out = (time_t) (http_days_from_civil(year, month + 1, day) * 86400 +
+      hour * 3600 + min * 60 + sec);
+  return 0;
+}
+
+void http_etag(char* out, size_t size, uint64_t file_size, time_t mtime) {
+  snprintf(out, size, "\"%llx-%llx\"",
+      (unsigned long long) mtime,
+      (unsigned long long) file_size);
+}
+
+/* Validators */
+
+/* Weak comparison against a list of entity tags, RFC 7232 2.3.2 */
+static int http_etag_list_match(const char* list, size_t len,
+                                const char* etag) {
+  size_t etag_len = strlen(etag);
+
+  /* Opaque part of our tag */
+  if (etag_len >= 2 && memcmp(etag, "W/", 2) == 0) {
+    etag += 2;
+    etag_len -= 2;
+  }
+
+  while (len > 0) {
+    const char* comma = memchr(list, ',', len);
+    size_t item_len = comma == NULL ? len : (size_t) (comma - list);
+    const char* item = list;
+
+    list += item_len;
+    len -= item_len;
+    if (comma != NULL) {
+      list++;
+      len--;
+    }
+
+    http_trim(&item, &item_len);
+    if (item_len == 1 && item[0] == '*') {
+      return 1;
+    }
+
+    if (item_len >= 2 && memcmp(item, "W/", 2) == 0) {
+      item += 2;
+      item_len -= 2;
+    }
+
+    if (item_len == etag_len && memcmp(item, etag, etag_len) == 0) {
+      return 1;
+    }
+  }
+
+  return 0;
+}
+
+/* `If-Range` allows only the strong comparison, RFC 7233 3.2 */
+static int http_if_range_match(const char* value, size_t len,
+                               const char* etag,
+                               time_t mtime) {
+  time_t date;
+
+  http_trim(&value, &len);
+
+  if (len > 0 && (value[0] == '"' || value[0] == 'W')) {
+    return len == strlen(etag) && etag[0] != 'W' &&
+           memcmp(value, etag, len) == 0;
+  }
+
+  return http_date_parse(value, len, &date) == 0 && date == mtime;
+}
+
+/* Ranges */
+
+enum http_range_result_e {
+  kHttpRangeIgnore,
+  kHttpRangeOk,
+  kHttpRangeUnsatisfiable
+};
+
+/* Returns the number of parsed digits, or `-1` on overflow */
+static int http_parse_u64(const char* str, size_t len, uint64_t* out) {
+  uint64_t res = 0;
+  size_t i;
+
+  for (i = 0; i < len && str[i] >= '0' && str[i] <= '9'; i++) {
+    if (res > (UINT64_MAX - 9) / 10) {
+      return -1;
+    }
+    res = res * 10 + (str[i] - '0');
+  }
+
+  *out = res;
+  return (int) i;
+}
+
+/* NOTE: Multiple ranges are ignored, the whole body is sent instead */
+static int http_range_parse(const char* str, size_t len, uint64_t size,
+                            uint64_t* start, uint64_t* end) {
+  static const char unit[] = "bytes=";
+  const size_t unit_len = sizeof(unit) - 1;
+  uint64_t first;
+  uint64_t last;
+  int n;
+
+  http_trim(&str, &len);
+
+  if (len <= unit_len || memchr(str, ',', len) != NULL) {
+    return kHttpRangeIgnore;
+  }
+  for (size_t i = 0; i < unit_len; i++) {
+    char c = str[i];
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    if (c != unit[i]) {
+      return kHttpRangeIgnore;
+    }
+  }
+  str += unit_len;
+  len -= unit_len;
+
+  /* Suffix: `-500` */
+  if (str[0] == '-') {
+    n = http_parse_u64(str + 1, len - 1, &last);
+    if (n <= 0 || (size_t) n != len - 1) {
+      return kHttpRangeIgnore;
+    }
+    if (last == 0 || size == 0) {
+      return kHttpRangeUnsatisfiable;
+    }
+
+    *start = last >= size ? 0 : size - last;
+    *end = size - 1;
+    return kHttpRangeOk;
+  }
+
+  n = http_parse_u64(str, len, &first);
+  if (n <= 0 || (size_t) n >= len || str[n] != '-') {
+    return kHttpRangeIgnore;
+  }
+  str += n + 1;
+  len -= n + 1;
+
+  /* Open: `500-` */
+  if (len == 0) {
+    last = UINT64_MAX;
+  } else {
+    n = http_parse_u64(str, len, &last);
+    if (n <= 0 || (size_t) n != len || last < first) {
+      return kHttpRangeIgnore;
+    }
+  }
+
+  if (first >= size) {
+    return kHttpRangeUnsatisfiable;
+  }
+
+  *start = first;
+  *end = last >= size ? size - 1 : last;
+  return kHttpRangeOk;
+}
+
+int http_cond_evaluate(const http_cond_t* cond,
+                       const char* etag,
+                       time_t mtime,
+                       uint64_t size,
+                       uint64_t* start,
+                       uint64_t* end) {
+  /* `If-Modified-Since` is ignored when `If-None-Match` is present */
+  if (cond->if_none_match.base != NULL) {
+    if (http_etag_list_match(cond->if_none_match.base,
+                             cond->if_none_match.len,
+                             etag)) {
+      return 304;
+    }
+  } else if (cond->if_modified_since.base != NULL) {
+    time_t since;
+
+    if (http_date_parse(cond->if_modified_since.base,
+                        cond->if_modified_since.len,
+                        &since) == 0 &&
+        mtime <= since) {
+      return 304;
+    }
+  }
+
+  if (cond->range.base == NULL) {
+    return 200;
+  }
+
+  if (cond->if_range.base != NULL &&
+      !http_if_range_match(cond->if_range.base, cond->if_range.len,
+                           etag, mtime)) {
+    return 200;
+  }
+
+  switch (http_range_parse(cond->range.base, cond->range.len, size,
+                           start, end)) {
+    case kHttpRangeOk:
+      return 206;
+    case kHttpRangeUnsatisfiable:
+      return 416;
+    default:
+      return 200;
+  }
+}
@@ -0,0 +1,45 @@
+#ifndef SRC_HTTP_COND_H_
+#define SRC_HTTP_COND_H_
+
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include "uv.h"
+
+/*
+ * Conditional (RFC 7232) and range (RFC 7233) request handling for responses
+ * whose validators are known in C.
+ */
+
+typedef struct http_cond_s http_cond_t;
+
+/* NOTE: Absent headers have `NULL` base */
+struct http_cond_s {
+  uv_buf_t if_none_match;
+  uv_buf_t if_modified_since;
+  uv_buf_t range;
+  uv_buf_t if_range;
+};
+
+/* Formats `t` as IMF-fixdate */
+void http_date(char* out, size_t size, time_t t);
+
+/* Parses IMF-fixdate, returns `0` on success */
+int http_date_parse(const char* str, size_t len, time_t* out);
+
+/* Formats strong `ETag` from file's size and modification time */
+void http_etag(char* out, size_t size, uint64_t file_size, time_t mtime);
+
+/*
+ * Returns the status code to respond with: `200`, `206` with the inclusive
+ * range in `start` and `end`, `304` or `416`.
+ */
+int http_cond_evaluate(const http_cond_t* cond,
+                       const char* etag,
+                       time_t mtime,
+                       uint64_t size,
+                       uint64_t* start,
+                       uint64_t* end);
+
+#endif  /* SRC_HTTP_COND_H_ */
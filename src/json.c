@@ -0,0 +1,503 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "json.h"
+#include "common.h"
+#include "refs.h"
+#include "string_cache.h"
+
+/* Typedefs */
+
+#define JSON_MAX_DEPTH 512
+
+enum json_state_e {
+  kJsonValue,
+  kJsonArrayStart,
+  kJsonObjectStart,
+  kJsonKey,
+  kJsonColon,
+  kJsonAfterValue,
+  kJsonString,
+  kJsonEscape,
+  kJsonUnicode,
+  kJsonNumber,
+  kJsonLiteral,
+  kJsonDone,
+  kJsonError
+};
+
+struct json_parser_s {
+  /* Thread holding the unfinished value, referenced from `parent` */
+  duk_context* ctx;
+  duk_context* parent;
+  int thread_ref;
+
+  enum json_state_e state;
+
+  /* Open containers, `{` or `[` */
+  char frames[JSON_MAX_DEPTH];
+  unsigned int depth;
+
+  /* String being parsed is an object key */
+  int is_key;
+
+  /* Decoded part of a string or a number that spans several chunks */
+  char* buf;
+  size_t buf_len;
+  size_t buf_size;
+
+  /* `\uXXXX` escape */
+  unsigned int unicode;
+  int unicode_len;
+
+  /* `true`, `false` or `null` being matched */
+  const char* literal;
+  size_t literal_off;
+};
+
+/* Some static vars */
+
+static const size_t JSON_INITIAL_BUF_SIZE = 256;
+
+/* Helpers */
+
+static int json_is_space(char c) {
+  return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+static int json_is_number_char(char c) {
+  return (c >= '0' && c <= '9') || c == '-' || c == '+' || c == '.' ||
+         c == 'e' || c == 'E';
+}
+
+static int json_hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+static int json_error(json_parser_t* parser) {
+  parser->state = kJsonError;
+  return -1;
+}
+
+/* NOTE: Keeps space for the trailing NUL that `strtod()` needs */
+static void json_append(json_parser_t* parser, const char* data, size_t len) {
+  if (parser->buf_len + len + 1 > parser->buf_size) {
+    size_t size = parser->buf_size == 0 ?
+        JSON_INITIAL_BUF_SIZE : parser->buf_size;
+    while (parser->buf_len + len + 1 > size) {
+      size *= 2;
+    }
+
+    char* buf = realloc(parser->buf, size);
+    CHECK(buf != NULL);
+    parser->buf = buf;
+    parser->buf_size = size;
+  }
+
+  memcpy(parser->buf + parser->buf_len, data, len);
+  parser->buf_len += len;
+}
+
+/*
+ * Surrogates are encoded one by one, like Duktape stores them, so that
+ * `"😀"` has length 2 as with `JSON.parse()`.
+ */
+static void json_append_code_unit(json_parser_t* parser, unsigned int unit) {
+  char out[3];
+
+  if (unit < 0x80) {
+    out[0] = (char) unit;
+    json_append(parser, out, 1);
+  } else if (unit < 0x800) {
+    out[0] = (char) (0xc0 | (unit >> 6));
+    out[1] = (char) (0x80 | (unit & 0x3f));
+    json_append(parser, out, 2);
+  } else {
+    out[0] = (char) (0xe0 | (unit >> 12));
+    out[1] = (char) (0x80 | ((unit >> 6) & 0x3f));
+    out[2] = (char) (0x80 | (unit & 0x3f));
+    json_append(parser, out, 3);
+  }
+}
+
+/* `-?(0|[1-9][0-9]*)(\.[0-9]+)?([eE][+-]?[0-9]+)?` */
+static int json_is_number(const char* str, size_t len) {
+  size_t i = 0;
+  size_t digits;
+
+  if (i < len && str[i] == '-') {
+    i++;
+  }
+
+  if (i < len && str[i] == '0') {
+    i++;
+  } else {
+    for (digits = 0; i < len && str[i] >= '0' && str[i] <= '9'; digits++) {
+      i++;
+    }
+    if (digits == 0) {
+      return 0;
+    }
+  }
+
+  if (i < len && str[i] == '.') {
+    i++;
+    for (digits = 0; i < len && str[i] >= '0' && str[i] <= '9'; digits++) {
+      i++;
+    }
+    if (digits == 0) {
+      return 0;
+    }
+  }
+
+  if (i < len && (str[i] == 'e' || str[i] == 'E')) {
+    i++;
+    if (i < len && (str[i] == '+' || str[i] == '-')) {
+      i++;
+    }
+    for (digits = 0; i < len && str[i] >= '0' && str[i] <= '9'; digits++) {
+      i++;
+    }
+    if (digits == 0) {
+      return 0;
+    }
+  }
+
+  return i == len;
+}
+
+/* Stores the value on the top of the stack into the enclosing container */
+static void json_on_value(json_parser_t* parser) {
+  duk_context* ctx = parser->ctx;
+
+  if (parser->depth == 0) {
+    parser->state = kJsonDone;
+    return;
+  }
+
+  if (parser->frames[parser->depth - 1] == '[') {
+    duk_put_prop_index(ctx, -2, (duk_uarridx_t) duk_get_length(ctx, -2));
+  } else {
+    /* NOTE: Defined rather than put, so that `__proto__` is just a key */
+    duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_SET_WEC);
+  }
+
+  parser->state = kJsonAfterValue;
+}
+
+static void json_on_string(json_parser_t* parser,
+                           const char* str,
+                           size_t len) {
+  string_cache_push(parser->ctx, str, len);
+
+  if (parser->is_key) {
+    parser->state = kJsonColon;
+  } else {
+    json_on_value(parser);
+  }
+}
+
+static int json_on_number(json_parser_t* parser) {
+  if (!json_is_number(parser->buf, parser->buf_len)) {
+    return json_error(parser);
+  }
+
+  parser->buf[parser->buf_len] = '\0';
+  duk_push_number(parser->ctx, strtod(parser->buf, NULL));
+  parser->buf_len = 0;
+
+  json_on_value(parser);
+  return 0;
+}
+
+static int json_open(json_parser_t* parser, char type) {
+  duk_context* ctx = parser->ctx;
+
+  /* Container, key and value */
+  if (parser->depth == JSON_MAX_DEPTH || !duk_check_stack(ctx, 3)) {
+    return json_error(parser);
+  }
+
+  if (type == '[') {
+    duk_push_array(ctx);
+    parser->state = kJsonArrayStart;
+  } else {
+    duk_push_object(ctx);
+    parser->state = kJsonObjectStart;
+  }
+  parser->frames[parser->depth++] = type;
+
+  return 0;
+}
+
+static int json_close(json_parser_t* parser, char type) {
+  if (parser->depth == 0 || parser->frames[parser->depth - 1] != type) {
+    return json_error(parser);
+  }
+
+  parser->depth--;
+  json_on_value(parser);
+  return 0;
+}
+
+/* Consumes the first character of a value, except for numbers */
+static int json_begin_value(json_parser_t* parser, char c) {
+  switch (c) {
+    case '{':
+    case '[':
+      return json_open(parser, c);
+    case '"':
+      parser->is_key = 0;
+      parser->state = kJsonString;
+      return 0;
+    case 't':
+      parser->literal = "true";
+      break;
+    case 'f':
+      parser->literal = "false";
+      break;
+    case 'n':
+      parser->literal = "null";
+      break;
+    default:
+      if (c == '-' || (c >= '0' && c <= '9')) {
+        parser->state = kJsonNumber;
+        return 0;
+      }
+      return json_error(parser);
+  }
+
+  parser->literal_off = 1;
+  parser->state = kJsonLiteral;
+  return 0;
+}
+
+/* Parser */
+
+json_parser_t* json_parser_new(duk_context* ctx) {
+  json_parser_t* parser;
+
+  parser = malloc(sizeof(*parser));
+  CHECK(parser != NULL);
+  memset(parser, 0, sizeof(*parser));
+
+  duk_push_thread(ctx);
+  parser->ctx = duk_get_context(ctx, -1);
+  parser->parent = ctx;
+  parser->thread_ref = refs_put(ctx);
+  parser->state = kJsonValue;
+
+  return parser;
+}
+
+void json_parser_free(json_parser_t* parser) {
+  refs_del(parser->parent, parser->thread_ref);
+  free(parser->buf);
+  free(parser);
+}
+
+int json_parser_execute(json_parser_t* parser, const char* data, size_t len) {
+  const char* p = data;
+  const char* end = data + len;
+
+  while (p != end) {
+    char c = *p;
+
+    switch (parser->state) {
+      case kJsonValue:
+      case kJsonArrayStart:
+        if (json_is_space(c)) {
+          p++;
+          break;
+        }
+        if (c == ']' && parser->state == kJsonArrayStart) {
+          p++;
+          json_close(parser, '[');
+          break;
+        }
+        if (json_begin_value(parser, c) != 0) {
+          return -1;
+        }
+        if (parser->state != kJsonNumber) {
+          p++;
+        }
+        break;
+      case kJsonObjectStart:
+      case kJsonKey:
+        if (json_is_space(c)) {
+          p++;
+          break;
+        }
+        p++;
+        if (c == '}' && parser->state == kJsonObjectStart) {
+          json_close(parser, '{');
+        } else if (c == '"') {
+          parser->is_key = 1;
+          parser->state = kJsonString;
+        } else {
+          return json_error(parser);
+        }
+        break;
+      case kJsonColon:
+        if (json_is_space(c)) {
+          p++;
+          break;
+        }
+        p++;
+        if (c != ':') {
+          return json_error(parser);
+        }
+        parser->state = kJsonValue;
+        break;
+      case kJsonAfterValue:
+        if (json_is_space(c)) {
+          p++;
+          break;
+        }
+        p++;
+        if (c == ',') {
+          parser->state = parser->frames[parser->depth - 1] == '[' ?
+              kJsonValue : kJsonKey;
+        } else if (c == ']' || c == '}') {
+          if (json_close(parser, c == ']' ? '[' : '{') != 0) {
+            return -1;
+          }
+        } else {
+          return json_error(parser);
+        }
+        break;
+      case kJsonString:
+        {
+          const char* start = p;
+
+          while (p != end && *p != '"' && *p != '\\' &&
+                 (unsigned char) *p >= 0x20) {
+            p++;
+          }
+
+          /* Strings without escapes within a chunk are not copied */
+          if (p != end && *p == '"' && parser->buf_len == 0) {
+            json_on_string(parser, start, p - start);
+            p++;
+            break;
+          }
+
+          json_append(parser, start, p - start);
+          if (p == end) {
+            break;
+          }
+
+          c = *p++;
+          if (c == '"') {
+            json_on_string(parser, parser->buf, parser->buf_len);
+            parser->buf_len = 0;
+          } else if (c == '\\') {
+            parser->state = kJsonEscape;
+          } else {
+            return json_error(parser);
+          }
+        }
+        break;
+      case kJsonEscape:
+        p++;
+        switch (c) {
+          case '"': case '\\': case '/': break;
+          case 'b': c = '\b'; break;
+          case 'f': c = '\f'; break;
+          case 'n': c = '\n'; break;
+          case 'r': c = '\r'; break;
+          case 't': c = '\t'; break;
+          case 'u':
+            parser->unicode = 0;
+            parser->unicode_len = 0;
+            parser->state = kJsonUnicode;
+            continue;
+          default:
+            return json_error(parser);
+        }
+        json_append(parser, &c, 1);
+        parser->state = kJsonString;
+        break;
+      case kJsonUnicode:
+        {
+          int value = json_hex_value(c);
+
+          p++;
+          if (value == -1) {
+            return json_error(parser);
+          }
+
+          parser->unicode = parser->unicode * 16 + value;
+          if (++parser->unicode_len == 4) {
+            json_append_code_unit(parser, parser->unicode);
+            parser->state = kJsonString;
+          }
+        }
+        break;
+      case kJsonNumber:
+        {
+          const char* start = p;
+
+          while (p != end && json_is_number_char(*p)) {
+            p++;
+          }
+          json_append(parser, start, p - start);
+
+          /* The number might continue in the next chunk */
+          if (p != end && json_on_number(parser) != 0) {
+            return -1;
+          }
+        }
+        break;
+      case kJsonLiteral:
+        p++;
+        if (c != parser->literal[parser->literal_off++]) {
+          return json_error(parser);
+        }
+        if (parser->literal[parser->literal_off] != '\0') {
+          break;
+        }
+
+        if (parser->literal[0] == 'n') {
+          duk_push_null(parser->ctx);
+        } else {
+          duk_push_boolean(parser->ctx, parser->literal[0] == 't');
+        }
+        json_on_value(parser);
+        break;
+      case kJsonDone:
+        if (!json_is_space(c)) {
+          return json_error(parser);
+        }
+        p++;
+        break;
+      case kJsonError:
+        return -1;
+    }
+  }
+
+  return parser->state == kJsonError ? -1 : 0;
+}
+
+int json_parser_finish(json_parser_t* parser, duk_context* ctx) {
+  /* Top-level number ends with the input */
+  if (parser->state == kJsonNumber && json_on_number(parser) != 0) {
+    return -1;
+  }
+
+  if (parser->state != kJsonDone) {
+    return -1;
+  }
+
+  duk_xmove_top(ctx, parser->ctx, 1);
+  return 0;
+}
@@ -0,0 +1,30 @@
+#ifndef SRC_JSON_H_
+#define SRC_JSON_H_
+
+#include <stddef.h>
+
+#include "duktape.h"
+
+/*
+ * Incremental JSON (RFC 8259) parser. It is fed with the chunks of a request
+ * body as they arrive and builds the Duktape value right away, keeping the
+ * unfinished objects and arrays on the value stack of its own thread. Only
+ * the tokens that span chunk boundaries, and strings with escapes, are
+ * copied. Results match `JSON.parse()`.
+ */
+
+typedef struct json_parser_s json_parser_t;
+
+json_parser_t* json_parser_new(duk_context* ctx);
+void json_parser_free(json_parser_t* parser);
+
+/* Returns `0`, or `-1` once the input is not valid JSON */
+int json_parser_execute(json_parser_t* parser, const char* data, size_t len);
+
+/*
+ * Moves the parsed value to the top of `ctx`, which must belong to the same
+ * heap. Returns `-1` if the input is incomplete or invalid.
+ */
+int json_parser_finish(json_parser_t* parser, duk_context* ctx);
+
+#endif  /* SRC_JSON_H_ */
@@ -1,326 +1,4375 @@
 #include <stdlib.h>
 #include <stdio.h>
+#include <string.h>
 #include <signal.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <unistd.h>
+#endif
 
 #include "uv.h"
 #include "duktape.h"
 #include "llhttp.h"
 
-#define CHECK(result) \
-  do { \
-    if (!(result)) { \
-      fprintf(stderr, "Check failed at line: %d\n", __LINE__); \
-      abort(); \
-    } \
-  } while (0)
-
-#define CHECK_EQ(expected, actual) \
-  do { \
-    int res = (actual); \
-    if (res != (expected)) { \
-      fprintf(stderr, "Expected: %d, but got %d at line: %d\n", \
-          (expected), res, __LINE__); \
-      abort(); \
-    } \
-  } while (0)
+#include "asset_cache.h"
+#include "body.h"
+#include "common.h"
+#include "fetch.h"
+#include "file_cache.h"
+#include "fs.h"
+#include "h2.h"
+#include "header_names.h"
+#include "http_cond.h"
+#include "json.h"
+#include "mime.h"
+#include "plugins.h"
+#include "proxy.h"
+#include "refs.h"
+#include "response_cache.h"
+#include "router.h"
+#include "sse.h"
+#include "string_cache.h"
+#include "timers.h"
+#include "upload.h"
+#include "upstream.h"
+#include "url.h"
+#include "ws.h"
+
+/* Typedefs */
+
+typedef struct conn_s conn_t;
+typedef struct req_s req_t;
+typedef struct header_s header_t;
+
+struct header_s {
+  /* NOTE: Lowercase, static for well-known names */
+  uv_buf_t field;
+  uv_buf_t value;
+
+  /* Id in `header_names`, or `-1` if `field` is owned */
+  int name_id;
+};
+
+/* Write request that keeps memoized response alive */
+typedef struct cached_write_s cached_write_t;
+struct cached_write_s {
+  uv_write_t req;
+  response_entry_t* entry;
+};
+
+struct req_s {
+  /* NOTE: `NULL` once the connection is closed */
+  conn_t* conn;
+  req_t* next;
+
+  /* Held by the connection queue, the thread and JS functions */
+  int refs;
+
+  /* Per-request coroutine, kept in the heap stash while pending */
+  duk_context* thread;
+  int thread_ref;
+
+  uv_buf_t url;
+  int method;
+
+  /* Request headers, copied into JS only when the handler runs */
+  header_t* headers;
+  unsigned int header_count;
+  unsigned int header_size;
+
+  /* Request body, the bytes received so far and the limit for them */
+  body_t payload;
+  uint64_t body_len;
+  uint64_t max_body_size;
+
+  /*
+   * Body is passed to `request.onData` as it arrives instead of being
+   * buffered. `reader` is the connection that is still reading it, and
+   * `request_ref` keeps the request object until the body ends.
+   */
+  int streaming;
+  int paused;
+  conn_t* reader;
+  int request_ref;
+
+  /* Chunk that stays valid while the body is paused */
+  int chunk_ref;
+
+  /* Copy of the paused chunk, HTTP/2 frames don't stay in the read buffer */
+  char* chunk_copy;
+
+  /* `parseJson` routes build `request.json` while the body arrives */
+  json_parser_t* json;
+  int json_ref;
+
+  /* `multipart` routes write files to disk while the body arrives */
+  upload_t* upload;
+
+  /*
+   * `respond({ code, stream: true })` sends the body with chunked encoding
+   * as `res.write()` produces it. `res_ref` keeps the response object for
+   * its callbacks, and `unsent` holds the chunks written before the response
+   * reached the socket.
+   */
+  int chunked;
+  int chunked_end;
+  int drain;
+  int res_ref;
+  body_t unsent;
+
+  /*
+   * Request forwarded by a proxy route. Its response is streamed the same
+   * way, but written as is if `identity` is set, because the length is
+   * known.
+   */
+  proxy_t* proxy;
+  int identity;
+
+  /* `respond({ code, sse })` subscribes the connection to this channel */
+  uv_buf_t sse_channel;
+
+  /*
+   * Valid WebSocket handshake, and the socket that `respond({ websocket })`
+   * created until the connection takes it over.
+   */
+  int websocket;
+  ws_t* ws;
+
+  int in_call;
+  int responded;
+  int head_only;
+  int code;
+
+  /* Close the connection once the response is written */
+  int close;
+
+  /* Serialized response, allocated together with the write request */
+  uv_write_t* response;
+  size_t response_len;
+
+  /* File body range, sent after the serialized headers */
+  file_entry_t* file;
+  uint64_t file_offset;
+  uint64_t file_end;
+
+  /* Preserialized response, written instead of `response` bytes */
+  const asset_t* asset;
+
+  /* Borrowed body bytes written after the head, a slice of `asset` */
+  uv_buf_t body;
+
+  /* Memoized response, written instead of `response` bytes */
+  response_entry_t* cached;
+
+  /* Set when other requests wait for this one's response */
+  response_flight_t* flight;
+
+  /*
+   * HTTP/2 stream, `NULL` once it is closed. The stream takes over the
+   * queue's reference when the response starts, and file bodies are read
+   * into its buffer in chunks.
+   */
+  h2_stream_t* h2;
+  int h2_sending;
+  int h2_reading;
+};
+
+struct conn_s {
+  uv_tcp_t tcp_client;
+  char read_buf[1024];
+
+  uv_buf_t url;
+
+  /* Raw name of the header being parsed, reused by the next one */
+  uv_buf_t header_raw;
+  size_t header_raw_size;
+
+  /* Parsed header, `field` is owned only if `name_id` is `-1` */
+  uv_buf_t header_field;
+  uv_buf_t header_value;
+  int header_name_id;
+
+  llhttp_t http;
+
+  /* Request being parsed */
+  req_t* req;
+
+  /* Unparsed part of `read_buf` while the request body is paused */
+  uv_buf_t pending;
+  int in_execute;
+
+  /* Pipelined requests, responses are written in this order */
+  req_t* queue_head;
+  req_t* queue_tail;
+
+  /* Request whose chunked body is being written */
+  req_t* stream_req;
+
+  /* Subscription of the `stream_req` that is an event stream */
+  sse_client_t sse;
+
+  /*
+   * Parser stops at the end of a WebSocket handshake, and the socket takes
+   * over the connection once the handler accepts it.
+   */
+  int websocket;
+  ws_t* ws;
+
+  /*
+   * Connections that start with HTTP/2 preface are served by the frame layer
+   * instead of llhttp, `preface_len` bytes of it have arrived so far.
+   */
+  h2_t* h2;
+  unsigned int preface_len;
+  int sniffed;
+
+  /* Request whose file body is being sent */
+  req_t* file_req;
+  uint64_t file_sent;
+  uv_fs_t file_fs_req;
+  int file_active;
+
+#ifdef _WIN32
+  uv_write_t* file_chunk;
+#else
+  /* Duplicate of the socket, owned by us and polled for writability */
+  int out_fd;
+  uv_poll_t out_poll;
+  int out_poll_active;
+#endif  /* _WIN32 */
+
+  int closed;
+};
+
+/* Handler of a route table entry */
+typedef struct route_s route_t;
+struct route_s {
+  int handler;
+  uint64_t max_body_size;
+  int stream_body;
+  int parse_json;
+  int multipart;
+  unsigned int max_files;
+
+  /*
+   * Requests go to `upstream`, with `proxy_path` put in front of the url.
+   * `handler` picks the url for every request instead, if it is set.
+   */
+  int proxy;
+  upstream_t* upstream;
+  char* proxy_path;
+  size_t proxy_path_len;
+  uint64_t proxy_timeout;
+};
+
+typedef struct static_mount_s static_mount_t;
+struct static_mount_s {
+  const char* prefix;
+  size_t prefix_len;
+  const char* dir;
+  size_t dir_len;
+};
+
+/* Some static vars */
+
+static const int BACKLOG = 511;
+static const unsigned int INITIAL_HEADER_SIZE = 16;
+static const int FILE_READ_CHUNK_LEN = 4096;
+static const unsigned int FILE_CACHE_MAX_ENTRIES = 1024;
+static const size_t RESPONSE_CACHE_MAX_BYTES = 64 * 1024 * 1024;
+static const uint64_t DEFAULT_MAX_BODY_SIZE = 8 * 1024 * 1024;
+static const unsigned int BODY_POOL_MAX_FREE = 256;
+static const size_t RESPONSE_HIGH_WATERMARK = 65536;
+static const size_t FILE_SEND_CHUNK_LEN = 65536;
+static const uint64_t DEFAULT_PROXY_TIMEOUT = 30000;
+static const unsigned int DEFAULT_MAX_FILES = 16;
+static const unsigned int MAX_FILES_LIMIT = 1024;
+
+static uv_loop_t loop;
+static uv_tcp_t tcp_server;
+static llhttp_settings_t http_settings;
+static h2_callbacks_t h2_callbacks;
+static proxy_callbacks_t proxy_callbacks;
+
+/* HTTP/2 frames are parsed right away, so all connections share this */
+static char h2_read_buf[65536];
+
+/* Worker heap shared by all connections */
+static duk_context* duk_ctx;
+static int handler_ref;
+
+/* Prototype of the proxy handlers behind `headers` objects */
+static int headers_proto_ref;
+
+/* Prototype of `request` objects */
+static int request_proto_ref;
+
+/* Prototype of streamed response objects */
+static int response_proto_ref;
+
+/* Compiled route table, when `handler.js` evaluates to an object */
+static router_t router;
+static int use_router;
+static route_t* routes;
+
+/* Limit for request bodies, unless the route says otherwise */
+static uint64_t max_body_size;
+
+static static_mount_t* static_mounts;
+static unsigned int static_mount_count;
+
+static static_mount_t* cache_mounts;
+static unsigned int cache_mount_count;
+static int cache_use_mmap;
+
+/* Forward declarations */
+
+static void conn_flush(conn_t* conn);
+static void conn_resume(conn_t* conn);
+static void conn_stream_abort(conn_t* conn, const char* error);
+static void req_dispatch(req_t* req);
+static void req_proxy_close(req_t* req);
+static void req_proxy_splice(req_t* req);
+
+/* Requests */
+
+static req_t* req_new(conn_t* conn) {
+  req_t* req;
+
+  req = malloc(sizeof(*req));
+  CHECK(req != NULL);
+
+  memset(req, 0, sizeof(*req));
+
+  req->conn = conn;
+  req->refs = 1;
+
+  /* Append to the connection's queue */
+  if (conn->queue_tail == NULL) {
+    conn->queue_head = req;
+  } else {
+    conn->queue_tail->next = req;
+  }
+  conn->queue_tail = req;
+
+  return req;
+}
+
+static void req_unref(req_t* req) {
+  CHECK(req->refs > 0);
+  req->refs--;
+  if (req->refs != 0) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < req->header_count; i++) {
+    if (req->headers[i].name_id == -1) {
+      free(req->headers[i].field.base);
+    }
+    free(req->headers[i].value.base);
+  }
+  free(req->headers);
+  free(req->url.base);
+  body_reset(&req->payload);
+  body_reset(&req->unsent);
+  free(req->sse_channel.base);
+
+  if (req->json != NULL) {
+    json_parser_free(req->json);
+  }
+  if (req->json_ref != REFS_NONE) {
+    refs_del(duk_ctx, req->json_ref);
+  }
+  if (req->upload != NULL) {
+    upload_close(req->upload);
+  }
+  if (req->ws != NULL) {
+    ws_destroy(req->ws);
+  }
+
+  if (req->cached != NULL) {
+    response_cache_release(req->cached);
+  }
+
+  free(req->response);
+  req->response = NULL;
+  free(req);
+}
+
+/* Returns the value of the first header named `name`, or `NULL` base */
+static uv_buf_t req_get_header(req_t* req, const char* name) {
+  size_t name_len = strlen(name);
+
+  for (unsigned int i = 0; i < req->header_count; i++) {
+    header_t* header = &req->headers[i];
+
+    if (header->field.len == name_len &&
+        memcmp(header->field.base, name, name_len) == 0) {
+      return header->value;
+    }
+  }
+
+  return uv_buf_init(NULL, 0);
+}
+
+/* Drops the reference of a JS object that points to the request */
+static duk_ret_t req_finalize_cb(duk_context* ctx) {
+  duk_get_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("req"));
+  req_t* req = duk_get_pointer(ctx, -1);
+  duk_pop(ctx);
+
+  if (req == NULL) {
+    return 0;
+  }
+
+  /* Guard against repeated finalization */
+  duk_del_prop_string(ctx, 0, DUK_HIDDEN_SYMBOL("req"));
+
+  req_unref(req);
+  return 0;
+}
+
+/*
+ * Headers. The handler receives a proxy that looks the raw header spans up on
+ * access, so only the names and values it actually reads become JS strings.
+ * Properties assigned by JS are stored on the proxy target and take
+ * precedence.
+ */
+
+/* Returns the request behind `this`, `NULL` if there is none */
+static req_t* req_from_this(duk_context* ctx) {
+  duk_push_this(ctx);
+  duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("req"));
+  req_t* req = duk_get_pointer(ctx, -1);
+  duk_pop_2(ctx);
+
+  return req;
+}
+
+/*
+ * Returns the last header named `name` in any case, like repeated puts of
+ * the lowercase names would.
+ */
+static header_t* req_find_header(req_t* req, const char* name,
+                                 size_t name_len) {
+  for (unsigned int i = req->header_count; i > 0; i--) {
+    header_t* header = &req->headers[i - 1];
+
+    if (header->field.len != name_len) {
+      continue;
+    }
+
+    size_t j;
+    for (j = 0; j < name_len; j++) {
+      char c = name[j];
+      if (c >= 'A' && c <= 'Z') {
+        c += 'a' - 'A';
+      }
+      if (c != header->field.base[j]) {
+        break;
+      }
+    }
+
+    if (j == name_len) {
+      return header;
+    }
+  }
+
+  return NULL;
+}
+
+/* Looks up the header named by the key at `idx` */
+static header_t* req_find_header_key(duk_context* ctx, duk_idx_t idx) {
+  req_t* req = req_from_this(ctx);
+  duk_size_t name_len;
+  const char* name;
+
+  if (req == NULL || !duk_is_string(ctx, idx) || duk_is_symbol(ctx, idx)) {
+    return NULL;
+  }
+
+  name = duk_get_lstring(ctx, idx, &name_len);
+  return req_find_header(req, name, name_len);
+}
+
+/* `get(target, key)` */
+static duk_ret_t req_headers_get_cb(duk_context* ctx) {
+  header_t* header;
+
+  duk_dup(ctx, 1);
+  if (duk_has_prop(ctx, 0) || (header = req_find_header_key(ctx, 1)) == NULL) {
+    duk_dup(ctx, 1);
+    duk_get_prop(ctx, 0);
+    return 1;
+  }
+
+  string_cache_push(ctx, header->value.base, header->value.len);
+  return 1;
+}
+
+/* `has(target, key)` */
+static duk_ret_t req_headers_has_cb(duk_context* ctx) {
+  duk_dup(ctx, 1);
+  duk_push_boolean(ctx,
+      duk_has_prop(ctx, 0) || req_find_header_key(ctx, 1) != NULL);
+  return 1;
+}
+
+/*
+ * `ownKeys(target)`. Duktape takes enumerability from the target, so all
+ * headers have to be materialized on it first.
+ */
+static duk_ret_t req_headers_own_keys_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+
+  for (unsigned int i = 0; req != NULL && i < req->header_count; i++) {
+    header_t* header = &req->headers[i];
+
+    if (header->name_id != -1) {
+      header_names_push(ctx, header->name_id);
+    } else {
+      string_cache_push(ctx, header->field.base, header->field.len);
+    }
+    duk_dup_top(ctx);
+    if (duk_has_prop(ctx, 0)) {
+      duk_pop(ctx);
+      continue;
+    }
+
+    header = req_find_header(req, header->field.base, header->field.len);
+    string_cache_push(ctx, header->value.base, header->value.len);
+    duk_put_prop(ctx, 0);
+  }
+
+  duk_push_array(ctx);
+  duk_uarridx_t count = 0;
+
+  duk_enum(ctx, 0, DUK_ENUM_OWN_PROPERTIES_ONLY);
+  while (duk_next(ctx, -1, 0)) {
+    duk_put_prop_index(ctx, -3, count++);
+  }
+  duk_pop(ctx);
+
+  return 1;
+}
+
+static void req_headers_init(duk_context* ctx) {
+  static const duk_function_list_entry funcs[] = {
+    { "get", req_headers_get_cb, 3 },
+    { "has", req_headers_has_cb, 2 },
+    { "ownKeys", req_headers_own_keys_cb, 1 },
+    { NULL, NULL, 0 }
+  };
+
+  duk_push_object(ctx);
+  duk_put_function_list(ctx, -1, funcs);
+
+  /* NOTE: Finalizer is inherited by the handlers */
+  duk_push_c_function(ctx, req_finalize_cb, 1);
+  duk_set_finalizer(ctx, -2);
+
+  headers_proto_ref = refs_put(ctx);
+}
+
+/* Pushes `headers` proxy, it keeps the request alive */
+static void req_push_headers(req_t* req, duk_context* ctx) {
+  duk_push_object(ctx);
+
+  duk_push_bare_object(ctx);
+  refs_push(ctx, headers_proto_ref);
+  duk_set_prototype(ctx, -2);
+
+  duk_push_pointer(ctx, req);
+  duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("req"));
+  req->refs++;
+
+  duk_push_proxy(ctx, 0);
+}
+
+/*
+ * Request object. `path`, `query`, `cookies` and `body` are getters on the
+ * shared prototype that parse the raw spans on first access, and then cache
+ * the result as own property of the object.
+ */
+
+/* Pushes percent-decoded string, `+` is decoded as space with `form` */
+static void push_decoded(duk_context* ctx,
+                         const char* str,
+                         size_t len,
+                         int form) {
+  char small[256];
+  char* out = small;
+
+  if (memchr(str, '%', len) == NULL &&
+      (!form || memchr(str, '+', len) == NULL)) {
+    string_cache_push(ctx, str, len);
+    return;
+  }
+
+  if (len > sizeof(small)) {
+    out = duk_push_fixed_buffer(ctx, len);
+  }
+
+  size_t out_len = url_decode(out, str, len, form);
+  duk_push_lstring(ctx, out, out_len);
+
+  if (out != small) {
+    duk_remove(ctx, -2);
+  }
+}
+
+/* Caches the value on the stack top as own property `name` of `this` */
+static duk_ret_t req_request_cache(duk_context* ctx, const char* name) {
+  duk_push_this(ctx);
+  duk_push_string(ctx, name);
+  duk_dup(ctx, -3);
+  duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_SET_WEC);
+  duk_pop(ctx);
+
+  return 1;
+}
+
+static duk_ret_t req_request_method_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+
+  if (req == NULL) {
+    return 0;
+  }
+
+  duk_push_string(ctx, llhttp_method_name(req->method));
+  return 1;
+}
+
+static duk_ret_t req_request_url_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+
+  if (req == NULL) {
+    return 0;
+  }
+
+  string_cache_push(ctx, req->url.base, req->url.len);
+  return 1;
+}
+
+static duk_ret_t req_request_path_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+
+  if (req == NULL) {
+    return 0;
+  }
+
+  push_decoded(ctx, req->url.base, url_path_len(req->url.base, req->url.len),
+      0);
+  return req_request_cache(ctx, "path");
+}
+
+/* Appends decoded `value` to property `key` of the object at `-1` */
+static void req_push_pair(duk_context* ctx,
+                          const char* key,
+                          size_t key_len,
+                          const char* value,
+                          size_t value_len) {
+  push_decoded(ctx, key, key_len, 1);
+  push_decoded(ctx, value, value_len, 1);
+
+  duk_dup(ctx, -2);
+  duk_get_prop(ctx, -4);
+
+  /* Repeated keys collect their values into an array */
+  if (duk_is_undefined(ctx, -1)) {
+    duk_pop(ctx);
+    duk_put_prop(ctx, -3);
+  } else if (duk_is_array(ctx, -1)) {
+    duk_swap_top(ctx, -2);
+    duk_put_prop_index(ctx, -2, (duk_uarridx_t) duk_get_length(ctx, -2));
+    duk_pop_2(ctx);
+  } else {
+    duk_push_array(ctx);
+    duk_swap_top(ctx, -2);
+    duk_put_prop_index(ctx, -2, 0);
+    duk_swap_top(ctx, -2);
+    duk_put_prop_index(ctx, -2, 1);
+    duk_put_prop(ctx, -3);
+  }
+}
+
+static duk_ret_t req_request_query_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+  size_t len;
+
+  if (req == NULL) {
+    return 0;
+  }
+
+  const char* query = url_query(req->url.base, req->url.len, &len);
+
+  /* NOTE: No prototype, so that any key is safe */
+  duk_push_bare_object(ctx);
+
+  while (len != 0) {
+    const char* amp = memchr(query, '&', len);
+    size_t pair_len = amp == NULL ? len : (size_t) (amp - query);
+    const char* eq = memchr(query, '=', pair_len);
+    size_t key_len = eq == NULL ? pair_len : (size_t) (eq - query);
+
+    if (key_len != 0) {
+      if (eq == NULL) {
+        req_push_pair(ctx, query, key_len, "", 0);
+      } else {
+        req_push_pair(ctx, query, key_len, eq + 1, pair_len - key_len - 1);
+      }
+    }
+
+    if (amp == NULL) {
+      break;
+    }
+    len -= pair_len + 1;
+    query = amp + 1;
+  }
+
+  return req_request_cache(ctx, "query");
+}
+
+static duk_ret_t req_request_cookies_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+
+  if (req == NULL) {
+    return 0;
+  }
+
+  uv_buf_t header = req_get_header(req, "cookie");
+  const char* p = header.base;
+  size_t len = header.len;
+
+  duk_push_bare_object(ctx);
+
+  while (len != 0) {
+    const char* semi = memchr(p, ';', len);
+    size_t pair_len = semi == NULL ? len : (size_t) (semi - p);
+    const char* key = p;
+    const char* eq = memchr(p, '=', pair_len);
+
+    if (semi == NULL) {
+      len = 0;
+    } else {
+      len -= pair_len + 1;
+      p = semi + 1;
+    }
+
+    if (eq == NULL) {
+      continue;
+    }
+
+    const char* key_end = eq;
+    const char* value = eq + 1;
+    const char* value_end = key + pair_len;
+
+    while (key < key_end && (*key == ' ' || *key == '\t')) {
+      key++;
+    }
+    while (key_end > key && (key_end[-1] == ' ' || key_end[-1] == '\t')) {
+      key_end--;
+    }
+    while (value < value_end && (*value == ' ' || *value == '\t')) {
+      value++;
+    }
+    while (value_end > value &&
+           (value_end[-1] == ' ' || value_end[-1] == '\t')) {
+      value_end--;
+    }
+    if (value_end - value >= 2 && *value == '"' && value_end[-1] == '"') {
+      value++;
+      value_end--;
+    }
+
+    if (key == key_end) {
+      continue;
+    }
+
+    /* The first cookie with a given name wins, it has the longest path */
+    duk_push_lstring(ctx, key, key_end - key);
+    duk_dup_top(ctx);
+    if (duk_has_prop(ctx, -3)) {
+      duk_pop(ctx);
+      continue;
+    }
+    push_decoded(ctx, value, value_end - value, 0);
+    duk_put_prop(ctx, -3);
+  }
+
+  return req_request_cache(ctx, "cookies");
+}
+
+static duk_ret_t req_request_body_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+
+  if (req == NULL) {
+    return 0;
+  }
+
+  /* Bodies that fit into a single chunk don't need a copy */
+  const body_t* body = &req->payload;
+  if (body->head == body->tail) {
+    duk_push_lstring(ctx, body->head == NULL ? "" : body->head->data,
+        (duk_size_t) body->len);
+  } else {
+    body_copy(body, duk_push_fixed_buffer(ctx, (duk_size_t) body->len));
+    duk_buffer_to_string(ctx, -1);
+  }
+
+  return req_request_cache(ctx, "body");
+}
+
+static duk_ret_t req_request_body_buffer_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+
+  if (req == NULL) {
+    return 0;
+  }
+
+  body_copy(&req->payload,
+      duk_push_fixed_buffer(ctx, (duk_size_t) req->payload.len));
+  return req_request_cache(ctx, "bodyBuffer");
+}
+
+/*
+ * Streamed bodies. Chunks are external buffers over the read buffer of the
+ * connection, so they are detached as soon as `onData` returns. `pause()`
+ * stops reading from the socket, and keeps the last chunk valid until
+ * `resume()`.
+ */
+
+/* Calls `obj[name](...)` with arguments from the top of the stack */
+static void req_emit(int obj_ref, const char* name, duk_idx_t nargs) {
+  duk_context* ctx = duk_ctx;
+
+  refs_push(ctx, obj_ref);
+  duk_get_prop_string(ctx, -1, name);
+  if (!duk_is_callable(ctx, -1)) {
+    duk_pop_n(ctx, nargs + 2);
+    return;
+  }
+
+  /* [ ...args, request, fn ] => [ fn, request, ...args ] */
+  duk_insert(ctx, -(nargs + 2));
+  duk_insert(ctx, -(nargs + 1));
+
+  if (duk_pcall_method(ctx, nargs) != DUK_EXEC_SUCCESS) {
+    fprintf(stderr, "Stream callback error: %s\n",
+        duk_safe_to_string(ctx, -1));
+  }
+  duk_pop(ctx);
+}
+
+static void req_stream_release_chunk(req_t* req) {
+  duk_context* ctx = duk_ctx;
+
+  if (req->chunk_ref == REFS_NONE) {
+    return;
+  }
+
+  refs_push(ctx, req->chunk_ref);
+  duk_config_buffer(ctx, -1, NULL, 0);
+  duk_pop(ctx);
+
+  refs_del(ctx, req->chunk_ref);
+  req->chunk_ref = REFS_NONE;
+
+  free(req->chunk_copy);
+  req->chunk_copy = NULL;
+}
+
+static void req_stream_data(req_t* req, const char* data, size_t len) {
+  duk_context* ctx = duk_ctx;
+
+  if (req->request_ref == REFS_NONE) {
+    return;
+  }
+
+  duk_push_external_buffer(ctx);
+  duk_config_buffer(ctx, -1, (void*) data, len);
+
+  duk_dup_top(ctx);
+  req_emit(req->request_ref, "onData", 1);
+
+  if (req->paused && req->reader != NULL) {
+    if (req->reader->h2 != NULL) {
+      req->chunk_copy = malloc(len);
+      CHECK(req->chunk_copy != NULL);
+      memcpy(req->chunk_copy, data, len);
+      duk_config_buffer(ctx, -1, req->chunk_copy, len);
+    }
+    req->chunk_ref = refs_put(ctx);
+  } else {
+    duk_config_buffer(ctx, -1, NULL, 0);
+    duk_pop(ctx);
+  }
+}
+
+/* Emits `onEnd`, or `onError` if `error` is not `NULL` */
+static void req_stream_end(req_t* req, const char* error) {
+  conn_t* conn = req->reader;
+
+  /* NOTE: The connection's reference is released below */
+  if (conn->h2 == NULL) {
+    conn->req = NULL;
+  }
+  req->reader = NULL;
+
+  req_stream_release_chunk(req);
+
+  /* Upstream gets the end of the body, or nothing more at all */
+  if (req->proxy != NULL) {
+    if (error == NULL) {
+      proxy_end(req->proxy);
+    } else {
+      req_proxy_close(req);
+    }
+  }
+
+  if (req->request_ref != REFS_NONE) {
+    if (error == NULL) {
+      req_emit(req->request_ref, "onEnd", 0);
+    } else {
+      duk_push_error_object(duk_ctx, DUK_ERR_ERROR, "%s", error);
+      req_emit(req->request_ref, "onError", 1);
+    }
+
+    refs_del(duk_ctx, req->request_ref);
+    req->request_ref = REFS_NONE;
+  }
+
+  req_unref(req);
+}
+
+/* Lets the streamed response object go, emits `onError` if `error` is set */
+static void req_response_close(req_t* req, const char* error) {
+  body_reset(&req->unsent);
+  req_proxy_close(req);
+
+  if (req->res_ref == REFS_NONE) {
+    return;
+  }
+
+  if (error != NULL) {
+    duk_push_error_object(duk_ctx, DUK_ERR_ERROR, "%s", error);
+    req_emit(req->res_ref, "onError", 1);
+  }
+
+  refs_del(duk_ctx, req->res_ref);
+  req->res_ref = REFS_NONE;
+}
+
+static duk_ret_t req_request_pause_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+
+  if (req == NULL || req->reader == NULL || req->paused) {
+    return 0;
+  }
+
+  req->paused = 1;
+
+  /* Inside of the parser the pause happens once the callback returns */
+  conn_t* conn = req->reader;
+  if (conn->h2 != NULL) {
+    h2_stream_pause(req->h2);
+  } else if (!conn->in_execute) {
+    CHECK_EQ(0, uv_read_stop((uv_stream_t*) &conn->tcp_client));
+  }
+
+  return 0;
+}
+
+static duk_ret_t req_request_resume_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+
+  if (req == NULL || req->reader == NULL || !req->paused) {
+    return 0;
+  }
+
+  req->paused = 0;
+
+  conn_t* conn = req->reader;
+  if (conn->h2 != NULL) {
+    req_stream_release_chunk(req);
+    h2_stream_resume(req->h2);
+  } else if (!conn->in_execute) {
+    req_stream_release_chunk(req);
+    conn_resume(conn);
+  }
+
+  return 0;
+}
+
+static void req_request_init(duk_context* ctx) {
+  static const struct {
+    const char* name;
+    duk_c_function getter;
+  } getters[] = {
+    { "method", req_request_method_cb },
+    { "url", req_request_url_cb },
+    { "path", req_request_path_cb },
+    { "query", req_request_query_cb },
+    { "cookies", req_request_cookies_cb },
+    { "body", req_request_body_cb },
+    { "bodyBuffer", req_request_body_buffer_cb },
+  };
+
+  static const duk_function_list_entry funcs[] = {
+    { "pause", req_request_pause_cb, 0 },
+    { "resume", req_request_resume_cb, 0 },
+    { NULL, NULL, 0 }
+  };
+
+  duk_push_object(ctx);
+  duk_put_function_list(ctx, -1, funcs);
+
+  for (unsigned int i = 0; i < ARRAY_SIZE(getters); i++) {
+    duk_push_string(ctx, getters[i].name);
+    duk_push_c_function(ctx, getters[i].getter, 0);
+    duk_def_prop(ctx, -3,
+        DUK_DEFPROP_HAVE_GETTER | DUK_DEFPROP_SET_CONFIGURABLE);
+  }
+
+  /* NOTE: Finalizer is inherited by the requests */
+  duk_push_c_function(ctx, req_finalize_cb, 1);
+  duk_set_finalizer(ctx, -2);
+
+  request_proto_ref = refs_put(ctx);
+}
+
+/* Pushes `request` object, it keeps the request alive */
+static void req_push_request(req_t* req, duk_context* ctx) {
+  duk_push_object(ctx);
+  refs_push(ctx, request_proto_ref);
+  duk_set_prototype(ctx, -2);
+
+  duk_push_pointer(ctx, req);
+  duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("req"));
+  req->refs++;
+}
+
+/* Pushes streamed response object, it keeps the request alive too */
+static void req_push_response(req_t* req, duk_context* ctx) {
+  duk_push_object(ctx);
+  refs_push(ctx, response_proto_ref);
+  duk_set_prototype(ctx, -2);
+
+  duk_push_pointer(ctx, req);
+  duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("req"));
+  req->refs++;
+}
+
+/* Creates per-request thread and puts the handler and headers on its stack */
+static void req_start_thread(req_t* req, int handler) {
+  duk_idx_t thread_idx = duk_push_thread(duk_ctx);
+  req->thread = duk_get_context(duk_ctx, thread_idx);
+  req->thread_ref = refs_put(duk_ctx);
+  req->refs++;
+
+  duk_context* ctx = req->thread;
+
+  refs_push(ctx, handler);
+  req_push_headers(req, ctx);
+}
+
+static uv_buf_t req_header_cb(void* arg, const char* name) {
+  return req_get_header(arg, name);
+}
+
+/* Evaluates conditional and range headers against the validators */
+static int req_evaluate_cond(req_t* req,
+                             const char* etag,
+                             time_t mtime,
+                             uint64_t size,
+                             uint64_t* start,
+                             uint64_t* end) {
+  http_cond_t cond;
+
+  cond.if_none_match = req_get_header(req, "if-none-match");
+  cond.if_modified_since = req_get_header(req, "if-modified-since");
+
+  /* NOTE: `Range` is defined only for GET */
+  if (req->head_only) {
+    cond.range = uv_buf_init(NULL, 0);
+  } else {
+    cond.range = req_get_header(req, "range");
+  }
+  cond.if_range = req_get_header(req, "if-range");
+
+  return http_cond_evaluate(&cond, etag, mtime, size, start, end);
+}
+
+static void req_release_thread(req_t* req) {
+  /* NOTE: The thread can't go away while we are executing it */
+  if (req->in_call || req->thread_ref == REFS_NONE) {
+    return;
+  }
+
+  refs_del(duk_ctx, req->thread_ref);
+  req->thread_ref = REFS_NONE;
+  req->thread = NULL;
+
+  /* The response, if any, is in the cache by now */
+  if (req->flight != NULL) {
+    response_cache_land(req->flight);
+    req->flight = NULL;
+  }
+
+  /* Uploaded files are removed once the handler is done */
+  if (req->upload != NULL) {
+    upload_close(req->upload);
+    req->upload = NULL;
+  }
+
+  req_unref(req);
+}
+
+/*
+ * Serializes the response head and the in-memory part of the body. Returns
+ * non-zero if there is a connection to write it to.
+ */
+static int req_serialize(req_t* req,
+                         const char* headers,
+                         uint64_t content_length,
+                         const char* body,
+                         size_t body_len) {
+  /* Connection is gone, nowhere to write to */
+  if (req->conn == NULL) {
+    return 0;
+  }
+
+  if (req->head_only) {
+    body_len = 0;
+  }
+
+  /* NOTE: `UINT64_MAX` stands for the length of a body that isn't there */
+  char length[64];
+  if (req->chunked && !req->identity) {
+    snprintf(length, sizeof(length), "Transfer-Encoding: chunked\r\n");
+  } else if (req->code == 101 || content_length == UINT64_MAX) {
+    length[0] = '\0';
+  } else {
+    snprintf(length, sizeof(length), "Content-Length: %llu\r\n",
+        (unsigned long long) content_length);
+  }
+
+  int response_len = snprintf(NULL, 0,
+      "HTTP/1.1 %d HTTP/1.1 WHATEVER\r\n"
+      "%s"
+      "%s"
+      "\r\n",
+      req->code,
+      length,
+      headers);
+
+  uv_write_t* write_req;
+  write_req = malloc(sizeof(*write_req) + response_len + body_len + 1);
+  CHECK(write_req != NULL);
+
+  char* response = ((char*) write_req) + sizeof(*write_req);
+
+  CHECK_EQ(response_len, snprintf(response, response_len + 1,
+      "HTTP/1.1 %d HTTP/1.1 WHATEVER\r\n"
+      "%s"
+      "%s"
+      "\r\n",
+      req->code,
+      length,
+      headers));
+
+  if (body_len != 0) {
+    memcpy(response + response_len, body, body_len);
+  }
+
+  req->response = write_req;
+  req->response_len = response_len + body_len;
+
+  return 1;
+}
+
+static void req_finish(req_t* req,
+                       const char* headers,
+                       uint64_t content_length,
+                       const char* body,
+                       size_t body_len) {
+  if (req_serialize(req, headers, content_length, body, body_len)) {
+    conn_flush(req->conn);
+  }
+}
+
+static void req_respond_error(req_t* req, int code, const char* body) {
+  if (req->responded) {
+    return;
+  }
+
+  req->responded = 1;
+  req->code = code;
+  req_finish(req, "", strlen(body), body, strlen(body));
+}
+
+/*
+ * Serializes the head of a response with known validators. The body, if any,
+ * is set up by the caller.
+ */
+static void req_finish_cond(req_t* req,
+                            int code,
+                            const char* etag,
+                            time_t mtime,
+                            uint64_t size,
+                            const char* content_type,
+                            uint64_t start,
+                            uint64_t end) {
+  char last_modified[64];
+  char headers[512];
+
+  http_date(last_modified, sizeof(last_modified), mtime);
+
+  req->code = code;
+
+  if (code == 304) {
+    /* NOTE: Content-Length is the one that `200` would have */
+    snprintf(headers, sizeof(headers),
+        "ETag: %s\r\n"
+        "Last-Modified: %s\r\n",
+        etag,
+        last_modified);
+    req_finish(req, headers, size, NULL, 0);
+    return;
+  }
+
+  if (code == 416) {
+    snprintf(headers, sizeof(headers),
+        "Content-Range: bytes */%llu\r\n",
+        (unsigned long long) size);
+    req_finish(req, headers, 0, NULL, 0);
+    return;
+  }
+
+  int len = snprintf(headers, sizeof(headers),
+      "Accept-Ranges: bytes\r\n"
+      "Content-Type: %s\r\n"
+      "ETag: %s\r\n"
+      "Last-Modified: %s\r\n",
+      content_type,
+      etag,
+      last_modified);
+  CHECK(len > 0 && (size_t) len < sizeof(headers));
+
+  if (code == 206) {
+    snprintf(headers + len, sizeof(headers) - len,
+        "Content-Range: bytes %llu-%llu/%llu\r\n",
+        (unsigned long long) start,
+        (unsigned long long) end,
+        (unsigned long long) size);
+    req_finish(req, headers, end - start + 1, NULL, 0);
+    return;
+  }
+
+  req_finish(req, headers, size, NULL, 0);
+}
+
+static void req_on_file(file_entry_t* entry, int status, void* arg) {
+  req_t* req = arg;
+
+  if (status != 0) {
+    if (status == UV_ENOENT || status == UV_ENOTDIR || status == UV_EISDIR) {
+      req->code = 404;
+      req_finish(req, "", 9, "Not Found", 9);
+    } else if (status == UV_EACCES || status == UV_EPERM) {
+      req->code = 403;
+      req_finish(req, "", 9, "Forbidden", 9);
+    } else {
+      req->code = 500;
+      req_finish(req, "", 21, "Internal Server Error", 21);
+    }
+    req_unref(req);
+    return;
+  }
+
+  if (req->conn == NULL) {
+    file_cache_release(entry);
+    req_unref(req);
+    return;
+  }
+
+  time_t mtime = (time_t) entry->mtime.tv_sec;
+  char etag[48];
+  uint64_t start = 0;
+  uint64_t end = 0;
+  int code = req->code;
+
+  http_etag(etag, sizeof(etag), entry->size, mtime);
+
+  /* NOTE: Custom status codes are sent as is */
+  if (code == 200) {
+    code = req_evaluate_cond(req, etag, mtime, entry->size, &start, &end);
+  }
+
+  req->file = entry;
+  req->file_offset = 0;
+  req->file_end = entry->size;
+
+  if (code == 206) {
+    req->file_offset = start;
+    req->file_end = end + 1;
+  } else if (code == 304 || code == 416) {
+    req->file = NULL;
+    file_cache_release(entry);
+  }
+
+  req_finish_cond(req, code, etag, mtime, entry->size,
+      mime_from_path(entry->path, entry->path_len), start, end);
+  req_unref(req);
+}
+
+/* Streams the file at `path` as the response body */
+static void req_respond_file(req_t* req, const char* path, size_t path_len) {
+  req->responded = 1;
+
+  req->refs++;
+  file_cache_get(path, path_len, req_on_file, req);
+}
+
+/* Responds with the cached asset, only `206` and `304` need formatting */
+static void req_respond_asset(req_t* req, const asset_t* asset) {
+  uint64_t start = 0;
+  uint64_t end = 0;
+  int code;
+
+  req->responded = 1;
+  req->asset = asset;
+
+  code = req_evaluate_cond(req, asset->etag, asset->mtime, asset->body.len,
+      &start, &end);
+  if (code != 200) {
+    if (code == 206) {
+      req->body = uv_buf_init(asset->body.base + start, end - start + 1);
+    }
+
+    req_finish_cond(req, code, asset->etag, asset->mtime, asset->body.len,
+        mime_from_path(asset->url, strlen(asset->url)), start, end);
+    return;
+  }
+
+  req->code = 200;
+  req->body = asset->body;
+
+  req->response = malloc(sizeof(*req->response));
+  CHECK(req->response != NULL);
+  req->response_len = 0;
+
+  conn_flush(req->conn);
+}
+
+/* Responds with memoized bytes of an earlier handler call */
+static void req_respond_cached(req_t* req, response_entry_t* entry) {
+  req->responded = 1;
+  req->code = 200;
+  req->cached = entry;
+
+  req->response = malloc(sizeof(cached_write_t));
+  CHECK(req->response != NULL);
+  req->response_len = 0;
+
+  conn_flush(req->conn);
+}
+
+/* Pushes lowercase copy of the header name at `idx` */
+static const char* req_push_vary_name(duk_context* ctx, duk_idx_t idx) {
+  duk_size_t len;
+  const char* name = duk_require_lstring(ctx, idx, &len);
+  char* lower = duk_push_fixed_buffer(ctx, len + 1);
+
+  for (duk_size_t i = 0; i < len; i++) {
+    char c = name[i];
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    lower[i] = c;
+  }
+  lower[len] = '\0';
+
+  return lower;
+}
+
+/*
+ * Reads `res.cache`, `{ ttl, vary }`. Returns TTL in milliseconds, the header
+ * names are pushed on the stack.
+ */
+static uint64_t req_read_cache(duk_context* ctx,
+                               duk_idx_t res_idx,
+                               const char** vary,
+                               unsigned int vary_size,
+                               unsigned int* vary_count) {
+  double ttl;
+
+  *vary_count = 0;
+
+  duk_get_prop_string(ctx, res_idx, "cache");
+  if (!duk_is_object(ctx, -1)) {
+    return 0;
+  }
+
+  duk_get_prop_string(ctx, -1, "ttl");
+  ttl = duk_get_number_default(ctx, -1, 0);
+  duk_pop(ctx);
+
+  if (!(ttl >= 1)) {
+    return 0;
+  }
+
+  duk_get_prop_string(ctx, -1, "vary");
+  duk_idx_t vary_idx = duk_get_top_index(ctx);
+
+  if (duk_is_string(ctx, vary_idx)) {
+    vary[(*vary_count)++] = req_push_vary_name(ctx, vary_idx);
+  } else if (duk_is_array(ctx, vary_idx)) {
+    duk_size_t len = duk_get_length(ctx, vary_idx);
+
+    if (len > vary_size) {
+      (void) duk_range_error(ctx, "Too many vary headers");
+    }
+
+    for (duk_size_t i = 0; i < len; i++) {
+      duk_get_prop_index(ctx, vary_idx, i);
+      vary[(*vary_count)++] = req_push_vary_name(ctx, -1);
+    }
+  } else if (!duk_is_undefined(ctx, vary_idx)) {
+    (void) duk_type_error(ctx, "Invalid cache.vary");
+  }
+
+  return (uint64_t) ttl;
+}
+
+/*
+ * Reads `{ code, body }` or `{ code, file }` from the top of the stack.
+ * Streamed responses and WebSockets push the object that `respond()` returns.
+ */
+static duk_ret_t req_respond_unsafe(duk_context* ctx, void* udata) {
+  req_t* req = udata;
+
+  duk_require_object(ctx, -1);
+  duk_idx_t res_idx = duk_get_top_index(ctx);
+
+  /* Get res.file */
+  duk_get_prop_string(ctx, -1, "file");
+  if (!duk_is_undefined(ctx, -1)) {
+    duk_size_t path_len;
+    const char* path = duk_require_lstring(ctx, -1, &path_len);
+
+    duk_get_prop_string(ctx, -2, "code");
+    req->code = duk_get_int_default(ctx, -1, 200);
+    duk_pop(ctx);
+
+    req_respond_file(req, path, path_len);
+
+    duk_pop(ctx);
+    return 0;
+  }
+  duk_pop(ctx);
+
+  /* Messages follow through the socket object */
+  duk_get_prop_string(ctx, -1, "websocket");
+  if (duk_to_boolean(ctx, -1)) {
+    char headers[128 + WS_ACCEPT_LEN];
+    char accept[WS_ACCEPT_LEN + 1];
+    uv_buf_t key = req_get_header(req, "sec-websocket-key");
+
+    if (!req->websocket) {
+      (void) duk_type_error(ctx, "Not a WebSocket handshake");
+    }
+
+    ws_accept_key(key.base, key.len, accept);
+    snprintf(headers, sizeof(headers),
+        "Upgrade: websocket\r\n"
+        "Connection: Upgrade\r\n"
+        "Sec-WebSocket-Accept: %s\r\n",
+        accept);
+
+    req->ws = ws_new(ctx, req->max_body_size);
+
+    req->responded = 1;
+    req->code = 101;
+    req_finish(req, headers, 0, NULL, 0);
+    return 1;
+  }
+  duk_pop(ctx);
+
+  /* Get res.code */
+  duk_get_prop_string(ctx, -1, "code");
+  duk_int_t code = duk_require_int(ctx, -1);
+  duk_pop(ctx);
+
+  /* Body follows through `res.write()` */
+  duk_get_prop_string(ctx, -1, "stream");
+  if (duk_to_boolean(ctx, -1)) {
+    req_push_response(req, ctx);
+    duk_dup_top(ctx);
+    req->res_ref = refs_put(ctx);
+
+    req->responded = 1;
+    req->chunked = 1;
+    req->code = code;
+    req_finish(req, "", 0, NULL, 0);
+    return 1;
+  }
+  duk_pop(ctx);
+
+  /* Events follow through `sse.broadcast()` */
+  duk_get_prop_string(ctx, -1, "sse");
+  if (!duk_is_undefined(ctx, -1)) {
+    duk_size_t channel_len;
+    const char* channel = duk_require_lstring(ctx, -1, &channel_len);
+
+    /* Subscribers are written to as HTTP/1.1 chunks */
+    if (req->conn != NULL && req->conn->h2 != NULL) {
+      (void) duk_type_error(ctx, "Event streams need HTTP/1.1");
+    }
+
+    req->sse_channel.base = malloc(channel_len + 1);
+    CHECK(req->sse_channel.base != NULL);
+    memcpy(req->sse_channel.base, channel, channel_len);
+    req->sse_channel.len = channel_len;
+
+    req->responded = 1;
+    req->chunked = 1;
+    req->chunked_end = req->head_only;
+    req->code = code;
+    req_finish(req,
+        "Content-Type: text/event-stream\r\n"
+        "Cache-Control: no-cache\r\n",
+        0,
+        NULL,
+        0);
+
+    duk_pop(ctx);
+    return 0;
+  }
+  duk_pop(ctx);
+
+  /* Get res.body, either a string or a buffer */
+  duk_get_prop_string(ctx, -1, "body");
+
+  duk_size_t body_len;
+  const char* body;
+  if (duk_is_buffer_data(ctx, -1)) {
+    body = duk_get_buffer_data(ctx, -1, &body_len);
+  } else {
+    body = duk_require_lstring(ctx, -1, &body_len);
+    CHECK(body != NULL);
+  }
+
+  /* Memoize only idempotent requests */
+  const char* vary[8];
+  unsigned int vary_count = 0;
+  uint64_t ttl = 0;
+  if (req->method == HTTP_GET || req->method == HTTP_HEAD) {
+    ttl = req_read_cache(ctx, res_idx, vary, ARRAY_SIZE(vary), &vary_count);
+  }
+
+  req->responded = 1;
+  req->code = code;
+  if (req_serialize(req, "", body_len, body, body_len)) {
+    if (ttl != 0) {
+      response_cache_put(llhttp_method_name(req->method),
+          req->url.base, req->url.len,
+          vary, vary_count,
+          req_header_cb, req,
+          ((char*) req->response) + sizeof(*req->response), req->response_len,
+          ttl);
+    }
+    conn_flush(req->conn);
+  }
+
+  duk_set_top(ctx, res_idx + 1);
+
+  return 0;
+}
+
+static void req_log_error(duk_context* ctx, const char* message) {
+  fprintf(stderr, "%s: %s\n", message, duk_safe_to_string(ctx, -1));
+}
+
+/*
+ * Answers `500` to a response that the handler returned instead of passing
+ * to `respond()`, if it is streamed or a WebSocket. Both are used through
+ * the object that `respond()` returns, nothing could use them otherwise.
+ */
+static int req_reject_returned_writer(req_t* req, duk_context* ctx) {
+  static const char* const props[] = { "stream", "websocket" };
+
+  if (!duk_is_object(ctx, -1)) {
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < ARRAY_SIZE(props); i++) {
+    duk_get_prop_string(ctx, -1, props[i]);
+    int set = duk_to_boolean(ctx, -1);
+    duk_pop(ctx);
+
+    if (set) {
+      fprintf(stderr, "Responses with `%s` must be passed to respond()\n",
+          props[i]);
+      req_respond_error(req, 500, "Internal Server Error");
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/*
+ * `respond(res)` (magic 0), `reject(err)` (magic 1), and `resolve(res)`
+ * (magic 2) for thenables
+ */
+static duk_ret_t req_respond_cb(duk_context* ctx) {
+  duk_push_current_function(ctx);
+  duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("req"));
+  req_t* req = duk_get_pointer(ctx, -1);
+  int magic = duk_get_current_magic(ctx);
+  duk_pop_2(ctx);
+
+  /* Already finalized or responded */
+  if (req == NULL || req->responded) {
+    return 0;
+  }
+
+  duk_ret_t ret = 0;
+  if (magic == 1) {
+    duk_dup(ctx, 0);
+    req_log_error(ctx, "Handler rejected");
+    duk_pop(ctx);
+    req_respond_error(req, 500, "Internal Server Error");
+  } else if (magic == 0 || !req_reject_returned_writer(req, ctx)) {
+    duk_dup(ctx, 0);
+    if (duk_safe_call(ctx, req_respond_unsafe, req, 1, 1) == DUK_EXEC_SUCCESS) {
+      ret = 1;
+    } else {
+      req_log_error(ctx, "Invalid response");
+      duk_pop(ctx);
+      req_respond_error(req, 500, "Internal Server Error");
+    }
+  }
+
+  /* The handler has returned already, the coroutine is not needed */
+  req_release_thread(req);
+
+  /* Streamed response or WebSocket object is on the top */
+  return ret;
+}
+
+static void req_push_respond(req_t* req, duk_context* ctx, int magic) {
+  duk_push_c_function(ctx, req_respond_cb, 1);
+  duk_set_magic(ctx, -1, magic);
+
+  duk_push_pointer(ctx, req);
+  duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("req"));
+
+  duk_push_c_function(ctx, req_finalize_cb, 1);
+  duk_set_finalizer(ctx, -2);
+
+  req->refs++;
+}
+
+/* Handles the handler's return value on the top of the thread's stack */
+static void req_on_result(req_t* req) {
+  duk_context* ctx = req->thread;
+
+  /* Handler is going to call `respond()` later */
+  if (req->responded || duk_is_undefined(ctx, -1)) {
+    return;
+  }
+
+  if (!duk_is_object(ctx, -1)) {
+    fprintf(stderr, "Handler returned non-object\n");
+    req_respond_error(req, 500, "Internal Server Error");
+    return;
+  }
+
+  /* Thenable, `res.then(resolve, reject)` */
+  duk_get_prop_string(ctx, -1, "then");
+  if (duk_is_callable(ctx, -1)) {
+    duk_dup(ctx, -2);
+    req_push_respond(req, ctx, 2);
+    req_push_respond(req, ctx, 1);
+
+    if (duk_pcall_method(ctx, 2) != DUK_EXEC_SUCCESS) {
+      req_log_error(ctx, "Thenable error");
+      req_respond_error(req, 500, "Internal Server Error");
+    }
+    duk_pop(ctx);
+    return;
+  }
+  duk_pop(ctx);
+
+  if (req_reject_returned_writer(req, ctx)) {
+    return;
+  }
+
+  duk_dup_top(ctx);
+  if (duk_safe_call(ctx, req_respond_unsafe, req, 1, 1) != DUK_EXEC_SUCCESS) {
+    req_log_error(ctx, "Invalid response");
+    req_respond_error(req, 500, "Internal Server Error");
+  }
+  duk_pop(ctx);
+}
+
+/* Callbacks */
+
+static void conn_maybe_free(conn_t* conn) {
+  /* NOTE: The threadpool might still be using the file or the socket */
+  if (!conn->closed || conn->file_active) {
+    return;
+  }
+
+#ifndef _WIN32
+  if (conn->out_poll_active) {
+    return;
+  }
+
+  if (conn->out_fd != -1) {
+    close(conn->out_fd);
+    conn->out_fd = -1;
+  }
+#endif  /* !_WIN32 */
+
+  free(conn);
+}
+
+static void conn_file_abort(conn_t* conn) {
+  req_t* req = conn->file_req;
+
+  if (req == NULL) {
+    return;
+  }
+
+  conn->file_req = NULL;
+
+  file_cache_release(req->file);
+  req->file = NULL;
+
+  req->conn = NULL;
+  req_release_thread(req);
+  req_unref(req);
+}
+
+static void conn_on_close(uv_handle_t* handle) {
+  conn_t* conn = handle->data;
+
+  handle->data = NULL;
+
+  free(conn->url.base);
+  conn->url = uv_buf_init(NULL, 0);
+  free(conn->header_raw.base);
+  conn->header_raw = uv_buf_init(NULL, 0);
+  if (conn->header_name_id == -1) {
+    free(conn->header_field.base);
+  }
+  conn->header_field = uv_buf_init(NULL, 0);
+  free(conn->header_value.base);
+  conn->header_value = uv_buf_init(NULL, 0);
+
+  /* Closes the streams, their requests leave the queue */
+  if (conn->h2 != NULL) {
+    h2_destroy(conn->h2);
+    conn->h2 = NULL;
+  }
+
+  if (conn->req != NULL && conn->req->streaming) {
+    req_stream_end(conn->req, "Connection closed");
+  }
+
+  conn_stream_abort(conn, "Connection closed");
+
+  if (conn->ws != NULL) {
+    ws_destroy(conn->ws);
+    conn->ws = NULL;
+  }
+
+  /* Detach pending requests, they'll be freed once JS lets them go */
+  while (conn->queue_head != NULL) {
+    req_t* req = conn->queue_head;
+    conn->queue_head = req->next;
+
+    req->conn = NULL;
+    req->next = NULL;
+    if (req->ws != NULL) {
+      ws_destroy(req->ws);
+      req->ws = NULL;
+    }
+    req_response_close(req, "Connection closed");
+    req_release_thread(req);
+    req_unref(req);
+  }
+  conn->queue_tail = NULL;
+  conn->req = NULL;
+
+  if (!conn->file_active) {
+    conn_file_abort(conn);
+  }
+
+  conn->closed = 1;
+  conn_maybe_free(conn);
+}
+
+#ifndef _WIN32
+static void conn_on_out_poll_close(uv_handle_t* handle) {
+  conn_t* conn = handle->data;
+
+  conn->out_poll_active = 0;
+  conn_maybe_free(conn);
+}
+#endif  /* !_WIN32 */
+
+static void conn_close(conn_t* conn) {
+  if (uv_is_closing((uv_handle_t*) &conn->tcp_client)) {
+    return;
+  }
+
+  /* NOTE: Broadcasts must not write to the closing socket */
+  sse_unsubscribe(&conn->sse);
+
+  uv_close((uv_handle_t*) &conn->tcp_client, conn_on_close);
+
+#ifndef _WIN32
+  if (conn->out_poll_active) {
+    uv_close((uv_handle_t*) &conn->out_poll, conn_on_out_poll_close);
+  }
+#endif  /* !_WIN32 */
+}
+
+static void worker_on_fatal_error(void* udata, const char* message) {
+  (void) udata;
+
+  fprintf(stderr, "Runtime error: %s\n", message);
+  abort();
+}
+
+static void conn_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf) {
+  (void) size;
+
+  conn_t* conn = handle->data;
+
+  if (conn->h2 != NULL) {
+    buf->base = h2_read_buf;
+    buf->len = sizeof(h2_read_buf);
+    return;
+  }
+
+  buf->base = conn->read_buf;
+  buf->len = sizeof(conn->read_buf);
+}
+
+/* Returns non-zero if the parser stopped before the end of `data` */
+static int conn_execute(conn_t* conn, const char* data, size_t len) {
+  llhttp_errno_t err;
+
+  for (;;) {
+    conn->in_execute = 1;
+    err = llhttp_execute(&conn->http, data, len);
+    conn->in_execute = 0;
+
+    if (err != HPE_PAUSED_UPGRADE || conn->websocket) {
+      break;
+    }
+
+    /* Upgrades to other protocols are ignored, the next request follows */
+    const char* pos = llhttp_get_error_pos(&conn->http);
+    llhttp_resume_after_upgrade(&conn->http);
+    len = (data + len) - pos;
+    data = pos;
+  }
+
+  if (err == HPE_OK) {
+    return 0;
+  }
+
+  /*
+   * Either the body was rejected, or JS paused it. In the latter case the
+   * rest of the data is parsed on `resume()`. After a WebSocket handshake it
+   * is the first frames, kept until the handler accepts the socket.
+   */
+  if (err == HPE_PAUSED || err == HPE_PAUSED_UPGRADE) {
+    const char* pos = llhttp_get_error_pos(&conn->http);
+
+    conn->pending = uv_buf_init((char*) pos, (data + len) - pos);
+    CHECK_EQ(0, uv_read_stop((uv_stream_t*) &conn->tcp_client));
+    return -1;
+  }
+
+  fprintf(stderr, "parsing error: %s at pos: %d\n",
+      llhttp_get_error_reason(&conn->http),
+      (int) (llhttp_get_error_pos(&conn->http) - data));
+
+  conn_close(conn);
+  return -1;
+}
+
+static void conn_on_h2_fail(void* arg) {
+  conn_close(arg);
+}
+
+/*
+ * Hands connections that start with HTTP/2 preface over to the frame layer.
+ * Returns non-zero if the data was consumed.
+ */
+static int conn_sniff(conn_t* conn, const char* data, size_t len) {
+  size_t n = H2_PREFACE_LEN - conn->preface_len;
+  if (n > len) {
+    n = len;
+  }
+
+  /* HTTP/1.1 request, the part that matched is parsed first */
+  if (memcmp(data, H2_PREFACE + conn->preface_len, n) != 0) {
+    conn->sniffed = 1;
+    return conn->preface_len != 0 &&
+           conn_execute(conn, H2_PREFACE, conn->preface_len) != 0;
+  }
+
+  conn->preface_len += n;
+  if (conn->preface_len != H2_PREFACE_LEN) {
+    return 1;
+  }
+
+  conn->sniffed = 1;
+  conn->h2 = h2_new((uv_stream_t*) &conn->tcp_client, &h2_callbacks, conn);
+  h2_execute(conn->h2, data + n, len - n);
+  return 1;
+}
+
+static void conn_read_cb(uv_stream_t* stream, ssize_t nread,
+                         const uv_buf_t* buf) {
+  conn_t* conn = stream->data;
+
+  if (nread < 0) {
+    conn_close(conn);
+    return;
+  }
+
+  if (conn->ws != NULL) {
+    ws_execute(conn->ws, buf->base, nread);
+    return;
+  }
+
+  if (conn->h2 != NULL) {
+    h2_execute(conn->h2, buf->base, nread);
+    return;
+  }
+
+  if (!conn->sniffed && conn_sniff(conn, buf->base, nread)) {
+    return;
+  }
+
+  conn_execute(conn, buf->base, nread);
+}
+
+static void conn_on_ws_end(void* arg) {
+  conn_close(arg);
+}
+
+/*
+ * Hands the connection over to the socket once the `101` response is written.
+ * By then the parser has stopped at the end of the handshake, and the handler
+ * has set the callbacks for the frames that came with it.
+ */
+static void conn_upgrade(conn_t* conn) {
+  uv_buf_t pending = conn->pending;
+
+  if (uv_is_closing((uv_handle_t*) &conn->tcp_client)) {
+    return;
+  }
+  CHECK(conn->ws != NULL);
+  CHECK_EQ(HPE_PAUSED_UPGRADE, llhttp_get_errno(&conn->http));
+
+  /* NOTE: `read_buf` wasn't touched since the pause */
+  conn->pending = uv_buf_init(NULL, 0);
+  ws_start(conn->ws, (uv_stream_t*) &conn->tcp_client, conn_on_ws_end, conn,
+      pending.base, pending.len);
+
+  if (uv_is_closing((uv_handle_t*) &conn->tcp_client)) {
+    return;
+  }
+
+  CHECK_EQ(0, uv_read_start(
+        (uv_stream_t*) &conn->tcp_client,
+        conn_alloc_cb,
+        conn_read_cb));
+}
+
+static void conn_resume(conn_t* conn) {
+  uv_buf_t pending = conn->pending;
+
+  if (uv_is_closing((uv_handle_t*) &conn->tcp_client)) {
+    return;
+  }
+
+  conn->pending = uv_buf_init(NULL, 0);
+
+  /*
+   * NOTE: `read_buf` wasn't touched since the pause. The parser has to run
+   * even if nothing is left in it, to complete the message.
+   */
+  if (llhttp_get_errno(&conn->http) == HPE_PAUSED) {
+    llhttp_resume(&conn->http);
+    if (conn_execute(conn, pending.base, pending.len) != 0) {
+      return;
+    }
+  }
+
+  CHECK_EQ(0, uv_read_start(
+        (uv_stream_t*) &conn->tcp_client,
+        conn_alloc_cb,
+        conn_read_cb));
+}
+
+static void conn_write_cb(uv_write_t* req, int status) {
+  conn_t* conn = req->data;
+  req->data = NULL;
+
+  free(req);
+
+  /* Error */
+  if (status != 0) {
+    /* TODO(indutny): I forgot if we should ignore this. I think we should? */
+    if (status == UV_EPIPE || status == UV_ECANCELED) {
+      return;
+    }
+
+    conn_close(conn);
+    return;
+  }
+}
+
+static void conn_send_file(conn_t* conn);
+
+static void conn_file_done(conn_t* conn) {
+  conn_file_abort(conn);
+  conn_flush(conn);
+}
+
+/* Returns non-zero if the connection went away during the file operation */
+static int conn_file_op_complete(conn_t* conn) {
+  conn->file_active = 0;
+
+  if (!uv_is_closing((uv_handle_t*) &conn->tcp_client)) {
+    return 0;
+  }
+
+  /* `conn_on_close` already ran and left the cleanup to us */
+  if (conn->closed) {
+    conn_file_abort(conn);
+    conn_maybe_free(conn);
+  }
+  return 1;
+}
+
+#ifdef _WIN32
+
+/* No `sendfile()` for sockets, read the file in chunks and write them */
+
+static void conn_on_file_chunk_write(uv_write_t* write_req, int status) {
+  conn_t* conn = write_req->data;
+
+  free(write_req);
+
+  if (status != 0) {
+    conn_close(conn);
+    return;
+  }
+
+  conn_send_file(conn);
+}
+
+static void conn_on_file_read(uv_fs_t* fs_req) {
+  conn_t* conn = fs_req->data;
+  ssize_t nread = fs_req->result;
+  uv_write_t* write_req = conn->file_chunk;
+
+  uv_fs_req_cleanup(fs_req);
+  conn->file_chunk = NULL;
+
+  if (conn_file_op_complete(conn)) {
+    free(write_req);
+    return;
+  }
+
+  /* NOTE: Zero means that the file was truncated */
+  if (nread <= 0) {
+    free(write_req);
+    conn_close(conn);
+    return;
+  }
+
+  conn->file_sent += nread;
+
+  write_req->data = conn;
+  uv_buf_t buf = uv_buf_init(((char*) write_req) + sizeof(*write_req), nread);
+  CHECK_EQ(0, uv_write(write_req, (uv_stream_t*) &conn->tcp_client, &buf, 1,
+        conn_on_file_chunk_write));
+}
+
+static void conn_send_file(conn_t* conn) {
+  req_t* req = conn->file_req;
+  file_entry_t* file = req->file;
+  uint64_t remaining = req->file_end - conn->file_sent;
+
+  if (remaining == 0) {
+    conn_file_done(conn);
+    return;
+  }
+
+  size_t len = remaining < FILE_SEND_CHUNK_LEN ?
+      (size_t) remaining : FILE_SEND_CHUNK_LEN;
+
+  conn->file_chunk = malloc(sizeof(*conn->file_chunk) + len);
+  CHECK(conn->file_chunk != NULL);
+
+  uv_buf_t buf = uv_buf_init(
+      ((char*) conn->file_chunk) + sizeof(*conn->file_chunk), len);
+
+  conn->file_active = 1;
+  conn->file_fs_req.data = conn;
+  CHECK_EQ(0, uv_fs_read(&loop, &conn->file_fs_req, file->fd, &buf, 1,
+        conn->file_sent, conn_on_file_read));
+}
+
+#else  /* !_WIN32 */
+
+static void conn_on_writable(uv_poll_t* handle, int status, int events) {
+  conn_t* conn = handle->data;
+
+  (void) events;
+
+  CHECK_EQ(0, uv_poll_stop(handle));
+
+  if (status != 0) {
+    conn_close(conn);
+    return;
+  }
+
+  conn_send_file(conn);
+}
+
+static void conn_on_sendfile(uv_fs_t* fs_req) {
+  conn_t* conn = fs_req->data;
+  ssize_t nsent = fs_req->result;
+
+  uv_fs_req_cleanup(fs_req);
+
+  if (conn_file_op_complete(conn)) {
+    return;
+  }
+
+  /* Socket buffer is full, wait for it to drain */
+  if (nsent == UV_EAGAIN) {
+    CHECK_EQ(0, uv_poll_start(&conn->out_poll, UV_WRITABLE, conn_on_writable));
+    return;
+  }
+
+  /* NOTE: Zero means that the file was truncated */
+  if (nsent <= 0) {
+    conn_close(conn);
+    return;
+  }
+
+  conn->file_sent += nsent;
+  conn_send_file(conn);
+}
+
+static void conn_send_file(conn_t* conn) {
+  req_t* req = conn->file_req;
+  file_entry_t* file = req->file;
+  uint64_t remaining = req->file_end - conn->file_sent;
+
+  if (remaining == 0) {
+    conn_file_done(conn);
+    return;
+  }
+
+  /*
+   * `sendfile()` runs on the threadpool, so it gets its own descriptor that
+   * can't be closed and reused under its feet. The same descriptor is polled
+   * for writability when the socket buffer is full.
+   */
+  if (conn->out_fd == -1) {
+    uv_os_fd_t fd;
+
+    CHECK_EQ(0, uv_fileno((uv_handle_t*) &conn->tcp_client, &fd));
+    conn->out_fd = dup(fd);
+    if (conn->out_fd == -1) {
+      conn_close(conn);
+      return;
+    }
+
+    CHECK_EQ(0, uv_poll_init(&loop, &conn->out_poll, conn->out_fd));
+    conn->out_poll.data = conn;
+    conn->out_poll_active = 1;
+  }
+
+  conn->file_active = 1;
+  conn->file_fs_req.data = conn;
+  CHECK_EQ(0, uv_fs_sendfile(&loop, &conn->file_fs_req, conn->out_fd,
+        file->fd, conn->file_sent, remaining, conn_on_sendfile));
+}
+
+#endif  /* _WIN32 */
+
+static void conn_on_file_head_write(uv_write_t* write_req, int status) {
+  conn_t* conn = write_req->data;
+
+  free(write_req);
+
+  if (status != 0) {
+    conn_close(conn);
+    return;
+  }
+
+  conn_send_file(conn);
+}
+
+static void conn_on_last_write(uv_write_t* write_req, int status) {
+  conn_t* conn = write_req->data;
+
+  conn_write_cb(write_req, status);
+  conn_close(conn);
+}
+
+static void conn_on_upgrade_write(uv_write_t* write_req, int status) {
+  conn_t* conn = write_req->data;
+
+  conn_write_cb(write_req, status);
+  conn_upgrade(conn);
+}
+
+static void conn_on_cached_write(uv_write_t* write_req, int status) {
+  cached_write_t* cached_write = (cached_write_t*) write_req;
+
+  response_cache_release(cached_write->entry);
+  conn_write_cb(write_req, status);
+}
+
+/*
+ * Streamed responses. Every `res.write()` becomes a chunk that is written to
+ * the socket right away, unless earlier responses of the connection are
+ * still pending. `write()` returns `false` once the socket's write queue
+ * grows over the limit, and `res.onDrain` is called when it gets below.
+ */
+
+/* Socket takes more of the response, proxied ones read from upstream again */
+static void req_on_response_drain(req_t* req) {
+  req->drain = 0;
+
+  if (req->proxy != NULL) {
+    proxy_resume(req->proxy);
+    req_proxy_splice(req);
+  } else if (req->res_ref != REFS_NONE) {
+    req_emit(req->res_ref, "onDrain", 0);
+  }
+}
+
+static void conn_on_chunk_write(uv_write_t* write_req, int status) {
+  conn_t* conn = write_req->data;
+
+  conn_write_cb(write_req, status);
+
+  req_t* req = conn->stream_req;
+  if (req == NULL || !req->drain ||
+      uv_is_closing((uv_handle_t*) &conn->tcp_client) ||
+      uv_stream_get_write_queue_size((uv_stream_t*) &conn->tcp_client) >=
+          RESPONSE_HIGH_WATERMARK) {
+    return;
+  }
+
+  req_on_response_drain(req);
+}
+
+/*
+ * Writes `data` as a chunk, followed by the last chunk if `last` is set.
+ * `NULL` data stands for the chunks in `unsent`. Bodies of known length are
+ * written without the framing.
+ */
+static void req_write_chunk(req_t* req,
+                            const char* data,
+                            size_t len,
+                            int last) {
+  static const char last_chunk[] = "0\r\n\r\n";
+  conn_t* conn = req->conn;
+  char size[32];
+  int size_len = 0;
+
+  if (req->head_only || (len == 0 && !last)) {
+    return;
+  }
+
+  int framed = !req->identity;
+
+  if (len != 0 && framed) {
+    size_len = snprintf(size, sizeof(size), "%llx\r\n",
+        (unsigned long long) len);
+  }
+
+  /* NOTE: Unframed end is still written, the connection may close after it */
+  size_t frame_len = size_len + len + (len != 0 && framed ? 2 : 0) +
+      (last && framed ? sizeof(last_chunk) - 1 : 0);
+
+  uv_write_t* write_req = malloc(sizeof(*write_req) + frame_len);
+  CHECK(write_req != NULL);
+
+  char* frame = ((char*) write_req) + sizeof(*write_req);
+  char* p = frame;
+
+  if (len != 0) {
+    memcpy(p, size, size_len);
+    p += size_len;
+    if (data == NULL) {
+      body_copy(&req->unsent, p);
+    } else {
+      memcpy(p, data, len);
+    }
+    p += len;
+    if (framed) {
+      memcpy(p, "\r\n", 2);
+      p += 2;
+    }
+  }
+  if (last && framed) {
+    memcpy(p, last_chunk, sizeof(last_chunk) - 1);
+  }
+
+  write_req->data = conn;
+  uv_buf_t buf = uv_buf_init(frame, frame_len);
+  CHECK_EQ(0, uv_write(write_req, (uv_stream_t*) &conn->tcp_client, &buf, 1,
+        last && req->close ? conn_on_last_write : conn_on_chunk_write));
+}
+
+/* Stops streaming the response, emits `onError` if `error` is set */
+static void conn_stream_abort(conn_t* conn, const char* error) {
+  req_t* req = conn->stream_req;
+
+  if (req == NULL) {
+    return;
+  }
+
+  conn->stream_req = NULL;
+  req_response_close(req, error);
+
+  req->conn = NULL;
+  req_release_thread(req);
+  req_unref(req);
+}
+
+/*
+ * HTTP/2 responses. Streams don't wait for each other, so every response
+ * starts as soon as it is serialized. The head is parsed back into the status
+ * and the headers, and all of the body goes through the stream's buffer,
+ * files included.
+ */
+
+static void conn_unlink(conn_t* conn, req_t* req) {
+  req_t* prev = NULL;
+
+  for (req_t* cur = conn->queue_head; cur != req; cur = cur->next) {
+    CHECK(cur != NULL);
+    prev = cur;
+  }
+
+  if (prev == NULL) {
+    conn->queue_head = req->next;
+  } else {
+    prev->next = req->next;
+  }
+  if (conn->queue_tail == req) {
+    conn->queue_tail = prev;
+  }
+  req->next = NULL;
+}
+
+static void req_h2_send_file(req_t* req);
+
+static void req_h2_on_file_read(uv_fs_t* fs_req) {
+  req_t* req = fs_req->data;
+  ssize_t nread = fs_req->result;
+  const char* data = ((const char*) fs_req) + sizeof(*fs_req);
+
+  uv_fs_req_cleanup(fs_req);
+  req->h2_reading = 0;
+
+  if (req->h2 == NULL) {
+    /* Stream is gone, and left the file to us */
+    file_cache_release(req->file);
+    req->file = NULL;
+  } else if (nread <= 0) {
+    /* NOTE: Zero means that the file was truncated */
+    h2_stream_fail(req->h2);
+  } else {
+    req->file_offset += nread;
+
+    int last = req->file_offset == req->file_end;
+    if (h2_send(req->h2, data, nread, last) || last) {
+      req_h2_send_file(req);
+    }
+  }
+
+  free(fs_req);
+  req_unref(req);
+}
+
+/* Reads the next chunk of the file body, the read keeps a reference */
+static void req_h2_send_file(req_t* req) {
+  uint64_t remaining = req->file_end - req->file_offset;
+
+  if (remaining == 0) {
+    file_cache_release(req->file);
+    req->file = NULL;
+    return;
+  }
+
+  size_t len = remaining < FILE_SEND_CHUNK_LEN ?
+      (size_t) remaining : FILE_SEND_CHUNK_LEN;
+
+  uv_fs_t* fs_req = malloc(sizeof(*fs_req) + len);
+  CHECK(fs_req != NULL);
+
+  uv_buf_t buf = uv_buf_init(((char*) fs_req) + sizeof(*fs_req), len);
+
+  req->h2_reading = 1;
+  req->refs++;
+  fs_req->data = req;
+  CHECK_EQ(0, uv_fs_read(&loop, fs_req, req->file->fd, &buf, 1,
+        req->file_offset, req_h2_on_file_read));
+}
+
+/* Starts the response on the stream, which keeps the request from now on */
+static void req_h2_respond(req_t* req) {
+  /* Framing is up to HTTP/2 */
+  static const char* const skip[] = {
+    "connection", "keep-alive", "transfer-encoding"
+  };
+  uv_buf_t data;
+
+  if (req->cached != NULL) {
+    data = req->cached->data;
+  } else if (req->asset != NULL && req->response_len == 0) {
+    data = req->asset->head;
+  } else {
+    data = uv_buf_init(((char*) req->response) + sizeof(*req->response),
+        req->response_len);
+  }
+
+  /* Head is followed by the in-memory body, if any */
+  size_t head_len = 0;
+  unsigned int line_count = 0;
+  for (size_t i = 0; i + 1 < data.len; i++) {
+    if (data.base[i] != '\r' || data.base[i + 1] != '\n') {
+      continue;
+    }
+
+    line_count++;
+    if (i + 3 < data.len && data.base[i + 2] == '\r' &&
+        data.base[i + 3] == '\n') {
+      head_len = i + 4;
+      break;
+    }
+  }
+  CHECK(head_len != 0);
+
+  /* NOTE: Names are lowercased in place */
+  char* head = malloc(head_len + 1);
+  CHECK(head != NULL);
+  memcpy(head, data.base, head_len);
+  head[head_len] = '\0';
+
+  h2_header_t* headers = malloc(line_count * sizeof(*headers));
+  CHECK(headers != NULL);
+
+  char* line = memchr(head, ' ', head_len);
+  CHECK(line != NULL);
+  int code = atoi(line + 1);
+
+  unsigned int header_count = 0;
+  line = strstr(head, "\r\n") + 2;
+  while (line < head + head_len - 2) {
+    char* end = strstr(line, "\r\n");
+    char* colon = memchr(line, ':', end - line);
+    CHECK(colon != NULL);
+
+    for (char* p = line; p < colon; p++) {
+      if (*p >= 'A' && *p <= 'Z') {
+        *p += 'a' - 'A';
+      }
+    }
+
+    char* value = colon + 1;
+    while (value < end && *value == ' ') {
+      value++;
+    }
+
+    h2_header_t* header = &headers[header_count];
+    header->name = line;
+    header->name_len = colon - line;
+    header->value = value;
+    header->value_len = end - value;
+    line = end + 2;
+
+    int skipped = 0;
+    for (unsigned int i = 0; i < ARRAY_SIZE(skip); i++) {
+      skipped |= strlen(skip[i]) == header->name_len &&
+                 memcmp(skip[i], header->name, header->name_len) == 0;
+    }
+    if (!skipped) {
+      header_count++;
+    }
+  }
+
+  const char* rest = data.base + head_len;
+  size_t rest_len = data.len - head_len;
+  int more = !req->head_only &&
+      (req->body.len != 0 || req->file != NULL || req->chunked);
+
+  if (req->head_only) {
+    rest_len = 0;
+  }
+
+  h2_respond(req->h2, code, headers, header_count, rest, rest_len, !more);
+  free(headers);
+  free(head);
+
+  if (req->body.len != 0 && !req->head_only) {
+    h2_send(req->h2, req->body.base, req->body.len,
+        req->file == NULL && !req->chunked);
+  }
+
+  free(req->response);
+  req->response = NULL;
+  if (req->cached != NULL) {
+    response_cache_release(req->cached);
+    req->cached = NULL;
+  }
+
+  req->h2_sending = 1;
+
+  if (req->file != NULL) {
+    if (req->head_only) {
+      file_cache_release(req->file);
+      req->file = NULL;
+    } else {
+      req_h2_send_file(req);
+    }
+  }
+
+  /* Chunks written so far go right after the head */
+  if (req->chunked && !req->head_only) {
+    for (body_chunk_t* c = req->unsent.head; c != NULL; c = c->next) {
+      h2_send(req->h2, c->data, c->len, 0);
+    }
+    h2_send(req->h2, NULL, 0, req->chunked_end);
+  }
+  body_reset(&req->unsent);
+
+  if (req->chunked_end) {
+    req_response_close(req, NULL);
+  }
+}
+
+/* Streamed response of HTTP/2 request, see `req_write_response()` */
+static int req_h2_write(req_t* req, const char* data, size_t len, int last) {
+  int ok;
+
+  if (!req->h2_sending) {
+    body_append(&req->unsent, data, len);
+    req->drain = req->unsent.len >= RESPONSE_HIGH_WATERMARK;
+    return !req->drain;
+  }
+
+  /* Stream is gone, or the headers have ended it already */
+  if (req->h2 == NULL || req->head_only) {
+    ok = req->h2 != NULL;
+  } else {
+    req->drain = !h2_send(req->h2, data, len, last);
+    ok = !req->drain;
+  }
+
+  if (last) {
+    req_response_close(req, NULL);
+  }
+  return ok;
+}
+
+static void conn_h2_flush(conn_t* conn) {
+  req_t* next;
+
+  for (req_t* req = conn->queue_head; req != NULL; req = next) {
+    next = req->next;
+    if (req->response == NULL) {
+      continue;
+    }
+
+    conn_unlink(conn, req);
+    req_h2_respond(req);
+  }
+}
+
+/*
+ * Returns non-zero if the socket accepts more data. Chunks are buffered
+ * until the response gets to the head of the queue.
+ */
+static int req_write_response(req_t* req,
+                              const char* data,
+                              size_t len,
+                              int last) {
+  conn_t* conn = req->conn;
+
+  if (last) {
+    req->chunked_end = 1;
+  }
+
+  if (conn == NULL) {
+    return 0;
+  }
+
+  if (conn->h2 != NULL) {
+    return req_h2_write(req, data, len, last);
+  }
+
+  if (conn->stream_req != req) {
+    body_append(&req->unsent, data, len);
+    req->drain = req->unsent.len >= RESPONSE_HIGH_WATERMARK;
+    return !req->drain;
+  }
+
+  req_write_chunk(req, data, len, last);
+  if (last) {
+    conn_stream_abort(conn, NULL);
+    conn_flush(conn);
+    return 1;
+  }
+
+  req->drain = uv_stream_get_write_queue_size(
+      (uv_stream_t*) &conn->tcp_client) >= RESPONSE_HIGH_WATERMARK;
+  return !req->drain;
+}
+
+static void conn_flush(conn_t* conn) {
+  if (uv_is_closing((uv_handle_t*) &conn->tcp_client)) {
+    return;
+  }
+
+  if (conn->h2 != NULL) {
+    conn_h2_flush(conn);
+    return;
+  }
+
+  while (conn->file_req == NULL &&
+         conn->stream_req == NULL &&
+         conn->queue_head != NULL &&
+         conn->queue_head->response != NULL) {
+    req_t* req = conn->queue_head;
+
+    conn->queue_head = req->next;
+    if (conn->queue_head == NULL) {
+      conn->queue_tail = NULL;
+    }
+    req->next = NULL;
+
+    uv_write_t* write_req = req->response;
+    req->response = NULL;
+    write_req->data = conn;
+
+    /* File body is sent once the headers are written */
+    uv_write_cb write_cb = conn_write_cb;
+    if (req->file != NULL && !req->head_only) {
+      conn->file_req = req;
+      conn->file_sent = req->file_offset;
+      write_cb = conn_on_file_head_write;
+    }
+
+    uv_buf_t bufs[2];
+    unsigned int nbufs = 1;
+
+    if (req->cached != NULL) {
+      cached_write_t* cached_write = (cached_write_t*) write_req;
+
+      /* Entry might get evicted before the write completes */
+      cached_write->entry = req->cached;
+      req->cached = NULL;
+
+      bufs[0] = cached_write->entry->data;
+      write_cb = conn_on_cached_write;
+    } else if (req->asset != NULL && req->response_len == 0) {
+      bufs[0] = req->asset->head;
+    } else {
+      char* response = ((char*) write_req) + sizeof(*write_req);
+      bufs[0] = uv_buf_init(response, req->response_len);
+    }
+
+    if (req->body.len != 0 && !req->head_only) {
+      bufs[nbufs++] = req->body;
+    }
+
+    /* NOTE: Chunked body ends with its own last write */
+    if (req->ws != NULL) {
+      write_cb = conn_on_upgrade_write;
+    } else if (req->close && !req->chunked) {
+      write_cb = conn_on_last_write;
+    }
+
+    CHECK_EQ(0, uv_write(
+          write_req,
+          (uv_stream_t*) &conn->tcp_client,
+          bufs,
+          nbufs,
+          write_cb));
+
+    if (conn->file_req == req) {
+      continue;
+    }
+
+    /* Chunks written so far go right after the head */
+    if (req->chunked) {
+      conn->stream_req = req;
+      req_write_chunk(req, NULL, req->unsent.len, req->chunked_end);
+      body_reset(&req->unsent);
+
+      if (req->chunked_end) {
+        conn_stream_abort(conn, NULL);
+      } else if (req->sse_channel.base != NULL) {
+        sse_subscribe(&conn->sse, req->sse_channel.base,
+            req->sse_channel.len);
+      }
+      continue;
+    }
+
+    if (req->file != NULL) {
+      file_cache_release(req->file);
+      req->file = NULL;
+    }
+
+    /* NOTE: Handshake is the last request that was parsed */
+    ws_t* ws = req->ws;
+    req->ws = NULL;
+
+    req->conn = NULL;
+    req_release_thread(req);
+    req_unref(req);
+
+    if (ws != NULL) {
+      conn->ws = ws;
+      return;
+    }
+  }
+}
+
+/* Returns the chunk at `idx`, either a string or a buffer */
+static const char* req_get_chunk(duk_context* ctx,
+                                 duk_idx_t idx,
+                                 duk_size_t* len) {
+  if (duk_is_buffer_data(ctx, idx)) {
+    return duk_get_buffer_data(ctx, idx, len);
+  }
+  return duk_require_lstring(ctx, idx, len);
+}
+
+/* `res.write(chunk)` and `res.end([chunk])` (magic 1) */
+static duk_ret_t req_response_write_cb(duk_context* ctx) {
+  req_t* req = req_from_this(ctx);
+  int last = duk_get_current_magic(ctx);
+  const char* data = NULL;
+  duk_size_t len = 0;
+
+  if (req == NULL || req->chunked_end) {
+    (void) duk_type_error(ctx, "Response has ended");
+  }
+
+  if (!last || !duk_is_undefined(ctx, 0)) {
+    data = req_get_chunk(ctx, 0, &len);
+  }
+
+  duk_push_boolean(ctx, req_write_response(req, data, len, last));
+  return 1;
+}
+
+static void req_response_init(duk_context* ctx) {
+  duk_push_object(ctx);
+
+  duk_push_c_function(ctx, req_response_write_cb, 1);
+  duk_put_prop_string(ctx, -2, "write");
+
+  duk_push_c_function(ctx, req_response_write_cb, 1);
+  duk_set_magic(ctx, -1, 1);
+  duk_put_prop_string(ctx, -2, "end");
+
+  /* NOTE: Finalizer is inherited by the responses */
+  duk_push_c_function(ctx, req_finalize_cb, 1);
+  duk_set_finalizer(ctx, -2);
+
+  response_proto_ref = refs_put(ctx);
+}
+
+/* Ends the event stream, or closes the connection if it fell behind */
+static void conn_on_sse_end(sse_client_t* client, int status) {
+  conn_t* conn = CONTAINER_OF(client, conn_t, sse);
+  req_t* req = conn->stream_req;
+
+  if (status != 0) {
+    conn_close(conn);
+    return;
+  }
+
+  req->chunked_end = 1;
+  req_write_chunk(req, NULL, 0, 1);
+  conn_stream_abort(conn, NULL);
+  conn_flush(conn);
+}
+
+static void on_connection(uv_stream_t* server, int status) {
+  conn_t* conn;
+
+  CHECK_EQ(0, status);
+
+  conn = malloc(sizeof(*conn));
+  CHECK(conn != NULL);
+
+  memset(conn, 0, sizeof(*conn));
+  conn->header_name_id = -1;
+#ifndef _WIN32
+  conn->out_fd = -1;
+#endif  /* !_WIN32 */
+
+  /* Accept connection */
+  CHECK_EQ(0, uv_tcp_init(&loop, &conn->tcp_client));
+  conn->tcp_client.data = conn;
+  conn->sse.stream = (uv_stream_t*) &conn->tcp_client;
+  conn->sse.on_end = conn_on_sse_end;
+
+  CHECK_EQ(0, uv_accept(server, (uv_stream_t*) &conn->tcp_client));
+
+  /* Initialize llhttp */
+  llhttp_init(&conn->http, HTTP_REQUEST, &http_settings);
+  conn->http.data = conn;
+
+  /* Start reading */
+  CHECK_EQ(0, uv_read_start(
+        (uv_stream_t*) &conn->tcp_client,
+        conn_alloc_cb,
+        conn_read_cb));
+}
+
+static int conn_on_message_begin(llhttp_t* http) {
+  conn_t* conn = http->data;
+
+  conn->req = req_new(conn);
+
+  return HPE_OK;
+}
+
+static void append_to_buffer(uv_buf_t* buf,
+                             const char* data,
+                             size_t len) {
+  char* new_buffer = realloc(buf->base, buf->len + len);
+  CHECK(new_buffer != NULL);
+
+  memcpy(new_buffer + buf->len, data, len);
+  buf->base = new_buffer;
+  buf->len += len;
+}
+
+static int conn_on_url(llhttp_t* http, const char* p, size_t len) {
+  conn_t* conn = http->data;
+
+  append_to_buffer(&conn->url, p, len);
+
+  return HPE_OK;
+}
+
+/* Request takes ownership of the buffers */
+static void req_add_header(req_t* req,
+                           uv_buf_t field,
+                           uv_buf_t value,
+                           int name_id) {
+  if (req->header_count == req->header_size) {
+    unsigned int size = req->header_size == 0 ?
+        INITIAL_HEADER_SIZE : req->header_size * 2;
+    header_t* headers = realloc(req->headers, size * sizeof(*headers));
+    CHECK(headers != NULL);
+
+    req->headers = headers;
+    req->header_size = size;
+  }
+
+  req->headers[req->header_count].field = field;
+  req->headers[req->header_count].value = value;
+  req->headers[req->header_count].name_id = name_id;
+  req->header_count++;
+}
+
+static void conn_add_headers(conn_t* conn) {
+  /* NOTE: Headers with empty values are dropped */
+  if (conn->header_value.base == NULL) {
+    if (conn->header_name_id == -1) {
+      free(conn->header_field.base);
+    }
+    conn->header_field = uv_buf_init(NULL, 0);
+    conn->header_name_id = -1;
+    return;
+  }
+
+  CHECK(conn->header_field.base != NULL);
+
+  req_add_header(conn->req, conn->header_field, conn->header_value,
+      conn->header_name_id);
+
+  conn->header_field = uv_buf_init(NULL, 0);
+  conn->header_value = uv_buf_init(NULL, 0);
+  conn->header_name_id = -1;
+}
+
+static int conn_on_header_field(llhttp_t* http, const char* p, size_t len) {
+  conn_t* conn = http->data;
+
+  conn_add_headers(conn);
+
+  /* NOTE: The name may arrive in several pieces */
+  if (conn->header_raw.len + len > conn->header_raw_size) {
+    size_t size = conn->header_raw.len + len;
+    char* raw = realloc(conn->header_raw.base, size);
+    CHECK(raw != NULL);
+
+    conn->header_raw.base = raw;
+    conn->header_raw_size = size;
+  }
+
+  memcpy(conn->header_raw.base + conn->header_raw.len, p, len);
+  conn->header_raw.len += len;
+
+  return HPE_OK;
+}
+
+static int conn_on_header_field_complete(llhttp_t* http) {
+  conn_t* conn = http->data;
+  const char* raw = conn->header_raw.base;
+  size_t len = conn->header_raw.len;
+
+  conn->header_raw.len = 0;
+
+  /* Well-known names don't need a copy */
+  conn->header_name_id = header_names_lookup(raw, len);
+  if (conn->header_name_id != -1) {
+    const char* name = header_names_get(conn->header_name_id, &len);
+    conn->header_field = uv_buf_init((char*) name, len);
+    return HPE_OK;
+  }
+
+  char* field = malloc(len);
+  CHECK(field != NULL);
+
+  for (size_t i = 0; i < len; i++) {
+    char c = raw[i];
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    field[i] = c;
+  }
+  conn->header_field = uv_buf_init(field, len);
+
+  return HPE_OK;
+}
+
+static int conn_on_header_value(llhttp_t* http, const char* p, size_t len) {
+  conn_t* conn = http->data;
+
+  append_to_buffer(&conn->header_value, p, len);
+
+  return HPE_OK;
+}
+
+/* Returns the route table entry that the request is going to, if any */
+static const route_t* req_find_route(req_t* req) {
+  router_match_t match;
+
+  if (!use_router) {
+    return NULL;
+  }
+
+  size_t path_len = url_path_len(req->url.base, req->url.len);
+  if (router_match(&router, req->method, req->url.base, path_len,
+                   &match) != 200) {
+    return NULL;
+  }
+
+  return &routes[match.value];
+}
+
+/* Body of the error responses to request bodies */
+static const char* req_body_error(int code) {
+  switch (code) {
+    case 400:
+      return "Bad Request";
+    case 413:
+      return "Payload Too Large";
+    default:
+      return "Internal Server Error";
+  }
+}
+
+/* Upload or upstream queue has room again, read the rest of the body */
+static void req_on_body_drain(void* arg) {
+  req_t* req = arg;
+  conn_t* conn = req->conn;
+
+  if (!req->paused) {
+    return;
+  }
+
+  req->paused = 0;
+  if (conn != NULL && conn->h2 != NULL) {
+    h2_stream_resume(req->h2);
+  } else if (conn != NULL && conn->req == req) {
+    conn_resume(conn);
+  }
+}
+
+/* All files are on disk, the upload's reference is released here */
+static void req_on_upload_done(void* arg, int status) {
+  req_t* req = arg;
+
+  if (req->conn != NULL) {
+    if (status == 200) {
+      req_dispatch(req);
+    } else {
+      req_respond_error(req, status, req_body_error(status));
+    }
+  }
+  req_unref(req);
+}
+
+/* Answers `code` and closes the connection without reading the rest */
+static int conn_reject_body(conn_t* conn, int code, const char* body) {
+  req_t* req = conn->req;
+
+  /* NOTE: Queue alone keeps `req` alive, and might free it once written */
+  if (!req->streaming) {
+    conn->req = NULL;
+  }
+
+  /* Streaming handler has responded already */
+  if (req->responded) {
+    conn_close(conn);
+  } else {
+    req->responded = 1;
+    req->close = 1;
+    req->code = code;
+    req_finish(req, "Connection: close\r\n", strlen(body), body,
+        strlen(body));
+  }
+
+  if (conn->req != NULL) {
+    req_stream_end(req, body);
+  }
+
+  return HPE_PAUSED;
+}
+
+/* Compares ASCII letters of `buf` to lowercase `expected` */
+static int buf_equals_lower(uv_buf_t buf, const char* expected) {
+  size_t len = strlen(expected);
+
+  if (buf.base == NULL || buf.len != len) {
+    return 0;
+  }
+  for (size_t i = 0; i < len; i++) {
+    if ((buf.base[i] | 0x20) != expected[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* `Connection: upgrade` is checked by llhttp */
+static int req_is_websocket(req_t* req) {
+  uv_buf_t version = req_get_header(req, "sec-websocket-version");
+
+  return req->method == HTTP_GET &&
+         buf_equals_lower(req_get_header(req, "upgrade"), "websocket") &&
+         version.len == 2 && memcmp(version.base, "13", 2) == 0 &&
+         req_get_header(req, "sec-websocket-key").len == 24;
+}
+
+/*
+ * Sets up the request for its body, `content_length` is `NULL` if it isn't
+ * known upfront. Returns the status code to reject the body with, or zero.
+ */
+static int req_on_headers(req_t* req, const uint64_t* content_length) {
+  const route_t* route = req_find_route(req);
+  req->max_body_size = route == NULL ? max_body_size : route->max_body_size;
+
+  /* Don't wait for the body if it is too large anyway */
+  if (content_length != NULL && *content_length > req->max_body_size) {
+    return 413;
+  }
+
+  if (route != NULL && route->parse_json) {
+    req->json = json_parser_new(duk_ctx);
+    return 0;
+  }
+
+  /* Other content types are buffered as usual */
+  if (route != NULL && route->multipart) {
+    uv_buf_t type = req_get_header(req, "content-type");
+
+    if (type.base != NULL) {
+      req->upload = upload_new(type.base, type.len, route->max_files,
+          req_on_body_drain, req);
+    }
+    return 0;
+  }
+
+  if (route == NULL || !route->stream_body ||
+      req->method == HTTP_GET || req->method == HTTP_HEAD) {
+    return 0;
+  }
+
+  /* Streaming handlers run before the body, the connection keeps a ref */
+  req->streaming = 1;
+  req->reader = req->conn;
+  req->refs++;
+  req_dispatch(req);
+
+  return 0;
+}
+
+/*
+ * Passes the piece of the body on, `req->paused` is set if no more should be
+ * read for now. Returns the status code to reject the body with, or zero.
+ */
+static int req_on_body(req_t* req, const char* p, size_t len) {
+  /* NOTE: Chunked bodies have no length upfront */
+  if (len > req->max_body_size - req->body_len) {
+    return 413;
+  }
+  req->body_len += len;
+
+  if (req->json != NULL) {
+    return json_parser_execute(req->json, p, len) != 0 ? 400 : 0;
+  }
+
+  if (req->upload != NULL) {
+    int status = upload_execute(req->upload, p, len);
+
+    if (status != 200) {
+      return status;
+    }
+
+    /* Wait for the disk to catch up */
+    if (upload_is_full(req->upload)) {
+      req->paused = 1;
+    }
+    return 0;
+  }
+
+  if (!req->streaming) {
+    body_append(&req->payload, p, len);
+    return 0;
+  }
+
+  /* Wait for the upstream to catch up */
+  if (req->proxy != NULL) {
+    if (!proxy_write(req->proxy, p, len)) {
+      req->paused = 1;
+    }
+    return 0;
+  }
+
+  req_stream_data(req, p, len);
+  return 0;
+}
+
+static int conn_on_headers_complete(llhttp_t* http) {
+  conn_t* conn = http->data;
+  req_t* req = conn->req;
+
+  CHECK(conn->url.base != NULL);
+
+  conn_add_headers(conn);
+
+  /* Request takes ownership of the url */
+  req->url = conn->url;
+  conn->url = uv_buf_init(NULL, 0);
+
+  req->method = http->method;
+  req->head_only = http->method == HTTP_HEAD;
+
+  /* Nothing but frames can follow the handshake, even if it is declined */
+  if (http->upgrade && req_is_websocket(req)) {
+    const route_t* route = req_find_route(req);
+
+    req->websocket = 1;
+    req->close = 1;
+    req->max_body_size = route == NULL ? max_body_size :
+        route->max_body_size;
+    conn->websocket = 1;
+    return HPE_OK;
+  }
+
+  if ((http->flags & (F_CONTENT_LENGTH | F_CHUNKED)) == 0) {
+    return HPE_OK;
+  }
+
+  int code = req_on_headers(req,
+      (http->flags & F_CONTENT_LENGTH) ? &http->content_length : NULL);
+  if (code != 0) {
+    return conn_reject_body(conn, code, req_body_error(code));
+  }
+
+  return req->paused ? HPE_PAUSED : HPE_OK;
+}
+
+static int conn_on_body(llhttp_t* http, const char* p, size_t len) {
+  conn_t* conn = http->data;
+  req_t* req = conn->req;
+
+  /* Resumed parser flushes an empty span */
+  if (len == 0) {
+    return HPE_OK;
+  }
+
+  int code = req_on_body(req, p, len);
+  if (code != 0) {
+    return conn_reject_body(conn, code, req_body_error(code));
+  }
+
+  return req->paused ? HPE_PAUSED : HPE_OK;
+}
+
+static int hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/*
+ * Maps `url` to a path inside of the mounted directory. Returns the length of
+ * the path written to `out`, or `-1` if the url doesn't belong to the mount or
+ * tries to escape it.
+ */
+static int static_resolve(const static_mount_t* mount,
+                          const char* url,
+                          size_t url_len,
+                          char* out,
+                          size_t out_size) {
+  size_t path_len = url_path_len(url, url_len);
+
+  if (path_len < mount->prefix_len ||
+      memcmp(url, mount->prefix, mount->prefix_len) != 0) {
+    return -1;
+  }
+
+  /* `/assets` should not match `/assetsfoo` */
+  if (mount->prefix_len != 0 &&
+      mount->prefix[mount->prefix_len - 1] != '/' &&
+      path_len != mount->prefix_len &&
+      url[mount->prefix_len] != '/') {
+    return -1;
+  }
+
+  if (mount->dir_len + 1 >= out_size) {
+    return -1;
+  }
+
+  size_t off = mount->dir_len;
+  memcpy(out, mount->dir, off);
+  out[off++] = '/';
+
+  /* Start of the current path segment in `out` */
+  size_t segment = off;
+
+  for (size_t i = mount->prefix_len; i < path_len; i++) {
+    char c = url[i];
+
+    if (c == '%' && i + 2 < path_len &&
+        hex_value(url[i + 1]) != -1 && hex_value(url[i + 2]) != -1) {
+      c = (char) (hex_value(url[i + 1]) * 16 + hex_value(url[i + 2]));
+      i += 2;
+    }
+
+    if (c == '\0' || c == '\\') {
+      return -1;
+    }
+
+    if (c == '/') {
+      /* Collapse slashes */
+      if (off == segment) {
+        continue;
+      }
+      if (off - segment == 2 && memcmp(out + segment, "..", 2) == 0) {
+        return -1;
+      }
+      segment = off + 1;
+    }
+
+    if (off + 1 >= out_size) {
+      return -1;
+    }
+    out[off++] = c;
+  }
+
+  if (off - segment == 2 && memcmp(out + segment, "..", 2) == 0) {
+    return -1;
+  }
+
+  /* Directory index */
+  if (off == segment) {
+    static const char index[] = "index.html";
+
+    if (off + sizeof(index) > out_size) {
+      return -1;
+    }
+    memcpy(out + off, index, sizeof(index) - 1);
+    off += sizeof(index) - 1;
+  }
+
+  out[off] = '\0';
+  return (int) off;
+}
+
+/* Serves the request from a mounted directory, without calling into JS */
+static int req_try_static(req_t* req, const char* url, size_t url_len) {
+  char path[4096];
+
+  for (unsigned int i = 0; i < static_mount_count; i++) {
+    int path_len = static_resolve(&static_mounts[i], url, url_len,
+        path, sizeof(path));
+    if (path_len == -1) {
+      continue;
+    }
+
+    req->code = 200;
+    req_respond_file(req, path, path_len);
+    return 1;
+  }
+
+  return 0;
+}
+
+static void req_on_flight(void* arg);
+
+/*
+ * Looks the request up in the route table. Returns zero if the request was
+ * answered with `404` or `405`.
+ */
+static int req_route(req_t* req, router_match_t* match) {
+  size_t path_len = url_path_len(req->url.base, req->url.len);
+
+  int code = router_match(&router, req->method, req->url.base, path_len,
+      match);
+  if (code == 200) {
+    return 1;
+  }
+
+  if (code == 404) {
+    req_respond_error(req, 404, "Not Found");
+    return 0;
+  }
+
+  /* List the allowed methods, `HEAD` is implied by `GET` */
+  char allow[512];
+  size_t off = 0;
+  int has_get = 0;
+  int has_head = 0;
+
+  for (unsigned int i = 0; i < match->route_count; i++) {
+    int method = match->routes[i].method;
+    has_get |= method == HTTP_GET;
+    has_head |= method == HTTP_HEAD;
+  }
+
+  off += snprintf(allow, sizeof(allow), "Allow: ");
+  for (unsigned int i = 0; i <= match->route_count; i++) {
+    const char* name;
+
+    if (i < match->route_count) {
+      name = llhttp_method_name(match->routes[i].method);
+    } else if (has_get && !has_head) {
+      name = "HEAD";
+    } else {
+      break;
+    }
+
+    if (off + strlen(name) + 5 >= sizeof(allow)) {
+      break;
+    }
+    off += snprintf(allow + off, sizeof(allow) - off, "%s%s",
+        i == 0 ? "" : ", ", name);
+  }
+  snprintf(allow + off, sizeof(allow) - off, "\r\n");
+
+  req->responded = 1;
+  req->code = 405;
+  req_finish(req, allow, 18, "Method Not Allowed", 18);
+  return 0;
+}
+
+/*
+ * Proxy routes. The request goes to the upstream with its body passed on as
+ * it arrives, and the response comes back like a streamed one. Bodies of
+ * known length are moved from socket to socket once the response gets to
+ * the head of the queue.
+ */
+
+static void req_proxy_splice(req_t* req) {
+  conn_t* conn = req->conn;
+
+  if (req->proxy == NULL || !req->identity || req->head_only ||
+      conn == NULL || conn->h2 != NULL || conn->stream_req != req) {
+    return;
+  }
+
+  proxy_splice(req->proxy, (uv_stream_t*) &conn->tcp_client);
+}
+
+/* Response has started but can't be completed, the client has to know */
+static void req_proxy_cut(req_t* req) {
+  if (!req->chunked || req->chunked_end) {
+    return;
+  }
+
+  if (req->h2 != NULL) {
+    h2_stream_fail(req->h2);
+  } else if (req->conn != NULL) {
+    conn_close(req->conn);
+  }
+}
+
+/* Stops the upstream request, if there is one */
+static void req_proxy_close(req_t* req) {
+  proxy_t* proxy = req->proxy;
+
+  if (proxy == NULL) {
+    return;
+  }
+
+  req->proxy = NULL;
+  proxy_close(proxy);
+  req_proxy_cut(req);
+  req_unref(req);
+}
+
+static void req_proxy_on_response(void* arg,
+                                  int status,
+                                  const char* headers,
+                                  int64_t content_length) {
+  req_t* req = arg;
+
+  req->responded = 1;
+  req->code = status;
+  req->chunked = 1;
+
+  /* Bodies of these end with the head */
+  req->identity = content_length >= 0 || req->head_only ||
+                  status == 204 || status == 304;
+
+  req_finish(req, headers,
+      content_length >= 0 ? (uint64_t) content_length : UINT64_MAX,
+      NULL, 0);
+  req_proxy_splice(req);
+}
+
+static int req_proxy_on_data(void* arg, const char* data, size_t len) {
+  req_t* req = arg;
+  int ok = req_write_response(req, data, len, 0);
+
+  req_proxy_splice(req);
+  return ok;
+}
+
+/* NOTE: The rest of the request body, if any, is read and dropped */
+static void req_proxy_on_end(void* arg) {
+  req_t* req = arg;
+
+  req->proxy = NULL;
+  req_on_body_drain(req);
+  req_write_response(req, NULL, 0, 1);
+  req_unref(req);
+}
+
+static void req_proxy_on_error(void* arg, int err) {
+  req_t* req = arg;
+
+  req->proxy = NULL;
+  req_on_body_drain(req);
+
+  if (!req->responded) {
+    fprintf(stderr, "Upstream error: %s\n", uv_strerror(err));
+    if (err == UV_ETIMEDOUT) {
+      req_respond_error(req, 504, "Gateway Timeout");
+    } else {
+      req_respond_error(req, 502, "Bad Gateway");
+    }
+  } else {
+    req_proxy_cut(req);
+  }
+  req_unref(req);
+}
+
+/*
+ * Calls the route's function with the headers, url, method and params.
+ * Returns a copy of the url it picked, or `NULL` if it failed.
+ */
+static char* req_proxy_target(req_t* req,
+                              int handler,
+                              const router_match_t* match,
+                              size_t* len) {
+  duk_context* ctx = duk_ctx;
+  char* target = NULL;
+
+  refs_push(ctx, handler);
+  req_push_headers(req, ctx);
+  string_cache_push(ctx, req->url.base, req->url.len);
+  duk_push_string(ctx, llhttp_method_name(req->method));
+
+  duk_push_object(ctx);
+  for (unsigned int i = 0; i < match->param_count; i++) {
+    const router_param_t* param = &match->params[i];
+
+    push_decoded(ctx, param->value, param->value_len, 0);
+    duk_put_prop_lstring(ctx, -2, param->name, param->name_len);
+  }
+
+  if (duk_pcall(ctx, 4) != DUK_EXEC_SUCCESS) {
+    req_log_error(ctx, "Proxy target error");
+  } else if (duk_is_string(ctx, -1)) {
+    const char* url = duk_get_lstring(ctx, -1, len);
+
+    target = malloc(*len + 1);
+    CHECK(target != NULL);
+    memcpy(target, url, *len);
+  } else {
+    fprintf(stderr, "Proxy target is not a string\n");
+  }
+  duk_pop(ctx);
+
+  return target;
+}
+
+/* Returns non-zero if the bytes can go into a request line or a header */
+static int field_is_valid(const char* p, size_t len, int value) {
+  for (size_t i = 0; i < len; i++) {
+    unsigned char c = p[i];
+
+    if (c == 0x7f || (c < ' ' && !(value && c == '\t')) ||
+        (c == ' ' && !value)) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void head_append(body_t* head, const char* data) {
+  body_append(head, data, strlen(data));
+}
+
+/* Appends the client's address, for `X-Forwarded-For` */
+static void req_proxy_append_peer(req_t* req, body_t* head) {
+  struct sockaddr_storage addr;
+  int addr_len = sizeof(addr);
+  char ip[INET6_ADDRSTRLEN];
+  const char* peer = ip;
+
+  ip[0] = '\0';
+  if (uv_tcp_getpeername(&req->conn->tcp_client, (struct sockaddr*) &addr,
+                         &addr_len) == 0) {
+    if (addr.ss_family == AF_INET6) {
+      uv_ip6_name((struct sockaddr_in6*) &addr, ip, sizeof(ip));
+    } else {
+      uv_ip4_name((struct sockaddr_in*) &addr, ip, sizeof(ip));
+    }
+  }
+
+  /* IPv4 clients of the dual-stack socket */
+  if (strncmp(ip, "::ffff:", 7) == 0 && strchr(ip + 7, ':') == NULL) {
+    peer += 7;
+  }
+  head_append(head, peer);
+}
+
+/*
+ * Forwards the request to the route's upstream. Hop-by-hop headers are
+ * dropped, `X-Forwarded-*` ones are added, and the body is framed anew.
+ */
+static void req_proxy(req_t* req,
+                      const route_t* route,
+                      const router_match_t* match) {
+  static const char* const skip[] = {
+    "host", "expect", "x-forwarded-for", "x-forwarded-host",
+    "x-forwarded-proto"
+  };
+  upstream_t* upstream = route->upstream;
+  const char* path = route->proxy_path;
+  size_t path_len = route->proxy_path_len;
+  char* target = NULL;
+  size_t target_len;
+  const char* host;
+  size_t host_len;
+  unsigned short port;
+  char line[64];
+  body_t head;
+  int valid = 1;
+
+  if (route->handler != REFS_NONE) {
+    target = req_proxy_target(req, route->handler, match, &target_len);
+    if (target == NULL ||
+        upstream_parse_url(target, target_len, &host, &host_len, &port,
+                           &path, &path_len) != 0 ||
+        (upstream = upstream_get(host, host_len, port)) == NULL) {
+      free(target);
+      req_respond_error(req, 502, "Bad Gateway");
+      return;
+    }
+  }
+
+  memset(&head, 0, sizeof(head));
+
+  head_append(&head, llhttp_method_name(req->method));
+  head_append(&head, " ");
+  if (target != NULL && (path_len == 0 || path[0] != '/')) {
+    head_append(&head, "/");
+  }
+  body_append(&head, path, path_len);
+  if (target == NULL) {
+    valid &= field_is_valid(req->url.base, req->url.len, 0);
+    body_append(&head, req->url.base, req->url.len);
+  }
+  head_append(&head, " HTTP/1.1\r\nHost: ");
+  host = upstream_host(upstream, &host_len);
+  body_append(&head, host, host_len);
+  head_append(&head, "\r\n");
+  free(target);
+
+  uv_buf_t connection = req_get_header(req, "connection");
+  for (unsigned int i = 0; i < req->header_count; i++) {
+    const header_t* header = &req->headers[i];
+    int skipped = proxy_is_hop_header(header->field.base, header->field.len,
+        connection.base, connection.len);
+
+    for (unsigned int j = 0; j < ARRAY_SIZE(skip); j++) {
+      skipped |= buf_equals_lower(header->field, skip[j]);
+    }
+    if (skipped) {
+      continue;
+    }
+
+    /* NOTE: HTTP/2 fields are not checked for line breaks by the frames */
+    valid &= field_is_valid(header->field.base, header->field.len, 0) &&
+             field_is_valid(header->value.base, header->value.len, 1);
+
+    body_append(&head, header->field.base, header->field.len);
+    head_append(&head, ": ");
+    body_append(&head, header->value.base, header->value.len);
+    head_append(&head, "\r\n");
+  }
+
+  head_append(&head, "X-Forwarded-For: ");
+  uv_buf_t forwarded = req_get_header(req, "x-forwarded-for");
+  if (forwarded.base != NULL) {
+    valid &= field_is_valid(forwarded.base, forwarded.len, 1);
+    body_append(&head, forwarded.base, forwarded.len);
+    head_append(&head, ", ");
+  }
+  req_proxy_append_peer(req, &head);
+  head_append(&head, "\r\n");
+
+  uv_buf_t original = req_get_header(req, "host");
+  if (original.base != NULL) {
+    valid &= field_is_valid(original.base, original.len, 0);
+    head_append(&head, "X-Forwarded-Host: ");
+    body_append(&head, original.base, original.len);
+    head_append(&head, "\r\n");
+  }
+  head_append(&head, "X-Forwarded-Proto: http\r\n");
+
+  /*
+   * Streamed body keeps its length, llhttp has checked that it matches.
+   * HTTP/2 frames don't, so it is chunked then.
+   */
+  uv_buf_t length = req_get_header(req, "content-length");
+  int chunked = 0;
+  line[0] = '\0';
+  if (req->streaming) {
+    if (length.base != NULL && req->conn->h2 == NULL) {
+      snprintf(line, sizeof(line), "Content-Length: %.*s\r\n",
+          (int) length.len, length.base);
+    } else {
+      chunked = 1;
+      snprintf(line, sizeof(line), "Transfer-Encoding: chunked\r\n");
+    }
+  } else if (req->payload.len != 0 || length.base != NULL ||
+             req_get_header(req, "transfer-encoding").base != NULL) {
+    snprintf(line, sizeof(line), "Content-Length: %llu\r\n",
+        (unsigned long long) req->payload.len);
+  }
+  head_append(&head, line);
+  head_append(&head, "\r\n");
+
+  if (!valid) {
+    body_reset(&head);
+    req_respond_error(req, 400, "Bad Request");
+    return;
+  }
+
+  /* Only requests without body can be sent again */
+  int retry = !req->streaming && req->payload.len == 0 &&
+      (req->method == HTTP_GET || req->method == HTTP_HEAD ||
+       req->method == HTTP_PUT || req->method == HTTP_DELETE ||
+       req->method == HTTP_OPTIONS || req->method == HTTP_TRACE);
+
+  char* data = malloc(head.len);
+  CHECK(data != NULL);
+  body_copy(&head, data);
+
+  proxy_t* proxy = proxy_new(upstream, data, head.len, chunked,
+      req->head_only, retry, route->proxy_timeout, &proxy_callbacks, req);
+  free(data);
+  body_reset(&head);
+
+  if (proxy == NULL) {
+    req_respond_error(req, 502, "Bad Gateway");
+    return;
+  }
+
+  req->proxy = proxy;
+  req->refs++;
+
+  if (req->streaming) {
+    return;
+  }
+
+  for (body_chunk_t* c = req->payload.head; c != NULL; c = c->next) {
+    proxy_write(proxy, c->data, c->len);
+  }
+  proxy_end(proxy);
+}
+
+/* Serves the request natively if possible, calls the handler otherwise */
+static void req_dispatch(req_t* req) {
+  router_match_t match;
+  duk_context* ctx;
+
+  if (req->method == HTTP_GET || req->method == HTTP_HEAD) {
+    const char* method = llhttp_method_name(req->method);
+    const asset_t* asset = asset_cache_get(req->url.base, req->url.len);
+    response_entry_t* entry = NULL;
+    int served = 1;
+
+    if (asset == NULL) {
+      entry = response_cache_get(method, req->url.base, req->url.len,
+          req_header_cb, req);
+    }
+
+    /* NOTE: Cached files are responded to synchronously */
+    req->refs++;
+    if (asset != NULL) {
+      req_respond_asset(req, asset);
+    } else if (entry != NULL) {
+      req_respond_cached(req, entry);
+    } else {
+      served = req_try_static(req, req->url.base, req->url.len);
+    }
+    req_unref(req);
+
+    if (served) {
+      return;
+    }
+  }
+
+  /* Native handlers from plugins, JS gets the rest */
+  dukhttp_res_t* res;
+  if (plugins_handle(req->method, req->url.base, req->url.len,
+                     req_header_cb, req, &res)) {
+    req->responded = 1;
+    req->code = res->code;
+    req_finish(req, res->headers.base, res->body.len, res->body.base,
+        res->body.len);
+    return;
+  }
+
+  int handler = handler_ref;
+  if (use_router) {
+    if (!req_route(req, &match)) {
+      return;
+    }
+    if (routes[match.value].proxy) {
+      req_proxy(req, &routes[match.value], &match);
+      return;
+    }
+    handler = routes[match.value].handler;
+  }
+
+  /* Wait for the same request that is already running the handler */
+  if ((req->method == HTTP_GET || req->method == HTTP_HEAD) &&
+      response_cache_join(llhttp_method_name(req->method),
+                          req->url.base, req->url.len,
+                          req_header_cb, req,
+                          req_on_flight, req,
+                          &req->flight)) {
+    req->refs++;
+    return;
+  }
 
-/* Typedefs */
+  req_start_thread(req, handler);
+  ctx = req->thread;
 
-typedef struct bytecode_s bytecode_t;
-struct bytecode_s {
-  void* buffer;
-  duk_size_t size;
-};
+  string_cache_push(ctx, req->url.base, req->url.len);
+  duk_push_string(ctx, llhttp_method_name(req->method));
+  req_push_respond(req, ctx, 0);
 
-typedef struct conn_s conn_t;
-struct conn_s {
-  uv_tcp_t tcp_client;
-  char read_buf[1024];
+  /* Route parameters */
+  duk_idx_t nargs = 5;
+  if (use_router) {
+    duk_push_object(ctx);
+    for (unsigned int i = 0; i < match.param_count; i++) {
+      const router_param_t* param = &match.params[i];
 
-  uv_buf_t url;
-  uv_buf_t header_field;
-  uv_buf_t header_value;
+      push_decoded(ctx, param->value, param->value_len, 0);
+      duk_put_prop_lstring(ctx, -2, param->name, param->name_len);
+    }
+    nargs++;
+  }
 
-  llhttp_t http;
+  req_push_request(req, ctx);
+  if (use_router) {
+    duk_dup(ctx, -2);
+    duk_put_prop_string(ctx, -2, "params");
+  }
+  if (req->streaming) {
+    duk_dup_top(ctx);
+    req->request_ref = refs_put(ctx);
+  }
+  if (req->json_ref != REFS_NONE) {
+    refs_push(ctx, req->json_ref);
+    duk_put_prop_string(ctx, -2, "json");
+    refs_del(duk_ctx, req->json_ref);
+    req->json_ref = REFS_NONE;
+  }
+  if (req->upload != NULL) {
+    upload_push_fields(req->upload, ctx);
+    duk_put_prop_string(ctx, -2, "fields");
+    upload_push_files(req->upload, ctx);
+    duk_put_prop_string(ctx, -2, "files");
+  }
 
-  duk_context* duk_ctx;
-  duk_idx_t headers_obj;
-};
+  req->in_call = 1;
+  if (duk_pcall(ctx, nargs) != DUK_EXEC_SUCCESS) {
+    req_log_error(ctx, "Handler error");
+    req_respond_error(req, 500, "Internal Server Error");
+  } else {
+    req_on_result(req);
+  }
+  req->in_call = 0;
 
-/* Some static vars */
+  /* Pop the result itself */
+  duk_pop(ctx);
 
-static const int BACKLOG = 511;
-static const int FILE_READ_CHUNK_LEN = 4096;
+  if (req->responded) {
+    req_release_thread(req);
+  }
+}
 
-static uv_loop_t loop;
-static uv_tcp_t tcp_server;
-static llhttp_settings_t http_settings;
-static bytecode_t bytecode;
+/* The request we waited for has landed, most likely in the response cache */
+static void req_on_flight(void* arg) {
+  req_t* req = arg;
 
-/* Callbacks */
+  if (req->conn != NULL) {
+    req_dispatch(req);
+  }
+  req_unref(req);
+}
 
-static void conn_on_close(uv_handle_t* handle) {
-  conn_t* conn = handle->data;
+/* Whole request has arrived */
+static void req_complete(req_t* req) {
+  if (req->streaming) {
+    req_stream_end(req, NULL);
+    return;
+  }
 
-  handle->data = NULL;
+  if (req->json != NULL) {
+    int err = json_parser_finish(req->json, duk_ctx);
 
-  free(conn->url.base);
-  conn->url = uv_buf_init(NULL, 0);
-  free(conn->header_field.base);
-  conn->header_field = uv_buf_init(NULL, 0);
-  free(conn->header_value.base);
-  conn->header_value = uv_buf_init(NULL, 0);
+    json_parser_free(req->json);
+    req->json = NULL;
+    if (err != 0) {
+      req_respond_error(req, 400, req_body_error(400));
+      return;
+    }
+    req->json_ref = refs_put(duk_ctx);
+  }
 
-  if (conn->duk_ctx != NULL) {
-    duk_destroy_heap(conn->duk_ctx);
-    conn->duk_ctx = NULL;
+  /* Files are still being written, the upload keeps a reference */
+  if (req->upload != NULL) {
+    req->refs++;
+    upload_finish(req->upload, req_on_upload_done);
+    return;
   }
 
-  free(conn);
+  req_dispatch(req);
 }
 
-static void conn_on_fatal_error(void* udata, const char* message) {
-  conn_t* conn = udata;
+static int conn_on_message_complete(llhttp_t* http) {
+  conn_t* conn = http->data;
+  req_t* req = conn->req;
 
-  fprintf(stderr, "Runtime error: %s\n", message);
+  /* NOTE: Streamed body releases the connection's reference when it ends */
+  if (!req->streaming) {
+    conn->req = NULL;
+  }
 
-  uv_close((uv_handle_t*) &conn->tcp_client, conn_on_close);
+  req_complete(req);
+
+  return HPE_OK;
 }
 
-static void conn_alloc_cb(uv_handle_t* handle, size_t size, uv_buf_t* buf) {
-  (void) size;
+/*
+ * HTTP/2 requests. Every stream gets a request of its own that goes through
+ * the same body handling and dispatch as HTTP/1.1 ones. They are queued on
+ * the connection until their responses start.
+ */
 
-  conn_t* conn = handle->data;
+static void* conn_h2_on_stream(void* arg, h2_stream_t* stream) {
+  req_t* req = req_new(arg);
 
-  buf->base = conn->read_buf;
-  buf->len = sizeof(conn->read_buf);
+  req->h2 = stream;
+  req->method = -1;
+  return req;
 }
 
-static void conn_read_cb(uv_stream_t* stream, ssize_t nread,
-                         const uv_buf_t* buf) {
-  conn_t* conn = stream->data;
-
-  if (nread == UV_EOF) {
-    uv_close((uv_handle_t*) stream, conn_on_close);
-    return;
-  }
+static char* buf_copy(const char* data, size_t len) {
+  char* copy = malloc(len);
+  CHECK(copy != NULL);
+  memcpy(copy, data, len);
+  return copy;
+}
 
-  if (HPE_OK != llhttp_execute(&conn->http, buf->base, nread)) {
-    fprintf(stderr, "parsing error: %s at pos: %d\n",
-        llhttp_get_error_reason(&conn->http),
-        (int) (llhttp_get_error_pos(&conn->http) - buf->base));
+/* Joined cookies are allocated in powers of two, see `conn_h2_on_header()` */
+static size_t conn_h2_cookie_size(size_t len) {
+  size_t size = 64;
 
-    uv_close((uv_handle_t*) stream, conn_on_close);
-    return;
+  while (size < len) {
+    size *= 2;
   }
+  return size;
 }
 
-static void conn_write_cb(uv_write_t* req, int status) {
-  conn_t* conn = req->data;
-  req->data = NULL;
-
-  free(req);
+static int conn_h2_on_pseudo_header(req_t* req,
+                                    const char* name,
+                                    size_t name_len,
+                                    const char* value,
+                                    size_t value_len) {
+  if (name_len == 7 && memcmp(name, ":method", 7) == 0) {
+    if (req->method != -1) {
+      return -1;
+    }
+    req->method = router_method_from_name(value, value_len);
+    return req->method == -1 ? -1 : 0;
+  }
 
-  /* Error */
-  if (status != 0) {
-    /* TODO(indutny): I forgot if we should ignore this. I think we should? */
-    if (status == UV_EPIPE) {
-      return;
+  if (name_len == 5 && memcmp(name, ":path", 5) == 0) {
+    if (req->url.base != NULL || value_len == 0) {
+      return -1;
     }
+    req->url = uv_buf_init(buf_copy(value, value_len), value_len);
+    return 0;
+  }
 
-    uv_close((uv_handle_t*) &conn->tcp_client, conn_on_close);
-    return;
+  /* Stands in for `Host` */
+  if (name_len == 10 && memcmp(name, ":authority", 10) == 0) {
+    size_t len;
+    int name_id = header_names_lookup("host", 4);
+    const char* field = header_names_get(name_id, &len);
+
+    req_add_header(req, uv_buf_init((char*) field, len),
+        uv_buf_init(buf_copy(value, value_len), value_len), name_id);
+    return 0;
   }
-}
 
-static void on_connection(uv_stream_t* server, int status) {
-  conn_t* conn;
+  if (name_len == 7 && memcmp(name, ":scheme", 7) == 0) {
+    return 0;
+  }
 
-  CHECK_EQ(0, status);
+  return -1;
+}
 
-  conn = malloc(sizeof(*conn));
-  CHECK(conn != NULL);
+/* NOTE: Names are lowercase, the frame layer has checked that */
+static int conn_h2_on_header(void* data,
+                             const char* name,
+                             size_t name_len,
+                             const char* value,
+                             size_t value_len) {
+  req_t* req = data;
 
-  memset(conn, 0, sizeof(*conn));
+  if (name[0] == ':') {
+    return conn_h2_on_pseudo_header(req, name, name_len, value, value_len);
+  }
 
-  /* Accept connection */
-  CHECK_EQ(0, uv_tcp_init(&loop, &conn->tcp_client));
-  conn->tcp_client.data = conn;
+  /* NOTE: Headers with empty values are dropped */
+  if (value_len == 0) {
+    return 0;
+  }
 
-  CHECK_EQ(0, uv_accept(server, (uv_stream_t*) &conn->tcp_client));
+  /*
+   * Cookies may come as separate fields, join them like HTTP/1.1 does. The
+   * value grows by doubling, so that many small fields take linear time.
+   */
+  int is_cookie = name_len == 6 && memcmp(name, "cookie", 6) == 0;
+  header_t* cookie;
+  if (is_cookie && (cookie = req_find_header(req, name, name_len)) != NULL) {
+    size_t len = cookie->value.len + 2 + value_len;
+    char* joined = cookie->value.base;
 
-  /* Initialize llhttp */
-  llhttp_init(&conn->http, HTTP_REQUEST, &http_settings);
-  conn->http.data = conn;
+    if (len > conn_h2_cookie_size(cookie->value.len)) {
+      joined = realloc(joined, conn_h2_cookie_size(len));
+      CHECK(joined != NULL);
+    }
 
-  /* Initialize duktape */
-  conn->duk_ctx = duk_create_heap(NULL, NULL, NULL, conn, conn_on_fatal_error);
-  CHECK(conn->duk_ctx != NULL);
+    memcpy(joined + cookie->value.len, "; ", 2);
+    memcpy(joined + cookie->value.len + 2, value, value_len);
+    cookie->value = uv_buf_init(joined, len);
+    return 0;
+  }
 
-  duk_push_external_buffer(conn->duk_ctx);
-  duk_config_buffer(conn->duk_ctx, -1, bytecode.buffer, bytecode.size);
-  duk_load_function(conn->duk_ctx);
+  /* Well-known names don't need a copy */
+  uv_buf_t field;
+  int name_id = header_names_lookup(name, name_len);
+  if (name_id == -1) {
+    field = uv_buf_init(buf_copy(name, name_len), name_len);
+  } else {
+    size_t len;
+    const char* known = header_names_get(name_id, &len);
+    field = uv_buf_init((char*) known, len);
+  }
 
-  /* Start reading */
-  CHECK_EQ(0, uv_read_start(
-        (uv_stream_t*) &conn->tcp_client,
-        conn_alloc_cb,
-        conn_read_cb));
+  char* copy;
+  if (is_cookie) {
+    copy = malloc(conn_h2_cookie_size(value_len));
+    CHECK(copy != NULL);
+    memcpy(copy, value, value_len);
+  } else {
+    copy = buf_copy(value, value_len);
+  }
+
+  req_add_header(req, field, uv_buf_init(copy, value_len), name_id);
+  return 0;
 }
 
-static int conn_on_message_begin(llhttp_t* http) {
-  conn_t* conn = http->data;
+/* Answers `code`, and drops the rest of the body */
+static void req_h2_reject(req_t* req, int code) {
+  const char* body = req_body_error(code);
+  h2_stream_t* stream = req->h2;
 
-  /* Duplicate function which should be on the stack */
-  duk_dup(conn->duk_ctx, -1);
+  req_respond_error(req, code, body);
+  if (req->reader != NULL) {
+    req_stream_end(req, body);
+  }
+  h2_stream_discard(stream);
+}
 
-  /* Create headers object */
-  conn->headers_obj = duk_push_object(conn->duk_ctx);
+static int conn_h2_on_headers_complete(void* data, int end_stream) {
+  req_t* req = data;
 
-  return HPE_OK;
-}
+  if (req->method == -1 || req->url.base == NULL) {
+    return -1;
+  }
+  req->head_only = req->method == HTTP_HEAD;
 
-static void append_to_buffer(uv_buf_t* buf,
-                             const char* data,
-                             size_t len) {
-  char* new_buffer = realloc(buf->base, buf->len + len);
-  CHECK(new_buffer != NULL);
+  if (end_stream) {
+    req_complete(req);
+    return 0;
+  }
 
-  memcpy(new_buffer + buf->len, data, len);
-  buf->base = new_buffer;
-  buf->len += len;
+  /* Length is optional, and only checked against the limit */
+  uint64_t content_length = 0;
+  uv_buf_t length = req_get_header(req, "content-length");
+  for (size_t i = 0; i < length.len; i++) {
+    if (length.base[i] < '0' || length.base[i] > '9' ||
+        content_length > (UINT64_MAX - 9) / 10) {
+      return -1;
+    }
+    content_length = content_length * 10 + (length.base[i] - '0');
+  }
+
+  int code = req_on_headers(req, length.base == NULL ? NULL : &content_length);
+  if (code != 0) {
+    req_h2_reject(req, code);
+  } else if (req->paused) {
+    h2_stream_pause(req->h2);
+  }
+  return 0;
 }
 
-static int conn_on_url(llhttp_t* http, const char* p, size_t len) {
-  conn_t* conn = http->data;
+static void conn_h2_on_data(void* data, const char* p, size_t len) {
+  req_t* req = data;
 
-  append_to_buffer(&conn->url, p, len);
+  int code = req_on_body(req, p, len);
+  if (code != 0) {
+    req_h2_reject(req, code);
+  } else if (req->paused) {
+    h2_stream_pause(req->h2);
+  }
+}
 
-  return HPE_OK;
+static void conn_h2_on_end(void* data) {
+  req_complete(data);
 }
 
-static void conn_add_headers(conn_t* conn) {
-  if (conn->header_value.base == NULL) {
+static void conn_h2_on_drain(void* data) {
+  req_t* req = data;
+
+  if (req->file != NULL) {
+    if (!req->h2_reading) {
+      req_h2_send_file(req);
+    }
     return;
   }
 
-  CHECK(conn->header_field.base != NULL);
-
-  duk_push_lstring(conn->duk_ctx,
-      conn->header_value.base, conn->header_value.len);
-  duk_put_prop_lstring(conn->duk_ctx,
-      conn->headers_obj,
-      conn->header_field.base, conn->header_field.len);
-
-  free(conn->header_field.base);
-  free(conn->header_value.base);
-  conn->header_field = uv_buf_init(NULL, 0);
-  conn->header_value = uv_buf_init(NULL, 0);
+  if (req->drain) {
+    req_on_response_drain(req);
+  }
 }
 
-static int conn_on_header_field(llhttp_t* http, const char* p, size_t len) {
-  conn_t* conn = http->data;
+static void conn_h2_on_close(void* data, int error) {
+  req_t* req = data;
+  const char* reason = error ? "Stream reset" : NULL;
 
-  conn_add_headers(conn);
+  req->h2 = NULL;
+  if (req->reader != NULL) {
+    req_stream_end(req, "Stream reset");
+  }
 
-  append_to_buffer(&conn->header_field, p, len);
+  /* The stream holds the reference once the response has started */
+  if (!req->h2_sending) {
+    conn_unlink(req->conn, req);
+  } else if (req->file != NULL && !req->h2_reading) {
+    file_cache_release(req->file);
+    req->file = NULL;
+  }
 
-  return HPE_OK;
+  req_response_close(req, reason);
+  req->conn = NULL;
+  req_release_thread(req);
+  req_unref(req);
 }
 
-static int conn_on_header_value(llhttp_t* http, const char* p, size_t len) {
-  conn_t* conn = http->data;
+/* Reads a finite, non-negative number from the stack top */
+static int load_uint64(duk_context* ctx, uint64_t* out) {
+  double value = duk_get_number(ctx, -1);
 
-  append_to_buffer(&conn->header_value, p, len);
+  /* NOTE: Also rejects `Infinity`, casting it to integer is undefined */
+  if (!duk_is_number(ctx, -1) ||
+      !(value >= 0 && value <= 9007199254740991.0)) {
+    return 0;
+  }
 
-  return HPE_OK;
+  *out = (uint64_t) value;
+  return 1;
 }
 
-static int conn_on_message_complete(llhttp_t* http) {
-  conn_t* conn = http->data;
-  duk_context* ctx = conn->duk_ctx;
+/*
+ * Reads the options of a proxy route, `proxy` value is on the stack top and
+ * the route object below it. The value is either an `http://` url that the
+ * request url is appended to, or a function that returns the whole url.
+ */
+static int load_proxy(duk_context* ctx, const char* key, route_t* route) {
+  if (route->parse_json || route->multipart) {
+    fprintf(stderr, "Route \"%s\" can't proxy parsed bodies\n", key);
+    return -1;
+  }
 
-  CHECK(conn->url.base != NULL);
+  /* NOTE: Body is passed on as it arrives */
+  route->proxy = 1;
+  route->stream_body = 1;
 
-  conn_add_headers(conn);
+  duk_get_prop_string(ctx, -2, "timeout");
+  if (!duk_is_undefined(ctx, -1)) {
+    if (!load_uint64(ctx, &route->proxy_timeout)) {
+      fprintf(stderr, "Route \"%s\" has invalid timeout\n", key);
+      return -1;
+    }
+  }
+  duk_pop(ctx);
 
-  duk_push_lstring(ctx, conn->url.base, conn->url.len);
-  duk_push_string(ctx, llhttp_method_name(http->method));
+  if (duk_is_callable(ctx, -1)) {
+    return 0;
+  }
 
-  duk_call(ctx, 3);
+  duk_size_t url_len;
+  const char* url = duk_get_lstring(ctx, -1, &url_len);
+  const char* host;
+  size_t host_len;
+  unsigned short port;
+  const char* path;
+  size_t path_len;
 
-  /* The result of execution must be an object */
-  duk_require_object(ctx, -1);
+  if (url == NULL ||
+      upstream_parse_url(url, url_len, &host, &host_len, &port, &path,
+                         &path_len) != 0 ||
+      memchr(path, '?', path_len) != NULL ||
+      (route->upstream = upstream_get(host, host_len, port)) == NULL) {
+    fprintf(stderr, "Route \"%s\" has invalid proxy url\n", key);
+    return -1;
+  }
 
-  /* Get res.code */
-  duk_push_string(ctx, "code");
-  duk_get_prop(ctx, -2);
+  /* `http://host/` and `http://host` are the same */
+  if (path_len != 0 && path[path_len - 1] == '/') {
+    path_len--;
+  }
 
-  duk_int_t code = duk_require_int(ctx, -1);
-  duk_pop(ctx);
+  route->proxy_path = malloc(path_len + 1);
+  CHECK(route->proxy_path != NULL);
+  memcpy(route->proxy_path, path, path_len);
+  route->proxy_path[path_len] = '\0';
+  route->proxy_path_len = path_len;
 
-  /* Get res.body */
-  duk_push_string(ctx, "body");
-  duk_get_prop(ctx, -2);
+  return 0;
+}
 
-  duk_size_t body_len;
-  const char* body = duk_require_lstring(ctx, -1, &body_len);
-  CHECK(body != NULL);
-  duk_pop(ctx);
+/* Compiles `{ "GET /users/:id": fn, "/health": fn }` from the stack top */
+static int load_routes(duk_context* ctx) {
+  router_init(&router);
+  use_router = 1;
 
-  /* TODO(indutny): check body length? */
+  duk_enum(ctx, -1, DUK_ENUM_OWN_PROPERTIES_ONLY);
+  while (duk_next(ctx, -1, 1)) {
+    duk_size_t key_len;
+    const char* key = duk_get_lstring(ctx, -2, &key_len);
+    const char* pattern = key;
+    size_t pattern_len = key_len;
+    int method = ROUTER_ANY_METHOD;
+    int valid = 1;
 
-  /* Pop the result itself */
-  duk_pop(ctx);
+    /* Optional method prefix */
+    const char* space = memchr(key, ' ', key_len);
+    if (space != NULL) {
+      method = router_method_from_name(key, space - key);
+      valid = method != -1;
+      pattern = space + 1;
+      pattern_len = key_len - (pattern - key);
+    }
 
-  int response_len = snprintf(NULL, 0,
-      "HTTP/1.1 %d HTTP/1.1 WHATEVER\r\n"
-      "Content-Length: %lld\r\n"
-      "\r\n",
-      code,
-      (long long) body_len);
+    if (!valid || pattern_len == 0 || pattern[0] != '/') {
+      fprintf(stderr, "Invalid route: \"%s\"\n", key);
+      return -1;
+    }
 
-  uv_write_t* req;
-  req = malloc(sizeof(*req) + response_len + body_len + 1);
-  CHECK(req != NULL);
+    route_t route;
+    route.max_body_size = max_body_size;
+    route.stream_body = 0;
+    route.parse_json = 0;
+    route.multipart = 0;
+    route.max_files = DEFAULT_MAX_FILES;
+    route.proxy = 0;
+    route.upstream = NULL;
+    route.proxy_path = NULL;
+    route.proxy_path_len = 0;
+    route.proxy_timeout = DEFAULT_PROXY_TIMEOUT;
 
-  char* response = ((char*) req) + sizeof(*req);
+    /*
+     * `{ handler, maxBodySize, streamBody, parseJson, multipart, maxFiles }`,
+     * or
+     * `{ proxy, timeout, maxBodySize }`
+     */
+    if (duk_is_object(ctx, -1) && !duk_is_callable(ctx, -1)) {
+      duk_get_prop_string(ctx, -1, "streamBody");
+      route.stream_body = duk_to_boolean(ctx, -1);
+      duk_pop(ctx);
 
-  CHECK_EQ(response_len, snprintf(response, response_len + 1,
-      "HTTP/1.1 %d HTTP/1.1 WHATEVER\r\n"
-      "Content-Length: %lld\r\n"
-      "\r\n",
-      code,
-      (long long) body_len));
+      duk_get_prop_string(ctx, -1, "parseJson");
+      route.parse_json = duk_to_boolean(ctx, -1);
+      duk_pop(ctx);
 
-  memcpy(response + response_len, body, body_len);
+      duk_get_prop_string(ctx, -1, "multipart");
+      route.multipart = duk_to_boolean(ctx, -1);
+      duk_pop(ctx);
 
-  req->data = conn;
+      if (route.stream_body + route.parse_json + route.multipart > 1) {
+        fprintf(stderr, "Route \"%s\" can only use one of streamBody, "
+            "parseJson and multipart\n", key);
+        return -1;
+      }
 
-  uv_buf_t bufs[1] = { uv_buf_init(response, response_len + body_len) };
+      duk_get_prop_string(ctx, -1, "maxBodySize");
+      if (!duk_is_undefined(ctx, -1)) {
+        if (!load_uint64(ctx, &route.max_body_size)) {
+          fprintf(stderr, "Route \"%s\" has invalid maxBodySize\n", key);
+          return -1;
+        }
+      }
+      duk_pop(ctx);
 
-  CHECK_EQ(0, uv_write(
-        req,
-        (uv_stream_t*) &conn->tcp_client,
-        bufs,
-        1,
-        conn_write_cb));
+      duk_get_prop_string(ctx, -1, "maxFiles");
+      if (!duk_is_undefined(ctx, -1)) {
+        uint64_t max_files;
 
-  /* Finally free request url */
-  free(conn->url.base);
-  conn->url = uv_buf_init(NULL, 0);
+        if (!load_uint64(ctx, &max_files) || max_files > MAX_FILES_LIMIT) {
+          fprintf(stderr, "Route \"%s\" has invalid maxFiles\n", key);
+          return -1;
+        }
+        route.max_files = (unsigned int) max_files;
+      }
+      duk_pop(ctx);
 
-  return HPE_OK;
-}
+      duk_get_prop_string(ctx, -1, "proxy");
+      if (duk_is_undefined(ctx, -1)) {
+        duk_pop(ctx);
+        duk_get_prop_string(ctx, -1, "handler");
+      } else if (load_proxy(ctx, key, &route) != 0) {
+        return -1;
+      }
+      duk_remove(ctx, -2);
+    }
 
-static void bytecode_on_fatal_error(void* udata, const char* message) {
-  (void) udata;
+    if (!route.proxy && !duk_is_callable(ctx, -1)) {
+      fprintf(stderr, "Route \"%s\" must be a function\n", key);
+      return -1;
+    }
+
+    /* NOTE: Consumes the value, proxy urls are parsed already */
+    if (duk_is_callable(ctx, -1)) {
+      route.handler = refs_put(ctx);
+    } else {
+      route.handler = REFS_NONE;
+      duk_pop(ctx);
+    }
+    if (router_add(&router, method, pattern, pattern_len,
+                   router.route_count) != 0) {
+      fprintf(stderr, "Invalid or conflicting route: \"%s\"\n", key);
+      return -1;
+    }
+
+    route_t* new_routes = realloc(routes,
+        router.route_count * sizeof(*routes));
+    CHECK(new_routes != NULL);
+    routes = new_routes;
+    routes[router.route_count - 1] = route;
+
+    duk_pop(ctx);
+  }
+  duk_pop(ctx);
+
+  if (router.route_count == 0) {
+    fprintf(stderr, "Route table is empty\n");
+    return -1;
+  }
 
-  fprintf(stderr, "Compilation error: %s\n", message);
+  return 0;
 }
 
-bytecode_t compile_bytecode(const char* filename) {
-  duk_context* ctx;
+static int load_handler(const char* filename) {
+  duk_context* ctx = duk_ctx;
 
   /* Read file */
   FILE* f = fopen(filename, "r");
@@ -350,38 +4399,171 @@ bytecode_t compile_bytecode(const char* filename) {
 
   fclose(f);
 
-  /* Compile bytecode */
-  ctx = duk_create_heap(NULL, NULL, NULL, NULL, bytecode_on_fatal_error);
-
-  duk_eval_lstring(ctx, code, code_len);
-  duk_dump_function(ctx);
+  /* Evaluate handler in the worker heap */
+  duk_push_string(ctx, filename);
+  int err = duk_pcompile_lstring_filename(ctx, DUK_COMPILE_EVAL,
+      code, code_len);
 
   free(code);
   code = NULL;
 
-  bytecode_t res;
-  void* buffer = duk_require_buffer(ctx, -1, &res.size);
-  CHECK(buffer != NULL);
+  if (err == 0) {
+    err = duk_pcall(ctx, 0);
+  }
+
+  if (err != 0) {
+    fprintf(stderr, "Compilation error: %s\n", duk_safe_to_string(ctx, -1));
+    return -1;
+  }
+
+  if (duk_is_callable(ctx, -1)) {
+    handler_ref = refs_put(ctx);
+    return 0;
+  }
+
+  if (!duk_is_object(ctx, -1)) {
+    fprintf(stderr, "Handler must evaluate to a function or a route table\n");
+    return -1;
+  }
+
+  err = load_routes(ctx);
+  duk_pop(ctx);
+
+  return err;
+}
+
+/* Parses `/prefix=dir` and appends it to `*mounts` */
+static int add_mount(static_mount_t** mounts,
+                     unsigned int* count,
+                     const char* arg) {
+  const char* sep = strchr(arg, '=');
+  static_mount_t* new_mounts;
+  static_mount_t* mount;
+
+  if (sep == NULL || sep[1] == '\0') {
+    return -1;
+  }
 
-  res.buffer = malloc(res.size);
-  CHECK(res.buffer != NULL);
+  new_mounts = realloc(*mounts, (*count + 1) * sizeof(**mounts));
+  CHECK(new_mounts != NULL);
+  *mounts = new_mounts;
 
-  memcpy(res.buffer, buffer, res.size);
+  mount = &new_mounts[(*count)++];
+  mount->prefix = arg;
+  mount->prefix_len = sep - arg;
+  mount->dir = sep + 1;
+  mount->dir_len = strlen(mount->dir);
 
-  duk_destroy_heap(ctx);
+  /* Strip trailing slash */
+  while (mount->dir_len > 1 && mount->dir[mount->dir_len - 1] == '/') {
+    mount->dir_len--;
+  }
+
+  return 0;
+}
 
-  return res;
+static int usage(void) {
+  fprintf(stderr,
+    "Usage:\n"
+    "./dukhttp [--static /prefix=dir]... [--cache /prefix=dir]... [--mmap] "
+    "[--plugin lib]... [--max-body-size bytes] [--upload-dir dir] "
+    "handler.js\r\n");
+  return 1;
 }
 
 int main(int argc, char** argv) {
-  if (argc < 2) {
-    fprintf(stderr,
-      "Usage:\n"
-      "./dukhttp handler.js\r\n");
-    return 1;
+  const char* handler = NULL;
+  const char** plugins = NULL;
+  unsigned int plugin_count = 0;
+  const char* upload_dir = NULL;
+
+  max_body_size = DEFAULT_MAX_BODY_SIZE;
+
+  for (int i = 1; i < argc; i++) {
+    if (strcmp(argv[i], "--static") == 0 && i + 1 < argc) {
+      if (add_mount(&static_mounts, &static_mount_count, argv[++i]) != 0) {
+        return usage();
+      }
+    } else if (strcmp(argv[i], "--cache") == 0 && i + 1 < argc) {
+      if (add_mount(&cache_mounts, &cache_mount_count, argv[++i]) != 0) {
+        return usage();
+      }
+    } else if (strcmp(argv[i], "--plugin") == 0 && i + 1 < argc) {
+      const char** new_plugins = realloc(plugins,
+          (plugin_count + 1) * sizeof(*plugins));
+      CHECK(new_plugins != NULL);
+      plugins = new_plugins;
+      plugins[plugin_count++] = argv[++i];
+    } else if (strcmp(argv[i], "--max-body-size") == 0 && i + 1 < argc) {
+      char* end;
+
+      max_body_size = strtoull(argv[++i], &end, 10);
+      if (end == argv[i] || *end != '\0' || argv[i][0] == '-') {
+        return usage();
+      }
+    } else if (strcmp(argv[i], "--upload-dir") == 0 && i + 1 < argc) {
+      upload_dir = argv[++i];
+    } else if (strcmp(argv[i], "--mmap") == 0) {
+      cache_use_mmap = 1;
+    } else if (handler == NULL && argv[i][0] != '-') {
+      handler = argv[i];
+    } else {
+      return usage();
+    }
+  }
+
+  if (handler == NULL) {
+    return usage();
+  }
+
+  CHECK_EQ(0, uv_loop_init(&loop));
+
+  duk_ctx = duk_create_heap(NULL, NULL, NULL, NULL, worker_on_fatal_error);
+  CHECK(duk_ctx != NULL);
+
+  refs_init(duk_ctx);
+  req_headers_init(duk_ctx);
+  req_request_init(duk_ctx);
+  req_response_init(duk_ctx);
+  sse_init(duk_ctx);
+  ws_init(duk_ctx);
+  header_names_init(duk_ctx);
+  string_cache_init(duk_ctx);
+  timers_init(&loop, duk_ctx);
+  fs_init(&loop, duk_ctx);
+  fetch_init(&loop, duk_ctx);
+
+  file_cache_init(&loop, FILE_CACHE_MAX_ENTRIES);
+  response_cache_init(&loop, duk_ctx, RESPONSE_CACHE_MAX_BYTES);
+  asset_cache_init(&loop);
+  body_pool_init(BODY_POOL_MAX_FREE);
+  upload_init(&loop, upload_dir);
+  upstream_init(&loop);
+  proxy_init(&loop);
+
+  for (unsigned int i = 0; i < cache_mount_count; i++) {
+    const static_mount_t* mount = &cache_mounts[i];
+    int err = asset_cache_add_dir(mount->prefix, mount->prefix_len,
+        mount->dir, cache_use_mmap);
+
+    if (err != 0) {
+      fprintf(stderr, "Failed to load %s: %s\n", mount->dir, uv_strerror(err));
+      return 1;
+    }
   }
 
-  bytecode = compile_bytecode(argv[1]);
+  plugins_init();
+  for (unsigned int i = 0; i < plugin_count; i++) {
+    if (plugins_load(plugins[i]) != 0) {
+      free(plugins);
+      return 1;
+    }
+  }
+  free(plugins);
+
+  if (load_handler(handler) != 0) {
+    return 1;
+  }
 
   llhttp_settings_init(&http_settings);
 
@@ -389,9 +4571,27 @@ int main(int argc, char** argv) {
   http_settings.on_url = conn_on_url;
   http_settings.on_message_complete = conn_on_message_complete;
   http_settings.on_header_field = conn_on_header_field;
+  http_settings.on_header_field_complete = conn_on_header_field_complete;
   http_settings.on_header_value = conn_on_header_value;
+  http_settings.on_headers_complete = conn_on_headers_complete;
+  http_settings.on_body = conn_on_body;
 
-  CHECK_EQ(0, uv_loop_init(&loop));
+  h2_init();
+
+  h2_callbacks.on_stream = conn_h2_on_stream;
+  h2_callbacks.on_header = conn_h2_on_header;
+  h2_callbacks.on_headers_complete = conn_h2_on_headers_complete;
+  h2_callbacks.on_data = conn_h2_on_data;
+  h2_callbacks.on_end = conn_h2_on_end;
+  h2_callbacks.on_drain = conn_h2_on_drain;
+  h2_callbacks.on_close = conn_h2_on_close;
+  h2_callbacks.on_fail = conn_on_h2_fail;
+
+  proxy_callbacks.on_response = req_proxy_on_response;
+  proxy_callbacks.on_data = req_proxy_on_data;
+  proxy_callbacks.on_end = req_proxy_on_end;
+  proxy_callbacks.on_error = req_proxy_on_error;
+  proxy_callbacks.on_drain = req_on_body_drain;
 
   CHECK_EQ(0, uv_tcp_init(&loop, &tcp_server));
 
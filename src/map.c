@@ -0,0 +1,108 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "map.h"
+#include "common.h"
+
+static const unsigned int MAP_MIN_SIZE = 16;
+
+void map_init(map_t* map, unsigned int size) {
+  /* Round up to the power of two */
+  unsigned int pow2 = MAP_MIN_SIZE;
+  while (pow2 < size) {
+    pow2 *= 2;
+  }
+
+  map->buckets = calloc(pow2, sizeof(*map->buckets));
+  CHECK(map->buckets != NULL);
+
+  map->size = pow2;
+  map->count = 0;
+}
+
+void map_destroy(map_t* map) {
+  free(map->buckets);
+  map->buckets = NULL;
+  map->size = 0;
+  map->count = 0;
+}
+
+/* FNV-1a */
+uint32_t map_hash(const char* key, size_t key_len) {
+  uint32_t hash = 2166136261u;
+
+  for (size_t i = 0; i < key_len; i++) {
+    hash ^= (uint8_t) key[i];
+    hash *= 16777619u;
+  }
+
+  return hash;
+}
+
+map_entry_t* map_get(map_t* map, const char* key, size_t key_len,
+                     uint32_t hash) {
+  map_entry_t* entry = map->buckets[hash & (map->size - 1)];
+
+  for (; entry != NULL; entry = entry->next) {
+    if (entry->hash == hash &&
+        entry->key_len == key_len &&
+        memcmp(entry->key, key, key_len) == 0) {
+      return entry;
+    }
+  }
+
+  return NULL;
+}
+
+static void map_grow(map_t* map) {
+  unsigned int new_size = map->size * 2;
+  map_entry_t** buckets;
+
+  buckets = calloc(new_size, sizeof(*buckets));
+  CHECK(buckets != NULL);
+
+  for (unsigned int i = 0; i < map->size; i++) {
+    map_entry_t* entry = map->buckets[i];
+
+    while (entry != NULL) {
+      map_entry_t* next = entry->next;
+      map_entry_t** bucket = &buckets[entry->hash & (new_size - 1)];
+
+      entry->next = *bucket;
+      *bucket = entry;
+      entry = next;
+    }
+  }
+
+  free(map->buckets);
+  map->buckets = buckets;
+  map->size = new_size;
+}
+
+void map_insert(map_t* map, map_entry_t* entry) {
+  if (map->count >= map->size) {
+    map_grow(map);
+  }
+
+  map_entry_t** bucket = &map->buckets[entry->hash & (map->size - 1)];
+
+  entry->next = *bucket;
+  *bucket = entry;
+  map->count++;
+}
+
+void map_remove(map_t* map, map_entry_t* entry) {
+  map_entry_t** p = &map->buckets[entry->hash & (map->size - 1)];
+
+  for (; *p != NULL; p = &(*p)->next) {
+    if (*p == entry) {
+      *p = entry->next;
+      entry->next = NULL;
+      map->count--;
+      return;
+    }
+  }
+
+  /* Not in the map */
+  CHECK(0);
+}
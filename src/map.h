@@ -0,0 +1,40 @@
+#ifndef SRC_MAP_H_
+#define SRC_MAP_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+/*
+ * Intrusive chained hash map keyed by byte strings. Entries are embedded into
+ * the owning structures (see `CONTAINER_OF`), and keys are not copied.
+ */
+
+typedef struct map_entry_s map_entry_t;
+typedef struct map_s map_t;
+
+struct map_entry_s {
+  map_entry_t* next;
+  uint32_t hash;
+  const char* key;
+  size_t key_len;
+};
+
+struct map_s {
+  map_entry_t** buckets;
+  unsigned int size;
+  unsigned int count;
+};
+
+void map_init(map_t* map, unsigned int size);
+void map_destroy(map_t* map);
+
+uint32_t map_hash(const char* key, size_t key_len);
+
+map_entry_t* map_get(map_t* map, const char* key, size_t key_len,
+                     uint32_t hash);
+
+/* NOTE: `entry->key`, `entry->key_len` and `entry->hash` must be set */
+void map_insert(map_t* map, map_entry_t* entry);
+void map_remove(map_t* map, map_entry_t* entry);
+
+#endif  /* SRC_MAP_H_ */
@@ -0,0 +1,85 @@
+#include <string.h>
+
+#include "mime.h"
+#include "common.h"
+
+typedef struct mime_type_s mime_type_t;
+struct mime_type_s {
+  const char* ext;
+  const char* type;
+};
+
+static const mime_type_t mime_types[] = {
+  { "html", "text/html; charset=utf-8" },
+  { "htm", "text/html; charset=utf-8" },
+  { "css", "text/css; charset=utf-8" },
+  { "js", "application/javascript; charset=utf-8" },
+  { "mjs", "application/javascript; charset=utf-8" },
+  { "json", "application/json" },
+  { "map", "application/json" },
+  { "txt", "text/plain; charset=utf-8" },
+  { "xml", "application/xml" },
+  { "svg", "image/svg+xml" },
+  { "png", "image/png" },
+  { "jpg", "image/jpeg" },
+  { "jpeg", "image/jpeg" },
+  { "gif", "image/gif" },
+  { "webp", "image/webp" },
+  { "ico", "image/x-icon" },
+  { "woff", "font/woff" },
+  { "woff2", "font/woff2" },
+  { "ttf", "font/ttf" },
+  { "wasm", "application/wasm" },
+  { "pdf", "application/pdf" },
+  { "mp4", "video/mp4" },
+  { "webm", "video/webm" },
+  { "mp3", "audio/mpeg" },
+};
+
+static const char* MIME_DEFAULT = "application/octet-stream";
+
+const char* mime_from_path(const char* path, size_t path_len) {
+  size_t i;
+
+  for (i = path_len; i > 0; i--) {
+    char c = path[i - 1];
+    if (c == '.') {
+      break;
+    }
+    if (c == '/') {
+      return MIME_DEFAULT;
+    }
+  }
+
+  if (i == 0) {
+    return MIME_DEFAULT;
+  }
+
+  const char* ext = path + i;
+  size_t ext_len = path_len - i;
+
+  for (size_t j = 0; j < ARRAY_SIZE(mime_types); j++) {
+    const char* candidate = mime_types[j].ext;
+
+    if (strlen(candidate) != ext_len) {
+      continue;
+    }
+
+    size_t k;
+    for (k = 0; k < ext_len; k++) {
+      char c = ext[k];
+      if (c >= 'A' && c <= 'Z') {
+        c += 'a' - 'A';
+      }
+      if (c != candidate[k]) {
+        break;
+      }
+    }
+
+    if (k == ext_len) {
+      return mime_types[j].type;
+    }
+  }
+
+  return MIME_DEFAULT;
+}
@@ -0,0 +1,9 @@
+#ifndef SRC_MIME_H_
+#define SRC_MIME_H_
+
+#include <stddef.h>
+
+/* Returns `Content-Type` for the file extension of `path` */
+const char* mime_from_path(const char* path, size_t path_len);
+
+#endif  /* SRC_MIME_H_ */
@@ -0,0 +1,421 @@
+#include <string.h>
+
+#include "multipart.h"
+
+/* Typedefs */
+
+enum multipart_state_e {
+  kMultipartPreamble,
+  kMultipartAfterDelimiter,
+  kMultipartAfterDelimiterCr,
+  kMultipartFinalDash,
+  kMultipartHeaders,
+  kMultipartBody,
+  kMultipartEpilogue,
+  kMultipartError
+};
+
+/* Slice of the header buffer, terminated in place once all are found */
+typedef struct multipart_value_s multipart_value_t;
+struct multipart_value_s {
+  const char* str;
+  size_t len;
+  int quoted;
+};
+
+/* Helpers */
+
+static int multipart_is_space(char c) {
+  return c == ' ' || c == '\t';
+}
+
+static char multipart_lower(char c) {
+  return (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c;
+}
+
+/* `expected` is lowercase */
+static int multipart_name_eq(const char* name,
+                             size_t name_len,
+                             const char* expected) {
+  size_t expected_len = strlen(expected);
+
+  if (name_len != expected_len) {
+    return 0;
+  }
+
+  for (size_t i = 0; i < name_len; i++) {
+    if (multipart_lower(name[i]) != expected[i]) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static void multipart_trim(const char** str, size_t* len) {
+  while (*len != 0 && multipart_is_space(**str)) {
+    (*str)++;
+    (*len)--;
+  }
+  while (*len != 0 && multipart_is_space((*str)[*len - 1])) {
+    (*len)--;
+  }
+}
+
+/* Unescapes quoted-pair, and terminates the value */
+static void multipart_value_finish(multipart_value_t* value) {
+  /* NOTE: Values of the part headers point into `parser->header` */
+  char* str = (char*) value->str;
+
+  if (str == NULL) {
+    return;
+  }
+
+  if (value->quoted) {
+    size_t out = 0;
+
+    for (size_t i = 0; i < value->len; i++) {
+      if (str[i] == '\\' && i + 1 < value->len) {
+        i++;
+      }
+      str[out++] = str[i];
+    }
+    value->len = out;
+  }
+
+  str[value->len] = '\0';
+}
+
+/* Finds `key` in `type; a=b; key="value"`, leaves `value` as is otherwise */
+static void multipart_find_param(const char* p,
+                                 const char* end,
+                                 const char* key,
+                                 multipart_value_t* value) {
+  /* Skip the type */
+  p = memchr(p, ';', end - p);
+  if (p == NULL) {
+    return;
+  }
+
+  while (p != end && *p == ';') {
+    multipart_value_t param;
+
+    for (p++; p != end && multipart_is_space(*p); p++) {
+    }
+
+    const char* name = p;
+    while (p != end && *p != '=' && *p != ';') {
+      p++;
+    }
+    size_t name_len = p - name;
+    while (name_len != 0 && multipart_is_space(name[name_len - 1])) {
+      name_len--;
+    }
+
+    if (p == end || *p != '=') {
+      continue;
+    }
+
+    for (p++; p != end && multipart_is_space(*p); p++) {
+    }
+
+    if (p != end && *p == '"') {
+      param.str = ++p;
+      while (p != end && *p != '"') {
+        if (*p == '\\' && p + 1 != end) {
+          p++;
+        }
+        p++;
+      }
+      param.len = p - param.str;
+      param.quoted = 1;
+    } else {
+      param.str = p;
+      while (p != end && *p != ';' && !multipart_is_space(*p)) {
+        p++;
+      }
+      param.len = p - param.str;
+      param.quoted = 0;
+    }
+
+    /* Rest of the parameter, if any */
+    while (p != end && *p != ';') {
+      p++;
+    }
+
+    if (multipart_name_eq(name, name_len, key)) {
+      *value = param;
+      return;
+    }
+  }
+}
+
+static int multipart_on_headers(multipart_t* parser) {
+  multipart_value_t name = { NULL, 0, 0 };
+  multipart_value_t filename = { NULL, 0, 0 };
+  multipart_value_t content_type = { NULL, 0, 0 };
+  multipart_part_t part;
+  char* p = parser->header;
+  char* end = parser->header + parser->header_len;
+
+  /* NOTE: Every line, including the last empty one, ends with `\r\n` */
+  while (p != end) {
+    char* line_end = memchr(p, '\r', end - p);
+    char* colon = memchr(p, ':', line_end - p);
+
+    if (colon != NULL) {
+      const char* value = colon + 1;
+      size_t value_len = line_end - value;
+
+      multipart_trim(&value, &value_len);
+      if (multipart_name_eq(p, colon - p, "content-disposition")) {
+        multipart_find_param(value, value + value_len, "name", &name);
+        multipart_find_param(value, value + value_len, "filename",
+            &filename);
+      } else if (multipart_name_eq(p, colon - p, "content-type")) {
+        content_type.str = value;
+        content_type.len = value_len;
+      }
+    }
+
+    p = line_end + 2;
+  }
+
+  multipart_value_finish(&name);
+  multipart_value_finish(&filename);
+  multipart_value_finish(&content_type);
+
+  part.name = name.str == NULL ? "" : name.str;
+  part.name_len = name.len;
+  part.filename = filename.str;
+  part.filename_len = filename.len;
+  part.content_type = content_type.str;
+  part.content_type_len = content_type.len;
+
+  return parser->settings->on_part_begin(parser, &part);
+}
+
+static int multipart_on_data(multipart_t* parser,
+                             const char* data,
+                             size_t len) {
+  if (parser->state != kMultipartBody || len == 0) {
+    return 0;
+  }
+  return parser->settings->on_part_data(parser, data, len);
+}
+
+static int multipart_on_delimiter(multipart_t* parser) {
+  int in_body = parser->state == kMultipartBody;
+
+  parser->state = kMultipartAfterDelimiter;
+  if (in_body) {
+    return parser->settings->on_part_end(parser);
+  }
+  return 0;
+}
+
+/*
+ * Looks for the delimiter in the part body, or in the preamble. Since `\r`
+ * can't be a part of the boundary, only its first byte needs to be searched
+ * for, and `memchr()` does it with SIMD on common platforms.
+ */
+static const char* multipart_scan(multipart_t* parser,
+                                  const char* p,
+                                  const char* end) {
+  const char* delimiter = parser->delimiter;
+  size_t delimiter_len = parser->delimiter_len;
+
+  /* Continue the match from the previous input */
+  if (parser->match != 0) {
+    size_t match = parser->match;
+
+    while (p != end && match != delimiter_len && *p == delimiter[match]) {
+      p++;
+      match++;
+    }
+
+    if (match == delimiter_len) {
+      parser->match = 0;
+      return multipart_on_delimiter(parser) == 0 ? p : NULL;
+    }
+
+    if (p == end) {
+      parser->match = match;
+      return p;
+    }
+
+    /* Held back bytes were data after all */
+    parser->match = 0;
+    if (multipart_on_data(parser, delimiter, match) != 0) {
+      return NULL;
+    }
+  }
+
+  const char* start = p;
+  for (;;) {
+    const char* cr = memchr(p, '\r', end - p);
+
+    if (cr == NULL) {
+      return multipart_on_data(parser, start, end - start) == 0 ? end : NULL;
+    }
+
+    size_t avail = end - cr;
+    size_t len = avail < delimiter_len ? avail : delimiter_len;
+    if (memcmp(cr, delimiter, len) != 0) {
+      p = cr + 1;
+      continue;
+    }
+
+    if (multipart_on_data(parser, start, cr - start) != 0) {
+      return NULL;
+    }
+
+    /* Input ends with a part of the delimiter */
+    if (len != delimiter_len) {
+      parser->match = len;
+      return end;
+    }
+
+    return multipart_on_delimiter(parser) == 0 ? cr + delimiter_len : NULL;
+  }
+}
+
+static int multipart_error(multipart_t* parser) {
+  parser->state = kMultipartError;
+  return -1;
+}
+
+/* Parser */
+
+int multipart_get_boundary(const char* content_type,
+                           size_t content_type_len,
+                           const char** boundary,
+                           size_t* boundary_len) {
+  static const char type[] = "multipart/form-data";
+  multipart_value_t value = { NULL, 0, 0 };
+  size_t type_len = sizeof(type) - 1;
+
+  if (content_type_len < type_len ||
+      !multipart_name_eq(content_type, type_len, type)) {
+    return -1;
+  }
+
+  multipart_find_param(content_type + type_len,
+      content_type + content_type_len, "boundary", &value);
+
+  /* NOTE: Boundary characters don't need quoted-pair */
+  if (value.len == 0 || value.len > MULTIPART_MAX_BOUNDARY ||
+      memchr(value.str, '\r', value.len) != NULL) {
+    return -1;
+  }
+
+  *boundary = value.str;
+  *boundary_len = value.len;
+  return 0;
+}
+
+void multipart_init(multipart_t* parser,
+                    const char* boundary,
+                    size_t boundary_len,
+                    const multipart_settings_t* settings) {
+  memset(parser, 0, sizeof(*parser));
+
+  parser->settings = settings;
+  parser->state = kMultipartPreamble;
+
+  memcpy(parser->delimiter, "\r\n--", 4);
+  memcpy(parser->delimiter + 4, boundary, boundary_len);
+  parser->delimiter_len = 4 + boundary_len;
+
+  /* The first delimiter may start the body without a preceding `\r\n` */
+  parser->match = 2;
+}
+
+int multipart_execute(multipart_t* parser, const char* data, size_t len) {
+  const char* p = data;
+  const char* end = data + len;
+
+  while (p != end) {
+    char c = *p;
+
+    switch (parser->state) {
+      case kMultipartPreamble:
+      case kMultipartBody:
+        p = multipart_scan(parser, p, end);
+        if (p == NULL) {
+          return multipart_error(parser);
+        }
+        break;
+      case kMultipartAfterDelimiter:
+        p++;
+        if (c == '-') {
+          parser->state = kMultipartFinalDash;
+        } else if (c == '\r') {
+          parser->state = kMultipartAfterDelimiterCr;
+        } else if (!multipart_is_space(c)) {
+          return multipart_error(parser);
+        }
+        break;
+      case kMultipartAfterDelimiterCr:
+        p++;
+        if (c != '\n') {
+          return multipart_error(parser);
+        }
+        parser->header_len = 0;
+        parser->state = kMultipartHeaders;
+        break;
+      case kMultipartFinalDash:
+        p++;
+        if (c != '-') {
+          return multipart_error(parser);
+        }
+        parser->state = kMultipartEpilogue;
+        break;
+      case kMultipartHeaders:
+        {
+          const char* lf = memchr(p, '\n', end - p);
+          size_t len = (lf == NULL ? end : lf + 1) - p;
+
+          if (len > MULTIPART_MAX_HEADER_SIZE - parser->header_len) {
+            return multipart_error(parser);
+          }
+          memcpy(parser->header + parser->header_len, p, len);
+          parser->header_len += len;
+          p += len;
+
+          if (lf == NULL) {
+            break;
+          }
+
+          /* Lines must end with `\r\n` */
+          const char* header = parser->header;
+          size_t header_len = parser->header_len;
+          if (header_len < 2 || header[header_len - 2] != '\r') {
+            return multipart_error(parser);
+          }
+
+          /* Empty line ends the headers */
+          if (header_len != 2 &&
+              (header_len < 4 || header[header_len - 3] != '\n')) {
+            break;
+          }
+
+          parser->state = kMultipartBody;
+          if (multipart_on_headers(parser) != 0) {
+            return multipart_error(parser);
+          }
+        }
+        break;
+      case kMultipartEpilogue:
+        p = end;
+        break;
+      case kMultipartError:
+        return -1;
+    }
+  }
+
+  return parser->state == kMultipartError ? -1 : 0;
+}
+
+int multipart_finish(multipart_t* parser) {
+  return parser->state == kMultipartEpilogue ? 0 : -1;
+}
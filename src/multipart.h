@@ -0,0 +1,77 @@
+#ifndef SRC_MULTIPART_H_
+#define SRC_MULTIPART_H_
+
+#include <stddef.h>
+
+/*
+ * Incremental `multipart/form-data` (RFC 7578) parser. Part bodies are
+ * passed to `on_part_data` as slices of the input, so nothing but the part
+ * headers is copied. A delimiter split between two inputs is held back
+ * until it either completes or turns out to be data.
+ */
+
+#define MULTIPART_MAX_BOUNDARY 70
+#define MULTIPART_MAX_HEADER_SIZE 8192
+
+typedef struct multipart_s multipart_t;
+typedef struct multipart_part_s multipart_part_t;
+typedef struct multipart_settings_s multipart_settings_t;
+
+/* NOTE: Strings are NUL-terminated and valid until `on_part_end` */
+struct multipart_part_s {
+  const char* name;
+  size_t name_len;
+
+  /* `NULL` for fields that aren't files */
+  const char* filename;
+  size_t filename_len;
+
+  /* `NULL` if the part has no `Content-Type` */
+  const char* content_type;
+  size_t content_type_len;
+};
+
+/* Callbacks return `0`, anything else stops the parser */
+struct multipart_settings_s {
+  int (*on_part_begin)(multipart_t* parser, const multipart_part_t* part);
+  int (*on_part_data)(multipart_t* parser, const char* data, size_t len);
+  int (*on_part_end)(multipart_t* parser);
+};
+
+struct multipart_s {
+  void* data;
+
+  const multipart_settings_t* settings;
+  int state;
+
+  /* `\r\n--boundary`, and how much of it the previous input ended with */
+  char delimiter[4 + MULTIPART_MAX_BOUNDARY];
+  size_t delimiter_len;
+  size_t match;
+
+  /* Headers of the current part */
+  char header[MULTIPART_MAX_HEADER_SIZE + 1];
+  size_t header_len;
+};
+
+/*
+ * Finds `boundary` parameter in the value of `Content-Type`. Returns `0`, or
+ * `-1` if it isn't a valid `multipart/form-data` type.
+ */
+int multipart_get_boundary(const char* content_type,
+                           size_t content_type_len,
+                           const char** boundary,
+                           size_t* boundary_len);
+
+void multipart_init(multipart_t* parser,
+                    const char* boundary,
+                    size_t boundary_len,
+                    const multipart_settings_t* settings);
+
+/* Returns `0`, or `-1` if the body is invalid or a callback failed */
+int multipart_execute(multipart_t* parser, const char* data, size_t len);
+
+/* Returns `0` if the final delimiter was seen */
+int multipart_finish(multipart_t* parser);
+
+#endif  /* SRC_MULTIPART_H_ */
@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "plugins.h"
+#include "common.h"
+#include "llhttp.h"
+#include "router.h"
+#include "url.h"
+
+/* Typedefs */
+
+typedef struct plugins_handler_s plugins_handler_t;
+typedef struct plugins_req_s plugins_req_t;
+
+struct plugins_handler_s {
+  dukhttp_handler_t cb;
+  void* data;
+};
+
+/* What `dukhttp_req_t.internal` points to */
+struct plugins_req_s {
+  plugins_header_cb get_header;
+  void* arg;
+};
+
+/* Some static vars */
+
+static const size_t PLUGINS_INITIAL_BUF_SIZE = 1024;
+static const size_t PLUGINS_MAX_HEADER_NAME_LEN = 64;
+static const char PLUGINS_INIT_NAME[] = "dukhttp_plugin_init";
+
+static router_t plugins_router;
+static plugins_handler_t* plugins_handlers;
+static unsigned int plugins_handler_count;
+
+/* Reused by every response, copied into the write request on finish */
+static dukhttp_res_t plugins_res;
+
+/* Helpers */
+
+static void plugins_buf_append(uv_buf_t* buf,
+                               size_t* size,
+                               const void* data,
+                               size_t len) {
+  /* Keep space for the trailing NUL */
+  if (buf->len + len + 1 > *size) {
+    size_t new_size = *size == 0 ? PLUGINS_INITIAL_BUF_SIZE : *size;
+    while (buf->len + len + 1 > new_size) {
+      new_size *= 2;
+    }
+
+    char* base = realloc(buf->base, new_size);
+    CHECK(base != NULL);
+    buf->base = base;
+    *size = new_size;
+  }
+
+  memcpy(buf->base + buf->len, data, len);
+  buf->len += len;
+  buf->base[buf->len] = '\0';
+}
+
+/* Rejects anything that would break out of the header line */
+static int plugins_is_header_safe(const char* str) {
+  return strpbrk(str, "\r\n") == NULL;
+}
+
+/* API */
+
+static int plugins_api_add_route(const char* method,
+                                 const char* pattern,
+                                 dukhttp_handler_t handler,
+                                 void* data) {
+  int num = ROUTER_ANY_METHOD;
+  size_t pattern_len = strlen(pattern);
+
+  if (method != NULL) {
+    num = router_method_from_name(method, strlen(method));
+    if (num == -1) {
+      return -1;
+    }
+  }
+
+  if (handler == NULL || pattern_len == 0 || pattern[0] != '/') {
+    return -1;
+  }
+
+  if (router_add(&plugins_router, num, pattern, pattern_len,
+                 plugins_handler_count) != 0) {
+    return -1;
+  }
+
+  plugins_handler_t* handlers = realloc(plugins_handlers,
+      (plugins_handler_count + 1) * sizeof(*handlers));
+  CHECK(handlers != NULL);
+  plugins_handlers = handlers;
+
+  handlers[plugins_handler_count].cb = handler;
+  handlers[plugins_handler_count].data = data;
+  plugins_handler_count++;
+
+  return 0;
+}
+
+static dukhttp_str_t plugins_api_get_header(const dukhttp_req_t* req,
+                                            const char* name) {
+  const plugins_req_t* internal = req->internal;
+  char lower[PLUGINS_MAX_HEADER_NAME_LEN + 1];
+  dukhttp_str_t res;
+  size_t i;
+
+  res.base = NULL;
+  res.len = 0;
+
+  for (i = 0; name[i] != '\0'; i++) {
+    if (i == PLUGINS_MAX_HEADER_NAME_LEN) {
+      return res;
+    }
+
+    char c = name[i];
+    if (c >= 'A' && c <= 'Z') {
+      c += 'a' - 'A';
+    }
+    lower[i] = c;
+  }
+  lower[i] = '\0';
+
+  uv_buf_t value = internal->get_header(internal->arg, lower);
+  res.base = value.base;
+  res.len = value.len;
+  return res;
+}
+
+static void plugins_api_set_status(dukhttp_res_t* res, int code) {
+  if (code >= 100 && code <= 999) {
+    res->code = code;
+  }
+}
+
+static void plugins_api_set_header(dukhttp_res_t* res,
+                                   const char* name,
+                                   const char* value) {
+  if (!plugins_is_header_safe(name) || !plugins_is_header_safe(value)) {
+    return;
+  }
+
+  plugins_buf_append(&res->headers, &res->headers_size, name, strlen(name));
+  plugins_buf_append(&res->headers, &res->headers_size, ": ", 2);
+  plugins_buf_append(&res->headers, &res->headers_size, value, strlen(value));
+  plugins_buf_append(&res->headers, &res->headers_size, "\r\n", 2);
+}
+
+static void plugins_api_write(dukhttp_res_t* res,
+                              const void* data,
+                              size_t len) {
+  plugins_buf_append(&res->body, &res->body_size, data, len);
+}
+
+static const dukhttp_api_t plugins_api = {
+  DUKHTTP_PLUGIN_ABI_VERSION,
+  plugins_api_add_route,
+  plugins_api_get_header,
+  plugins_api_set_status,
+  plugins_api_set_header,
+  plugins_api_write
+};
+
+/* Plugins */
+
+void plugins_init(void) {
+  router_init(&plugins_router);
+
+  plugins_buf_append(&plugins_res.headers, &plugins_res.headers_size, "", 0);
+  plugins_buf_append(&plugins_res.body, &plugins_res.body_size, "", 0);
+}
+
+int plugins_load(const char* path) {
+  uv_lib_t* lib;
+  dukhttp_plugin_init_t init;
+
+  lib = malloc(sizeof(*lib));
+  CHECK(lib != NULL);
+
+  if (uv_dlopen(path, lib) != 0) {
+    fprintf(stderr, "Failed to load plugin %s: %s\n", path, uv_dlerror(lib));
+    uv_dlclose(lib);
+    free(lib);
+    return -1;
+  }
+
+  if (uv_dlsym(lib, PLUGINS_INIT_NAME, (void**) &init) != 0) {
+    fprintf(stderr, "Plugin %s has no %s()\n", path, PLUGINS_INIT_NAME);
+    uv_dlclose(lib);
+    free(lib);
+    return -1;
+  }
+
+  if (init(&plugins_api) != 0) {
+    fprintf(stderr, "Plugin %s failed to initialize\n", path);
+    return -1;
+  }
+
+  /* NOTE: The library stays loaded for the lifetime of the process */
+  return 0;
+}
+
+int plugins_handle(int method,
+                   const char* url,
+                   size_t url_len,
+                   plugins_header_cb get_header,
+                   void* arg,
+                   dukhttp_res_t** res) {
+  router_match_t match;
+  dukhttp_param_t params[ROUTER_MAX_PARAMS];
+  plugins_req_t internal;
+  dukhttp_req_t req;
+
+  if (plugins_router.route_count == 0) {
+    return 0;
+  }
+
+  size_t path_len = url_path_len(url, url_len);
+
+  if (router_match(&plugins_router, method, url, path_len, &match) != 200) {
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < match.param_count; i++) {
+    params[i].name.base = match.params[i].name;
+    params[i].name.len = match.params[i].name_len;
+    params[i].value.base = match.params[i].value;
+    params[i].value.len = match.params[i].value_len;
+  }
+
+  internal.get_header = get_header;
+  internal.arg = arg;
+
+  req.method = llhttp_method_name(method);
+  req.url.base = url;
+  req.url.len = url_len;
+  req.path.base = url;
+  req.path.len = path_len;
+  req.params = params;
+  req.param_count = match.param_count;
+  req.internal = &internal;
+
+  plugins_res.code = 200;
+  plugins_res.headers.len = 0;
+  plugins_res.headers.base[0] = '\0';
+  plugins_res.body.len = 0;
+
+  const plugins_handler_t* handler = &plugins_handlers[match.value];
+  if (handler->cb(&req, &plugins_res, handler->data) != 0) {
+    return 0;
+  }
+
+  *res = &plugins_res;
+  return 1;
+}
@@ -0,0 +1,45 @@
+#ifndef SRC_PLUGINS_H_
+#define SRC_PLUGINS_H_
+
+#include "uv.h"
+
+#include "dukhttp_plugin.h"
+
+/*
+ * Shared objects with native handlers, see `dukhttp_plugin.h`. Their routes
+ * live in a separate trie that is consulted before the JS handler, and the
+ * requests they don't match fall through to JS.
+ */
+
+/* Returns the value of request header `name` (lowercase), or `NULL` base */
+typedef uv_buf_t (*plugins_header_cb)(void* arg, const char* name);
+
+/* NOTE: The buffers are reused by the next call to `plugins_handle()` */
+struct dukhttp_res_s {
+  int code;
+
+  /* NUL-terminated header lines */
+  uv_buf_t headers;
+  size_t headers_size;
+
+  uv_buf_t body;
+  size_t body_size;
+};
+
+void plugins_init(void);
+
+/* Returns `0`, or `-1` after printing the reason */
+int plugins_load(const char* path);
+
+/*
+ * Returns non-zero if a native handler responded to the request, and fills
+ * `*res` with its response.
+ */
+int plugins_handle(int method,
+                   const char* url,
+                   size_t url_len,
+                   plugins_header_cb get_header,
+                   void* arg,
+                   dukhttp_res_t** res);
+
+#endif  /* SRC_PLUGINS_H_ */
@@ -0,0 +1,868 @@
+#ifdef __linux__
+# define _GNU_SOURCE
+#endif  /* __linux__ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef __linux__
+# include <fcntl.h>
+# include <unistd.h>
+#endif  /* __linux__ */
+
+#include "proxy.h"
+#include "common.h"
+#include "llhttp.h"
+
+/* Typedefs */
+
+struct proxy_s {
+  upstream_wait_t wait;
+  upstream_conn_t* conn;
+  uv_timer_t timer;
+  llhttp_t parser;
+
+  const proxy_callbacks_t* callbacks;
+  void* arg;
+
+  /*
+   * Head and the body written before the connection is there. The head is
+   * kept for another attempt if the request may be retried.
+   */
+  char* out;
+  size_t out_len;
+  size_t out_size;
+
+  int chunked;
+  int head_only;
+  int retry;
+  int ended;
+  int drain;
+
+  /* Incremented for every connection the request is written to */
+  unsigned int attempt;
+  unsigned int writes;
+
+  /* Response */
+  int received;
+  int responded;
+  int complete;
+  int keep_alive;
+  int paused;
+  int in_read;
+  int err;
+  int status;
+
+  /* `name\0value\0` pairs of the response head */
+  char* fields;
+  size_t fields_len;
+  size_t fields_size;
+
+  /* Timer, writes and poll handles that haven't called back yet */
+  unsigned int pending;
+  int done;
+
+  /* Errors during `proxy_new()` are returned instead of called back */
+  int starting;
+
+  /* Socket that the rest of the body may be spliced into */
+  uv_stream_t* splice_out;
+
+#ifdef __linux__
+  int splicing;
+  int in_fd;
+  int out_fd;
+  int pipe_fds[2];
+  size_t pipe_len;
+  uint64_t remaining;
+  uv_poll_t in_poll;
+  uv_poll_t out_poll;
+#endif  /* __linux__ */
+};
+
+typedef struct proxy_write_s proxy_write_t;
+struct proxy_write_s {
+  uv_write_t req;
+  proxy_t* proxy;
+  unsigned int attempt;
+  char data[];
+};
+
+/* Some static vars */
+
+static const size_t PROXY_HIGH_WATERMARK = 65536;
+static const size_t PROXY_MAX_HEAD_SIZE = 64 * 1024;
+
+#ifdef __linux__
+/* Smaller bodies are not worth the extra system calls */
+static const uint64_t PROXY_SPLICE_MIN = 64 * 1024;
+static const size_t PROXY_SPLICE_CHUNK = 65536;
+#endif  /* __linux__ */
+
+static uv_loop_t* proxy_loop;
+static llhttp_settings_t proxy_settings;
+static char proxy_read_buf[65536];
+
+/* Helpers */
+
+static void proxy_append(char** buf, size_t* len, size_t* size,
+                         const char* data, size_t data_len) {
+  if (*len + data_len > *size) {
+    size_t new_size = *size == 0 ? 1024 : *size;
+    char* new_buf;
+
+    while (new_size < *len + data_len) {
+      new_size *= 2;
+    }
+    new_buf = realloc(*buf, new_size);
+    CHECK(new_buf != NULL);
+
+    *buf = new_buf;
+    *size = new_size;
+  }
+
+  memcpy(*buf + *len, data, data_len);
+  *len += data_len;
+}
+
+/* Returns non-zero if `name` is in the comma-separated `list` */
+static int proxy_is_listed(const char* list, size_t list_len,
+                           const char* name, size_t name_len) {
+  const char* end = list + list_len;
+  const char* p = list;
+
+  while (p < end) {
+    const char* token;
+    const char* token_end;
+
+    while (p < end && (*p == ' ' || *p == '\t' || *p == ',')) {
+      p++;
+    }
+    token = p;
+    while (p < end && *p != ',') {
+      p++;
+    }
+    token_end = p;
+    while (token_end > token && (token_end[-1] == ' ' ||
+                                 token_end[-1] == '\t')) {
+      token_end--;
+    }
+
+    if ((size_t) (token_end - token) == name_len &&
+        upstream_equals_nocase(token, name, name_len)) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+int proxy_is_hop_header(const char* name, size_t name_len,
+                        const char* connection, size_t connection_len) {
+  static const char hop[] =
+    "connection, keep-alive, proxy-connection, te, trailer, "
+    "transfer-encoding, upgrade, content-length";
+
+  return proxy_is_listed(hop, sizeof(hop) - 1, name, name_len) ||
+         (connection != NULL &&
+          proxy_is_listed(connection, connection_len, name, name_len));
+}
+
+/* Teardown */
+
+static void proxy_maybe_free(proxy_t* proxy) {
+  if (!proxy->done || proxy->pending != 0) {
+    return;
+  }
+
+  free(proxy);
+}
+
+static void proxy_on_handle_close(uv_handle_t* handle) {
+  proxy_t* proxy = handle->data;
+
+#ifdef __linux__
+  if (handle == (uv_handle_t*) &proxy->in_poll) {
+    close(proxy->in_fd);
+  } else if (handle == (uv_handle_t*) &proxy->out_poll) {
+    close(proxy->out_fd);
+  }
+#endif  /* __linux__ */
+
+  proxy->pending--;
+  proxy_maybe_free(proxy);
+}
+
+/* Lets the connection go, either back to the pool or closed */
+static void proxy_release(proxy_t* proxy, int reuse) {
+  if (proxy->conn == NULL) {
+    upstream_cancel(&proxy->wait);
+    return;
+  }
+
+  uv_read_stop((uv_stream_t*) &proxy->conn->tcp);
+  upstream_release(proxy->conn, reuse);
+  proxy->conn = NULL;
+
+  /* Writes still in flight on it don't count anymore */
+  proxy->attempt++;
+  proxy->writes = 0;
+}
+
+/* NOTE: Memory stays until the handles and the writes call back */
+static void proxy_teardown(proxy_t* proxy) {
+  proxy->done = 1;
+
+#ifdef __linux__
+  if (proxy->splicing) {
+    proxy->splicing = 0;
+    close(proxy->pipe_fds[0]);
+    close(proxy->pipe_fds[1]);
+    uv_close((uv_handle_t*) &proxy->in_poll, proxy_on_handle_close);
+    uv_close((uv_handle_t*) &proxy->out_poll, proxy_on_handle_close);
+  }
+#endif  /* __linux__ */
+
+  free(proxy->out);
+  free(proxy->fields);
+  proxy->out = NULL;
+  proxy->fields = NULL;
+
+  uv_close((uv_handle_t*) &proxy->timer, proxy_on_handle_close);
+}
+
+static void proxy_emit_error(proxy_t* proxy, int err) {
+  if (!proxy->starting) {
+    proxy->callbacks->on_error(proxy->arg, err);
+  }
+}
+
+static void proxy_fail(proxy_t* proxy, int err) {
+  proxy_release(proxy, 0);
+  proxy_teardown(proxy);
+  proxy_emit_error(proxy, err);
+}
+
+static void proxy_finish(proxy_t* proxy, int reuse) {
+  proxy_release(proxy, reuse);
+  proxy_teardown(proxy);
+  proxy->callbacks->on_end(proxy->arg);
+}
+
+void proxy_close(proxy_t* proxy) {
+  proxy_release(proxy, 0);
+  proxy_teardown(proxy);
+}
+
+/* Request */
+
+static void proxy_on_acquire(upstream_wait_t* wait,
+                             upstream_conn_t* conn,
+                             int status);
+
+/*
+ * Servers close keep-alive connections whenever they like, and a request
+ * written to one at that moment is lost. It is sent again on a new
+ * connection if nothing was received and it can be repeated.
+ */
+static void proxy_conn_error(proxy_t* proxy, int err) {
+  upstream_t* upstream = proxy->wait.upstream;
+
+  if (proxy->received || !proxy->retry || proxy->conn->uses == 0) {
+    proxy_fail(proxy, err);
+    return;
+  }
+
+  proxy_release(proxy, 0);
+  proxy->retry = 0;
+
+  err = upstream_acquire(upstream, &proxy->wait, proxy_on_acquire, 1);
+  if (err != 0) {
+    proxy_teardown(proxy);
+    proxy_emit_error(proxy, err);
+  }
+}
+
+static void proxy_on_write(uv_write_t* write_req, int status) {
+  proxy_write_t* write = CONTAINER_OF(write_req, proxy_write_t, req);
+  proxy_t* proxy = write->proxy;
+  unsigned int attempt = write->attempt;
+
+  free(write);
+  proxy->pending--;
+
+  if (proxy->done) {
+    proxy_maybe_free(proxy);
+    return;
+  }
+
+  /* Connection was dropped for a retry */
+  if (attempt != proxy->attempt) {
+    return;
+  }
+  proxy->writes--;
+
+  if (status != 0) {
+    proxy_conn_error(proxy, status);
+    return;
+  }
+
+  if (proxy->drain && proxy->conn != NULL &&
+      uv_stream_get_write_queue_size((uv_stream_t*) &proxy->conn->tcp) <
+          PROXY_HIGH_WATERMARK) {
+    proxy->drain = 0;
+    proxy->callbacks->on_drain(proxy->arg);
+  }
+}
+
+/* Writes the concatenation of the pieces, or queues it until connected */
+static void proxy_send(proxy_t* proxy,
+                       const uv_buf_t* bufs,
+                       unsigned int nbufs) {
+  proxy_write_t* write;
+  size_t len = 0;
+  char* p;
+  uv_buf_t buf;
+  int err;
+
+  if (proxy->conn == NULL) {
+    for (unsigned int i = 0; i < nbufs; i++) {
+      proxy_append(&proxy->out, &proxy->out_len, &proxy->out_size,
+          bufs[i].base, bufs[i].len);
+    }
+    proxy->drain = proxy->out_len >= PROXY_HIGH_WATERMARK;
+    return;
+  }
+
+  for (unsigned int i = 0; i < nbufs; i++) {
+    len += bufs[i].len;
+  }
+
+  write = malloc(sizeof(*write) + len);
+  CHECK(write != NULL);
+
+  write->proxy = proxy;
+  write->attempt = proxy->attempt;
+
+  p = write->data;
+  for (unsigned int i = 0; i < nbufs; i++) {
+    memcpy(p, bufs[i].base, bufs[i].len);
+    p += bufs[i].len;
+  }
+
+  buf = uv_buf_init(write->data, len);
+  err = uv_write(&write->req, (uv_stream_t*) &proxy->conn->tcp, &buf, 1,
+      proxy_on_write);
+  if (err != 0) {
+    free(write);
+    proxy_conn_error(proxy, err);
+    return;
+  }
+
+  proxy->pending++;
+  proxy->writes++;
+  proxy->drain = uv_stream_get_write_queue_size(
+      (uv_stream_t*) &proxy->conn->tcp) >= PROXY_HIGH_WATERMARK;
+}
+
+int proxy_write(proxy_t* proxy, const char* data, size_t len) {
+  char size[32];
+  uv_buf_t bufs[3];
+
+  if (proxy->done || len == 0) {
+    return 1;
+  }
+
+  if (!proxy->chunked) {
+    bufs[0] = uv_buf_init((char*) data, len);
+    proxy_send(proxy, bufs, 1);
+    return proxy->done || !proxy->drain;
+  }
+
+  bufs[0] = uv_buf_init(size, snprintf(size, sizeof(size), "%llx\r\n",
+        (unsigned long long) len));
+  bufs[1] = uv_buf_init((char*) data, len);
+  bufs[2] = uv_buf_init("\r\n", 2);
+  proxy_send(proxy, bufs, 3);
+  return proxy->done || !proxy->drain;
+}
+
+void proxy_end(proxy_t* proxy) {
+  uv_buf_t buf;
+
+  if (proxy->done || proxy->ended) {
+    return;
+  }
+  proxy->ended = 1;
+
+  if (proxy->chunked) {
+    buf = uv_buf_init("0\r\n\r\n", 5);
+    proxy_send(proxy, &buf, 1);
+  }
+}
+
+/* Splicing */
+
+#ifdef __linux__
+
+static void proxy_splice_run(proxy_t* proxy);
+
+static void proxy_on_poll(uv_poll_t* handle, int status, int events) {
+  proxy_t* proxy = handle->data;
+
+  (void) events;
+
+  CHECK_EQ(0, uv_poll_stop(handle));
+
+  if (status != 0) {
+    proxy_fail(proxy, status);
+    return;
+  }
+
+  proxy_splice_run(proxy);
+}
+
+/*
+ * Moves the body from the upstream socket into the pipe and from the pipe
+ * into the client socket, until either of them would block.
+ */
+static void proxy_splice_run(proxy_t* proxy) {
+  ssize_t n;
+
+  /* NOTE: The head and earlier chunks have to get to the socket first */
+  if (uv_stream_get_write_queue_size(proxy->splice_out) != 0) {
+    CHECK_EQ(0, uv_poll_start(&proxy->out_poll, UV_WRITABLE,
+          proxy_on_poll));
+    return;
+  }
+
+  for (;;) {
+    if (proxy->pipe_len != 0) {
+      n = splice(proxy->pipe_fds[0], NULL, proxy->out_fd, NULL,
+          proxy->pipe_len, SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+      if (n < 0 && errno == EAGAIN) {
+        CHECK_EQ(0, uv_poll_start(&proxy->out_poll, UV_WRITABLE,
+              proxy_on_poll));
+        return;
+      }
+      if (n < 0) {
+        proxy_fail(proxy, uv_translate_sys_error(errno));
+        return;
+      }
+
+      proxy->pipe_len -= n;
+      continue;
+    }
+
+    if (proxy->remaining == 0) {
+      break;
+    }
+
+    n = splice(proxy->in_fd, NULL, proxy->pipe_fds[1], NULL,
+        proxy->remaining < PROXY_SPLICE_CHUNK ?
+            (size_t) proxy->remaining : PROXY_SPLICE_CHUNK,
+        SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+    if (n < 0 && errno == EAGAIN) {
+      CHECK_EQ(0, uv_poll_start(&proxy->in_poll, UV_READABLE,
+            proxy_on_poll));
+      return;
+    }
+    if (n <= 0) {
+      proxy_fail(proxy, n == 0 ? UV_EOF : uv_translate_sys_error(errno));
+      return;
+    }
+
+    proxy->remaining -= n;
+    proxy->pipe_len += n;
+  }
+
+  /* NOTE: The socket is right past the response */
+  proxy->complete = 1;
+  proxy_finish(proxy, proxy->keep_alive && proxy->ended &&
+      proxy->writes == 0);
+}
+
+static void proxy_maybe_splice(proxy_t* proxy) {
+  uv_os_fd_t in;
+  uv_os_fd_t out;
+
+  if (proxy->splice_out == NULL || proxy->splicing || proxy->done ||
+      !proxy->responded || proxy->complete || proxy->conn == NULL ||
+      (proxy->parser.flags & F_CONTENT_LENGTH) == 0 ||
+      proxy->parser.content_length < PROXY_SPLICE_MIN) {
+    return;
+  }
+
+  if (uv_fileno((uv_handle_t*) &proxy->conn->tcp, &in) != 0 ||
+      uv_fileno((uv_handle_t*) proxy->splice_out, &out) != 0) {
+    return;
+  }
+
+  /* Own descriptors, so that the polls don't clash with the streams */
+  if (pipe2(proxy->pipe_fds, O_NONBLOCK | O_CLOEXEC) != 0) {
+    return;
+  }
+  proxy->in_fd = dup(in);
+  proxy->out_fd = dup(out);
+  if (proxy->in_fd == -1 || proxy->out_fd == -1) {
+    if (proxy->in_fd != -1) {
+      close(proxy->in_fd);
+    }
+    if (proxy->out_fd != -1) {
+      close(proxy->out_fd);
+    }
+    close(proxy->pipe_fds[0]);
+    close(proxy->pipe_fds[1]);
+    return;
+  }
+
+  CHECK_EQ(0, uv_poll_init(proxy_loop, &proxy->in_poll, proxy->in_fd));
+  CHECK_EQ(0, uv_poll_init(proxy_loop, &proxy->out_poll, proxy->out_fd));
+  proxy->in_poll.data = proxy;
+  proxy->out_poll.data = proxy;
+  proxy->pending += 2;
+
+  uv_read_stop((uv_stream_t*) &proxy->conn->tcp);
+
+  proxy->splicing = 1;
+  proxy->pipe_len = 0;
+  proxy->remaining = proxy->parser.content_length;
+  proxy_splice_run(proxy);
+}
+
+#else  /* !__linux__ */
+
+static void proxy_maybe_splice(proxy_t* proxy) {
+  (void) proxy;
+}
+
+#endif  /* __linux__ */
+
+void proxy_splice(proxy_t* proxy, uv_stream_t* out) {
+  if (proxy->done || proxy->head_only) {
+    return;
+  }
+
+  proxy->splice_out = out;
+  if (!proxy->in_read) {
+    proxy_maybe_splice(proxy);
+  }
+}
+
+/* Response */
+
+static void proxy_alloc_cb(uv_handle_t* handle,
+                           size_t suggested_size,
+                           uv_buf_t* buf) {
+  (void) handle;
+  (void) suggested_size;
+
+  *buf = uv_buf_init(proxy_read_buf, sizeof(proxy_read_buf));
+}
+
+static void proxy_read_cb(uv_stream_t* stream,
+                          ssize_t nread,
+                          const uv_buf_t* buf) {
+  upstream_conn_t* conn = CONTAINER_OF(stream, upstream_conn_t, tcp);
+  proxy_t* proxy = conn->data;
+  llhttp_errno_t err;
+
+  if (nread == 0) {
+    return;
+  }
+
+  if (nread < 0) {
+    /* Responses without `Content-Length` end with the connection */
+    if (nread == UV_EOF && proxy->received) {
+      proxy->in_read = 1;
+      llhttp_finish(&proxy->parser);
+      proxy->in_read = 0;
+
+      if (proxy->done) {
+        return;
+      }
+      if (proxy->complete) {
+        proxy_finish(proxy, 0);
+        return;
+      }
+    }
+
+    proxy_conn_error(proxy, nread == UV_EOF ? UV_ECONNRESET : (int) nread);
+    return;
+  }
+
+  proxy->received = 1;
+  proxy->in_read = 1;
+  err = llhttp_execute(&proxy->parser, buf->base, nread);
+  proxy->in_read = 0;
+
+  /* Closed from one of the callbacks */
+  if (proxy->done) {
+    return;
+  }
+
+  if (err == HPE_PAUSED && proxy->complete) {
+    const char* pos = llhttp_get_error_pos(&proxy->parser);
+
+    /*
+     * NOTE: Anything past the response means the connection is out of sync,
+     * and the server might not have read the whole request before answering.
+     */
+    proxy_finish(proxy, pos == buf->base + nread && proxy->keep_alive &&
+        proxy->ended && proxy->writes == 0);
+    return;
+  }
+
+  if (err != HPE_OK) {
+    proxy_fail(proxy, proxy->err != 0 ? proxy->err : UV_EPROTO);
+    return;
+  }
+
+  if (proxy->paused) {
+    uv_read_stop(stream);
+  }
+  proxy_maybe_splice(proxy);
+}
+
+void proxy_resume(proxy_t* proxy) {
+  if (proxy->done || !proxy->paused) {
+    return;
+  }
+
+  proxy->paused = 0;
+#ifdef __linux__
+  if (proxy->splicing) {
+    return;
+  }
+#endif  /* __linux__ */
+  if (proxy->conn != NULL) {
+    CHECK_EQ(0, uv_read_start((uv_stream_t*) &proxy->conn->tcp,
+          proxy_alloc_cb, proxy_read_cb));
+  }
+}
+
+static void proxy_on_acquire(upstream_wait_t* wait,
+                             upstream_conn_t* conn,
+                             int status) {
+  proxy_t* proxy = CONTAINER_OF(wait, proxy_t, wait);
+  uv_buf_t buf;
+
+  if (status != 0) {
+    proxy_teardown(proxy);
+    proxy_emit_error(proxy, status);
+    return;
+  }
+
+  proxy->conn = conn;
+  conn->data = proxy;
+
+  llhttp_init(&proxy->parser, HTTP_RESPONSE, &proxy_settings);
+  proxy->parser.data = proxy;
+
+  CHECK_EQ(0, uv_read_start((uv_stream_t*) &conn->tcp, proxy_alloc_cb,
+        proxy_read_cb));
+
+  buf = uv_buf_init(proxy->out, proxy->out_len);
+  if (!proxy->retry) {
+    proxy->out_len = 0;
+  }
+  proxy_send(proxy, &buf, 1);
+
+  if (!proxy->done && !proxy->starting && !proxy->drain &&
+      proxy->out_len == 0 && proxy->conn != NULL) {
+    proxy->callbacks->on_drain(proxy->arg);
+  }
+}
+
+static void proxy_timer_cb(uv_timer_t* timer) {
+  proxy_fail(timer->data, UV_ETIMEDOUT);
+}
+
+/* Parser */
+
+static int proxy_on_message_begin(llhttp_t* p) {
+  proxy_t* proxy = p->data;
+
+  /* NOTE: Informational responses are skipped */
+  proxy->status = 0;
+  proxy->fields_len = 0;
+  return 0;
+}
+
+static int proxy_on_head_data(llhttp_t* p, const char* at, size_t length) {
+  proxy_t* proxy = p->data;
+
+  if (proxy->fields_len + length + 1 > PROXY_MAX_HEAD_SIZE) {
+    proxy->err = UV_E2BIG;
+    return -1;
+  }
+
+  proxy_append(&proxy->fields, &proxy->fields_len, &proxy->fields_size, at,
+      length);
+  return 0;
+}
+
+static int proxy_on_head_complete(llhttp_t* p) {
+  return proxy_on_head_data(p, "", 1);
+}
+
+/* Serializes the headers to pass on, returns a string to be freed */
+static char* proxy_serialize_headers(proxy_t* proxy) {
+  const char* connection = NULL;
+  size_t connection_len = 0;
+  const char* end = proxy->fields + proxy->fields_len;
+  const char* p;
+  char* out = NULL;
+  size_t out_len = 0;
+  size_t out_size = 0;
+
+  for (p = proxy->fields; p != end; ) {
+    size_t name_len = strlen(p);
+    const char* value = p + name_len + 1;
+
+    if (name_len == 10 && upstream_equals_nocase(p, "connection", 10)) {
+      connection = value;
+      connection_len = strlen(value);
+    }
+    p = value + strlen(value) + 1;
+  }
+
+  for (p = proxy->fields; p != end; ) {
+    size_t name_len = strlen(p);
+    const char* value = p + name_len + 1;
+    size_t value_len = strlen(value);
+
+    if (!proxy_is_hop_header(p, name_len, connection, connection_len)) {
+      proxy_append(&out, &out_len, &out_size, p, name_len);
+      proxy_append(&out, &out_len, &out_size, ": ", 2);
+      proxy_append(&out, &out_len, &out_size, value, value_len);
+      proxy_append(&out, &out_len, &out_size, "\r\n", 2);
+    }
+    p = value + value_len + 1;
+  }
+  proxy_append(&out, &out_len, &out_size, "", 1);
+
+  return out;
+}
+
+static int proxy_on_headers_complete(llhttp_t* p) {
+  proxy_t* proxy = p->data;
+  int64_t content_length = -1;
+  char* headers;
+
+  proxy->status = p->status_code;
+  if (proxy->status < 200) {
+    return 0;
+  }
+
+  if (p->flags & F_CONTENT_LENGTH) {
+    content_length = (int64_t) p->content_length;
+  }
+
+  proxy->keep_alive = llhttp_should_keep_alive(p);
+  proxy->responded = 1;
+  uv_timer_stop(&proxy->timer);
+
+  /* NOTE: The request doesn't need to be sent again from now on */
+  if (proxy->retry) {
+    proxy->retry = 0;
+    proxy->out_len = 0;
+  }
+
+  headers = proxy_serialize_headers(proxy);
+  proxy->callbacks->on_response(proxy->arg, proxy->status, headers,
+      content_length);
+  free(headers);
+
+  if (proxy->done) {
+    return -1;
+  }
+
+  /* No body */
+  return proxy->head_only ? 1 : 0;
+}
+
+static int proxy_on_body(llhttp_t* p, const char* at, size_t length) {
+  proxy_t* proxy = p->data;
+
+  if (!proxy->callbacks->on_data(proxy->arg, at, length)) {
+    proxy->paused = 1;
+  }
+  return proxy->done ? -1 : 0;
+}
+
+static int proxy_on_message_complete(llhttp_t* p) {
+  proxy_t* proxy = p->data;
+
+  if (proxy->status < 200) {
+    return 0;
+  }
+
+  proxy->complete = 1;
+  return HPE_PAUSED;
+}
+
+proxy_t* proxy_new(upstream_t* upstream,
+                   const char* head,
+                   size_t head_len,
+                   int chunked,
+                   int head_only,
+                   int retry,
+                   uint64_t timeout,
+                   const proxy_callbacks_t* callbacks,
+                   void* arg) {
+  proxy_t* proxy;
+  int err;
+
+  proxy = malloc(sizeof(*proxy));
+  CHECK(proxy != NULL);
+
+  memset(proxy, 0, sizeof(*proxy));
+
+  proxy->chunked = chunked;
+  proxy->head_only = head_only;
+  proxy->retry = retry;
+  proxy->callbacks = callbacks;
+  proxy->arg = arg;
+
+  proxy_append(&proxy->out, &proxy->out_len, &proxy->out_size, head,
+      head_len);
+
+  CHECK_EQ(0, uv_timer_init(proxy_loop, &proxy->timer));
+  proxy->timer.data = proxy;
+  proxy->pending = 1;
+  if (timeout != 0) {
+    CHECK_EQ(0, uv_timer_start(&proxy->timer, proxy_timer_cb, timeout, 0));
+  }
+
+  proxy->starting = 1;
+  err = upstream_acquire(upstream, &proxy->wait, proxy_on_acquire, 0);
+  proxy->starting = 0;
+
+  if (err != 0) {
+    proxy_teardown(proxy);
+    return NULL;
+  }
+
+  /* Idle connection was there, but writing to it failed */
+  if (proxy->done) {
+    return NULL;
+  }
+
+  return proxy;
+}
+
+void proxy_init(uv_loop_t* loop) {
+  proxy_loop = loop;
+
+  llhttp_settings_init(&proxy_settings);
+  proxy_settings.on_message_begin = proxy_on_message_begin;
+  proxy_settings.on_header_field = proxy_on_head_data;
+  proxy_settings.on_header_field_complete = proxy_on_head_complete;
+  proxy_settings.on_header_value = proxy_on_head_data;
+  proxy_settings.on_header_value_complete = proxy_on_head_complete;
+  proxy_settings.on_headers_complete = proxy_on_headers_complete;
+  proxy_settings.on_body = proxy_on_body;
+  proxy_settings.on_message_complete = proxy_on_message_complete;
+}
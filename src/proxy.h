@@ -0,0 +1,86 @@
+#ifndef SRC_PROXY_H_
+#define SRC_PROXY_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "uv.h"
+#include "upstream.h"
+
+/*
+ * Requests forwarded to upstream servers. The head is written to a
+ * connection borrowed from the upstream's pool, and the body follows piece
+ * by piece as it arrives. The response head is parsed and passed on without
+ * hop-by-hop headers, and so is the body, unless it is moved from socket to
+ * socket with `splice()` through a pipe. Either way no message is buffered
+ * as a whole.
+ */
+
+typedef struct proxy_s proxy_t;
+typedef struct proxy_callbacks_s proxy_callbacks_t;
+
+struct proxy_callbacks_s {
+  /*
+   * `headers` are `Name: value\r\n` lines without framing headers,
+   * `content_length` is `-1` if the body ends otherwise.
+   */
+  void (*on_response)(void* arg,
+                      int status,
+                      const char* headers,
+                      int64_t content_length);
+
+  /* Returns zero to stop reading the response for now */
+  int (*on_data)(void* arg, const char* data, size_t len);
+
+  /* Last callback of the proxy, unless it is closed */
+  void (*on_end)(void* arg);
+  void (*on_error)(void* arg, int err);
+
+  /* Request body written with `proxy_write()` got below the limit */
+  void (*on_drain)(void* arg);
+};
+
+void proxy_init(uv_loop_t* loop);
+
+/*
+ * Returns non-zero for headers that apply to a single connection, including
+ * the ones named in the `Connection` header value, which may be `NULL`.
+ */
+int proxy_is_hop_header(const char* name, size_t name_len,
+                        const char* connection, size_t connection_len);
+
+/*
+ * Sends `head` to the upstream, the request body follows chunked if
+ * `chunked` is set. Without `retry` the request isn't sent again when a
+ * reused connection turns out to be closed. `timeout` is in milliseconds
+ * and applies until the response head arrives.
+ */
+proxy_t* proxy_new(upstream_t* upstream,
+                   const char* head,
+                   size_t head_len,
+                   int chunked,
+                   int head_only,
+                   int retry,
+                   uint64_t timeout,
+                   const proxy_callbacks_t* callbacks,
+                   void* arg);
+
+/* Returns zero once too much of the request body is waiting to be sent */
+int proxy_write(proxy_t* proxy, const char* data, size_t len);
+
+/* Request body is complete */
+void proxy_end(proxy_t* proxy);
+
+void proxy_resume(proxy_t* proxy);
+
+/*
+ * Moves the rest of the response body straight into `out` once its write
+ * queue is empty, if the body has a known length. No-op on platforms
+ * without `splice()`.
+ */
+void proxy_splice(proxy_t* proxy, uv_stream_t* out);
+
+/* Stops the request, no callbacks are called after this */
+void proxy_close(proxy_t* proxy);
+
+#endif  /* SRC_PROXY_H_ */
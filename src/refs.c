@@ -0,0 +1,67 @@
+#include "refs.h"
+#include "common.h"
+
+/* NOTE: kept alive by the heap stash */
+static void* refs_table;
+
+void refs_init(duk_context* ctx) {
+  duk_push_heap_stash(ctx);
+
+  duk_push_array(ctx);
+  refs_table = duk_get_heapptr(ctx, -1);
+
+  /* Head of the free list */
+  duk_push_int(ctx, REFS_NONE);
+  duk_put_prop_index(ctx, -2, 0);
+
+  duk_put_prop_string(ctx, -2, "refs");
+  duk_pop(ctx);
+}
+
+int refs_put(duk_context* ctx) {
+  int ref;
+
+  CHECK(refs_table != NULL);
+
+  duk_push_heapptr(ctx, refs_table);
+
+  duk_get_prop_index(ctx, -1, 0);
+  ref = duk_get_int(ctx, -1);
+  duk_pop(ctx);
+
+  if (ref != REFS_NONE) {
+    /* Reuse free slot, its value is the next free slot */
+    duk_get_prop_index(ctx, -1, ref);
+    duk_put_prop_index(ctx, -2, 0);
+  } else {
+    ref = (int) duk_get_length(ctx, -1);
+  }
+
+  duk_dup(ctx, -2);
+  duk_put_prop_index(ctx, -2, ref);
+  duk_pop_2(ctx);
+
+  return ref;
+}
+
+void refs_push(duk_context* ctx, int ref) {
+  CHECK(ref != REFS_NONE);
+
+  duk_push_heapptr(ctx, refs_table);
+  duk_get_prop_index(ctx, -1, ref);
+  duk_remove(ctx, -2);
+}
+
+void refs_del(duk_context* ctx, int ref) {
+  CHECK(ref != REFS_NONE);
+
+  duk_push_heapptr(ctx, refs_table);
+
+  duk_get_prop_index(ctx, -1, 0);
+  duk_put_prop_index(ctx, -2, ref);
+
+  duk_push_int(ctx, ref);
+  duk_put_prop_index(ctx, -2, 0);
+
+  duk_pop(ctx);
+}
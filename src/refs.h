@@ -0,0 +1,22 @@
+#ifndef SRC_REFS_H_
+#define SRC_REFS_H_
+
+#include "duktape.h"
+
+/*
+ * References to JS values held by C code. Values are kept alive in an array
+ * in the heap stash, and the freed slots are chained into a free list that
+ * starts at index 0.
+ */
+
+#define REFS_NONE 0
+
+void refs_init(duk_context* ctx);
+
+/* Pops the value from the top of the stack and returns its reference */
+int refs_put(duk_context* ctx);
+
+void refs_push(duk_context* ctx, int ref);
+void refs_del(duk_context* ctx, int ref);
+
+#endif  /* SRC_REFS_H_ */
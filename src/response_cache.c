@@ -0,0 +1,551 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "response_cache.h"
+#include "common.h"
+
+/* Typedefs */
+
+/* Header names that responses for a method and url vary on */
+struct response_vary_s {
+  map_entry_t map_entry;
+  char* key;
+
+  char** names;
+  unsigned int count;
+
+  /* Number of cached entries that were stored with this list */
+  unsigned int entries;
+  int in_map;
+};
+
+typedef struct response_waiter_s response_waiter_t;
+struct response_waiter_s {
+  response_flight_cb cb;
+  void* arg;
+};
+
+/* Response being computed, keyed like the entries */
+struct response_flight_s {
+  map_entry_t map_entry;
+  response_flight_t* next;
+
+  response_waiter_t* waiters;
+  unsigned int waiter_count;
+};
+
+/* Some static vars */
+
+static const unsigned int INITIAL_MAP_SIZE = 256;
+static const unsigned int MAX_FLIGHT_WAITERS = 128;
+
+static uv_loop_t* response_cache_loop;
+static size_t response_cache_max_bytes;
+
+/* `method \0 url` => `response_vary_t` */
+static map_t response_vary_map;
+
+/* `method \0 url \0 (name=value \0)*` => `response_entry_t` */
+static map_t response_cache_map;
+
+/* Same keys as above => `response_flight_t` */
+static map_t response_flight_map;
+
+/* Flights whose waiters are about to be called back */
+static response_flight_t* response_cache_landed;
+static uv_idle_t response_cache_idle;
+
+static response_entry_t* response_cache_lru_head;
+static response_entry_t* response_cache_lru_tail;
+
+/* Scratch space for building keys */
+static char* response_cache_key;
+static size_t response_cache_key_size;
+
+static struct {
+  double hits;
+  double misses;
+  double evictions;
+  double expirations;
+  double coalesced;
+  double entries;
+  double bytes;
+} response_cache_stats;
+
+/* LRU */
+
+static void response_cache_lru_unlink(response_entry_t* entry) {
+  if (entry->lru_prev != NULL) {
+    entry->lru_prev->lru_next = entry->lru_next;
+  } else {
+    response_cache_lru_head = entry->lru_next;
+  }
+
+  if (entry->lru_next != NULL) {
+    entry->lru_next->lru_prev = entry->lru_prev;
+  } else {
+    response_cache_lru_tail = entry->lru_prev;
+  }
+
+  entry->lru_prev = NULL;
+  entry->lru_next = NULL;
+}
+
+static void response_cache_lru_push(response_entry_t* entry) {
+  entry->lru_prev = NULL;
+  entry->lru_next = response_cache_lru_head;
+
+  if (response_cache_lru_head != NULL) {
+    response_cache_lru_head->lru_prev = entry;
+  } else {
+    response_cache_lru_tail = entry;
+  }
+  response_cache_lru_head = entry;
+}
+
+/* Keys */
+
+static void response_cache_key_append(size_t* off,
+                                      const char* data,
+                                      size_t len) {
+  if (*off + len > response_cache_key_size) {
+    size_t size = response_cache_key_size == 0 ? 256 : response_cache_key_size;
+    while (*off + len > size) {
+      size *= 2;
+    }
+
+    char* key = realloc(response_cache_key, size);
+    CHECK(key != NULL);
+    response_cache_key = key;
+    response_cache_key_size = size;
+  }
+
+  if (len != 0) {
+    memcpy(response_cache_key + *off, data, len);
+  }
+  *off += len;
+}
+
+/* Builds `method \0 url` in the scratch space */
+static size_t response_cache_base_key(const char* method,
+                                      const char* url,
+                                      size_t url_len) {
+  size_t off = 0;
+
+  response_cache_key_append(&off, method, strlen(method) + 1);
+  response_cache_key_append(&off, url, url_len);
+
+  return off;
+}
+
+/* Appends `\0 (name=value \0)*` to the base key */
+static size_t response_cache_full_key(size_t off,
+                                      const response_vary_t* vary,
+                                      response_cache_header_cb get_header,
+                                      void* arg) {
+  response_cache_key_append(&off, "", 1);
+
+  for (unsigned int i = 0; i < vary->count; i++) {
+    const char* name = vary->names[i];
+    uv_buf_t value = get_header(arg, name);
+
+    response_cache_key_append(&off, name, strlen(name));
+
+    /* NOTE: Missing header is different from an empty one */
+    if (value.base == NULL) {
+      response_cache_key_append(&off, "", 1);
+    } else {
+      response_cache_key_append(&off, "=", 1);
+      response_cache_key_append(&off, value.base, value.len);
+      response_cache_key_append(&off, "", 1);
+    }
+  }
+
+  return off;
+}
+
+/* Vary lists */
+
+static void response_vary_free(response_vary_t* vary) {
+  for (unsigned int i = 0; i < vary->count; i++) {
+    free(vary->names[i]);
+  }
+  free(vary->names);
+  free(vary->key);
+  free(vary);
+}
+
+static void response_vary_detach(response_vary_t* vary) {
+  if (vary->in_map) {
+    map_remove(&response_vary_map, &vary->map_entry);
+    vary->in_map = 0;
+  }
+
+  if (vary->entries == 0) {
+    response_vary_free(vary);
+  }
+}
+
+static int response_vary_equal(const response_vary_t* vary,
+                               const char* const* names,
+                               unsigned int count) {
+  if (vary->count != count) {
+    return 0;
+  }
+
+  for (unsigned int i = 0; i < count; i++) {
+    if (strcmp(vary->names[i], names[i]) != 0) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+static response_vary_t* response_vary_get(size_t key_len) {
+  map_entry_t* map_entry = map_get(&response_vary_map,
+      response_cache_key, key_len, map_hash(response_cache_key, key_len));
+
+  if (map_entry == NULL) {
+    return NULL;
+  }
+  return CONTAINER_OF(map_entry, response_vary_t, map_entry);
+}
+
+/* Returns vary list for the base key in the scratch space */
+static response_vary_t* response_vary_ensure(size_t key_len,
+                                             const char* const* names,
+                                             unsigned int count) {
+  response_vary_t* vary = response_vary_get(key_len);
+
+  if (vary != NULL) {
+    if (response_vary_equal(vary, names, count)) {
+      return vary;
+    }
+
+    /* Entries stored with the old list become unreachable and age out */
+    response_vary_detach(vary);
+  }
+
+  vary = malloc(sizeof(*vary));
+  CHECK(vary != NULL);
+  memset(vary, 0, sizeof(*vary));
+
+  vary->key = malloc(key_len);
+  CHECK(vary->key != NULL);
+  memcpy(vary->key, response_cache_key, key_len);
+
+  if (count != 0) {
+    vary->names = malloc(count * sizeof(*vary->names));
+    CHECK(vary->names != NULL);
+  }
+  for (unsigned int i = 0; i < count; i++) {
+    vary->names[i] = strdup(names[i]);
+    CHECK(vary->names[i] != NULL);
+  }
+  vary->count = count;
+
+  vary->map_entry.key = vary->key;
+  vary->map_entry.key_len = key_len;
+  vary->map_entry.hash = map_hash(vary->key, key_len);
+  map_insert(&response_vary_map, &vary->map_entry);
+  vary->in_map = 1;
+
+  return vary;
+}
+
+/* Entries */
+
+void response_cache_release(response_entry_t* entry) {
+  CHECK(entry->refs > 0);
+  entry->refs--;
+  if (entry->refs == 0) {
+    CHECK(!entry->cached);
+    free(entry);
+  }
+}
+
+static void response_cache_invalidate(response_entry_t* entry) {
+  if (!entry->cached) {
+    return;
+  }
+
+  map_remove(&response_cache_map, &entry->map_entry);
+  response_cache_lru_unlink(entry);
+  entry->cached = 0;
+
+  response_cache_stats.entries--;
+  response_cache_stats.bytes -= entry->data.len;
+
+  CHECK(entry->vary->entries > 0);
+  entry->vary->entries--;
+  if (entry->vary->entries == 0) {
+    response_vary_detach(entry->vary);
+  }
+  entry->vary = NULL;
+
+  response_cache_release(entry);
+}
+
+static void response_cache_evict(void) {
+  while (response_cache_stats.bytes > response_cache_max_bytes &&
+         response_cache_lru_tail != NULL) {
+    response_cache_invalidate(response_cache_lru_tail);
+    response_cache_stats.evictions++;
+  }
+}
+
+response_entry_t* response_cache_get(const char* method,
+                                     const char* url,
+                                     size_t url_len,
+                                     response_cache_header_cb get_header,
+                                     void* arg) {
+  size_t key_len = response_cache_base_key(method, url, url_len);
+  response_vary_t* vary = response_vary_get(key_len);
+  map_entry_t* map_entry;
+  response_entry_t* entry;
+
+  if (vary == NULL) {
+    response_cache_stats.misses++;
+    return NULL;
+  }
+
+  key_len = response_cache_full_key(key_len, vary, get_header, arg);
+  map_entry = map_get(&response_cache_map, response_cache_key, key_len,
+      map_hash(response_cache_key, key_len));
+  if (map_entry == NULL) {
+    response_cache_stats.misses++;
+    return NULL;
+  }
+
+  /*
+   * NOTE: Stale entries are kept until they are refreshed, so that the vary
+   * list stays known and the misses could be coalesced.
+   */
+  entry = CONTAINER_OF(map_entry, response_entry_t, map_entry);
+  if (uv_now(response_cache_loop) >= entry->expires) {
+    response_cache_stats.expirations++;
+    response_cache_stats.misses++;
+    return NULL;
+  }
+
+  response_cache_lru_unlink(entry);
+  response_cache_lru_push(entry);
+
+  response_cache_stats.hits++;
+  entry->refs++;
+  return entry;
+}
+
+void response_cache_put(const char* method,
+                        const char* url,
+                        size_t url_len,
+                        const char* const* names,
+                        unsigned int count,
+                        response_cache_header_cb get_header,
+                        void* arg,
+                        const char* data,
+                        size_t data_len,
+                        uint64_t ttl) {
+  size_t key_len;
+  response_vary_t* vary;
+  map_entry_t* map_entry;
+  response_entry_t* entry;
+
+  /* Don't let a single response flush the whole cache */
+  if (ttl == 0 || data_len > response_cache_max_bytes / 8) {
+    return;
+  }
+
+  key_len = response_cache_base_key(method, url, url_len);
+  vary = response_vary_ensure(key_len, names, count);
+  key_len = response_cache_full_key(key_len, vary, get_header, arg);
+
+  /* NOTE: Reserve before invalidating the old entry, it may be the last one */
+  vary->entries++;
+
+  map_entry = map_get(&response_cache_map, response_cache_key, key_len,
+      map_hash(response_cache_key, key_len));
+  if (map_entry != NULL) {
+    response_cache_invalidate(
+        CONTAINER_OF(map_entry, response_entry_t, map_entry));
+  }
+
+  /* Key and data are stored right after the entry */
+  entry = malloc(sizeof(*entry) + key_len + data_len);
+  CHECK(entry != NULL);
+  memset(entry, 0, sizeof(*entry));
+
+  char* key = ((char*) entry) + sizeof(*entry);
+  memcpy(key, response_cache_key, key_len);
+  memcpy(key + key_len, data, data_len);
+
+  entry->vary = vary;
+  entry->data = uv_buf_init(key + key_len, data_len);
+  entry->expires = uv_now(response_cache_loop) + ttl;
+  entry->refs = 1;
+  entry->cached = 1;
+
+  entry->map_entry.key = key;
+  entry->map_entry.key_len = key_len;
+  entry->map_entry.hash = map_hash(key, key_len);
+  map_insert(&response_cache_map, &entry->map_entry);
+
+  response_cache_lru_push(entry);
+
+  response_cache_stats.entries++;
+  response_cache_stats.bytes += data_len;
+
+  response_cache_evict();
+}
+
+/* Single-flight */
+
+static void response_cache_on_idle(uv_idle_t* handle) {
+  response_flight_t* flight = response_cache_landed;
+
+  response_cache_landed = NULL;
+  CHECK_EQ(0, uv_idle_stop(handle));
+
+  while (flight != NULL) {
+    response_flight_t* next = flight->next;
+
+    for (unsigned int i = 0; i < flight->waiter_count; i++) {
+      flight->waiters[i].cb(flight->waiters[i].arg);
+    }
+
+    free(flight->waiters);
+    free(flight);
+    flight = next;
+  }
+}
+
+int response_cache_join(const char* method,
+                        const char* url,
+                        size_t url_len,
+                        response_cache_header_cb get_header,
+                        void* arg,
+                        response_flight_cb cb,
+                        void* cb_arg,
+                        response_flight_t** out) {
+  size_t key_len = response_cache_base_key(method, url, url_len);
+  response_vary_t* vary = response_vary_get(key_len);
+  map_entry_t* map_entry;
+  response_flight_t* flight;
+
+  *out = NULL;
+
+  if (vary == NULL) {
+    return 0;
+  }
+
+  key_len = response_cache_full_key(key_len, vary, get_header, arg);
+  map_entry = map_get(&response_flight_map, response_cache_key, key_len,
+      map_hash(response_cache_key, key_len));
+
+  if (map_entry != NULL) {
+    flight = CONTAINER_OF(map_entry, response_flight_t, map_entry);
+
+    /* Let the rest through, they'll race as if there was no cache */
+    if (flight->waiter_count == MAX_FLIGHT_WAITERS) {
+      return 0;
+    }
+
+    if (flight->waiters == NULL) {
+      flight->waiters = malloc(MAX_FLIGHT_WAITERS * sizeof(*flight->waiters));
+      CHECK(flight->waiters != NULL);
+    }
+
+    flight->waiters[flight->waiter_count].cb = cb;
+    flight->waiters[flight->waiter_count].arg = cb_arg;
+    flight->waiter_count++;
+
+    response_cache_stats.coalesced++;
+    return 1;
+  }
+
+  /* Key is stored right after the flight */
+  flight = malloc(sizeof(*flight) + key_len);
+  CHECK(flight != NULL);
+  memset(flight, 0, sizeof(*flight));
+
+  char* key = ((char*) flight) + sizeof(*flight);
+  memcpy(key, response_cache_key, key_len);
+
+  flight->map_entry.key = key;
+  flight->map_entry.key_len = key_len;
+  flight->map_entry.hash = map_hash(key, key_len);
+  map_insert(&response_flight_map, &flight->map_entry);
+
+  *out = flight;
+  return 0;
+}
+
+void response_cache_land(response_flight_t* flight) {
+  map_entry_t* map_entry;
+
+  map_remove(&response_flight_map, &flight->map_entry);
+
+  /*
+   * The response wasn't cacheable this time. Drop the stale entry, otherwise
+   * all requests for it would keep being serialized.
+   */
+  map_entry = map_get(&response_cache_map, flight->map_entry.key,
+      flight->map_entry.key_len, flight->map_entry.hash);
+  if (map_entry != NULL) {
+    response_entry_t* entry =
+        CONTAINER_OF(map_entry, response_entry_t, map_entry);
+
+    if (uv_now(response_cache_loop) >= entry->expires) {
+      response_cache_invalidate(entry);
+    }
+  }
+
+  if (flight->waiter_count == 0) {
+    free(flight);
+    return;
+  }
+
+  flight->next = response_cache_landed;
+  response_cache_landed = flight;
+  CHECK_EQ(0, uv_idle_start(&response_cache_idle, response_cache_on_idle));
+}
+
+/* JS API */
+
+/* `responseCacheStats()` */
+static duk_ret_t response_cache_stats_cb(duk_context* ctx) {
+  duk_push_object(ctx);
+
+  duk_push_number(ctx, response_cache_stats.hits);
+  duk_put_prop_string(ctx, -2, "hits");
+  duk_push_number(ctx, response_cache_stats.misses);
+  duk_put_prop_string(ctx, -2, "misses");
+  duk_push_number(ctx, response_cache_stats.evictions);
+  duk_put_prop_string(ctx, -2, "evictions");
+  duk_push_number(ctx, response_cache_stats.expirations);
+  duk_put_prop_string(ctx, -2, "expirations");
+  duk_push_number(ctx, response_cache_stats.coalesced);
+  duk_put_prop_string(ctx, -2, "coalesced");
+  duk_push_number(ctx, response_cache_stats.entries);
+  duk_put_prop_string(ctx, -2, "entries");
+  duk_push_number(ctx, response_cache_stats.bytes);
+  duk_put_prop_string(ctx, -2, "bytes");
+
+  return 1;
+}
+
+void response_cache_init(uv_loop_t* loop, duk_context* ctx, size_t max_bytes) {
+  response_cache_loop = loop;
+  response_cache_max_bytes = max_bytes;
+
+  map_init(&response_vary_map, INITIAL_MAP_SIZE);
+  map_init(&response_cache_map, INITIAL_MAP_SIZE);
+  map_init(&response_flight_map, INITIAL_MAP_SIZE);
+
+  CHECK_EQ(0, uv_idle_init(loop, &response_cache_idle));
+
+  duk_push_global_object(ctx);
+  duk_push_c_function(ctx, response_cache_stats_cb, 0);
+  duk_put_prop_string(ctx, -2, "responseCacheStats");
+  duk_pop(ctx);
+}
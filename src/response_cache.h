@@ -0,0 +1,84 @@
+#ifndef SRC_RESPONSE_CACHE_H_
+#define SRC_RESPONSE_CACHE_H_
+
+#include "uv.h"
+#include "duktape.h"
+
+#include "map.h"
+
+/*
+ * Serialized handler responses memoized by method, url and the values of the
+ * request headers they vary on. Entries expire after their TTL and the least
+ * recently used ones are evicted when the cache grows over its byte limit.
+ * Concurrent misses of an expired entry are coalesced into a single handler
+ * call. Statistics are available to JS through global `responseCacheStats()`.
+ */
+
+typedef struct response_entry_s response_entry_t;
+typedef struct response_vary_s response_vary_t;
+typedef struct response_flight_s response_flight_t;
+
+/* Returns the value of request header `name` (lowercase), or `NULL` base */
+typedef uv_buf_t (*response_cache_header_cb)(void* arg, const char* name);
+
+typedef void (*response_flight_cb)(void* arg);
+
+struct response_entry_s {
+  map_entry_t map_entry;
+  response_vary_t* vary;
+
+  /* Full response: status line, headers and body */
+  uv_buf_t data;
+  uint64_t expires;
+
+  /* One for the cache itself and one per pending write */
+  int refs;
+  int cached;
+
+  response_entry_t* lru_prev;
+  response_entry_t* lru_next;
+};
+
+void response_cache_init(uv_loop_t* loop, duk_context* ctx, size_t max_bytes);
+
+/* Returns referenced entry, or `NULL` on miss or when the entry is stale */
+response_entry_t* response_cache_get(const char* method,
+                                     const char* url,
+                                     size_t url_len,
+                                     response_cache_header_cb get_header,
+                                     void* arg);
+
+/* Stores a copy of `data`, `vary` holds lowercase header names */
+void response_cache_put(const char* method,
+                        const char* url,
+                        size_t url_len,
+                        const char* const* vary,
+                        unsigned int vary_count,
+                        response_cache_header_cb get_header,
+                        void* arg,
+                        const char* data,
+                        size_t data_len,
+                        uint64_t ttl);
+
+void response_cache_release(response_entry_t* entry);
+
+/*
+ * Coalesces concurrent misses of a resource that was cached before. Returns
+ * non-zero if another request is computing the response, and `cb` will be
+ * called after it lands. Otherwise `*flight` is set if the caller should
+ * compute the response and `response_cache_land()` it afterwards, or is `NULL`
+ * if the resource isn't known to be cacheable or its wait list is full.
+ */
+int response_cache_join(const char* method,
+                        const char* url,
+                        size_t url_len,
+                        response_cache_header_cb get_header,
+                        void* arg,
+                        response_flight_cb cb,
+                        void* cb_arg,
+                        response_flight_t** flight);
+
+/* NOTE: Waiters are called back on the next loop iteration */
+void response_cache_land(response_flight_t* flight);
+
+#endif  /* SRC_RESPONSE_CACHE_H_ */
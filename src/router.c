@@ -0,0 +1,315 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "router.h"
+#include "common.h"
+#include "llhttp.h"
+
+/* Typedefs */
+
+struct router_node_s {
+  /* Static segment, or the name of `:param` and `*wildcard` */
+  char* segment;
+  size_t segment_len;
+
+  router_node_t** children;
+  unsigned int child_count;
+
+  router_node_t* param;
+  router_node_t* wildcard;
+
+  router_route_t* routes;
+  unsigned int route_count;
+};
+
+/* Helpers */
+
+/* Finds the next non-empty segment at or after `*off` */
+static int router_next_segment(const char* path,
+                               size_t path_len,
+                               size_t* off,
+                               const char** segment,
+                               size_t* segment_len) {
+  size_t start = *off;
+
+  while (start < path_len && path[start] == '/') {
+    start++;
+  }
+
+  if (start == path_len) {
+    *off = start;
+    return 0;
+  }
+
+  size_t end = start;
+  while (end < path_len && path[end] != '/') {
+    end++;
+  }
+
+  *segment = path + start;
+  *segment_len = end - start;
+  *off = end;
+  return 1;
+}
+
+static router_node_t* router_node_new(const char* segment, size_t segment_len) {
+  router_node_t* node;
+
+  node = malloc(sizeof(*node));
+  CHECK(node != NULL);
+  memset(node, 0, sizeof(*node));
+
+  node->segment = malloc(segment_len + 1);
+  CHECK(node->segment != NULL);
+  memcpy(node->segment, segment, segment_len);
+  node->segment[segment_len] = '\0';
+  node->segment_len = segment_len;
+
+  return node;
+}
+
+static void router_node_free(router_node_t* node) {
+  if (node == NULL) {
+    return;
+  }
+
+  for (unsigned int i = 0; i < node->child_count; i++) {
+    router_node_free(node->children[i]);
+  }
+  router_node_free(node->param);
+  router_node_free(node->wildcard);
+
+  free(node->children);
+  free(node->routes);
+  free(node->segment);
+  free(node);
+}
+
+static int router_segment_eq(const router_node_t* node,
+                             const char* segment,
+                             size_t segment_len) {
+  return node->segment_len == segment_len &&
+         memcmp(node->segment, segment, segment_len) == 0;
+}
+
+/* Returns `:param` or `*wildcard` child, `NULL` if the names conflict */
+static router_node_t* router_named_child(router_node_t** child,
+                                         const char* name,
+                                         size_t name_len) {
+  if (name_len == 0) {
+    return NULL;
+  }
+
+  if (*child == NULL) {
+    *child = router_node_new(name, name_len);
+  } else if (!router_segment_eq(*child, name, name_len)) {
+    return NULL;
+  }
+
+  return *child;
+}
+
+/* Trie */
+
+int router_method_from_name(const char* name, size_t name_len) {
+#define METHOD_FROM_NAME(NUM, NAME, STRING)                                  \
+  if (name_len == sizeof(#STRING) - 1 &&                                    \
+      memcmp(name, #STRING, name_len) == 0) {                               \
+    return NUM;                                                             \
+  }
+  HTTP_METHOD_MAP(METHOD_FROM_NAME)
+#undef METHOD_FROM_NAME
+
+  return -1;
+}
+
+void router_init(router_t* router) {
+  router->root = router_node_new("", 0);
+  router->route_count = 0;
+}
+
+void router_destroy(router_t* router) {
+  router_node_free(router->root);
+  router->root = NULL;
+  router->route_count = 0;
+}
+
+int router_add(router_t* router,
+               int method,
+               const char* pattern,
+               size_t pattern_len,
+               int value) {
+  router_node_t* node = router->root;
+  size_t off = 0;
+  const char* segment;
+  size_t segment_len;
+
+  while (router_next_segment(pattern, pattern_len, &off, &segment,
+                             &segment_len)) {
+    if (segment[0] == ':') {
+      node = router_named_child(&node->param, segment + 1, segment_len - 1);
+    } else if (segment[0] == '*') {
+      const char* rest;
+      size_t rest_len;
+
+      /* Wildcard must be the last segment */
+      if (router_next_segment(pattern, pattern_len, &off, &rest, &rest_len)) {
+        return -1;
+      }
+      node = router_named_child(&node->wildcard, segment + 1,
+          segment_len - 1);
+    } else {
+      router_node_t* child = NULL;
+
+      for (unsigned int i = 0; i < node->child_count; i++) {
+        if (router_segment_eq(node->children[i], segment, segment_len)) {
+          child = node->children[i];
+          break;
+        }
+      }
+
+      if (child == NULL) {
+        router_node_t** children = realloc(node->children,
+            (node->child_count + 1) * sizeof(*children));
+        CHECK(children != NULL);
+        node->children = children;
+
+        child = router_node_new(segment, segment_len);
+        node->children[node->child_count++] = child;
+      }
+      node = child;
+    }
+
+    if (node == NULL) {
+      return -1;
+    }
+  }
+
+  for (unsigned int i = 0; i < node->route_count; i++) {
+    if (node->routes[i].method == method) {
+      return -1;
+    }
+  }
+
+  router_route_t* routes = realloc(node->routes,
+      (node->route_count + 1) * sizeof(*routes));
+  CHECK(routes != NULL);
+  node->routes = routes;
+
+  node->routes[node->route_count].method = method;
+  node->routes[node->route_count].value = value;
+  node->route_count++;
+  router->route_count++;
+
+  return 0;
+}
+
+static int router_push_param(router_match_t* match,
+                             const router_node_t* node,
+                             const char* value,
+                             size_t value_len) {
+  if (match->param_count == ROUTER_MAX_PARAMS) {
+    return -1;
+  }
+
+  router_param_t* param = &match->params[match->param_count++];
+  param->name = node->segment;
+  param->name_len = node->segment_len;
+  param->value = value;
+  param->value_len = value_len;
+  return 0;
+}
+
+static const router_node_t* router_lookup(const router_node_t* node,
+                                          const char* path,
+                                          size_t path_len,
+                                          size_t off,
+                                          router_match_t* match) {
+  const char* segment;
+  size_t segment_len;
+  const router_node_t* res;
+
+  if (!router_next_segment(path, path_len, &off, &segment, &segment_len)) {
+    return node->route_count != 0 ? node : NULL;
+  }
+
+  for (unsigned int i = 0; i < node->child_count; i++) {
+    if (router_segment_eq(node->children[i], segment, segment_len)) {
+      res = router_lookup(node->children[i], path, path_len, off, match);
+      if (res != NULL) {
+        return res;
+      }
+      break;
+    }
+  }
+
+  if (node->param != NULL) {
+    unsigned int param_count = match->param_count;
+
+    if (router_push_param(match, node->param, segment, segment_len) == 0) {
+      res = router_lookup(node->param, path, path_len, off, match);
+      if (res != NULL) {
+        return res;
+      }
+    }
+    match->param_count = param_count;
+  }
+
+  if (node->wildcard != NULL && node->wildcard->route_count != 0) {
+    if (router_push_param(match, node->wildcard, segment,
+                          path_len - (segment - path)) == 0) {
+      return node->wildcard;
+    }
+  }
+
+  return NULL;
+}
+
+int router_match(const router_t* router,
+                 int method,
+                 const char* path,
+                 size_t path_len,
+                 router_match_t* match) {
+  const router_node_t* node;
+  const router_route_t* any = NULL;
+  const router_route_t* get = NULL;
+
+  match->param_count = 0;
+  match->routes = NULL;
+  match->route_count = 0;
+
+  node = router_lookup(router->root, path, path_len, 0, match);
+  if (node == NULL) {
+    return 404;
+  }
+
+  for (unsigned int i = 0; i < node->route_count; i++) {
+    const router_route_t* route = &node->routes[i];
+
+    if (route->method == method) {
+      match->value = route->value;
+      return 200;
+    }
+
+    if (route->method == ROUTER_ANY_METHOD) {
+      any = route;
+    } else if (route->method == HTTP_GET) {
+      get = route;
+    }
+  }
+
+  /* `HEAD` is served by `GET` routes, the body is dropped anyway */
+  if (method == HTTP_HEAD && get != NULL) {
+    match->value = get->value;
+    return 200;
+  }
+
+  if (any != NULL) {
+    match->value = any->value;
+    return 200;
+  }
+
+  match->routes = node->routes;
+  match->route_count = node->route_count;
+  return 405;
+}
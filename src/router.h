@@ -0,0 +1,74 @@
+#ifndef SRC_ROUTER_H_
+#define SRC_ROUTER_H_
+
+#include <stddef.h>
+
+/*
+ * Radix trie over path segments. Patterns consist of static segments,
+ * `:name` parameters matching a single segment, and a trailing `*name`
+ * wildcard matching the rest of the path. Static segments take precedence
+ * over parameters, and parameters over wildcards. Empty segments are
+ * ignored, so `/a//b/` is the same as `/a/b`.
+ */
+
+#define ROUTER_ANY_METHOD -1
+#define ROUTER_MAX_PARAMS 16
+
+typedef struct router_s router_t;
+typedef struct router_node_s router_node_t;
+typedef struct router_route_s router_route_t;
+typedef struct router_param_s router_param_t;
+typedef struct router_match_s router_match_t;
+
+struct router_route_s {
+  int method;
+  int value;
+};
+
+struct router_param_s {
+  const char* name;
+  size_t name_len;
+
+  /* NOTE: Points into the matched path, not decoded */
+  const char* value;
+  size_t value_len;
+};
+
+struct router_match_s {
+  /* Value of the matched route */
+  int value;
+
+  router_param_t params[ROUTER_MAX_PARAMS];
+  unsigned int param_count;
+
+  /* Routes of the matched path when the method didn't match */
+  const router_route_t* routes;
+  unsigned int route_count;
+};
+
+struct router_s {
+  router_node_t* root;
+  unsigned int route_count;
+};
+
+/* Returns llhttp method for `name`, or `-1` */
+int router_method_from_name(const char* name, size_t name_len);
+
+void router_init(router_t* router);
+void router_destroy(router_t* router);
+
+/* Returns `0`, or `-1` if the pattern is invalid or already registered */
+int router_add(router_t* router,
+               int method,
+               const char* pattern,
+               size_t pattern_len,
+               int value);
+
+/* Returns `200`, `404`, or `405` if only the method didn't match */
+int router_match(const router_t* router,
+                 int method,
+                 const char* path,
+                 size_t path_len,
+                 router_match_t* match);
+
+#endif  /* SRC_ROUTER_H_ */
@@ -0,0 +1,365 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "sse.h"
+#include "common.h"
+#include "map.h"
+
+/* Typedefs */
+
+struct sse_channel_s {
+  map_entry_t entry;
+  char* name;
+
+  sse_client_t* clients;
+  unsigned int client_count;
+};
+
+/* Serialized event, a complete chunk of the chunked response */
+typedef struct sse_frame_s sse_frame_t;
+struct sse_frame_s {
+  unsigned int refs;
+  size_t len;
+  char data[];
+};
+
+typedef struct sse_write_s sse_write_t;
+struct sse_write_s {
+  uv_write_t req;
+  sse_frame_t* frame;
+};
+
+/* Some static vars */
+
+static const unsigned int SSE_INITIAL_CHANNELS = 64;
+
+/* Subscribers with more than this waiting to be sent are dropped */
+static const size_t SSE_MAX_QUEUE_SIZE = 1024 * 1024;
+
+static map_t sse_channels;
+
+/* Helpers */
+
+static sse_channel_t* sse_find(const char* name, size_t name_len) {
+  map_entry_t* entry = map_get(&sse_channels, name, name_len,
+      map_hash(name, name_len));
+
+  if (entry == NULL) {
+    return NULL;
+  }
+  return CONTAINER_OF(entry, sse_channel_t, entry);
+}
+
+static void sse_frame_unref(sse_frame_t* frame) {
+  CHECK(frame->refs > 0);
+  if (--frame->refs == 0) {
+    free(frame);
+  }
+}
+
+/*
+ * Writes `data: line` for every line of `data`, and the optional `event` and
+ * `id` fields. Returns the length, `out` may be `NULL` to just measure it.
+ */
+static size_t sse_format(char* out,
+                         const char* event,
+                         size_t event_len,
+                         const char* id,
+                         size_t id_len,
+                         const char* data,
+                         size_t data_len) {
+  size_t len = 0;
+
+#define SSE_APPEND(str, str_len)                                              \
+    do {                                                                      \
+      if (out != NULL) {                                                      \
+        memcpy(out + len, (str), (str_len));                                  \
+      }                                                                       \
+      len += (str_len);                                                       \
+    } while (0)
+
+  if (event != NULL) {
+    SSE_APPEND("event: ", 7);
+    SSE_APPEND(event, event_len);
+    SSE_APPEND("\n", 1);
+  }
+  if (id != NULL) {
+    SSE_APPEND("id: ", 4);
+    SSE_APPEND(id, id_len);
+    SSE_APPEND("\n", 1);
+  }
+
+  /* NOTE: `\r\n`, `\r` and `\n` all end a line */
+  const char* end = data + data_len;
+  const char* line = data;
+  for (;;) {
+    const char* p = line;
+    while (p != end && *p != '\r' && *p != '\n') {
+      p++;
+    }
+
+    SSE_APPEND("data: ", 6);
+    SSE_APPEND(line, p - line);
+    SSE_APPEND("\n", 1);
+
+    if (p == end) {
+      break;
+    }
+    if (*p == '\r' && p + 1 != end && p[1] == '\n') {
+      p++;
+    }
+    line = p + 1;
+  }
+
+  SSE_APPEND("\n", 1);
+
+#undef SSE_APPEND
+
+  return len;
+}
+
+static sse_frame_t* sse_frame_new(const char* event,
+                                  size_t event_len,
+                                  const char* id,
+                                  size_t id_len,
+                                  const char* data,
+                                  size_t data_len) {
+  char size[32];
+  size_t payload_len;
+  int size_len;
+  sse_frame_t* frame;
+
+  payload_len = sse_format(NULL, event, event_len, id, id_len, data,
+      data_len);
+  size_len = snprintf(size, sizeof(size), "%llx\r\n",
+      (unsigned long long) payload_len);
+
+  frame = malloc(sizeof(*frame) + size_len + payload_len + 2);
+  CHECK(frame != NULL);
+
+  frame->refs = 1;
+  frame->len = size_len + payload_len + 2;
+
+  memcpy(frame->data, size, size_len);
+  sse_format(frame->data + size_len, event, event_len, id, id_len, data,
+      data_len);
+  memcpy(frame->data + size_len + payload_len, "\r\n", 2);
+
+  return frame;
+}
+
+static void sse_on_write(uv_write_t* req, int status) {
+  sse_write_t* write = CONTAINER_OF(req, sse_write_t, req);
+
+  /* NOTE: Errors are handled by the connection's read side */
+  (void) status;
+
+  sse_frame_unref(write->frame);
+  free(write);
+}
+
+static void sse_write(sse_client_t* client, sse_frame_t* frame) {
+  uv_buf_t buf = uv_buf_init(frame->data, frame->len);
+  int n;
+
+  /* Most subscribers have nothing queued, no write request is needed */
+  n = uv_try_write(client->stream, &buf, 1);
+  if (n == (int) buf.len) {
+    return;
+  }
+  if (n < 0 && n != UV_EAGAIN) {
+    return;
+  }
+  if (n > 0) {
+    buf.base += n;
+    buf.len -= n;
+  }
+
+  sse_write_t* write = malloc(sizeof(*write));
+  CHECK(write != NULL);
+
+  write->frame = frame;
+  frame->refs++;
+
+  if (uv_write(&write->req, client->stream, &buf, 1, sse_on_write) != 0) {
+    sse_frame_unref(frame);
+    free(write);
+  }
+}
+
+/* JS API */
+
+static const char* sse_get_field(duk_context* ctx,
+                                 duk_idx_t idx,
+                                 duk_size_t* len) {
+  if (duk_is_null_or_undefined(ctx, idx)) {
+    *len = 0;
+    return NULL;
+  }
+
+  const char* str = duk_require_lstring(ctx, idx, len);
+  if (memchr(str, '\n', *len) != NULL || memchr(str, '\r', *len) != NULL) {
+    (void) duk_type_error(ctx, "Event fields can't span lines");
+  }
+  return str;
+}
+
+/* `sse.broadcast(channel, data, [event], [id])` */
+static duk_ret_t sse_broadcast_cb(duk_context* ctx) {
+  duk_size_t name_len;
+  duk_size_t data_len;
+  duk_size_t event_len;
+  duk_size_t id_len;
+  const char* name = duk_require_lstring(ctx, 0, &name_len);
+  const char* data = duk_require_lstring(ctx, 1, &data_len);
+  const char* event = sse_get_field(ctx, 2, &event_len);
+  const char* id = sse_get_field(ctx, 3, &id_len);
+  sse_channel_t* channel;
+  unsigned int count;
+
+  channel = sse_find(name, name_len);
+  if (channel == NULL) {
+    duk_push_uint(ctx, 0);
+    return 1;
+  }
+
+  count = channel->client_count;
+
+  sse_frame_t* frame = sse_frame_new(event, event_len, id, id_len, data,
+      data_len);
+
+  /* NOTE: Dropping the last client frees the channel */
+  sse_client_t* next;
+  for (sse_client_t* client = channel->clients; client != NULL;
+       client = next) {
+    next = client->next;
+
+    if (uv_stream_get_write_queue_size(client->stream) >
+        SSE_MAX_QUEUE_SIZE) {
+      count--;
+      sse_unsubscribe(client);
+      client->on_end(client, -1);
+      continue;
+    }
+
+    sse_write(client, frame);
+  }
+
+  sse_frame_unref(frame);
+
+  duk_push_uint(ctx, count);
+  return 1;
+}
+
+/* `sse.count(channel)` */
+static duk_ret_t sse_count_cb(duk_context* ctx) {
+  duk_size_t name_len;
+  const char* name = duk_require_lstring(ctx, 0, &name_len);
+  sse_channel_t* channel = sse_find(name, name_len);
+
+  duk_push_uint(ctx, channel == NULL ? 0 : channel->client_count);
+  return 1;
+}
+
+/* `sse.close(channel)` ends the responses of all subscribers */
+static duk_ret_t sse_close_cb(duk_context* ctx) {
+  duk_size_t name_len;
+  const char* name = duk_require_lstring(ctx, 0, &name_len);
+  sse_channel_t* channel = sse_find(name, name_len);
+
+  if (channel == NULL) {
+    return 0;
+  }
+
+  /* NOTE: Clients that subscribe from `on_end` are added to the head */
+  sse_client_t* next;
+  for (sse_client_t* client = channel->clients; client != NULL;
+       client = next) {
+    next = client->next;
+
+    sse_unsubscribe(client);
+    client->on_end(client, 0);
+  }
+
+  return 0;
+}
+
+/* Channels */
+
+void sse_init(duk_context* ctx) {
+  static const duk_function_list_entry sse_funcs[] = {
+    { "broadcast", sse_broadcast_cb, 4 },
+    { "count", sse_count_cb, 1 },
+    { "close", sse_close_cb, 1 },
+    { NULL, NULL, 0 }
+  };
+
+  map_init(&sse_channels, SSE_INITIAL_CHANNELS);
+
+  duk_push_global_object(ctx);
+  duk_push_object(ctx);
+  duk_put_function_list(ctx, -1, sse_funcs);
+  duk_put_prop_string(ctx, -2, "sse");
+  duk_pop(ctx);
+}
+
+void sse_subscribe(sse_client_t* client, const char* name, size_t name_len) {
+  sse_channel_t* channel = sse_find(name, name_len);
+
+  CHECK(client->channel == NULL);
+
+  if (channel == NULL) {
+    channel = malloc(sizeof(*channel));
+    CHECK(channel != NULL);
+    memset(channel, 0, sizeof(*channel));
+
+    channel->name = malloc(name_len + 1);
+    CHECK(channel->name != NULL);
+    memcpy(channel->name, name, name_len);
+    channel->name[name_len] = '\0';
+
+    channel->entry.key = channel->name;
+    channel->entry.key_len = name_len;
+    channel->entry.hash = map_hash(name, name_len);
+    map_insert(&sse_channels, &channel->entry);
+  }
+
+  client->channel = channel;
+  client->prev = NULL;
+  client->next = channel->clients;
+  if (channel->clients != NULL) {
+    channel->clients->prev = client;
+  }
+  channel->clients = client;
+  channel->client_count++;
+}
+
+void sse_unsubscribe(sse_client_t* client) {
+  sse_channel_t* channel = client->channel;
+
+  if (channel == NULL) {
+    return;
+  }
+
+  if (client->prev == NULL) {
+    channel->clients = client->next;
+  } else {
+    client->prev->next = client->next;
+  }
+  if (client->next != NULL) {
+    client->next->prev = client->prev;
+  }
+
+  client->channel = NULL;
+  client->prev = NULL;
+  client->next = NULL;
+
+  if (--channel->client_count != 0) {
+    return;
+  }
+
+  map_remove(&sse_channels, &channel->entry);
+  free(channel->name);
+  free(channel);
+}
@@ -0,0 +1,43 @@
+#ifndef SRC_SSE_H_
+#define SRC_SSE_H_
+
+#include <stddef.h>
+
+#include "uv.h"
+#include "duktape.h"
+
+/*
+ * Server-Sent Events channels, and the global `sse` object that broadcasts
+ * to them. Subscribers are plain C structures embedded into connections, so
+ * an idle one costs nothing on the JS heap. Every event is serialized once
+ * into a refcounted chunk that is written to all subscribers, with
+ * `uv_try_write()` first so that only the ones with a backlog need a write
+ * request.
+ */
+
+typedef struct sse_client_s sse_client_t;
+typedef struct sse_channel_s sse_channel_t;
+
+struct sse_client_s {
+  sse_client_t* prev;
+  sse_client_t* next;
+
+  /* `NULL` unless subscribed */
+  sse_channel_t* channel;
+
+  uv_stream_t* stream;
+
+  /*
+   * Called after `sse.close()` unsubscribes the client, or with `-1` when it
+   * is dropped for not keeping up with the events.
+   */
+  void (*on_end)(sse_client_t* client, int status);
+};
+
+void sse_init(duk_context* ctx);
+
+void sse_subscribe(sse_client_t* client, const char* channel,
+                   size_t channel_len);
+void sse_unsubscribe(sse_client_t* client);
+
+#endif  /* SRC_SSE_H_ */
@@ -0,0 +1,69 @@
+#include <string.h>
+
+#include "string_cache.h"
+#include "common.h"
+#include "map.h"
+#include "refs.h"
+
+/* Typedefs */
+
+typedef struct string_cache_slot_s string_cache_slot_t;
+struct string_cache_slot_s {
+  uint32_t hash;
+  size_t len;
+
+  /* NOTE: Points into the string itself, Duktape never moves strings */
+  const char* data;
+  void* ptr;
+};
+
+/* Some static vars */
+
+#define STRING_CACHE_SIZE 512
+
+static const size_t STRING_CACHE_MAX_LEN = 256;
+
+static string_cache_slot_t string_cache_slots[STRING_CACHE_SIZE];
+
+/* Array in the stash that keeps cached strings reachable */
+static void* string_cache_array;
+
+/* Strings */
+
+void string_cache_init(duk_context* ctx) {
+  duk_push_array(ctx);
+  string_cache_array = duk_get_heapptr(ctx, -1);
+
+  /* NOTE: Never released */
+  refs_put(ctx);
+}
+
+void string_cache_push(duk_context* ctx, const char* str, size_t len) {
+  if (len == 0 || len > STRING_CACHE_MAX_LEN) {
+    duk_push_lstring(ctx, str, len);
+    return;
+  }
+
+  uint32_t hash = map_hash(str, len);
+  unsigned int index = hash & (STRING_CACHE_SIZE - 1);
+  string_cache_slot_t* slot = &string_cache_slots[index];
+
+  if (slot->ptr != NULL && slot->hash == hash && slot->len == len &&
+      memcmp(slot->data, str, len) == 0) {
+    duk_push_heapptr(ctx, slot->ptr);
+    return;
+  }
+
+  duk_push_lstring(ctx, str, len);
+
+  /* Replace the slot, the old string may be collected afterwards */
+  duk_push_heapptr(ctx, string_cache_array);
+  duk_dup(ctx, -2);
+  duk_put_prop_index(ctx, -2, index);
+  duk_pop(ctx);
+
+  slot->hash = hash;
+  slot->len = len;
+  slot->data = duk_get_string(ctx, -1);
+  slot->ptr = duk_get_heapptr(ctx, -1);
+}
@@ -0,0 +1,20 @@
+#ifndef SRC_STRING_CACHE_H_
+#define SRC_STRING_CACHE_H_
+
+#include <stddef.h>
+
+#include "duktape.h"
+
+/*
+ * Recently pushed short strings, like header values and urls that repeat on
+ * every request of a keep-alive connection. A hit is pushed by heap pointer
+ * and costs a hash and a `memcmp()` instead of a string table lookup. The
+ * cache is direct-mapped, a colliding string replaces the previous one.
+ */
+
+void string_cache_init(duk_context* ctx);
+
+/* Works like `duk_push_lstring()` on any thread of the heap */
+void string_cache_push(duk_context* ctx, const char* str, size_t len);
+
+#endif  /* SRC_STRING_CACHE_H_ */
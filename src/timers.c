@@ -0,0 +1,323 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "timers.h"
+#include "common.h"
+#include "refs.h"
+
+/* Typedefs */
+
+typedef struct js_timer_s js_timer_t;
+struct js_timer_s {
+  double id;
+  uint64_t due;
+
+  /* Zero for `setTimeout` */
+  uint64_t repeat;
+
+  /* Callback, or `[ callback, ...args ]` when `has_args` is set */
+  int callback_ref;
+  int has_args;
+
+  unsigned int index;
+};
+
+/* Some static vars */
+
+static const unsigned int INITIAL_HEAP_SIZE = 16;
+
+/* Larger delays fire after 1ms, like in Node */
+static const double MAX_DELAY = 2147483647.0;
+
+static uv_loop_t* timers_loop;
+static duk_context* timers_ctx;
+static uv_timer_t timers_handle;
+
+static js_timer_t** timers_heap;
+static unsigned int timers_count;
+static unsigned int timers_size;
+
+/*
+ * Maps timer id to `js_timer_t*`, kept alive by the heap stash. Ids are
+ * numbers up to 2^53 and are used as keys as such, not as array indices.
+ */
+static void* timers_ids;
+static double timers_last_id;
+
+/* Heap */
+
+static int timers_less(const js_timer_t* a, const js_timer_t* b) {
+  if (a->due != b->due) {
+    return a->due < b->due;
+  }
+
+  /* Preserve insertion order for timers with the same deadline */
+  return a->id < b->id;
+}
+
+static void timers_swap(unsigned int a, unsigned int b) {
+  js_timer_t* t = timers_heap[a];
+
+  timers_heap[a] = timers_heap[b];
+  timers_heap[b] = t;
+
+  timers_heap[a]->index = a;
+  timers_heap[b]->index = b;
+}
+
+static void timers_sift_up(unsigned int index) {
+  while (index > 0) {
+    unsigned int parent = (index - 1) / 2;
+    if (!timers_less(timers_heap[index], timers_heap[parent])) {
+      break;
+    }
+
+    timers_swap(index, parent);
+    index = parent;
+  }
+}
+
+static void timers_sift_down(unsigned int index) {
+  for (;;) {
+    unsigned int left = 2 * index + 1;
+    unsigned int right = left + 1;
+    unsigned int smallest = index;
+
+    if (left < timers_count &&
+        timers_less(timers_heap[left], timers_heap[smallest])) {
+      smallest = left;
+    }
+    if (right < timers_count &&
+        timers_less(timers_heap[right], timers_heap[smallest])) {
+      smallest = right;
+    }
+    if (smallest == index) {
+      break;
+    }
+
+    timers_swap(index, smallest);
+    index = smallest;
+  }
+}
+
+static void timers_insert(js_timer_t* timer) {
+  if (timers_count == timers_size) {
+    unsigned int new_size = timers_size == 0 ?
+        INITIAL_HEAP_SIZE : timers_size * 2;
+    js_timer_t** new_heap;
+
+    new_heap = realloc(timers_heap, new_size * sizeof(*new_heap));
+    CHECK(new_heap != NULL);
+
+    timers_heap = new_heap;
+    timers_size = new_size;
+  }
+
+  timer->index = timers_count;
+  timers_heap[timers_count++] = timer;
+  timers_sift_up(timer->index);
+}
+
+static void timers_remove(js_timer_t* timer) {
+  unsigned int index = timer->index;
+
+  CHECK(index < timers_count && timers_heap[index] == timer);
+
+  timers_count--;
+  if (index == timers_count) {
+    return;
+  }
+
+  timers_heap[index] = timers_heap[timers_count];
+  timers_heap[index]->index = index;
+
+  timers_sift_up(index);
+  timers_sift_down(timers_heap[index]->index);
+}
+
+static void timers_arm(void);
+
+/* Callbacks */
+
+static void timers_on_timeout(uv_timer_t* handle) {
+  (void) handle;
+
+  duk_context* ctx = timers_ctx;
+  uint64_t now = uv_now(timers_loop);
+
+  while (timers_count != 0 && timers_heap[0]->due <= now) {
+    js_timer_t* timer = timers_heap[0];
+    int has_args = timer->has_args;
+
+    refs_push(ctx, timer->callback_ref);
+
+    if (timer->repeat != 0) {
+      /* NOTE: Callback may clear the interval, don't touch it afterwards */
+      timer->due = now + timer->repeat;
+      timers_sift_down(0);
+    } else {
+      timers_remove(timer);
+
+      duk_push_heapptr(ctx, timers_ids);
+      duk_push_number(ctx, timer->id);
+      duk_del_prop(ctx, -2);
+      duk_pop(ctx);
+
+      refs_del(ctx, timer->callback_ref);
+      free(timer);
+    }
+
+    duk_idx_t nargs = 0;
+    if (has_args) {
+      duk_idx_t args = duk_get_top_index(ctx);
+      duk_size_t len = duk_get_length(ctx, args);
+
+      for (duk_size_t i = 0; i < len; i++) {
+        duk_get_prop_index(ctx, args, i);
+      }
+      duk_remove(ctx, args);
+      nargs = (duk_idx_t) len - 1;
+    }
+
+    if (duk_pcall(ctx, nargs) != DUK_EXEC_SUCCESS) {
+      fprintf(stderr, "Timer error: %s\n", duk_safe_to_string(ctx, -1));
+    }
+    duk_pop(ctx);
+  }
+
+  timers_arm();
+}
+
+static void timers_arm(void) {
+  if (timers_count == 0) {
+    CHECK_EQ(0, uv_timer_stop(&timers_handle));
+    return;
+  }
+
+  uint64_t now = uv_now(timers_loop);
+  uint64_t due = timers_heap[0]->due;
+
+  CHECK_EQ(0, uv_timer_start(&timers_handle,
+        timers_on_timeout,
+        due > now ? due - now : 0,
+        0));
+}
+
+/* JS API */
+
+/* `setTimeout(fn, ms, ...args)` (magic 0), `setInterval` (magic 1) */
+static duk_ret_t timers_set_cb(duk_context* ctx) {
+  duk_idx_t nargs = duk_get_top(ctx);
+  int repeat = duk_get_current_magic(ctx);
+  js_timer_t* timer;
+
+  duk_require_callable(ctx, 0);
+  double delay = duk_get_number_default(ctx, 1, 0);
+
+  /* NOTE: Like in Node, zero delays would re-arm in the same loop iteration
+   * and starve I/O */
+  if (!(delay >= 1) || delay > MAX_DELAY) {
+    delay = 1;
+  }
+
+  timer = malloc(sizeof(*timer));
+  CHECK(timer != NULL);
+
+  memset(timer, 0, sizeof(*timer));
+
+  timer->id = ++timers_last_id;
+  timer->due = uv_now(timers_loop) + (uint64_t) delay;
+  timer->repeat = repeat ? (uint64_t) delay : 0;
+
+  if (nargs > 2) {
+    duk_push_array(ctx);
+    duk_dup(ctx, 0);
+    duk_put_prop_index(ctx, -2, 0);
+    for (duk_idx_t i = 2; i < nargs; i++) {
+      duk_dup(ctx, i);
+      duk_put_prop_index(ctx, -2, i - 1);
+    }
+    timer->has_args = 1;
+  } else {
+    duk_dup(ctx, 0);
+  }
+  timer->callback_ref = refs_put(ctx);
+
+  duk_push_heapptr(ctx, timers_ids);
+  duk_push_number(ctx, timer->id);
+  duk_push_pointer(ctx, timer);
+  duk_put_prop(ctx, -3);
+  duk_pop(ctx);
+
+  timers_insert(timer);
+  if (timer->index == 0) {
+    timers_arm();
+  }
+
+  duk_push_number(ctx, timer->id);
+  return 1;
+}
+
+/* `clearTimeout(id)`, `clearInterval(id)` */
+static duk_ret_t timers_clear_cb(duk_context* ctx) {
+  if (!duk_is_number(ctx, 0)) {
+    return 0;
+  }
+
+  duk_push_heapptr(ctx, timers_ids);
+  duk_dup(ctx, 0);
+  duk_get_prop(ctx, -2);
+  js_timer_t* timer = duk_get_pointer(ctx, -1);
+  duk_pop(ctx);
+
+  if (timer == NULL) {
+    duk_pop(ctx);
+    return 0;
+  }
+
+  duk_dup(ctx, 0);
+  duk_del_prop(ctx, -2);
+  duk_pop(ctx);
+
+  int was_first = timer->index == 0;
+  timers_remove(timer);
+  refs_del(ctx, timer->callback_ref);
+  free(timer);
+
+  if (was_first) {
+    timers_arm();
+  }
+
+  return 0;
+}
+
+void timers_init(uv_loop_t* loop, duk_context* ctx) {
+  timers_loop = loop;
+  timers_ctx = ctx;
+
+  CHECK_EQ(0, uv_timer_init(loop, &timers_handle));
+
+  duk_push_heap_stash(ctx);
+  duk_push_bare_object(ctx);
+  timers_ids = duk_get_heapptr(ctx, -1);
+  duk_put_prop_string(ctx, -2, "timers");
+  duk_pop(ctx);
+
+  duk_push_global_object(ctx);
+
+  duk_push_c_function(ctx, timers_set_cb, DUK_VARARGS);
+  duk_set_magic(ctx, -1, 0);
+  duk_put_prop_string(ctx, -2, "setTimeout");
+
+  duk_push_c_function(ctx, timers_set_cb, DUK_VARARGS);
+  duk_set_magic(ctx, -1, 1);
+  duk_put_prop_string(ctx, -2, "setInterval");
+
+  duk_push_c_function(ctx, timers_clear_cb, 1);
+  duk_put_prop_string(ctx, -2, "clearTimeout");
+
+  duk_push_c_function(ctx, timers_clear_cb, 1);
+  duk_put_prop_string(ctx, -2, "clearInterval");
+
+  duk_pop(ctx);
+}
@@ -0,0 +1,15 @@
+#ifndef SRC_TIMERS_H_
+#define SRC_TIMERS_H_
+
+#include "uv.h"
+#include "duktape.h"
+
+/*
+ * `setTimeout`, `setInterval`, `clearTimeout` and `clearInterval`. All JS
+ * timers of the loop live in a single binary heap driven by one `uv_timer_t`,
+ * and their callbacks run on the worker heap's main thread.
+ */
+
+void timers_init(uv_loop_t* loop, duk_context* ctx);
+
+#endif  /* SRC_TIMERS_H_ */
@@ -0,0 +1,579 @@
+#include <stdlib.h>
+#include <string.h>
+
+#include "upload.h"
+#include "common.h"
+#include "multipart.h"
+
+/* Typedefs */
+
+typedef struct upload_field_s upload_field_t;
+typedef struct upload_file_s upload_file_t;
+typedef struct upload_chunk_s upload_chunk_t;
+
+struct upload_field_s {
+  upload_field_t* next;
+  char* name;
+  char* value;
+  size_t value_len;
+  size_t value_size;
+};
+
+struct upload_file_s {
+  upload_file_t* next;
+  upload_t* upload;
+
+  /* Creates the file, and then closes and unlinks it */
+  uv_fs_t req;
+  uv_file fd;
+  char* path;
+  uint64_t size;
+
+  char* field;
+  char* name;
+  char* type;
+};
+
+/* Part of a file waiting to be written */
+struct upload_chunk_s {
+  upload_chunk_t* next;
+  upload_file_t* file;
+  size_t len;
+  size_t written;
+  char data[];
+};
+
+struct upload_s {
+  multipart_t parser;
+
+  void (*on_drain)(void* arg);
+  void (*on_done)(void* arg, int status);
+  void* arg;
+
+  upload_field_t* fields;
+  upload_field_t* fields_tail;
+  size_t fields_size;
+
+  upload_file_t* files;
+  upload_file_t* files_tail;
+  unsigned int file_count;
+  unsigned int max_files;
+
+  /* Part being parsed, either a field or a file */
+  upload_field_t* field;
+  upload_file_t* file;
+
+  /* Write queue, `head` is being written */
+  upload_chunk_t* head;
+  upload_chunk_t* tail;
+  unsigned int chunk_count;
+  uv_fs_t write_req;
+  int writing;
+
+  /* Temp files being created and the write in flight */
+  unsigned int pending;
+
+  /* `200`, or the first error */
+  int status;
+
+  int full;
+  int finished;
+  int closing;
+};
+
+/* Some static vars */
+
+static const size_t UPLOAD_CHUNK_SIZE = 65536;
+static const unsigned int UPLOAD_MAX_CHUNKS = 4;
+static const size_t UPLOAD_MAX_FIELDS_SIZE = 1024 * 1024;
+static const char UPLOAD_TEMPLATE[] = "/dukhttp-XXXXXX";
+
+static uv_loop_t* upload_loop;
+static char* upload_template;
+
+/* Forward declarations */
+
+static void upload_flush(upload_t* upload);
+
+/* Helpers */
+
+static char* upload_strdup(const char* str) {
+  size_t len = strlen(str);
+  char* res = malloc(len + 1);
+
+  CHECK(res != NULL);
+  memcpy(res, str, len + 1);
+  return res;
+}
+
+static size_t upload_chunk_capacity(void) {
+  return UPLOAD_CHUNK_SIZE - sizeof(upload_chunk_t);
+}
+
+static void upload_file_free(upload_file_t* file) {
+  free(file->path);
+  free(file->field);
+  free(file->name);
+  free(file->type);
+  free(file);
+}
+
+static void upload_file_on_unlink(uv_fs_t* req) {
+  upload_file_t* file = CONTAINER_OF(req, upload_file_t, req);
+
+  /* NOTE: JS might have moved the file already */
+  uv_fs_req_cleanup(req);
+  upload_file_free(file);
+}
+
+static void upload_file_on_close(uv_fs_t* req) {
+  upload_file_t* file = CONTAINER_OF(req, upload_file_t, req);
+
+  uv_fs_req_cleanup(req);
+  CHECK_EQ(0, uv_fs_unlink(upload_loop, &file->req, file->path,
+        upload_file_on_unlink));
+}
+
+/* NOTE: The file outlives the upload until it is removed */
+static void upload_file_remove(upload_file_t* file) {
+  if (file->fd < 0) {
+    upload_file_free(file);
+    return;
+  }
+
+  CHECK_EQ(0, uv_fs_close(upload_loop, &file->req, file->fd,
+        upload_file_on_close));
+}
+
+/* Drops the chunks that aren't being written */
+static void upload_drop_chunks(upload_t* upload) {
+  upload_chunk_t* chunk = upload->head;
+  upload_chunk_t* keep = NULL;
+
+  if (upload->writing) {
+    keep = chunk;
+    chunk = chunk->next;
+    keep->next = NULL;
+  }
+
+  while (chunk != NULL) {
+    upload_chunk_t* next = chunk->next;
+
+    free(chunk);
+    upload->chunk_count--;
+    chunk = next;
+  }
+
+  upload->head = keep;
+  upload->tail = keep;
+}
+
+static void upload_fail(upload_t* upload, int status) {
+  if (upload->status == 200) {
+    upload->status = status;
+  }
+  upload_drop_chunks(upload);
+}
+
+static void upload_maybe_free(upload_t* upload) {
+  if (upload->pending != 0) {
+    return;
+  }
+
+  upload_drop_chunks(upload);
+
+  while (upload->fields != NULL) {
+    upload_field_t* field = upload->fields;
+
+    upload->fields = field->next;
+    free(field->name);
+    free(field->value);
+    free(field);
+  }
+
+  while (upload->files != NULL) {
+    upload_file_t* file = upload->files;
+
+    upload->files = file->next;
+    upload_file_remove(file);
+  }
+
+  free(upload);
+}
+
+/* NOTE: Callbacks may close the upload, so they have to be called last */
+static void upload_notify(upload_t* upload) {
+  if (upload->finished) {
+    if (upload->pending != 0) {
+      return;
+    }
+
+    upload->finished = 0;
+    upload->on_done(upload->arg, upload->status);
+    return;
+  }
+
+  if (upload->full && upload->chunk_count < UPLOAD_MAX_CHUNKS) {
+    upload->full = 0;
+    upload->on_drain(upload->arg);
+  }
+}
+
+static void upload_on_open(uv_fs_t* req) {
+  upload_file_t* file = CONTAINER_OF(req, upload_file_t, req);
+  upload_t* upload = file->upload;
+
+  if (req->result >= 0) {
+    file->fd = (uv_file) req->result;
+    file->path = upload_strdup(req->path);
+  }
+
+  uv_fs_req_cleanup(req);
+  upload->pending--;
+
+  if (upload->closing) {
+    upload_maybe_free(upload);
+    return;
+  }
+
+  if (file->fd < 0) {
+    upload_fail(upload, 500);
+  }
+
+  upload_flush(upload);
+  upload_notify(upload);
+}
+
+static void upload_on_write(uv_fs_t* req) {
+  upload_t* upload = req->data;
+  ssize_t result = req->result;
+
+  uv_fs_req_cleanup(req);
+  upload->writing = 0;
+  upload->pending--;
+
+  if (upload->closing) {
+    upload_maybe_free(upload);
+    return;
+  }
+
+  if (result < 0) {
+    upload_fail(upload, 500);
+  } else {
+    upload_chunk_t* chunk = upload->head;
+
+    /* NOTE: Short write is retried with the rest */
+    chunk->written += result;
+    if (chunk->written == chunk->len) {
+      upload->head = chunk->next;
+      if (upload->head == NULL) {
+        upload->tail = NULL;
+      }
+      upload->chunk_count--;
+      free(chunk);
+    }
+  }
+
+  upload_flush(upload);
+  upload_notify(upload);
+}
+
+static void upload_flush(upload_t* upload) {
+  upload_chunk_t* chunk = upload->head;
+  uv_buf_t buf;
+
+  /* File might not be created yet */
+  if (upload->writing || chunk == NULL || chunk->file->fd < 0) {
+    return;
+  }
+
+  buf = uv_buf_init(chunk->data + chunk->written,
+      chunk->len - chunk->written);
+
+  upload->writing = 1;
+  upload->pending++;
+  upload->write_req.data = upload;
+  CHECK_EQ(0, uv_fs_write(upload_loop, &upload->write_req, chunk->file->fd,
+        &buf, 1, -1, upload_on_write));
+}
+
+static void upload_queue(upload_t* upload,
+                         upload_file_t* file,
+                         const char* data,
+                         size_t len) {
+  while (len != 0) {
+    upload_chunk_t* chunk = upload->tail;
+
+    /* NOTE: Chunk in flight can't grow */
+    if (chunk == NULL || chunk->file != file ||
+        chunk->len == upload_chunk_capacity() ||
+        (chunk == upload->head && upload->writing)) {
+      chunk = malloc(UPLOAD_CHUNK_SIZE);
+      CHECK(chunk != NULL);
+
+      chunk->next = NULL;
+      chunk->file = file;
+      chunk->len = 0;
+      chunk->written = 0;
+
+      if (upload->tail == NULL) {
+        upload->head = chunk;
+      } else {
+        upload->tail->next = chunk;
+      }
+      upload->tail = chunk;
+      upload->chunk_count++;
+    }
+
+    size_t avail = upload_chunk_capacity() - chunk->len;
+    size_t to_copy = len < avail ? len : avail;
+
+    memcpy(chunk->data + chunk->len, data, to_copy);
+    chunk->len += to_copy;
+    data += to_copy;
+    len -= to_copy;
+  }
+
+  upload_flush(upload);
+}
+
+/* Parser callbacks */
+
+static int upload_on_part_begin(multipart_t* parser,
+                                const multipart_part_t* part) {
+  upload_t* upload = parser->data;
+
+  upload->fields_size += part->name_len;
+  if (upload->fields_size > UPLOAD_MAX_FIELDS_SIZE) {
+    upload->status = 413;
+    return -1;
+  }
+
+  if (part->filename == NULL) {
+    upload_field_t* field = malloc(sizeof(*field));
+    CHECK(field != NULL);
+    memset(field, 0, sizeof(*field));
+
+    field->name = upload_strdup(part->name);
+
+    if (upload->fields_tail == NULL) {
+      upload->fields = field;
+    } else {
+      upload->fields_tail->next = field;
+    }
+    upload->fields_tail = field;
+    upload->field = field;
+    return 0;
+  }
+
+  /* NOTE: Every file holds a descriptor until the handler responds */
+  if (upload->file_count == upload->max_files) {
+    upload->status = 413;
+    return -1;
+  }
+  upload->file_count++;
+
+  upload_file_t* file = malloc(sizeof(*file));
+  CHECK(file != NULL);
+  memset(file, 0, sizeof(*file));
+
+  file->upload = upload;
+  file->fd = -1;
+  file->field = upload_strdup(part->name);
+  file->name = upload_strdup(part->filename);
+  file->type = upload_strdup(part->content_type == NULL ?
+      "application/octet-stream" : part->content_type);
+
+  if (upload->files_tail == NULL) {
+    upload->files = file;
+  } else {
+    upload->files_tail->next = file;
+  }
+  upload->files_tail = file;
+  upload->file = file;
+
+  upload->pending++;
+  CHECK_EQ(0, uv_fs_mkstemp(upload_loop, &file->req, upload_template,
+        upload_on_open));
+  return 0;
+}
+
+static int upload_on_part_data(multipart_t* parser,
+                               const char* data,
+                               size_t len) {
+  upload_t* upload = parser->data;
+
+  if (upload->file != NULL) {
+    upload->file->size += len;
+    if (upload->status == 200) {
+      upload_queue(upload, upload->file, data, len);
+    }
+    return 0;
+  }
+
+  upload_field_t* field = upload->field;
+
+  upload->fields_size += len;
+  if (upload->fields_size > UPLOAD_MAX_FIELDS_SIZE) {
+    upload->status = 413;
+    return -1;
+  }
+
+  if (field->value_len + len > field->value_size) {
+    size_t size = field->value_size == 0 ? 64 : field->value_size;
+    while (field->value_len + len > size) {
+      size *= 2;
+    }
+
+    char* value = realloc(field->value, size);
+    CHECK(value != NULL);
+    field->value = value;
+    field->value_size = size;
+  }
+
+  memcpy(field->value + field->value_len, data, len);
+  field->value_len += len;
+  return 0;
+}
+
+static int upload_on_part_end(multipart_t* parser) {
+  upload_t* upload = parser->data;
+
+  upload->field = NULL;
+  upload->file = NULL;
+  return 0;
+}
+
+/* Upload */
+
+void upload_init(uv_loop_t* loop, const char* dir) {
+  char tmpdir[1024];
+  size_t dir_len;
+
+  upload_loop = loop;
+
+  if (dir == NULL) {
+    size_t size = sizeof(tmpdir);
+
+    CHECK_EQ(0, uv_os_tmpdir(tmpdir, &size));
+    dir = tmpdir;
+  }
+
+  dir_len = strlen(dir);
+  upload_template = malloc(dir_len + sizeof(UPLOAD_TEMPLATE));
+  CHECK(upload_template != NULL);
+  memcpy(upload_template, dir, dir_len);
+  memcpy(upload_template + dir_len, UPLOAD_TEMPLATE, sizeof(UPLOAD_TEMPLATE));
+}
+
+upload_t* upload_new(const char* content_type,
+                     size_t content_type_len,
+                     unsigned int max_files,
+                     void (*on_drain)(void* arg),
+                     void* arg) {
+  static const multipart_settings_t settings = {
+    upload_on_part_begin,
+    upload_on_part_data,
+    upload_on_part_end,
+  };
+  const char* boundary;
+  size_t boundary_len;
+  upload_t* upload;
+
+  if (multipart_get_boundary(content_type, content_type_len, &boundary,
+                             &boundary_len) != 0) {
+    return NULL;
+  }
+
+  upload = malloc(sizeof(*upload));
+  CHECK(upload != NULL);
+  memset(upload, 0, sizeof(*upload));
+
+  multipart_init(&upload->parser, boundary, boundary_len, &settings);
+  upload->parser.data = upload;
+
+  upload->max_files = max_files;
+  upload->on_drain = on_drain;
+  upload->arg = arg;
+  upload->status = 200;
+
+  return upload;
+}
+
+int upload_execute(upload_t* upload, const char* data, size_t len) {
+  if (upload->status != 200) {
+    return upload->status;
+  }
+
+  if (multipart_execute(&upload->parser, data, len) != 0 &&
+      upload->status == 200) {
+    upload->status = 400;
+  }
+
+  if (upload->status != 200) {
+    upload_drop_chunks(upload);
+    return upload->status;
+  }
+
+  if (upload->chunk_count >= UPLOAD_MAX_CHUNKS) {
+    upload->full = 1;
+  }
+  return 200;
+}
+
+int upload_is_full(upload_t* upload) {
+  return upload->full;
+}
+
+void upload_finish(upload_t* upload, void (*on_done)(void* arg, int status)) {
+  if (multipart_finish(&upload->parser) != 0) {
+    upload_fail(upload, 400);
+  }
+
+  upload->on_done = on_done;
+  upload->finished = 1;
+  upload_notify(upload);
+}
+
+void upload_push_fields(upload_t* upload, duk_context* ctx) {
+  duk_push_object(ctx);
+
+  for (upload_field_t* field = upload->fields; field != NULL;
+       field = field->next) {
+    /* NOTE: Defined rather than put, so that `__proto__` is just a name */
+    duk_push_string(ctx, field->name);
+    duk_push_lstring(ctx, field->value, field->value_len);
+    duk_def_prop(ctx, -3, DUK_DEFPROP_HAVE_VALUE | DUK_DEFPROP_SET_WEC);
+  }
+}
+
+void upload_push_files(upload_t* upload, duk_context* ctx) {
+  duk_uarridx_t index = 0;
+
+  duk_push_array(ctx);
+
+  for (upload_file_t* file = upload->files; file != NULL;
+       file = file->next) {
+    duk_push_object(ctx);
+
+    duk_push_string(ctx, file->field);
+    duk_put_prop_string(ctx, -2, "field");
+    duk_push_string(ctx, file->name);
+    duk_put_prop_string(ctx, -2, "name");
+    duk_push_string(ctx, file->type);
+    duk_put_prop_string(ctx, -2, "type");
+    duk_push_string(ctx, file->path);
+    duk_put_prop_string(ctx, -2, "path");
+    duk_push_int(ctx, file->fd);
+    duk_put_prop_string(ctx, -2, "fd");
+    duk_push_number(ctx, (duk_double_t) file->size);
+    duk_put_prop_string(ctx, -2, "size");
+
+    duk_put_prop_index(ctx, -2, index++);
+  }
+}
+
+void upload_close(upload_t* upload) {
+  upload->closing = 1;
+  upload_maybe_free(upload);
+}
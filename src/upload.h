@@ -0,0 +1,53 @@
+#ifndef SRC_UPLOAD_H_
+#define SRC_UPLOAD_H_
+
+#include <stddef.h>
+
+#include "uv.h"
+#include "duktape.h"
+
+/*
+ * `multipart/form-data` bodies received straight to disk. Fields are kept in
+ * memory, and file parts are written to temp files by a short queue of
+ * `uv_fs_write()` requests on the threadpool. The caller stops reading once
+ * the queue is full, so the memory used by an upload doesn't depend on its
+ * size. Temp files are closed and removed by `upload_close()`.
+ */
+
+typedef struct upload_s upload_t;
+
+/* Temp files go to `dir` */
+void upload_init(uv_loop_t* loop, const char* dir);
+
+/*
+ * Returns `NULL` unless `content_type` is `multipart/form-data` with a
+ * boundary. Bodies with more than `max_files` file parts fail with `413`.
+ * `on_drain` is called once a full queue has room again.
+ */
+upload_t* upload_new(const char* content_type,
+                     size_t content_type_len,
+                     unsigned int max_files,
+                     void (*on_drain)(void* arg),
+                     void* arg);
+
+/* Returns `200`, or the status to answer with: `400`, `413` or `500` */
+int upload_execute(upload_t* upload, const char* data, size_t len);
+
+int upload_is_full(upload_t* upload);
+
+/*
+ * Calls `on_done` with the status once all files are written, which might
+ * happen synchronously.
+ */
+void upload_finish(upload_t* upload, void (*on_done)(void* arg, int status));
+
+/* `{ name: value }` of the fields that aren't files */
+void upload_push_fields(upload_t* upload, duk_context* ctx);
+
+/* `[{ field, name, type, path, fd, size }]` of the files */
+void upload_push_files(upload_t* upload, duk_context* ctx);
+
+/* Frees the upload once pending writes complete, and removes the files */
+void upload_close(upload_t* upload);
+
+#endif  /* SRC_UPLOAD_H_ */
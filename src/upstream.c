@@ -0,0 +1,498 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "upstream.h"
+#include "common.h"
+#include "map.h"
+
+/* Typedefs */
+
+struct upstream_s {
+  map_entry_t entry;
+
+  /* `host:port`, the key of the entry */
+  char* key;
+
+  char* host;
+  char port[8];
+
+  char* host_header;
+  size_t host_header_len;
+
+  /* Most recently used first */
+  upstream_conn_t* idle;
+
+  /* Open or connecting, idle ones included */
+  unsigned int conn_count;
+  unsigned int connecting;
+
+  upstream_wait_t* waits;
+  upstream_wait_t* last_wait;
+  unsigned int wait_count;
+};
+
+/* Some static vars */
+
+static const unsigned int UPSTREAM_INITIAL_POOLS = 16;
+static const unsigned int UPSTREAM_MAX_CONNS = 64;
+static const unsigned int UPSTREAM_MAX_WAITS = 1024;
+
+/* NOTE: Below the usual 5 seconds of servers, so they don't close first */
+static const uint64_t UPSTREAM_IDLE_TIMEOUT = 4000;
+
+static uv_loop_t* upstream_loop;
+static map_t upstream_pools;
+
+/* Idle connections should receive nothing */
+static char upstream_idle_buf[64];
+
+static void upstream_maybe_connect(upstream_t* upstream);
+
+/* Helpers */
+
+static char upstream_to_lower(char c) {
+  return c >= 'A' && c <= 'Z' ? (char) (c + ('a' - 'A')) : c;
+}
+
+int upstream_equals_nocase(const char* a, const char* b, size_t len) {
+  for (size_t i = 0; i < len; i++) {
+    if (upstream_to_lower(a[i]) != upstream_to_lower(b[i])) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/* Queue */
+
+static void upstream_wait_remove(upstream_wait_t* wait) {
+  upstream_t* upstream = wait->upstream;
+
+  if (wait->prev == NULL) {
+    upstream->waits = wait->next;
+  } else {
+    wait->prev->next = wait->next;
+  }
+  if (wait->next == NULL) {
+    upstream->last_wait = wait->prev;
+  } else {
+    wait->next->prev = wait->prev;
+  }
+
+  wait->prev = NULL;
+  wait->next = NULL;
+  wait->queued = 0;
+  upstream->wait_count--;
+}
+
+static void upstream_wait_append(upstream_wait_t* wait) {
+  upstream_t* upstream = wait->upstream;
+
+  wait->prev = upstream->last_wait;
+  wait->next = NULL;
+  if (upstream->last_wait == NULL) {
+    upstream->waits = wait;
+  } else {
+    upstream->last_wait->next = wait;
+  }
+  upstream->last_wait = wait;
+
+  wait->queued = 1;
+  upstream->wait_count++;
+}
+
+/* Connections */
+
+static void upstream_conn_on_close(uv_handle_t* handle) {
+  upstream_conn_t* conn = handle->data;
+
+  if (--conn->close_pending == 0) {
+    free(conn);
+  }
+}
+
+static void upstream_idle_remove(upstream_conn_t* conn) {
+  upstream_t* upstream = conn->upstream;
+
+  if (conn->prev == NULL) {
+    upstream->idle = conn->next;
+  } else {
+    conn->prev->next = conn->next;
+  }
+  if (conn->next != NULL) {
+    conn->next->prev = conn->prev;
+  }
+
+  conn->prev = NULL;
+  conn->next = NULL;
+  conn->idle = 0;
+
+  uv_timer_stop(&conn->idle_timer);
+  uv_read_stop((uv_stream_t*) &conn->tcp);
+}
+
+static void upstream_conn_close(upstream_conn_t* conn) {
+  upstream_t* upstream = conn->upstream;
+
+  if (conn->closing) {
+    return;
+  }
+  conn->closing = 1;
+
+  if (conn->idle) {
+    upstream_idle_remove(conn);
+  }
+  upstream->conn_count--;
+
+  conn->close_pending = 2;
+  uv_close((uv_handle_t*) &conn->tcp, upstream_conn_on_close);
+  uv_close((uv_handle_t*) &conn->idle_timer, upstream_conn_on_close);
+
+  upstream_maybe_connect(upstream);
+}
+
+static void upstream_idle_alloc_cb(uv_handle_t* handle,
+                                   size_t suggested_size,
+                                   uv_buf_t* buf) {
+  (void) handle;
+  (void) suggested_size;
+
+  *buf = uv_buf_init(upstream_idle_buf, sizeof(upstream_idle_buf));
+}
+
+/* Closed by the server, or it sent something nobody asked for */
+static void upstream_idle_read_cb(uv_stream_t* stream,
+                                  ssize_t nread,
+                                  const uv_buf_t* buf) {
+  upstream_conn_t* conn = CONTAINER_OF(stream, upstream_conn_t, tcp);
+
+  (void) buf;
+
+  if (nread != 0) {
+    upstream_conn_close(conn);
+  }
+}
+
+static void upstream_idle_timer_cb(uv_timer_t* timer) {
+  upstream_conn_close(CONTAINER_OF(timer, upstream_conn_t, idle_timer));
+}
+
+static void upstream_conn_idle(upstream_conn_t* conn) {
+  upstream_t* upstream = conn->upstream;
+
+  conn->prev = NULL;
+  conn->next = upstream->idle;
+  if (upstream->idle != NULL) {
+    upstream->idle->prev = conn;
+  }
+  upstream->idle = conn;
+  conn->idle = 1;
+
+  CHECK_EQ(0, uv_read_start((uv_stream_t*) &conn->tcp,
+        upstream_idle_alloc_cb, upstream_idle_read_cb));
+  CHECK_EQ(0, uv_timer_start(&conn->idle_timer, upstream_idle_timer_cb,
+        UPSTREAM_IDLE_TIMEOUT, 0));
+}
+
+/*
+ * Hands the connection to the first waiting request, or to the first one
+ * that doesn't need a new connection if `reused` is set. Keeps it idle if
+ * there is none.
+ */
+static void upstream_conn_ready(upstream_conn_t* conn, int reused) {
+  upstream_t* upstream = conn->upstream;
+  upstream_wait_t* wait;
+
+  for (wait = upstream->waits; wait != NULL; wait = wait->next) {
+    if (!reused || !wait->fresh) {
+      break;
+    }
+  }
+
+  if (wait == NULL) {
+    upstream_conn_idle(conn);
+    upstream_maybe_connect(upstream);
+    return;
+  }
+
+  upstream_wait_remove(wait);
+  wait->cb(wait, conn, 0);
+}
+
+static void upstream_connect_fail(upstream_conn_t* conn, int status) {
+  upstream_t* upstream = conn->upstream;
+  upstream_wait_t* wait = upstream->waits;
+
+  upstream->connecting--;
+
+  /* NOTE: Every connection is started for a request, fail the oldest one */
+  if (wait != NULL) {
+    upstream_wait_remove(wait);
+  }
+  upstream_conn_close(conn);
+
+  if (wait != NULL) {
+    wait->cb(wait, NULL, status);
+  }
+}
+
+static void upstream_on_connect(uv_connect_t* connect, int status) {
+  upstream_conn_t* conn = CONTAINER_OF(connect, upstream_conn_t, connect);
+
+  if (status != 0) {
+    upstream_connect_fail(conn, status);
+    return;
+  }
+
+  conn->upstream->connecting--;
+  uv_tcp_nodelay(&conn->tcp, 1);
+
+  upstream_conn_ready(conn, 0);
+}
+
+static void upstream_on_resolve(uv_getaddrinfo_t* req,
+                                int status,
+                                struct addrinfo* res) {
+  upstream_conn_t* conn = CONTAINER_OF(req, upstream_conn_t, getaddrinfo);
+
+  if (status != 0) {
+    upstream_connect_fail(conn, status);
+    return;
+  }
+
+  status = uv_tcp_connect(&conn->connect, &conn->tcp, res->ai_addr,
+      upstream_on_connect);
+  uv_freeaddrinfo(res);
+
+  if (status != 0) {
+    upstream_connect_fail(conn, status);
+  }
+}
+
+static void upstream_connect(upstream_t* upstream) {
+  struct addrinfo hints;
+  upstream_conn_t* conn;
+
+  conn = malloc(sizeof(*conn));
+  CHECK(conn != NULL);
+
+  memset(conn, 0, sizeof(*conn));
+  conn->upstream = upstream;
+
+  CHECK_EQ(0, uv_tcp_init(upstream_loop, &conn->tcp));
+  CHECK_EQ(0, uv_timer_init(upstream_loop, &conn->idle_timer));
+  conn->tcp.data = conn;
+  conn->idle_timer.data = conn;
+
+  upstream->conn_count++;
+  upstream->connecting++;
+
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+
+  CHECK_EQ(0, uv_getaddrinfo(upstream_loop, &conn->getaddrinfo,
+        upstream_on_resolve, upstream->host, upstream->port, &hints));
+}
+
+/* Opens connections for the requests that have none coming */
+static void upstream_maybe_connect(upstream_t* upstream) {
+  while (upstream->connecting < upstream->wait_count) {
+    if (upstream->conn_count < UPSTREAM_MAX_CONNS) {
+      upstream_connect(upstream);
+    } else if (upstream->idle != NULL) {
+      /* Only requests that need a new connection are waiting */
+      upstream_conn_close(upstream->idle);
+      return;
+    } else {
+      return;
+    }
+  }
+}
+
+/* Pools */
+
+int upstream_parse_url(const char* url,
+                       size_t url_len,
+                       const char** host,
+                       size_t* host_len,
+                       unsigned short* port,
+                       const char** path,
+                       size_t* path_len) {
+  const char* end = url + url_len;
+  const char* p;
+
+  if (url_len < 7 || !upstream_equals_nocase(url, "http://", 7)) {
+    return -1;
+  }
+  p = url + 7;
+
+  if (p != end && *p == '[') {
+    *host = ++p;
+    while (p != end && *p != ']') {
+      p++;
+    }
+    if (p == end) {
+      return -1;
+    }
+    *host_len = p++ - *host;
+  } else {
+    *host = p;
+    while (p != end && *p != ':' && *p != '/' && *p != '?') {
+      if ((unsigned char) *p <= ' ' || *p == '@' || *p == 0x7f) {
+        return -1;
+      }
+      p++;
+    }
+    *host_len = p - *host;
+  }
+  if (*host_len == 0) {
+    return -1;
+  }
+
+  *port = 80;
+  if (p != end && *p == ':') {
+    unsigned int value = 0;
+
+    p++;
+    if (p == end || *p < '0' || *p > '9') {
+      return -1;
+    }
+    while (p != end && *p >= '0' && *p <= '9') {
+      value = value * 10 + (*p++ - '0');
+      if (value > 65535) {
+        return -1;
+      }
+    }
+    if (value == 0) {
+      return -1;
+    }
+    *port = (unsigned short) value;
+  }
+
+  if (p != end && *p != '/' && *p != '?') {
+    return -1;
+  }
+
+  /* NOTE: Fragments are not sent */
+  *path = p;
+  while (p != end && *p != '#') {
+    if ((unsigned char) *p <= ' ' || *p == 0x7f) {
+      return -1;
+    }
+    p++;
+  }
+  *path_len = p - *path;
+
+  return 0;
+}
+
+void upstream_init(uv_loop_t* loop) {
+  upstream_loop = loop;
+  map_init(&upstream_pools, UPSTREAM_INITIAL_POOLS);
+}
+
+upstream_t* upstream_get(const char* host, size_t host_len,
+                         unsigned short port) {
+  char key[300];
+  int key_len;
+  uint32_t hash;
+  map_entry_t* entry;
+  upstream_t* upstream;
+  int ipv6;
+
+  if (host_len > 255) {
+    return NULL;
+  }
+
+  key_len = snprintf(key, sizeof(key), "%.*s:%u", (int) host_len, host,
+      port);
+  hash = map_hash(key, key_len);
+  entry = map_get(&upstream_pools, key, key_len, hash);
+  if (entry != NULL) {
+    return CONTAINER_OF(entry, upstream_t, entry);
+  }
+
+  upstream = malloc(sizeof(*upstream));
+  CHECK(upstream != NULL);
+  memset(upstream, 0, sizeof(*upstream));
+
+  upstream->key = malloc(key_len + 1);
+  upstream->host = malloc(host_len + 1);
+  upstream->host_header = malloc(key_len + 3);
+  CHECK(upstream->key != NULL);
+  CHECK(upstream->host != NULL);
+  CHECK(upstream->host_header != NULL);
+
+  memcpy(upstream->key, key, key_len + 1);
+  memcpy(upstream->host, host, host_len);
+  upstream->host[host_len] = '\0';
+  snprintf(upstream->port, sizeof(upstream->port), "%u", port);
+
+  /* IPv6 addresses are bracketed, and the default port is omitted */
+  ipv6 = memchr(host, ':', host_len) != NULL;
+  if (port == 80) {
+    upstream->host_header_len = snprintf(upstream->host_header, key_len + 3,
+        ipv6 ? "[%s]" : "%s", upstream->host);
+  } else {
+    upstream->host_header_len = snprintf(upstream->host_header, key_len + 3,
+        ipv6 ? "[%s]:%u" : "%s:%u", upstream->host, port);
+  }
+
+  upstream->entry.key = upstream->key;
+  upstream->entry.key_len = key_len;
+  upstream->entry.hash = hash;
+  map_insert(&upstream_pools, &upstream->entry);
+
+  return upstream;
+}
+
+const char* upstream_host(upstream_t* upstream, size_t* len) {
+  *len = upstream->host_header_len;
+  return upstream->host_header;
+}
+
+int upstream_acquire(upstream_t* upstream, upstream_wait_t* wait,
+                     upstream_acquire_cb cb, int fresh) {
+  upstream_conn_t* conn = upstream->idle;
+
+  wait->upstream = upstream;
+  wait->cb = cb;
+  wait->fresh = fresh;
+  wait->queued = 0;
+
+  if (conn != NULL && !fresh) {
+    upstream_idle_remove(conn);
+    cb(wait, conn, 0);
+    return 0;
+  }
+
+  if (upstream->wait_count >= UPSTREAM_MAX_WAITS) {
+    return UV_ENOBUFS;
+  }
+
+  upstream_wait_append(wait);
+  upstream_maybe_connect(upstream);
+  return 0;
+}
+
+void upstream_cancel(upstream_wait_t* wait) {
+  /* NOTE: Connection opened for it goes to the next one, or stays idle */
+  if (wait->queued) {
+    upstream_wait_remove(wait);
+  }
+}
+
+void upstream_release(upstream_conn_t* conn, int reuse) {
+  conn->data = NULL;
+
+  if (!reuse || conn->closing) {
+    upstream_conn_close(conn);
+    return;
+  }
+
+  conn->uses++;
+  uv_read_stop((uv_stream_t*) &conn->tcp);
+  upstream_conn_ready(conn, 1);
+}
@@ -0,0 +1,105 @@
+#ifndef SRC_UPSTREAM_H_
+#define SRC_UPSTREAM_H_
+
+#include <stddef.h>
+
+#include "uv.h"
+
+/*
+ * Pools of keep-alive connections to upstream servers, one per host and
+ * port. A connection is lent to a single request at a time and returned
+ * once its response is read, so requests are never queued behind each other
+ * on one socket. Idle connections keep reading to notice when the server
+ * closes them, and are closed after a few seconds without use. Requests
+ * wait in a queue once the connection limit of the upstream is reached.
+ */
+
+typedef struct upstream_s upstream_t;
+typedef struct upstream_conn_s upstream_conn_t;
+typedef struct upstream_wait_s upstream_wait_t;
+
+/* `status` is zero on success, in which case `conn` is lent to the caller */
+typedef void (*upstream_acquire_cb)(upstream_wait_t* wait,
+                                    upstream_conn_t* conn,
+                                    int status);
+
+struct upstream_conn_s {
+  uv_tcp_t tcp;
+  upstream_t* upstream;
+
+  /* Idle list */
+  upstream_conn_t* prev;
+  upstream_conn_t* next;
+
+  uv_timer_t idle_timer;
+  uv_getaddrinfo_t getaddrinfo;
+  uv_connect_t connect;
+
+  /* Number of requests that were done on the connection before this one */
+  unsigned int uses;
+
+  int idle;
+  int closing;
+  int close_pending;
+
+  /* Set by the borrower */
+  void* data;
+};
+
+struct upstream_wait_s {
+  upstream_wait_t* prev;
+  upstream_wait_t* next;
+
+  upstream_t* upstream;
+  upstream_acquire_cb cb;
+
+  /* Wait for a new connection instead of taking an idle one */
+  int fresh;
+  int queued;
+};
+
+void upstream_init(uv_loop_t* loop);
+
+/*
+ * Returns non-zero if `len` bytes at `a` and `b` only differ in ASCII case.
+ * NOTE: `strncasecmp()` is not available on Windows.
+ */
+int upstream_equals_nocase(const char* a, const char* b, size_t len);
+
+/*
+ * Splits `http://host[:port][/path]`, the path includes the query. Returns
+ * `-1` if the url is not like that.
+ */
+int upstream_parse_url(const char* url,
+                       size_t url_len,
+                       const char** host,
+                       size_t* host_len,
+                       unsigned short* port,
+                       const char** path,
+                       size_t* path_len);
+
+/* Returns the pool for `host` and `port`, creating it if needed */
+upstream_t* upstream_get(const char* host, size_t host_len,
+                         unsigned short port);
+
+/* Value of the `Host` header for requests to the upstream */
+const char* upstream_host(upstream_t* upstream, size_t* len);
+
+/*
+ * Calls `wait->cb` with a connection once one is available, which might
+ * happen synchronously. Returns `UV_ENOBUFS` if too many requests are
+ * waiting already.
+ */
+int upstream_acquire(upstream_t* upstream, upstream_wait_t* wait,
+                     upstream_acquire_cb cb, int fresh);
+
+/* Stops waiting, `wait->cb` is not called */
+void upstream_cancel(upstream_wait_t* wait);
+
+/*
+ * Returns the connection to the pool, or closes it unless `reuse` is set.
+ * NOTE: The borrower's reads and writes must be done by now.
+ */
+void upstream_release(upstream_conn_t* conn, int reuse);
+
+#endif  /* SRC_UPSTREAM_H_ */
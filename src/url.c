@@ -0,0 +1,97 @@
+#include <string.h>
+
+#include "url.h"
+
+/* Helpers */
+
+static int url_hex_value(char c) {
+  if (c >= '0' && c <= '9') {
+    return c - '0';
+  }
+  if (c >= 'a' && c <= 'f') {
+    return c - 'a' + 10;
+  }
+  if (c >= 'A' && c <= 'F') {
+    return c - 'A' + 10;
+  }
+  return -1;
+}
+
+/* URLs */
+
+size_t url_path_len(const char* url, size_t url_len) {
+  const char* end;
+
+  end = memchr(url, '?', url_len);
+  if (end != NULL) {
+    url_len = end - url;
+  }
+
+  end = memchr(url, '#', url_len);
+  if (end != NULL) {
+    url_len = end - url;
+  }
+
+  return url_len;
+}
+
+const char* url_query(const char* url, size_t url_len, size_t* query_len) {
+  size_t path_len = url_path_len(url, url_len);
+
+  *query_len = 0;
+  if (path_len == url_len || url[path_len] != '?') {
+    return NULL;
+  }
+
+  const char* query = url + path_len + 1;
+  const char* end = memchr(query, '#', url_len - path_len - 1);
+
+  *query_len = end == NULL ? url_len - path_len - 1 : (size_t) (end - query);
+  return query;
+}
+
+size_t url_decode(char* out, const char* in, size_t len, int form) {
+  size_t out_len = 0;
+
+  while (len != 0) {
+    /*
+     * Copy everything up to the next escape at once, `memchr()` is
+     * vectorized by libc on most platforms.
+     */
+    const char* escape = memchr(in, '%', len);
+    size_t run = escape == NULL ? len : (size_t) (escape - in);
+
+    memcpy(out + out_len, in, run);
+    if (form) {
+      char* plus = out + out_len;
+      char* end = plus + run;
+
+      while ((plus = memchr(plus, '+', end - plus)) != NULL) {
+        *plus++ = ' ';
+      }
+    }
+
+    out_len += run;
+    in += run;
+    len -= run;
+
+    if (len == 0) {
+      break;
+    }
+
+    /* `in` points to `%` */
+    if (len >= 3 && url_hex_value(in[1]) != -1 &&
+        url_hex_value(in[2]) != -1) {
+      out[out_len++] = (char) (url_hex_value(in[1]) * 16 +
+                               url_hex_value(in[2]));
+      in += 3;
+      len -= 3;
+    } else {
+      out[out_len++] = '%';
+      in++;
+      len--;
+    }
+  }
+
+  return out_len;
+}
@@ -0,0 +1,22 @@
+#ifndef SRC_URL_H_
+#define SRC_URL_H_
+
+#include <stddef.h>
+
+/* Returns the length of the path part of request target `url` */
+size_t url_path_len(const char* url, size_t url_len);
+
+/*
+ * Returns the query string of `url` without `?`, `NULL` if there is none.
+ * NOTE: `*query_len` is set in any case.
+ */
+const char* url_query(const char* url, size_t url_len, size_t* query_len);
+
+/*
+ * Percent-decodes `len` bytes of `in` into `out`, which must be at least as
+ * large. With `form` set, `+` is decoded as space. Malformed escapes are
+ * copied as is. Returns the decoded length.
+ */
+size_t url_decode(char* out, const char* in, size_t len, int form);
+
+#endif  /* SRC_URL_H_ */
@@ -0,0 +1,884 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "ws.h"
+#include "body.h"
+#include "common.h"
+#include "refs.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+# define WS_UNMASK_X86 1
+# include <immintrin.h>
+#endif  /* x86 && __GNUC__ */
+
+/* Typedefs */
+
+enum ws_opcode_e {
+  kWSContinuation = 0x0,
+  kWSText = 0x1,
+  kWSBinary = 0x2,
+  kWSClose = 0x8,
+  kWSPing = 0x9,
+  kWSPong = 0xa
+};
+
+struct ws_s {
+  /* `NULL` until started */
+  uv_stream_t* stream;
+  void (*on_end)(void* arg);
+  void* arg;
+
+  /* JS socket object, holds the callbacks */
+  int obj_ref;
+
+  uint64_t max_message_size;
+
+  /* Header of the frame being parsed, 2 to 14 bytes */
+  unsigned char head[14];
+  unsigned int head_len;
+  unsigned int head_size;
+
+  int fin;
+  int opcode;
+  unsigned char mask[4];
+  uint64_t frame_len;
+  uint64_t frame_left;
+
+  /* Data message being received, `0` opcode if none */
+  int message_opcode;
+  uint64_t message_len;
+  body_t message;
+
+  /* Control frames are at most 125 bytes and never fragmented */
+  char control[125];
+  size_t control_len;
+
+  /* Frames sent before the handshake is written */
+  body_t unsent;
+  unsigned int pending_writes;
+  int drain;
+
+  int close_sent;
+  int close_received;
+  int close_code;
+  char close_reason[123];
+  size_t close_reason_len;
+  int ended;
+};
+
+typedef void (*ws_unmask_fn)(unsigned char*, size_t, const unsigned char*);
+
+/* Some static vars */
+
+static const char WS_GUID[] = "258EAFA5-E914-47DA-95CA-C5AB0DC85B11";
+
+/* `send()` returns `false` once this much is waiting to be written */
+static const size_t WS_HIGH_WATERMARK = 65536;
+
+static duk_context* ws_ctx;
+
+/* Prototype of the socket objects */
+static int ws_proto_ref;
+
+static ws_unmask_fn ws_unmask_impl;
+
+/* Handshake */
+
+static uint32_t ws_rol(uint32_t x, int n) {
+  return (x << n) | (x >> (32 - n));
+}
+
+static void ws_sha1_block(uint32_t* h, const unsigned char* block) {
+  uint32_t w[80];
+  uint32_t a = h[0];
+  uint32_t b = h[1];
+  uint32_t c = h[2];
+  uint32_t d = h[3];
+  uint32_t e = h[4];
+
+  for (int i = 0; i < 16; i++) {
+    w[i] = ((uint32_t) block[i * 4] << 24) |
+           ((uint32_t) block[i * 4 + 1] << 16) |
+           ((uint32_t) block[i * 4 + 2] << 8) |
+           (uint32_t) block[i * 4 + 3];
+  }
+  for (int i = 16; i < 80; i++) {
+    w[i] = ws_rol(w[i - 3] ^ w[i - 8] ^ w[i - 14] ^ w[i - 16], 1);
+  }
+
+  for (int i = 0; i < 80; i++) {
+    uint32_t f;
+    uint32_t k;
+
+    if (i < 20) {
+      f = (b & c) | (~b & d);
+      k = 0x5a827999;
+    } else if (i < 40) {
+      f = b ^ c ^ d;
+      k = 0x6ed9eba1;
+    } else if (i < 60) {
+      f = (b & c) | (b & d) | (c & d);
+      k = 0x8f1bbcdc;
+    } else {
+      f = b ^ c ^ d;
+      k = 0xca62c1d6;
+    }
+
+    uint32_t t = ws_rol(a, 5) + f + e + k + w[i];
+    e = d;
+    d = c;
+    c = ws_rol(b, 30);
+    b = a;
+    a = t;
+  }
+
+  h[0] += a;
+  h[1] += b;
+  h[2] += c;
+  h[3] += d;
+  h[4] += e;
+}
+
+static void ws_sha1(const unsigned char* data, size_t len, unsigned char* out) {
+  uint32_t h[5] = {
+    0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476, 0xc3d2e1f0
+  };
+  unsigned char tail[128];
+  size_t tail_len;
+  uint64_t bits = (uint64_t) len * 8;
+
+  for (; len >= 64; data += 64, len -= 64) {
+    ws_sha1_block(h, data);
+  }
+
+  /* Padding and the length in bits take one or two more blocks */
+  memset(tail, 0, sizeof(tail));
+  memcpy(tail, data, len);
+  tail[len] = 0x80;
+  tail_len = len + 9 <= 64 ? 64 : 128;
+  for (int i = 0; i < 8; i++) {
+    tail[tail_len - 1 - i] = (unsigned char) (bits >> (i * 8));
+  }
+
+  ws_sha1_block(h, tail);
+  if (tail_len == 128) {
+    ws_sha1_block(h, tail + 64);
+  }
+
+  for (int i = 0; i < 20; i++) {
+    out[i] = (unsigned char) (h[i / 4] >> (24 - (i % 4) * 8));
+  }
+}
+
+void ws_accept_key(const char* key, size_t key_len, char* out) {
+  static const char alphabet[] =
+      "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+  unsigned char input[128];
+  unsigned char digest[20];
+  char* p = out;
+
+  CHECK(key_len + sizeof(WS_GUID) - 1 <= sizeof(input));
+
+  memcpy(input, key, key_len);
+  memcpy(input + key_len, WS_GUID, sizeof(WS_GUID) - 1);
+  ws_sha1(input, key_len + sizeof(WS_GUID) - 1, digest);
+
+  /* Base64, 20 bytes end with one byte of padding */
+  for (int i = 0; i < 20; i += 3) {
+    uint32_t n = ((uint32_t) digest[i] << 16) |
+                 ((uint32_t) digest[i + 1] << 8);
+    if (i + 2 < 20) {
+      n |= digest[i + 2];
+    }
+
+    *p++ = alphabet[(n >> 18) & 0x3f];
+    *p++ = alphabet[(n >> 12) & 0x3f];
+    *p++ = alphabet[(n >> 6) & 0x3f];
+    *p++ = i + 2 < 20 ? alphabet[n & 0x3f] : '=';
+  }
+  *p = '\0';
+
+  CHECK_EQ(WS_ACCEPT_LEN, p - out);
+}
+
+/* Helpers */
+
+/* `mask` is rotated to the offset of `p` in the frame */
+static void ws_unmask_scalar(unsigned char* p,
+                             size_t len,
+                             const unsigned char* mask) {
+  unsigned char mask8[8];
+  uint64_t word_mask;
+
+  for (int i = 0; i < 8; i++) {
+    mask8[i] = mask[i & 3];
+  }
+  memcpy(&word_mask, mask8, sizeof(word_mask));
+
+  for (; len >= 8; p += 8, len -= 8) {
+    uint64_t word;
+
+    memcpy(&word, p, sizeof(word));
+    word ^= word_mask;
+    memcpy(p, &word, sizeof(word));
+  }
+
+  for (size_t i = 0; i < len; i++) {
+    p[i] ^= mask[i & 3];
+  }
+}
+
+#ifdef WS_UNMASK_X86
+
+__attribute__((target("sse2")))
+static void ws_unmask_sse2(unsigned char* p,
+                           size_t len,
+                           const unsigned char* mask) {
+  uint32_t m;
+
+  memcpy(&m, mask, sizeof(m));
+  __m128i vmask = _mm_set1_epi32((int) m);
+
+  for (; len >= 16; p += 16, len -= 16) {
+    __m128i v = _mm_loadu_si128((__m128i const*) p);
+    _mm_storeu_si128((__m128i*) p, _mm_xor_si128(v, vmask));
+  }
+
+  ws_unmask_scalar(p, len, mask);
+}
+
+__attribute__((target("avx2")))
+static void ws_unmask_avx2(unsigned char* p,
+                           size_t len,
+                           const unsigned char* mask) {
+  uint32_t m;
+
+  memcpy(&m, mask, sizeof(m));
+  __m256i vmask = _mm256_set1_epi32((int) m);
+
+  for (; len >= 32; p += 32, len -= 32) {
+    __m256i v = _mm256_loadu_si256((__m256i const*) p);
+    _mm256_storeu_si256((__m256i*) p, _mm256_xor_si256(v, vmask));
+  }
+
+  _mm256_zeroupper();
+
+  ws_unmask_scalar(p, len, mask);
+}
+
+#endif  /* WS_UNMASK_X86 */
+
+/* Unmasks the next `len` bytes of the frame payload */
+static void ws_unmask(ws_t* ws, unsigned char* p, size_t len) {
+  unsigned int off = (unsigned int) ((ws->frame_len - ws->frame_left) & 3);
+  unsigned char mask[4];
+
+  for (unsigned int i = 0; i < 4; i++) {
+    mask[i] = ws->mask[(off + i) & 3];
+  }
+  ws_unmask_impl(p, len, mask);
+}
+
+static int ws_utf8_valid(const unsigned char* p, size_t len) {
+  size_t i = 0;
+
+  while (i < len) {
+    /* Skip ASCII a word at a time */
+    if (len - i >= 8) {
+      uint64_t word;
+
+      memcpy(&word, p + i, sizeof(word));
+      if ((word & 0x8080808080808080ULL) == 0) {
+        i += 8;
+        continue;
+      }
+    }
+
+    unsigned char c = p[i];
+    if (c < 0x80) {
+      i++;
+      continue;
+    }
+
+    /* Overlong forms, surrogates and code points over U+10FFFF are invalid */
+    unsigned int n;
+    unsigned char lo = 0x80;
+    unsigned char hi = 0xbf;
+    if (c >= 0xc2 && c <= 0xdf) {
+      n = 1;
+    } else if (c >= 0xe0 && c <= 0xef) {
+      n = 2;
+      if (c == 0xe0) {
+        lo = 0xa0;
+      } else if (c == 0xed) {
+        hi = 0x9f;
+      }
+    } else if (c >= 0xf0 && c <= 0xf4) {
+      n = 3;
+      if (c == 0xf0) {
+        lo = 0x90;
+      } else if (c == 0xf4) {
+        hi = 0x8f;
+      }
+    } else {
+      return 0;
+    }
+
+    if (len - i <= n || p[i + 1] < lo || p[i + 1] > hi) {
+      return 0;
+    }
+    for (unsigned int j = 2; j <= n; j++) {
+      if ((p[i + j] & 0xc0) != 0x80) {
+        return 0;
+      }
+    }
+    i += n + 1;
+  }
+
+  return 1;
+}
+
+/* Calls `ws[name](...)` with arguments from the top of the stack */
+static void ws_emit(ws_t* ws, const char* name, duk_idx_t nargs) {
+  duk_context* ctx = ws_ctx;
+
+  refs_push(ctx, ws->obj_ref);
+  duk_get_prop_string(ctx, -1, name);
+  if (!duk_is_callable(ctx, -1)) {
+    duk_pop_n(ctx, nargs + 2);
+    return;
+  }
+
+  /* [ ...args, ws, fn ] => [ fn, ws, ...args ] */
+  duk_insert(ctx, -(nargs + 2));
+  duk_insert(ctx, -(nargs + 1));
+
+  if (duk_pcall_method(ctx, nargs) != DUK_EXEC_SUCCESS) {
+    fprintf(stderr, "WebSocket callback error: %s\n",
+        duk_safe_to_string(ctx, -1));
+  }
+  duk_pop(ctx);
+}
+
+static void ws_end(ws_t* ws) {
+  if (ws->ended) {
+    return;
+  }
+
+  ws->ended = 1;
+  ws->on_end(ws->arg);
+}
+
+/* Connection is closed once both sides have sent `Close` */
+static void ws_maybe_end(ws_t* ws) {
+  if (ws->close_sent && ws->close_received && ws->pending_writes == 0) {
+    ws_end(ws);
+  }
+}
+
+static size_t ws_queue_size(ws_t* ws) {
+  if (ws->stream == NULL) {
+    return (size_t) ws->unsent.len;
+  }
+  return uv_stream_get_write_queue_size(ws->stream);
+}
+
+static void ws_on_write(uv_write_t* req, int status) {
+  ws_t* ws = req->data;
+
+  free(req);
+  ws->pending_writes--;
+
+  if (status != 0) {
+    ws_end(ws);
+    return;
+  }
+
+  if (ws->drain && ws_queue_size(ws) < WS_HIGH_WATERMARK) {
+    ws->drain = 0;
+    ws_emit(ws, "onDrain", 0);
+  }
+
+  ws_maybe_end(ws);
+}
+
+/* Writes `len` bytes that follow the write request in the same allocation */
+static void ws_write(ws_t* ws, uv_write_t* req, size_t len) {
+  uv_buf_t buf = uv_buf_init(((char*) req) + sizeof(*req), len);
+
+  req->data = ws;
+  ws->pending_writes++;
+  CHECK_EQ(0, uv_write(req, ws->stream, &buf, 1, ws_on_write));
+}
+
+static void ws_send(ws_t* ws, int opcode, const char* data, size_t len) {
+  unsigned char head[10];
+  size_t head_len;
+
+  head[0] = (unsigned char) (0x80 | opcode);
+  if (len < 126) {
+    head[1] = (unsigned char) len;
+    head_len = 2;
+  } else if (len <= 0xffff) {
+    head[1] = 126;
+    head[2] = (unsigned char) (len >> 8);
+    head[3] = (unsigned char) len;
+    head_len = 4;
+  } else {
+    head[1] = 127;
+    for (int i = 0; i < 8; i++) {
+      head[2 + i] = (unsigned char) ((uint64_t) len >> (56 - i * 8));
+    }
+    head_len = 10;
+  }
+
+  if (ws->stream == NULL) {
+    body_append(&ws->unsent, (const char*) head, head_len);
+    body_append(&ws->unsent, data, len);
+    return;
+  }
+
+  if (uv_is_closing((uv_handle_t*) ws->stream)) {
+    return;
+  }
+
+  uv_write_t* req = malloc(sizeof(*req) + head_len + len);
+  CHECK(req != NULL);
+
+  char* frame = ((char*) req) + sizeof(*req);
+  memcpy(frame, head, head_len);
+  memcpy(frame + head_len, data, len);
+
+  ws_write(ws, req, head_len + len);
+}
+
+/* `0` code sends `Close` without a payload */
+static void ws_send_close(ws_t* ws,
+                          int code,
+                          const char* reason,
+                          size_t reason_len) {
+  char payload[125];
+  size_t payload_len = 0;
+
+  if (code != 0) {
+    payload[0] = (char) (code >> 8);
+    payload[1] = (char) code;
+    memcpy(payload + 2, reason, reason_len);
+    payload_len = 2 + reason_len;
+  }
+
+  ws->close_sent = 1;
+  ws_send(ws, kWSClose, payload, payload_len);
+}
+
+/* Closes the socket with `code`, nothing is read past the error */
+static void ws_fail(ws_t* ws, int code) {
+  ws->close_received = 1;
+  ws->close_code = code;
+  ws->close_reason_len = 0;
+
+  if (!ws->close_sent) {
+    ws_send_close(ws, code, "", 0);
+  }
+  ws_maybe_end(ws);
+}
+
+/* Parsing */
+
+static int ws_valid_close_code(int code) {
+  return (code >= 1000 && code <= 1003) ||
+         (code >= 1007 && code <= 1011) ||
+         (code >= 3000 && code <= 4999);
+}
+
+/* Returns non-zero if the frame is invalid */
+static int ws_on_head(ws_t* ws) {
+  const unsigned char* p = ws->head + 2;
+  uint64_t len = ws->head[1] & 0x7f;
+
+  if (len == 126) {
+    len = ((uint64_t) p[0] << 8) | p[1];
+    p += 2;
+  } else if (len == 127) {
+    len = 0;
+    for (int i = 0; i < 8; i++) {
+      len = (len << 8) | p[i];
+    }
+    p += 8;
+  }
+  memcpy(ws->mask, p, sizeof(ws->mask));
+
+  ws->fin = (ws->head[0] & 0x80) != 0;
+  ws->opcode = ws->head[0] & 0x0f;
+  ws->frame_len = len;
+  ws->frame_left = len;
+  ws->control_len = 0;
+
+  /* No extensions are negotiated, so reserved bits must be clear */
+  int valid = (ws->head[0] & 0x70) == 0 && (len >> 63) == 0;
+  switch (ws->opcode) {
+    case kWSContinuation:
+      valid = valid && ws->message_opcode != 0;
+      break;
+    case kWSText:
+    case kWSBinary:
+      valid = valid && ws->message_opcode == 0;
+      ws->message_opcode = ws->opcode;
+      break;
+    case kWSClose:
+    case kWSPing:
+    case kWSPong:
+      valid = valid && ws->fin && len <= sizeof(ws->control);
+      break;
+    default:
+      valid = 0;
+      break;
+  }
+
+  if (!valid) {
+    ws_fail(ws, 1002);
+    return -1;
+  }
+
+  if (ws->opcode < kWSClose) {
+    if (len > ws->max_message_size - ws->message_len) {
+      ws_fail(ws, 1009);
+      return -1;
+    }
+    ws->message_len += len;
+  }
+
+  return 0;
+}
+
+/* Pushes text message from `data`, or from the collected fragments */
+static int ws_push_text(ws_t* ws, const char* data, size_t len) {
+  duk_context* ctx = ws_ctx;
+  int collected = data == NULL;
+
+  if (collected) {
+    char* out = duk_push_fixed_buffer(ctx, len);
+    body_copy(&ws->message, out);
+    data = out;
+  }
+
+  if (!ws_utf8_valid((const unsigned char*) data, len)) {
+    if (collected) {
+      duk_pop(ctx);
+    }
+    ws_fail(ws, 1007);
+    return -1;
+  }
+
+  if (collected) {
+    duk_buffer_to_string(ctx, -1);
+  } else {
+    duk_push_lstring(ctx, data, len);
+  }
+  return 0;
+}
+
+/* `data` is `NULL` when the message was collected from fragments */
+static void ws_on_message(ws_t* ws, const char* data, size_t len) {
+  duk_context* ctx = ws_ctx;
+  int opcode = ws->message_opcode;
+
+  ws->message_opcode = 0;
+  ws->message_len = 0;
+
+  if (opcode == kWSText) {
+    if (ws_push_text(ws, data, len) != 0) {
+      body_reset(&ws->message);
+      return;
+    }
+  } else {
+    char* out = duk_push_fixed_buffer(ctx, len);
+    if (data == NULL) {
+      body_copy(&ws->message, out);
+    } else {
+      memcpy(out, data, len);
+    }
+  }
+  body_reset(&ws->message);
+
+  ws_emit(ws, "onMessage", 1);
+}
+
+static void ws_on_control(ws_t* ws) {
+  const unsigned char* p = (const unsigned char*) ws->control;
+
+  if (ws->opcode == kWSPing) {
+    if (!ws->close_sent) {
+      ws_send(ws, kWSPong, ws->control, ws->control_len);
+    }
+    return;
+  }
+
+  if (ws->opcode == kWSPong) {
+    return;
+  }
+
+  int code = 1005;
+  if (ws->control_len == 1) {
+    ws_fail(ws, 1002);
+    return;
+  }
+  if (ws->control_len >= 2) {
+    code = (p[0] << 8) | p[1];
+    if (!ws_valid_close_code(code)) {
+      ws_fail(ws, 1002);
+      return;
+    }
+    if (!ws_utf8_valid(p + 2, ws->control_len - 2)) {
+      ws_fail(ws, 1007);
+      return;
+    }
+  }
+
+  ws->close_received = 1;
+  ws->close_code = code;
+  ws->close_reason_len = ws->control_len < 2 ? 0 : ws->control_len - 2;
+  memcpy(ws->close_reason, ws->control + 2, ws->close_reason_len);
+
+  /* Echo the status code */
+  if (!ws->close_sent) {
+    ws_send_close(ws, code == 1005 ? 0 : code, "", 0);
+  }
+  ws_maybe_end(ws);
+}
+
+static void ws_on_frame_end(ws_t* ws) {
+  ws->head_len = 0;
+  ws->head_size = 2;
+
+  if (ws->opcode >= kWSClose) {
+    ws_on_control(ws);
+  } else if (ws->fin && ws->message_opcode != 0) {
+    ws_on_message(ws, NULL, (size_t) ws->message.len);
+  }
+}
+
+void ws_execute(ws_t* ws, char* data, size_t len) {
+  while (len != 0 && !ws->close_received) {
+    /* Frame header */
+    if (ws->head_len != ws->head_size) {
+      size_t n = ws->head_size - ws->head_len;
+      if (n > len) {
+        n = len;
+      }
+
+      memcpy(ws->head + ws->head_len, data, n);
+      ws->head_len += n;
+      data += n;
+      len -= n;
+
+      if (ws->head_len != ws->head_size) {
+        continue;
+      }
+
+      /* Size of the rest of the header is known after two bytes */
+      if (ws->head_size == 2) {
+        unsigned int len7 = ws->head[1] & 0x7f;
+
+        /* Client frames are always masked */
+        if ((ws->head[1] & 0x80) == 0) {
+          ws_fail(ws, 1002);
+          return;
+        }
+
+        ws->head_size = 2 + 4 + (len7 == 126 ? 2 : len7 == 127 ? 8 : 0);
+        continue;
+      }
+
+      if (ws_on_head(ws) != 0) {
+        return;
+      }
+      if (ws->frame_left == 0) {
+        ws_on_frame_end(ws);
+      }
+      continue;
+    }
+
+    /* Payload */
+    char* payload = data;
+    size_t n = ws->frame_left < len ? (size_t) ws->frame_left : len;
+
+    ws_unmask(ws, (unsigned char*) payload, n);
+    ws->frame_left -= n;
+    data += n;
+    len -= n;
+
+    if (ws->opcode >= kWSClose) {
+      memcpy(ws->control + ws->control_len, payload, n);
+      ws->control_len += n;
+    } else if (ws->opcode != kWSContinuation && ws->fin &&
+               n == ws->frame_len) {
+      /* Whole message is in the read buffer */
+      ws_on_message(ws, payload, n);
+    } else {
+      body_append(&ws->message, payload, n);
+    }
+
+    if (ws->frame_left == 0) {
+      ws_on_frame_end(ws);
+    }
+  }
+}
+
+/* JS API */
+
+static ws_t* ws_get(duk_context* ctx) {
+  duk_push_this(ctx);
+  duk_get_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("ws"));
+  ws_t* ws = duk_get_pointer(ctx, -1);
+  duk_pop_2(ctx);
+
+  return ws;
+}
+
+/* `ws.send(data)`, strings are sent as text and buffers as binary */
+static duk_ret_t ws_send_cb(duk_context* ctx) {
+  ws_t* ws = ws_get(ctx);
+  const char* data;
+  duk_size_t len;
+  int opcode;
+
+  if (ws == NULL || ws->close_sent) {
+    (void) duk_type_error(ctx, "WebSocket is closed");
+  }
+
+  if (duk_is_buffer_data(ctx, 0)) {
+    data = duk_get_buffer_data(ctx, 0, &len);
+    opcode = kWSBinary;
+  } else {
+    data = duk_require_lstring(ctx, 0, &len);
+    opcode = kWSText;
+  }
+
+  ws_send(ws, opcode, data, len);
+
+  ws->drain = ws_queue_size(ws) >= WS_HIGH_WATERMARK;
+  duk_push_boolean(ctx, !ws->drain);
+  return 1;
+}
+
+/* `ws.close([code], [reason])` */
+static duk_ret_t ws_close_cb(duk_context* ctx) {
+  ws_t* ws = ws_get(ctx);
+  int code = duk_get_int_default(ctx, 0, 1000);
+  const char* reason = "";
+  duk_size_t reason_len = 0;
+
+  if (code != 1000 && (code < 3000 || code > 4999)) {
+    (void) duk_type_error(ctx, "Invalid close code: %d", code);
+  }
+  if (!duk_is_undefined(ctx, 1)) {
+    reason = duk_require_lstring(ctx, 1, &reason_len);
+    if (reason_len > sizeof(ws->close_reason)) {
+      (void) duk_type_error(ctx, "Close reason is too long");
+    }
+  }
+
+  if (ws == NULL || ws->close_sent) {
+    return 0;
+  }
+
+  ws_send_close(ws, code, reason, reason_len);
+  if (ws->stream != NULL) {
+    ws_maybe_end(ws);
+  }
+  return 0;
+}
+
+/* Sockets */
+
+void ws_init(duk_context* ctx) {
+  static const duk_function_list_entry ws_funcs[] = {
+    { "send", ws_send_cb, 1 },
+    { "close", ws_close_cb, 2 },
+    { NULL, NULL, 0 }
+  };
+
+  ws_ctx = ctx;
+
+  ws_unmask_impl = ws_unmask_scalar;
+#ifdef WS_UNMASK_X86
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) {
+    ws_unmask_impl = ws_unmask_avx2;
+  } else if (__builtin_cpu_supports("sse2")) {
+    ws_unmask_impl = ws_unmask_sse2;
+  }
+#endif  /* WS_UNMASK_X86 */
+
+  duk_push_object(ctx);
+  duk_put_function_list(ctx, -1, ws_funcs);
+  ws_proto_ref = refs_put(ctx);
+}
+
+ws_t* ws_new(duk_context* ctx, uint64_t max_message_size) {
+  ws_t* ws = malloc(sizeof(*ws));
+  CHECK(ws != NULL);
+
+  memset(ws, 0, sizeof(*ws));
+  ws->head_size = 2;
+  ws->max_message_size = max_message_size;
+
+  duk_push_object(ctx);
+  refs_push(ctx, ws_proto_ref);
+  duk_set_prototype(ctx, -2);
+
+  duk_push_pointer(ctx, ws);
+  duk_put_prop_string(ctx, -2, DUK_HIDDEN_SYMBOL("ws"));
+
+  duk_dup_top(ctx);
+  ws->obj_ref = refs_put(ctx);
+
+  return ws;
+}
+
+void ws_start(ws_t* ws,
+              uv_stream_t* stream,
+              void (*on_end)(void* arg),
+              void* arg,
+              char* data,
+              size_t len) {
+  CHECK(ws->stream == NULL);
+
+  ws->stream = stream;
+  ws->on_end = on_end;
+  ws->arg = arg;
+
+  if (ws->unsent.len != 0) {
+    size_t unsent_len = (size_t) ws->unsent.len;
+    uv_write_t* req = malloc(sizeof(*req) + unsent_len);
+    CHECK(req != NULL);
+
+    body_copy(&ws->unsent, ((char*) req) + sizeof(*req));
+    body_reset(&ws->unsent);
+
+    ws_write(ws, req, unsent_len);
+  }
+
+  ws_execute(ws, data, len);
+}
+
+void ws_destroy(ws_t* ws) {
+  duk_context* ctx = ws_ctx;
+
+  duk_push_int(ctx, ws->close_received ? ws->close_code : 1006);
+  duk_push_lstring(ctx, ws->close_reason, ws->close_reason_len);
+  ws_emit(ws, "onClose", 2);
+
+  /* Detach JS object */
+  refs_push(ctx, ws->obj_ref);
+  duk_del_prop_string(ctx, -1, DUK_HIDDEN_SYMBOL("ws"));
+  duk_pop(ctx);
+
+  refs_del(ctx, ws->obj_ref);
+
+  body_reset(&ws->message);
+  body_reset(&ws->unsent);
+  free(ws);
+}
@@ -0,0 +1,52 @@
+#ifndef SRC_WS_H_
+#define SRC_WS_H_
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include "uv.h"
+#include "duktape.h"
+
+/*
+ * WebSocket (RFC 6455) framing on upgraded connections. Frames are parsed
+ * and unmasked in place in the read buffer, fragments are collected into
+ * pooled body chunks, and pings and the closing handshake are answered
+ * without calling into JS. Each socket is a plain JS object with `send()`
+ * and `close()` that receives `onMessage`, `onDrain` and `onClose` calls on
+ * the worker heap, so idle sockets don't need a thread of their own.
+ */
+
+typedef struct ws_s ws_t;
+
+/* `base64(sha1(key + GUID))` is 28 characters */
+#define WS_ACCEPT_LEN 28
+
+void ws_init(duk_context* ctx);
+
+/* Writes NUL-terminated `Sec-WebSocket-Accept` value for `key` */
+void ws_accept_key(const char* key, size_t key_len, char* out);
+
+/*
+ * Pushes the socket object. Frames sent before `ws_start()` are buffered,
+ * messages over `max_message_size` close the socket with `1009`.
+ */
+ws_t* ws_new(duk_context* ctx, uint64_t max_message_size);
+
+/*
+ * Starts framing on `stream`, `data` is what the client sent after the
+ * handshake. `on_end` is called once the connection should be closed.
+ */
+void ws_start(ws_t* ws,
+              uv_stream_t* stream,
+              void (*on_end)(void* arg),
+              void* arg,
+              char* data,
+              size_t len);
+
+/* NOTE: `data` is unmasked in place */
+void ws_execute(ws_t* ws, char* data, size_t len);
+
+/* Connection is gone, emits `onClose` and frees the socket */
+void ws_destroy(ws_t* ws);
+
+#endif  /* SRC_WS_H_ */